@@ -0,0 +1,181 @@
+package org.microbridge.benchmark;
+
+import java.io.IOException;
+import java.util.concurrent.ConcurrentHashMap;
+
+import org.microbridge.server.AbstractServerListener;
+import org.microbridge.server.Client;
+import org.microbridge.server.Server;
+
+import android.app.Service;
+import android.content.Intent;
+import android.os.IBinder;
+import android.util.Log;
+
+/**
+ * Phone side of the throughput and latency benchmark. Runs three TCP servers that the Benchmark sketch
+ * (src/arduino/examples/Benchmark) or "make bench" (src/mcu) connect to:
+ *
+ * <ul>
+ * <li>4568, sink: sends a single byte when a client connects and discards everything it receives.</li>
+ * <li>4569, echo: sends every packet straight back.</li>
+ * <li>4570, source: reads a 4-byte request (chunk size and chunk count, both 16-bit little endian) and
+ * answers with that many writes of that size.</li>
+ * </ul>
+ *
+ * Start it with "adb shell am startservice -n org.microbridge.benchmark/.BenchmarkService". The results
+ * are printed by the device; the sink logs the number of bytes it received per connection.
+ *
+ * @author Niels Brouwers
+ *
+ */
+public class BenchmarkService extends Service
+{
+
+	public static final int SINK_PORT = 4568;
+	public static final int ECHO_PORT = 4569;
+	public static final int SOURCE_PORT = 4570;
+
+	private static final String TAG = "microbridge";
+
+	private Server sink, echo, source;
+
+	// Bytes received per sink client.
+	private ConcurrentHashMap<Client, Long> sinkBytes = new ConcurrentHashMap<Client, Long>();
+
+	// Partially received source requests.
+	private ConcurrentHashMap<Client, byte[]> requests = new ConcurrentHashMap<Client, byte[]>();
+
+	@Override
+	public void onCreate()
+	{
+		super.onCreate();
+
+		sink = new Server(SINK_PORT);
+		sink.addListener(new AbstractServerListener() {
+
+			@Override
+			public void onClientConnect(Server server, Client client)
+			{
+				sinkBytes.put(client, 0L);
+
+				// Tell the device that data is flowing in both directions.
+				try
+				{
+					client.send(new byte[] { 'H' });
+				} catch (IOException e)
+				{
+					Log.e(TAG, "sink: unable to send hello", e);
+				}
+			}
+
+			@Override
+			public void onReceive(Client client, byte[] data)
+			{
+				Long bytes = sinkBytes.get(client);
+				sinkBytes.put(client, (bytes == null ? 0 : bytes) + data.length);
+			}
+
+			@Override
+			public void onClientDisconnect(Server server, Client client)
+			{
+				Long bytes = sinkBytes.remove(client);
+				Log.i(TAG, "BENCH sink bytes=" + (bytes == null ? 0 : bytes));
+			}
+
+		});
+
+		echo = new Server(ECHO_PORT);
+		echo.addListener(new AbstractServerListener() {
+
+			@Override
+			public void onReceive(Client client, byte[] data)
+			{
+				try
+				{
+					client.send(data);
+				} catch (IOException e)
+				{
+					Log.e(TAG, "echo: send failed", e);
+				}
+			}
+
+		});
+
+		source = new Server(SOURCE_PORT);
+		source.addListener(new AbstractServerListener() {
+
+			@Override
+			public void onReceive(Client client, byte[] data)
+			{
+				byte[] request = requests.remove(client);
+				if (request == null) request = new byte[0];
+
+				// Requests may arrive split over several packets, collect at least 4 bytes.
+				byte[] buffer = new byte[request.length + data.length];
+				System.arraycopy(request, 0, buffer, 0, request.length);
+				System.arraycopy(data, 0, buffer, request.length, data.length);
+
+				int offset = 0;
+				for (; buffer.length - offset >= 4; offset += 4)
+				{
+					int size = (buffer[offset] & 0xff) | ((buffer[offset + 1] & 0xff) << 8);
+					int chunks = (buffer[offset + 2] & 0xff) | ((buffer[offset + 3] & 0xff) << 8);
+
+					// adbd may merge or split these writes, the chunk size is a request rather than a guarantee.
+					byte[] chunk = new byte[size];
+					try
+					{
+						for (int i = 0; i < chunks; i++)
+							client.send(chunk);
+					} catch (IOException e)
+					{
+						Log.e(TAG, "source: send failed", e);
+					}
+				}
+
+				if (offset < buffer.length)
+				{
+					request = new byte[buffer.length - offset];
+					System.arraycopy(buffer, offset, request, 0, request.length);
+					requests.put(client, request);
+				}
+			}
+
+			@Override
+			public void onClientDisconnect(Server server, Client client)
+			{
+				requests.remove(client);
+			}
+
+		});
+
+		try
+		{
+			sink.start();
+			echo.start();
+			source.start();
+		} catch (IOException e)
+		{
+			Log.e(TAG, "Unable to start TCP server", e);
+			stopSelf();
+		}
+	}
+
+	@Override
+	public void onDestroy()
+	{
+		sink.stop();
+		echo.stop();
+		source.stop();
+
+		super.onDestroy();
+	}
+
+	@Override
+	public IBinder onBind(Intent intent)
+	{
+		return null;
+	}
+
+}
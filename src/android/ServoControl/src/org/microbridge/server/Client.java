@@ -1,99 +1,320 @@
 package org.microbridge.server;
 
 import java.io.IOException;
-import java.io.InputStream;
-import java.io.OutputStream;
-import java.net.Socket;
-import java.net.SocketException;
+import java.nio.ByteBuffer;
+import java.nio.channels.CancelledKeyException;
+import java.nio.channels.SelectionKey;
+import java.nio.channels.Selector;
+import java.nio.channels.SocketChannel;
+import java.util.Iterator;
+import java.util.LinkedList;
+import java.util.concurrent.atomic.AtomicBoolean;
 
 import android.util.Log;
 
+/**
+ * A client connected to a Server. The socket is non-blocking and read by the I/O thread of the server. Data sent
+ * to the client is queued as frames (one per send) and written by the I/O thread when the socket is ready for it,
+ * with as many queued frames per system call as possible. The queue is unbounded
+ * unless a limit is set, see setQueueLimit.
+ *
+ * @author Niels Brouwers
+ *
+ */
 public class Client
 {
-	
-	private Socket socket;
-	
+
+	private final SocketChannel channel;
+
 	private final Server server;
-	
-	private final InputStream input;
-	private final OutputStream output;
-	
-	private boolean keepAlive = true;
-	
-	public Client(Server server, Socket socket) throws IOException
+
+	// Selection key of the channel, set when the client is registered with the selector of the server.
+	private SelectionKey key;
+
+	// Maximum number of frames handed to the socket in one gathering write.
+	private static final int GATHER_LIMIT = 16;
+
+	// Frames that have not been written (completely) yet, oldest first, and the number of bytes left in them.
+	// Guarded by this.
+	private final LinkedList<ByteBuffer> pending = new LinkedList<ByteBuffer>();
+	private int queuedBytes = 0;
+
+	// Queue bound and overflow policy, and the number of frames dropped so far. Guarded by this.
+	private int queueLimit;
+	private QueuePolicy queuePolicy;
+	private long droppedFrames = 0;
+
+	// Array for gathering writes, only used from the I/O thread.
+	private final ByteBuffer[] gather = new ByteBuffer[GATHER_LIMIT];
+
+	private final AtomicBoolean closed = new AtomicBoolean(false);
+
+	Client(Server server, SocketChannel channel, int queueLimit, QueuePolicy queuePolicy)
 	{
 		this.server = server;
-		this.socket = socket;
-		socket.setKeepAlive(true);
-		
-		this.input = this.socket.getInputStream();
-		this.output = this.socket.getOutputStream();
-
-		startCommunicationThread();
-	}	
-	
-	public void startCommunicationThread()
+		this.channel = channel;
+		this.queueLimit = queueLimit;
+		this.queuePolicy = queuePolicy;
+	}
+
+	/**
+	 * Registers the channel with the selector of the server, for reading. Called from the I/O thread.
+	 * @param selector selector of the server
+	 * @throws IOException
+	 */
+	void register(Selector selector) throws IOException
 	{
-		(new Thread() {
-			public void run()
+		key = channel.register(selector, SelectionKey.OP_READ, this);
+	}
+
+	/**
+	 * Reads what is available from the socket and passes it on to the server listeners. Called from the I/O
+	 * thread when the channel is readable.
+	 *
+	 * @param buffer read buffer, shared by all clients of the server
+	 */
+	void read(ByteBuffer buffer)
+	{
+		int bytesRead;
+
+		buffer.clear();
+		try
+		{
+			bytesRead = channel.read(buffer);
+		} catch (IOException e)
+		{
+			Log.d("microbridge", "IOException: " + e);
+			bytesRead = -1;
+		}
+
+		if (bytesRead == -1)
+		{
+			close();
+			return;
+		}
+
+		if (bytesRead > 0)
+		{
+			byte data[] = new byte[bytesRead];
+			buffer.flip();
+			buffer.get(data);
+			server.receive(this, data);
+		}
+	}
+
+	/**
+	 * Writes queued frames to the socket, as far as it takes them, up to GATHER_LIMIT frames per system call.
+	 * Called from the I/O thread when the channel is writable. Stops waiting for the channel to become writable
+	 * once the queue is empty.
+	 */
+	synchronized void flush()
+	{
+		try
+		{
+			while (!pending.isEmpty())
 			{
-				while (keepAlive)
+				int count = 0;
+				long length = 0;
+				for (ByteBuffer frame : pending)
 				{
-					try
-					{
-						
-						// Check for input
-						if (input.available()>0)
-						{
-						
-							int bytesRead;
-							byte buf[] = new byte[input.available()];
-							bytesRead = input.read(buf);
-							
-							if (bytesRead==-1)
-								keepAlive = false;
-							else
-								server.receive(Client.this, buf);
-						}
-						
-					} catch (IOException e)
-					{
-						keepAlive = false;
-						Log.d("microbridge", "IOException: " + e);
-					}
+					gather[count++] = frame;
+					length += frame.remaining();
+					if (count == GATHER_LIMIT) break;
 				}
-				
-				// Client exited, notify parent server
-				server.disconnectClient(Client.this);
+
+				long written = channel.write(gather, 0, count);
+				queuedBytes -= written;
+
+				while (!pending.isEmpty() && !pending.getFirst().hasRemaining())
+					pending.removeFirst();
+
+				// Socket buffer full, wait until it's writable again.
+				if (written < length) break;
 			}
-		}).start();
+
+			// Don't keep the frames reachable from the gather array.
+			for (int i = 0; i < GATHER_LIMIT; i++)
+				gather[i] = null;
+
+			if (pending.isEmpty())
+				key.interestOps(SelectionKey.OP_READ);
+
+		} catch (IOException e)
+		{
+			close();
+		}
+	}
+
+	/**
+	 * Waits for the channel to become writable if there is queued data. Called from the I/O thread after
+	 * Server.requestWrite.
+	 */
+	synchronized void updateInterest()
+	{
+		try
+		{
+			if (!pending.isEmpty())
+				key.interestOps(SelectionKey.OP_READ | SelectionKey.OP_WRITE);
+		} catch (CancelledKeyException ex)
+		{
+			// The client was closed in the meantime.
+		}
 	}
-	
+
+	/**
+	 * Closes the connection. The server listeners are notified through onClientDisconnect, once.
+	 */
 	public void close()
 	{
-		keepAlive = false;
-		
-		// Close the socket, will throw an IOException in the listener thread.
+		if (!closed.compareAndSet(false, true)) return;
+
+		// Closing the channel also cancels its selection key.
 		try
 		{
-			socket.close();
+			channel.close();
 		} catch (IOException e)
 		{
 			Log.e("microbridge", "error while closing socket", e);
 		}
+
+		synchronized (this)
+		{
+			pending.clear();
+			queuedBytes = 0;
+		}
+
+		// Client exited, notify parent server
+		server.disconnectClient(this);
+	}
+
+	/**
+	 * @return true iff the connection has been closed.
+	 */
+	public boolean isClosed()
+	{
+		return closed.get();
+	}
+
+	/**
+	 * Sets the bound of the write queue, and what to do with a frame that doesn't fit. The default comes from the
+	 * server, see Server.setQueueLimit. Pass Server.NO_LIMIT to remove the bound.
+	 *
+	 * @param limit maximum number of bytes queued for writing
+	 * @param policy what to do with a frame that doesn't fit
+	 */
+	public synchronized void setQueueLimit(int limit, QueuePolicy policy)
+	{
+		this.queueLimit = limit;
+		this.queuePolicy = policy;
+	}
+
+	/**
+	 * @return number of bytes queued for writing.
+	 */
+	public synchronized int getQueuedBytes()
+	{
+		return queuedBytes;
+	}
+
+	/**
+	 * @return number of frames dropped because the write queue was full.
+	 */
+	public synchronized long getDroppedFrames()
+	{
+		return droppedFrames;
+	}
+
+	/**
+	 * Queues a frame for writing, applying the queue limit. Does not write to the socket. The frame must not be
+	 * changed afterwards, but it may be shared with other clients as long as each has a buffer of its own.
+	 *
+	 * @param frame frame to queue, positioned at the first byte still to be written
+	 * @return true iff the queue was empty, i.e. the server has to be asked to write (see Server.requestWrite).
+	 */
+	synchronized boolean enqueue(ByteBuffer frame)
+	{
+		int length = frame.remaining();
+
+		if (closed.get()) return false;
+
+		if (length > queueLimit - queuedBytes)
+		{
+			// Make room by dropping the oldest frames, skipping the one being written.
+			if (queuePolicy == QueuePolicy.DROP_OLDEST)
+			{
+				Iterator<ByteBuffer> frames = pending.iterator();
+				while (length > queueLimit - queuedBytes && frames.hasNext())
+				{
+					ByteBuffer queued = frames.next();
+					if (queued.position() > 0) continue;
+
+					queuedBytes -= queued.remaining();
+					frames.remove();
+					droppedFrames++;
+				}
+			}
+
+			// Still too big, no room for a partial frame.
+			if (length > queueLimit - queuedBytes)
+			{
+				droppedFrames++;
+				return false;
+			}
+		}
+
+		pending.addLast(frame);
+		queuedBytes += length;
+
+		return pending.size() == 1;
 	}
-	
+
+	/**
+	 * Sends data to the client. Doesn't block: if nothing is queued ahead of it, the data is written right away as
+	 * far as the socket takes it, and the rest is queued and written by the I/O thread of the server. Data sent to a
+	 * client that has disconnected is discarded, and so is data that doesn't fit in the write queue when a limit
+	 * is set (see setQueueLimit) with the DROP_NEWEST policy.
+	 *
+	 * @param data data to send
+	 * @throws IOException
+	 */
 	public void send(byte[] data) throws IOException
 	{
-		try {
-			output.write(data);
-			output.flush();
-		} catch (SocketException ex)
+		ByteBuffer frame = ByteBuffer.wrap(data);
+
+		synchronized (this)
 		{
-			// Broken socket, disconnect
-			close();
-			server.disconnectClient(this);
+			if (closed.get()) return;
+
+			try
+			{
+				// Write straight to the socket unless there is data waiting ahead of this.
+				if (pending.isEmpty())
+					channel.write(frame);
+			} catch (IOException ex)
+			{
+				// Broken socket, disconnect
+				close();
+				return;
+			}
+
+			if (!frame.hasRemaining()) return;
+
+			// Queue a copy, since the caller may reuse the array. A frame that is partially written is never dropped,
+			// and goes in ahead of the limit.
+			int written = frame.position();
+			frame = ByteBuffer.wrap(data.clone());
+			frame.position(written);
+
+			if (written > 0)
+			{
+				pending.addLast(frame);
+				queuedBytes += frame.remaining();
+			}
+			else if (!enqueue(frame))
+				return;
 		}
+
+		server.requestWrite(this);
 	}
 
 	public void send(String command) throws IOException
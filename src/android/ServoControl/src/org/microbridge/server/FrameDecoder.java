@@ -0,0 +1,104 @@
+package org.microbridge.server;
+
+/**
+ * Incremental parser for the message framing of the microcontroller library (adb_initFramer). A frame is a type
+ * byte and a 16-bit little endian payload length, followed by the payload. Data can be fed in chunks of any size,
+ * as it comes from Client or ServerListener.onReceive; a frame that arrives in one piece is handed to the listener
+ * in place, a frame that is split is put together first. Use one decoder per client.
+ * 
+ * @author Niels Brouwers
+ *
+ */
+public class FrameDecoder
+{
+
+	private final FrameListener listener;
+
+	// Header of the frame being received and how much of it is in.
+	private final byte[] header = new byte[FrameEncoder.HEADER_SIZE];
+	private int headerLength = 0;
+
+	// Payload of a split frame, and how much of it is in.
+	private byte[] payload = null;
+	private int received = 0;
+
+	/**
+	 * Constructs a new decoder.
+	 * @param listener listener to hand the frames to
+	 */
+	public FrameDecoder(FrameListener listener)
+	{
+		this.listener = listener;
+	}
+
+	/**
+	 * Discards a partially received frame, for when the stream starts over.
+	 */
+	public void reset()
+	{
+		headerLength = 0;
+		payload = null;
+	}
+
+	/**
+	 * Parses received data, picking up where the previous call left off.
+	 * @param data received data
+	 */
+	public void decode(byte[] data)
+	{
+		decode(data, 0, data.length);
+	}
+
+	/**
+	 * Parses received data, picking up where the previous call left off.
+	 * @param data array holding the received data
+	 * @param offset offset of the data in the array
+	 * @param length number of bytes
+	 */
+	public void decode(byte[] data, int offset, int length)
+	{
+		int end = offset + length;
+
+		while (offset < end)
+		{
+			// Collect the header.
+			if (headerLength < FrameEncoder.HEADER_SIZE)
+			{
+				header[headerLength++] = data[offset++];
+				if (headerLength < FrameEncoder.HEADER_SIZE) continue;
+
+				payload = null;
+				received = 0;
+			}
+
+			int frameLength = (header[1] & 0xff) | ((header[2] & 0xff) << 8);
+			int type = header[0] & 0xff;
+
+			// The whole payload is here, hand it over in place.
+			if (payload == null && end - offset >= frameLength)
+			{
+				headerLength = 0;
+				listener.onFrame(type, data, offset, frameLength);
+				offset += frameLength;
+				continue;
+			}
+
+			// Put a split frame together.
+			if (payload == null)
+				payload = new byte[frameLength];
+
+			int chunk = Math.min(frameLength - received, end - offset);
+			System.arraycopy(data, offset, payload, received, chunk);
+			received += chunk;
+			offset += chunk;
+
+			if (received < frameLength) continue;
+
+			byte[] frame = payload;
+			headerLength = 0;
+			payload = null;
+			listener.onFrame(type, frame, 0, frameLength);
+		}
+	}
+
+}
@@ -0,0 +1,145 @@
+package org.microbridge.server;
+
+import java.io.IOException;
+
+/**
+ * Encoder for the message framing of the microcontroller library (adb_initFramer), see FrameDecoder. Frames are
+ * packed into a batch that goes out with a single send, which keeps the per-message overhead down when sending
+ * many small frames. Safe to use from any thread.
+ * 
+ * @author Niels Brouwers
+ *
+ */
+public class FrameEncoder
+{
+
+	/**
+	 * Size of a frame header: the frame type and the 16-bit little endian payload length.
+	 */
+	public static final int HEADER_SIZE = 3;
+
+	/**
+	 * Maximum payload length.
+	 */
+	public static final int MAX_LENGTH = 0xffff;
+
+	// Frames added since the last flush. Guarded by this.
+	private byte[] batch;
+	private int length = 0;
+
+	/**
+	 * Constructs a new encoder.
+	 * @param capacity initial size of the batch in bytes, it grows as needed
+	 */
+	public FrameEncoder(int capacity)
+	{
+		batch = new byte[Math.max(capacity, HEADER_SIZE)];
+	}
+
+	/**
+	 * Encodes a single frame.
+	 * @param type frame type, in the range of [0..255]
+	 * @param data payload, at most MAX_LENGTH bytes
+	 * @return the frame
+	 */
+	public static byte[] encode(int type, byte[] data)
+	{
+		byte[] frame = new byte[HEADER_SIZE + data.length];
+		put(frame, 0, type, data, 0, data.length);
+		return frame;
+	}
+
+	/**
+	 * Writes a frame into an array.
+	 */
+	private static void put(byte[] target, int position, int type, byte[] data, int offset, int length)
+	{
+		if (length > MAX_LENGTH)
+			throw new IllegalArgumentException("frame payload too long: " + length);
+
+		target[position] = (byte)type;
+		target[position + 1] = (byte)length;
+		target[position + 2] = (byte)(length >> 8);
+		System.arraycopy(data, offset, target, position + HEADER_SIZE, length);
+	}
+
+	/**
+	 * Adds a frame to the batch.
+	 * @param type frame type, in the range of [0..255]
+	 * @param data payload, at most MAX_LENGTH bytes
+	 */
+	public void add(int type, byte[] data)
+	{
+		add(type, data, 0, data.length);
+	}
+
+	/**
+	 * Adds a frame to the batch.
+	 * @param type frame type, in the range of [0..255]
+	 * @param data array holding the payload
+	 * @param offset offset of the payload in data
+	 * @param length payload length, at most MAX_LENGTH
+	 */
+	public synchronized void add(int type, byte[] data, int offset, int length)
+	{
+		int size = this.length + HEADER_SIZE + length;
+
+		if (size > batch.length)
+		{
+			byte[] grown = new byte[Math.max(size, batch.length * 2)];
+			System.arraycopy(batch, 0, grown, 0, this.length);
+			batch = grown;
+		}
+
+		put(batch, this.length, type, data, offset, length);
+		this.length = size;
+	}
+
+	/**
+	 * @return number of bytes in the batch.
+	 */
+	public synchronized int getLength()
+	{
+		return length;
+	}
+
+	/**
+	 * Takes the batch out of the encoder, which is then empty.
+	 * @return the frames added since the last call, or null if there are none.
+	 */
+	public synchronized byte[] take()
+	{
+		if (length == 0) return null;
+
+		byte[] frames = new byte[length];
+		System.arraycopy(batch, 0, frames, 0, length);
+		length = 0;
+
+		return frames;
+	}
+
+	/**
+	 * Sends the batch to all clients of a server.
+	 * @param server server to send to
+	 * @throws IOException
+	 */
+	public void flush(Server server) throws IOException
+	{
+		byte[] frames = take();
+		if (frames != null)
+			server.send(frames);
+	}
+
+	/**
+	 * Sends the batch to a client.
+	 * @param client client to send to
+	 * @throws IOException
+	 */
+	public void flush(Client client) throws IOException
+	{
+		byte[] frames = take();
+		if (frames != null)
+			client.send(frames);
+	}
+
+}
@@ -0,0 +1,23 @@
+package org.microbridge.server;
+
+/**
+ * 
+ * Frame listener interface, see FrameDecoder.
+ * 
+ * @author Niels Brouwers
+ *
+ */
+public interface FrameListener
+{
+
+	/**
+	 * Called for every complete frame. The payload is only valid during the call: it may be part of the received
+	 * data, which the decoder does not copy unless the frame was split.
+	 * @param type frame type, in the range of [0..255]
+	 * @param data array holding the payload
+	 * @param offset offset of the payload in data
+	 * @param length payload length
+	 */
+	public void onFrame(int type, byte[] data, int offset, int length);
+
+}
@@ -0,0 +1,26 @@
+package org.microbridge.server;
+
+/**
+ * What a Client does with a frame that doesn't fit in its write queue, see Client.setQueueLimit. Frames are the
+ * byte arrays passed to send. A frame is never split or dropped once part of it has been written.
+ *
+ * @author Niels Brouwers
+ *
+ */
+public enum QueuePolicy
+{
+
+	/**
+	 * Drops the new frame, so that the client gets what was queued first.
+	 */
+	DROP_NEWEST,
+
+	/**
+	 * Drops the oldest queued frames to make room for the new one, so that the client gets the latest data. This is
+	 * only safe when every frame is a complete snapshot that replaces all frames before it, like the updates of a
+	 * StateChannel. Frames that carry only what changed, or parts of a byte stream, are lost for good when dropped,
+	 * and the client is left with stale or corrupt data.
+	 */
+	DROP_OLDEST
+
+}
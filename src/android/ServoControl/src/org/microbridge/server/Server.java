@@ -1,23 +1,48 @@
 package org.microbridge.server;
 
 import java.io.IOException;
-import java.net.ServerSocket;
-import java.net.Socket;
-import java.net.SocketException;
+import java.net.InetSocketAddress;
+import java.nio.ByteBuffer;
+import java.nio.channels.CancelledKeyException;
+import java.nio.channels.SelectionKey;
+import java.nio.channels.Selector;
+import java.nio.channels.ServerSocketChannel;
+import java.nio.channels.SocketChannel;
+import java.util.Collections;
 import java.util.HashSet;
+import java.util.Iterator;
+import java.util.List;
+import java.util.concurrent.ConcurrentLinkedQueue;
 import java.util.concurrent.CopyOnWriteArrayList;
 
+import android.util.Log;
+
 /**
  * Lightweight TCP server that supports multiple clients connecting on a given port. 
  * 
+ * All sockets are non-blocking and served by a single I/O thread that waits on a Selector, so an idle client
+ * costs nothing. Listener callbacks are made from the I/O thread, except onClientDisconnect for a client that is
+ * closed from another thread, which is made from that thread.
+ * 
  * @author Niels Brouwers
  *
  */
 public class Server
 {
 	
-	// Server socket for the TCP connection
-	private ServerSocket serverSocket = null;
+	/**
+	 * Queue limit that doesn't bound the write queue, see setQueueLimit.
+	 */
+	public static final int NO_LIMIT = Integer.MAX_VALUE;
+	
+	// Size of the read buffer of the I/O thread.
+	private static final int BUFFER_SIZE = 4096;
+	
+	// Server socket channel for the TCP connection
+	private ServerSocketChannel serverChannel = null;
+	
+	// Selector the I/O thread waits on.
+	private Selector selector = null;
 	
 	// TCP port to use
 	private final int port;
@@ -29,8 +54,15 @@ public class Server
 	// Set of event listeners for this server
 	private HashSet<ServerListener> listeners = new HashSet<ServerListener>();
 	
+	// Clients that have data queued for writing, whose interest in OP_WRITE the I/O thread has to update.
+	private ConcurrentLinkedQueue<Client> writeRequests = new ConcurrentLinkedQueue<Client>();
+	
+	// Write queue bound and overflow policy for new clients.
+	private volatile int queueLimit = NO_LIMIT;
+	private volatile QueuePolicy queuePolicy = QueuePolicy.DROP_NEWEST;
+	
 	// Indicates that the main server loop should keep running. 
-	private boolean keepAlive = true;
+	private volatile boolean keepAlive = true;
 	
 	// Main thread.
 	private Thread listenThread;
@@ -68,6 +100,20 @@ public class Server
 		return listenThread!=null && listenThread.isAlive();
 	}
 	
+	/**
+	 * Sets the write queue bound and overflow policy of clients that connect from now on. Defaults to NO_LIMIT,
+	 * so that nothing sent is lost, and DROP_NEWEST. Use Client.setQueueLimit to change these for a client that is
+	 * already connected.
+	 * 
+	 * @param limit maximum number of bytes queued for writing, per client
+	 * @param policy what to do with a frame that doesn't fit
+	 */
+	public void setQueueLimit(int limit, QueuePolicy policy)
+	{
+		this.queueLimit = limit;
+		this.queuePolicy = policy;
+	}
+	
 	/**
 	 * @return the number of currently connected clients
 	 */
@@ -76,6 +122,15 @@ public class Server
 		return clients.size();
 	}
 	
+	/**
+	 * @return the currently connected clients. Iterating the list is safe while clients join or leave, and sees
+	 * the clients as they were when the iteration started.
+	 */
+	public List<Client> getClients()
+	{
+		return Collections.unmodifiableList(clients);
+	}
+	
 	/**
 	 * Starts the server.
 	 * @throws IOException
@@ -83,42 +138,68 @@ public class Server
 	public void start() throws IOException
 	{
 		keepAlive = true;
-		serverSocket = new ServerSocket(port);
+		selector = Selector.open();
+		serverChannel = ServerSocketChannel.open();
+		serverChannel.configureBlocking(false);
+		serverChannel.socket().bind(new InetSocketAddress(port));
+		serverChannel.register(selector, SelectionKey.OP_ACCEPT);
 		
 		(listenThread = new Thread(){
 			public void run()
 			{
-				Socket socket;
+				// Direct buffer for all reads, owned by this thread.
+				ByteBuffer readBuffer = ByteBuffer.allocateDirect(BUFFER_SIZE);
+				
 				try
 				{
 					while (keepAlive)
 					{
+						selector.select();
 						
-						try {
-
-							socket = serverSocket.accept();
-
-							// Create Client object.
-							Client client = new Client(Server.this, socket);
-							clients.add(client);
-							
-							// Notify listeners.
-							for (ServerListener listener : listeners)
-								listener.onClientConnect(Server.this, client);
+						// Apply the write interest of clients that queued data from other threads.
+						Client client;
+						while ((client = writeRequests.poll()) != null)
+							client.updateInterest();
 						
-						} catch (SocketException ex)
+						Iterator<SelectionKey> keys = selector.selectedKeys().iterator();
+						while (keys.hasNext())
 						{
-							// A SocketException is thrown when the stop method calls 'close' on the
-							// serverSocket object. This means we should break out of the connection
-							// accept loop.
-							keepAlive = false;
+							SelectionKey key = keys.next();
+							keys.remove();
+
+							try
+							{
+								if (key.isAcceptable())
+									accept();
+								else
+								{
+									client = (Client)key.attachment();
+									if (key.isReadable())
+										client.read(readBuffer);
+									if (key.isValid() && key.isWritable())
+										client.flush();
+								}
+							} catch (CancelledKeyException ex)
+							{
+								// The client was closed in the meantime.
+							} catch (IOException e)
+							{
+								Log.e("microbridge", "unable to accept connection", e);
+							}
 						}
-					
 					}
 					
 				} catch (IOException e)
 				{
-					// TODO
+					Log.e("microbridge", "I/O error in server loop", e);
+				}
+				
+				try
+				{
+					selector.close();
+				} catch (IOException e)
+				{
+					// Nothing left to do about it.
 				}
 			}
 		}).start();
@@ -129,20 +210,48 @@ public class Server
 		
 	}
 	
+	/**
+	 * Accepts a pending connection, and registers the new client with the selector.
+	 * @throws IOException
+	 */
+	private void accept() throws IOException
+	{
+		SocketChannel channel = serverChannel.accept();
+		if (channel == null) return;
+		
+		channel.configureBlocking(false);
+		channel.socket().setKeepAlive(true);
+		
+		// Create Client object.
+		Client client = new Client(this, channel, queueLimit, queuePolicy);
+		client.register(selector);
+		clients.add(client);
+		
+		// Notify listeners.
+		for (ServerListener listener : listeners)
+			listener.onClientConnect(this, client);
+	}
+	
 	/**
 	 * Stops the server
 	 */
 	public void stop()
 	{
+		keepAlive = false;
+		
 		// Stop listening in the TCP port.
-		if (serverSocket!=null)
+		if (serverChannel!=null)
 			try
 			{
-				serverSocket.close();
+				serverChannel.close();
 			} catch (IOException e)
 			{
 				// TODO
 			}
+		
+		// Get the I/O thread out of select, it closes the selector on its way out.
+		if (selector!=null)
+			selector.wakeup();
 			
 		// Close all clients.
 		for (Client client : clients)
@@ -154,6 +263,18 @@ public class Server
 		
 	}
 	
+	/**
+	 * Called by a client that has queued data for writing, from any thread. The I/O thread then starts waiting for
+	 * the socket to become writable.
+	 * 
+	 * @param client client with queued data
+	 */
+	void requestWrite(Client client)
+	{
+		writeRequests.offer(client);
+		selector.wakeup();
+	}
+	
 	/**
 	 * Called by the Client class to remove itself from the server. 
 	 * 
@@ -199,15 +320,30 @@ public class Server
 	}
 	
 	/**
-	 * Send bytes to all connected clients.
+	 * Send bytes to all connected clients. Doesn't block and doesn't touch the sockets: the data is copied once,
+	 * queued for every client according to its queue policy, and written by the I/O thread, which is woken up once
+	 * for the whole batch.
 	 *  
 	 * @param data data to send
 	 * @throws IOException
 	 */
 	public void send(byte[] data) throws IOException
 	{
+		if (clients.isEmpty()) return;
+		
+		// The copy is shared, every client gets a buffer of its own.
+		byte[] frame = data.clone();
+		boolean wakeup = false;
+		
 		for (Client client : clients)
-			client.send(data);
+			if (client.enqueue(ByteBuffer.wrap(frame)))
+			{
+				writeRequests.offer(client);
+				wakeup = true;
+			}
+		
+		if (wakeup)
+			selector.wakeup();
 	}
 
 	/**
@@ -217,8 +353,7 @@ public class Server
 	 */
 	public void send(String str) throws IOException
 	{
-		for (Client client : clients)
-			client.send(str);
+		send(str.getBytes());
 	}
 
 }
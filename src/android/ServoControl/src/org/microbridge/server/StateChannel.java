@@ -0,0 +1,300 @@
+package org.microbridge.server;
+
+import java.io.IOException;
+import java.util.Timer;
+import java.util.TimerTask;
+import java.util.concurrent.ConcurrentHashMap;
+import java.util.concurrent.CopyOnWriteArraySet;
+
+import android.util.Log;
+
+/**
+ * Latest-value state channel on top of a Server, the counterpart of the state channel of the microcontroller
+ * library (adb_initStateChannel). Both ends keep a table of 16-bit values indexed by key, and only the newest value
+ * of each key is sent: setting a key that has not been sent yet simply overwrites it. This is meant for control
+ * streams, like a joystick position, where a queue of outdated values would only add lag.
+ * 
+ * Values travel as records of RECORD_SIZE bytes, the key followed by the value (little endian). An update is sent
+ * when a key changes, and carries a record for every key set locally, so that it replaces all updates before it:
+ * a client whose write queue drops older updates (QueuePolicy.DROP_OLDEST) loses nothing. With a period, updates
+ * are sent to all connected clients at most once per period, and a client that hasn't taken the last one off its
+ * write queue yet gets the next one instead, so that updates don't pile up for a slow client. Otherwise every
+ * change is sent right away, and queued as far as the queue limit of the client allows. A client that connects
+ * gets all values set so far.
+ * 
+ * Each key is meant to have a single writer, at either end. If both ends set a key anyway, a value set locally
+ * but not sent yet wins: a record received for it is dropped, and the local value replaces it at the other end
+ * with the next update.
+ * 
+ * @author Niels Brouwers
+ *
+ */
+public class StateChannel
+{
+
+	/**
+	 * Maximum number of keys, as on the microcontroller.
+	 */
+	public static final int MAX_KEYS = 32;
+
+	/**
+	 * Size of a record on the wire.
+	 */
+	public static final int RECORD_SIZE = 3;
+
+	private final Server server;
+
+	// Latest values, and the keys set locally and those set locally but not sent yet. Guarded by this.
+	private final int[] values;
+	private int local = 0, dirty = 0;
+
+	// Start of a record whose remainder is still to come, per client. Concurrent rather than guarded by this, since
+	// a client closed while holding its own lock removes its entry, and flush takes the lock of a client.
+	private final ConcurrentHashMap<Client, byte[]> partials = new ConcurrentHashMap<Client, byte[]>();
+
+	// Set of event listeners for this channel. Copy-on-write, since listeners come and go from other threads
+	// than the I/O thread that notifies them.
+	private final CopyOnWriteArraySet<StateListener> listeners = new CopyOnWriteArraySet<StateListener>();
+
+	// Sends the pending changes once per period, or null if changes are sent right away.
+	private Timer timer = null;
+
+	private final ServerListener serverListener = new AbstractServerListener() {
+
+		@Override
+		public void onClientConnect(Server server, Client client)
+		{
+			byte[] frame = encode(local);
+			if (frame == null) return;
+
+			try
+			{
+				client.send(frame);
+			} catch (IOException e)
+			{
+				Log.e("microbridge", "problem sending state", e);
+			}
+		}
+
+		@Override
+		public void onClientDisconnect(Server server, Client client)
+		{
+			partials.remove(client);
+		}
+
+		@Override
+		public void onReceive(Client client, byte[] data)
+		{
+			receive(client, data);
+		}
+
+	};
+
+	/**
+	 * Constructs a new state channel and attaches it to a server.
+	 * @param server server to send and receive values on.
+	 * @param count number of keys, at most MAX_KEYS.
+	 * @param period minimum time between updates in milliseconds, or 0 to send every change right away.
+	 */
+	public StateChannel(Server server, int count, int period)
+	{
+		this.server = server;
+		this.values = new int[Math.min(count, MAX_KEYS)];
+
+		if (period > 0)
+		{
+			timer = new Timer("microbridge-state", true);
+			timer.scheduleAtFixedRate(new TimerTask() {
+				@Override
+				public void run()
+				{
+					flush();
+				}
+			}, period, period);
+		}
+
+		server.addListener(serverListener);
+	}
+
+	/**
+	 * Detaches the channel from the server. Pending changes are not sent.
+	 */
+	public void close()
+	{
+		if (timer != null)
+			timer.cancel();
+
+		server.removeListener(serverListener);
+	}
+
+	/**
+	 * @return the number of keys.
+	 */
+	public int getCount()
+	{
+		return values.length;
+	}
+
+	/**
+	 * Sets the local value of a key. The new value is sent with the next update, unless it is the same as the last
+	 * one.
+	 * @param key key, less than the number of keys.
+	 * @param value new value, in the range of [0..65535].
+	 */
+	public void set(int key, int value)
+	{
+		if (key < 0 || key >= values.length) return;
+
+		synchronized (this)
+		{
+			int bit = 1 << key;
+			if ((local & bit) != 0 && values[key] == value) return;
+
+			values[key] = value & 0xffff;
+			local |= bit;
+			dirty |= bit;
+		}
+
+		if (timer == null)
+			flush();
+	}
+
+	/**
+	 * @param key key, less than the number of keys.
+	 * @return the latest value of a key, set locally or received from a client.
+	 */
+	public synchronized int get(int key)
+	{
+		return key >= 0 && key < values.length ? values[key] : 0;
+	}
+
+	/**
+	 * Sends an update to all clients if a key changed since the last one. Called by the timer of the channel, or
+	 * by set if there is no period. With a period, a client with data still queued is skipped, and the change
+	 * counts as not sent until the next update reaches it as well. Doesn't block, see Client.send.
+	 */
+	public synchronized void flush()
+	{
+		if (dirty == 0) return;
+
+		byte[] frame = encode(local);
+		boolean skipped = false;
+
+		for (Client client : server.getClients())
+		{
+			if (timer != null && client.getQueuedBytes() > 0)
+			{
+				skipped = true;
+				continue;
+			}
+
+			try
+			{
+				client.send(frame);
+			} catch (IOException e)
+			{
+				Log.e("microbridge", "problem sending state", e);
+			}
+		}
+
+		if (!skipped)
+			dirty = 0;
+	}
+
+	/**
+	 * Encodes a set of keys as records.
+	 * @param keys bit mask of keys, bit i standing for key i.
+	 * @return the records, or null if the set is empty.
+	 */
+	private synchronized byte[] encode(int keys)
+	{
+		if (keys == 0) return null;
+
+		byte[] frame = new byte[Integer.bitCount(keys) * RECORD_SIZE];
+		int length = 0;
+
+		for (int key = 0; key < values.length; key++)
+			if ((keys & (1 << key)) != 0)
+			{
+				frame[length++] = (byte)key;
+				frame[length++] = (byte)values[key];
+				frame[length++] = (byte)(values[key] >> 8);
+			}
+
+		return frame;
+	}
+
+	/**
+	 * Stores received records and notifies the listeners, except for keys with a local value that has not been sent
+	 * yet. A record may be split across calls.
+	 * @param client source client
+	 * @param data received bytes
+	 */
+	private void receive(Client client, byte[] data)
+	{
+		byte[] partial = partials.remove(client);
+		byte[] record = new byte[RECORD_SIZE];
+		int offset = 0;
+
+		while (offset < data.length)
+		{
+			// Complete the record, starting from the bytes left over from last time.
+			int length = 0;
+			if (partial != null)
+			{
+				System.arraycopy(partial, 0, record, 0, partial.length);
+				length = partial.length;
+				partial = null;
+			}
+
+			while (length < RECORD_SIZE && offset < data.length)
+				record[length++] = data[offset++];
+
+			if (length < RECORD_SIZE)
+			{
+				byte[] rest = new byte[length];
+				System.arraycopy(record, 0, rest, 0, length);
+				partials.put(client, rest);
+
+				// Don't keep the entry of a client that was closed from another thread in the meantime.
+				if (client.isClosed())
+					partials.remove(client);
+				return;
+			}
+
+			// Keys the channel doesn't know are skipped.
+			int key = record[0] & 0xff;
+			if (key >= values.length) continue;
+
+			int value = (record[1] & 0xff) | ((record[2] & 0xff) << 8);
+			synchronized (this)
+			{
+				// A local value on its way wins.
+				if ((dirty & (1 << key)) != 0) continue;
+				values[key] = value;
+			}
+
+			for (StateListener listener : listeners)
+				listener.onStateChanged(this, key, value);
+		}
+	}
+
+	/**
+	 * Adds a listener to the channel
+	 * @param listener a StateListener instance
+	 */
+	public void addListener(StateListener listener)
+	{
+		this.listeners.add(listener);
+	}
+
+	/**
+	 * Removes a listener from the channel
+	 * @param listener a StateListener instance
+	 */
+	public void removeListener(StateListener listener)
+	{
+		this.listeners.remove(listener);
+	}
+
+}
@@ -0,0 +1,21 @@
+package org.microbridge.server;
+
+/**
+ * 
+ * State channel listener interface, see StateChannel.addListener.
+ * 
+ * @author Niels Brouwers
+ *
+ */
+public interface StateListener
+{
+
+	/**
+	 * Called when a value is received from a client. Called from the I/O thread of the server.
+	 * @param channel the channel the value came in on
+	 * @param key key of the value
+	 * @param value new value, in the range of [0..65535]
+	 */
+	public void onStateChanged(StateChannel channel, int key, int value);
+
+}
@@ -1,16 +1,14 @@
 package org.microbridge.servocontrol;
 
-import java.io.IOException;
-
-import org.microbridge.server.AbstractServerListener;
 import org.microbridge.server.Server;
+import org.microbridge.server.StateChannel;
+import org.microbridge.server.StateListener;
 
 import android.content.Context;
 import android.graphics.Canvas;
 import android.graphics.Color;
 import android.graphics.Paint;
 import android.graphics.Paint.Style;
-import android.util.Log;
 import android.view.MotionEvent;
 import android.view.View;
 import android.view.View.OnTouchListener;
@@ -28,7 +26,15 @@ public class JoystickView extends View implements OnTouchListener
 	private Paint borderPaint = new Paint();
 	private Paint sensorPaint = new Paint();
 	
-	private Server server;
+	// State shared with the Arduino: the servo positions go out, the sensor reading comes in.
+	private static final int KEY_SERVO0 = 0;
+	private static final int KEY_SERVO1 = 1;
+	private static final int KEY_SENSOR = 2;
+	
+	// Time between position updates in milliseconds, which bounds the control latency.
+	private static final int UPDATE_PERIOD = 20;
+	
+	private StateChannel state;
 	private float sx, sy;
 	private int sensorValue;
 	
@@ -36,16 +42,14 @@ public class JoystickView extends View implements OnTouchListener
 	{
 		super(context);
 		
-		this.server = server;
-		this.server.addListener(new AbstractServerListener() {
+		this.state = new StateChannel(server, 3, UPDATE_PERIOD);
+		this.state.addListener(new StateListener() {
 			
-			@Override
-			public void onReceive(org.microbridge.server.Client client, byte[] data)
+			public void onStateChanged(StateChannel channel, int key, int value)
 			{
+				if (key != KEY_SENSOR) return;
 				
-				if (data.length<2) return;
-				
-				sensorValue = (data[0] & 0xff) | ((data[1] & 0xff) << 8);
+				sensorValue = value;
 				
 				postInvalidate();
 			};
@@ -87,13 +91,9 @@ public class JoystickView extends View implements OnTouchListener
 		int x = Math.round((sx / this.getWidth()) * 180);
 		int y = Math.round((sy / this.getHeight()) * 180);
 		
-		try
-		{
-			server.send(new byte[] { (byte)x, (byte)y });
-		} catch (IOException e)
-		{
-			Log.e("microbridge", "problem sending TCP message", e);
-		}		
+		// Only the latest position is sent, once per update period.
+		state.set(KEY_SERVO0, x);
+		state.set(KEY_SERVO1, y);
 		
 		invalidate();
 		return true;
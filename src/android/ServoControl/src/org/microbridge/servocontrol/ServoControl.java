@@ -2,6 +2,7 @@ package org.microbridge.servocontrol;
 
 import java.io.IOException;
 
+import org.microbridge.server.QueuePolicy;
 import org.microbridge.server.Server;
 
 import android.app.Activity;
@@ -30,6 +31,10 @@ public class ServoControl extends Activity
 		try
 		{
 			server = new Server(4567);
+			
+			// Only the latest joystick position matters, so a slow client skips positions rather than lagging behind.
+			// Dropping the oldest frames is safe since every state channel update carries all values.
+			server.setQueueLimit(256, QueuePolicy.DROP_OLDEST);
 			server.start();
 		} catch (IOException e)
 		{
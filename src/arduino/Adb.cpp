@@ -15,16 +15,101 @@
 */
 
 #include <string.h>
+#include <avr/pgmspace.h>
+#include <avr/sleep.h>
 #include <Adb.h>
 
+#ifdef ADB_PROFILE_EEPROM
+#include <avr/eeprom.h>
+#endif
+
 // #define DEBUG
 
 #define MAX_BUF_SIZE 256
 
-static usb_device * adbDevice;
-static Connection * firstConnection;
-static boolean connected;
-static int connectionLocalId = 1;
+// System identity sent in our CNXN message, kept in flash.
+static const char identity[] PROGMEM = "host::microbridge";
+
+#if ADB_MAX_DEVICES > 1 && !ADB_HAS(ADB_FEATURE_HUB)
+#error "ADB_MAX_DEVICES > 1 needs ADB_FEATURE_HUB"
+#endif
+
+// Device table, and the device that goes first in the next poll. See ADB::service.
+static adb_device devices[ADB_MAX_DEVICES];
+static uint8_t nextDevice;
+
+#if ADB_HAS(ADB_FEATURE_HUB)
+// Index of the device an ADB_CONNECT, ADB_DISCONNECT or ADB_READY event is about, see ADB::getEventDevice.
+static uint8_t eventDevice;
+#endif
+
+#if ADB_HAS(ADB_FEATURE_ACCESSORY)
+// Accessory transport, or NULL if phones are only used through ADB. See ADB::initAccessory.
+static Accessory * aoa;
+
+// Maximum number of packets read from the accessory per poll.
+#define ADB_AOA_READS 8
+
+// Request types of the accessory vendor requests.
+#define bmREQ_AOA_GET (USB_SETUP_DEVICE_TO_HOST | USB_SETUP_TYPE_VENDOR | USB_SETUP_RECIPIENT_DEVICE)
+#define bmREQ_AOA_SET (USB_SETUP_HOST_TO_DEVICE | USB_SETUP_TYPE_VENDOR | USB_SETUP_RECIPIENT_DEVICE)
+#endif
+
+#if ADB_HAS(ADB_FEATURE_IDLE)
+// Time of the last ADB message or accessory transfer, see ADB::run.
+static uint32_t lastActivity;
+#endif
+
+#if ADB_HAS(ADB_FEATURE_IDLE) && ADB_HAS(ADB_FEATURE_STATS)
+// Time ADB::run last woke up, and whether nothing has been received since, see adb_stats.wakeLatency.
+static uint32_t wakeTime;
+static boolean awake;
+#endif
+
+#if ADB_HAS(ADB_FEATURE_PROFILE_CACHE)
+// Interface layouts of the devices seen before, and the entry that a new device replaces when the cache is full.
+static adb_profile profiles[ADB_PROFILE_CACHE_SIZE];
+static uint8_t nextProfile;
+
+#ifdef ADB_PROFILE_EEPROM
+// The EEPROM copy of the cache starts with a tag byte, which includes the number of entries so that a copy written
+// by a build with another cache size is ignored. The base changes with the layout of an entry.
+#define ADB_PROFILE_TAG (0xb0 + ADB_PROFILE_CACHE_SIZE)
+#endif
+#endif
+
+// Connection table. The local ID of a connection is its index in the table plus one, as ADB reserves ID 0.
+static Connection connections[ADB_MAX_CONNECTIONS];
+
+// Retry timer wheel. Each slot holds a bit mask of connections (by table index) whose OPEN retry deadline falls
+// in that tick. Deadlines more than one round ahead simply stay in their slot for another round. Connections whose
+// deadline has passed move to timerDue, and one of them is opened per poll.
+#define ADB_TIMER_SLOTS 8
+#define ADB_TIMER_TICK 128
+
+static uint32_t timerWheel[ADB_TIMER_SLOTS];
+static uint32_t timerDue;
+static uint32_t timerTick;
+
+// State of the pseudo random generator that adds jitter to the retry delays.
+static uint16_t jitter = 0xace1;
+
+// Time budget of the poll in progress (in microseconds), see ADB::poll(uint32_t). 0 means unbounded.
+static uint32_t pollStart;
+static uint32_t pollBudget;
+
+// A connection whose WRTE payload is still being received, and the state of the connection before the WRTE. No new
+// messages can be read, from any device, before the remainder of the payload: part of it may already be waiting in
+// the receive FIFO (see USB::setReadAhead).
+static Connection * receiving;
+static ConnectionStatus receivingStatus;
+static uint16_t receivingStored;
+
+#if ADB_HAS(ADB_FEATURE_STATS)
+// Statistics block, and the time each connection's last WRTE went out (to measure the OKAY round trip).
+static adb_stats stats;
+static uint32_t writeStart[ADB_MAX_CONNECTIONS];
+#endif
 
 // Event handler callback function.
 adb_eventHandler * eventHandler;
@@ -37,9 +122,17 @@ static void usbEventHandler(usb_device * device, usb_eventType event);
  */
 void ADB::init()
 {
+	uint8_t i;
+
 	// Signal that we are not connected.
-	adbDevice = NULL;
-	connected = false;
+	memset(devices, 0, sizeof(devices));
+	for (i = 0; i < ADB_MAX_DEVICES; i++)
+		devices[i].weight = 1;
+	nextDevice = 0;
+
+#if ADB_HAS(ADB_FEATURE_PROFILE_CACHE)
+	ADB::loadProfiles();
+#endif
 
 	// Initialise the USB layer and attach an event handler.
 	USB::setEventHandler(usbEventHandler);
@@ -81,10 +174,12 @@ void ADB::fireEvent(Connection * connection, adb_eventType type, uint16_t length
  * connection to tcp port 1234, and "shell:ls" outputs a listing of the phone root filesystem. Connections
  * can be made persistent by setting reconnect to true. Persistent connections will be automatically
  * reconnected when the USB cable is re-plugged in. Non-persistent connections will connect only once,
- * and should never be used after they are closed.
+ * and should never be used after they are closed, since their slot in the connection table is then free to be
+ * taken by the next connection that is added.
  *
- * The connection string is copied into the Connection record and may not exceed ADB_CONNECTIONSTRING_LENGTH-1
- * characters.
+ * Connections live in a static table of ADB_MAX_CONNECTIONS slots, so no heap memory is used. The connection
+ * string is copied into the Connection record and may not exceed ADB_CONNECTIONSTRING_LENGTH-1 characters.
+ * A constant connection string can be kept in flash instead, by passing it as F("tcp:1234").
  *
  * @param connectionString ADB connectionstring. I.e. "tcp:1234" or "shell:ls".
  * @param reconnect true for automatic reconnect (persistent connections).
@@ -93,36 +188,132 @@ void ADB::fireEvent(Connection * connection, adb_eventType type, uint16_t length
  */
 Connection * ADB::addConnection(const char * connectionString, boolean reconnect, adb_eventHandler * handler)
 {
+	Connection * connection;
 
-	// Allocate a new ADB connection object
-	Connection * connection = (Connection*)malloc(sizeof(Connection));
-	if (connection == NULL) return NULL;
+	if (strlen(connectionString) >= ADB_CONNECTIONSTRING_LENGTH) return NULL;
 
-	// Allocate memory for the connection string
-	connection->connectionString = (char*)strdup(connectionString);
-	if (connection->connectionString==NULL)
-	{
-		// Free the connection object and return null
-		free(connection);
-		return NULL;
-	}
+	connection = ADB::newConnection(reconnect, handler);
+#if ADB_CONNECTIONSTRING_LENGTH > 0
+	if (connection != NULL) strcpy(connection->connectionString, connectionString);
+#endif
+
+	return connection;
+}
+
+/**
+ * Adds a connection whose connection string is in program memory, e.g. ADB::addConnection(F("tcp:1234"), ...).
+ * The string is not copied, it goes from flash straight into the USB FIFO when the connection is opened, so it may
+ * be of any length and takes no SRAM. When all connections are added this way, ADB_CONNECTIONSTRING_LENGTH can be
+ * set to 0 to drop the connection string buffers altogether.
+ *
+ * @param connectionString ADB connectionstring in program memory.
+ * @param reconnect true for automatic reconnect (persistent connections).
+ * @param handler event handler.
+ * @return an ADB connection record or NULL on failure (not enough slots).
+ */
+Connection * ADB::addConnection(const __FlashStringHelper * connectionString, boolean reconnect, adb_eventHandler * handler)
+{
+	Connection * connection = ADB::newConnection(reconnect, handler);
+
+	if (connection != NULL) connection->progmemString = (const char *)connectionString;
+
+	return connection;
+}
+
+/**
+ * Takes a free slot in the connection table and initialises it, except for the connection string, which is left
+ * empty. The connection is opened on the next poll.
+ *
+ * @param reconnect true for automatic reconnect (persistent connections).
+ * @param handler event handler.
+ * @return an ADB connection record or NULL if all slots are in use.
+ */
+Connection * ADB::newConnection(boolean reconnect, adb_eventHandler * handler)
+{
+	Connection * connection = NULL;
+	uint8_t i;
 
-	// Initialise the newly created object.
-	connection->localID = connectionLocalId ++;
+	// Find a free slot in the connection table.
+	for (i = 0; i < ADB_MAX_CONNECTIONS; i++)
+		if (connections[i].status == ADB_UNUSED)
+		{
+			connection = &connections[i];
+			break;
+		}
+
+	// Unable to find an empty spot, all connection slots in use.
+	if (connection == NULL) return NULL;
+
+	// Initialise the connection record.
+#if ADB_CONNECTIONSTRING_LENGTH > 0
+	connection->connectionString[0] = 0;
+#endif
+	connection->progmemString = NULL;
+	connection->localID = i + 1;
+	connection->remoteID = 0;
 	connection->status = ADB_CLOSED;
-	connection->lastConnectionAttempt = 0;
-	connection->reconnect = reconnect;
+	connection->retryCount = 0;
+	connection->reconnect = reconnect != false;
 	connection->eventHandler = handler;
+#if ADB_HAS(ADB_FEATURE_HUB)
+	connection->device = 0;
+#endif
+#if ADB_HAS(ADB_FEATURE_WRITE_QUEUE)
+	connection->writeQueue = NULL;
+	connection->writeQueueSize = 0;
+	connection->writeQueueHead = 0;
+	connection->writeQueueLength = 0;
+	connection->coalesce = false;
+	connection->flushRequested = false;
+#endif
+#if ADB_HAS(ADB_FEATURE_RECEIVE_BUFFER)
+	connection->receiveBuffer = NULL;
+	connection->receiveBufferSize = 0;
+	connection->receiveHead = 0;
+	connection->receiveLength = 0;
+#endif
+#if ADB_HAS(ADB_FEATURE_FLOW_CONTROL)
+	connection->flowControl = false;
+	connection->okayPending = false;
+	connection->unconsumed = 0;
+#endif
 
-	// Add the connection to the linked list. Note that it's easier to just insert
-	// at position 0 because you don't have to traverse the list :)
-	connection->next = firstConnection;
-	firstConnection = connection;
+	// Open the connection as soon as possible.
+	ADB::scheduleOpen(connection, 0);
 
-	// Unable to find an empty spot, all connection slots in use.
 	return connection;
 }
 
+/**
+ * Looks up a connection by its local ID.
+ *
+ * @param localID local ID of the connection, as sent by the device in arg1 of OKAY, CLSE, and WRTE messages.
+ * @return the connection, or NULL if the ID does not refer to a connection in use.
+ */
+Connection * ADB::getConnection(uint32_t localID)
+{
+	Connection * connection;
+
+	if (localID == 0 || localID > ADB_MAX_CONNECTIONS) return NULL;
+
+	connection = &connections[localID - 1];
+	return connection->status == ADB_UNUSED ? NULL : connection;
+}
+
+/**
+ * @param connection ADB connection.
+ * @return the ADB device the connection is bound to.
+ */
+adb_device * ADB::getDevice(Connection * connection)
+{
+#if ADB_HAS(ADB_FEATURE_HUB)
+	return &devices[connection->device];
+#else
+	(void)connection;
+	return &devices[0];
+#endif
+}
+
 /**
  * Prints an ADB_message, for debugging purposes.
  * @param message ADB message to print.
@@ -160,13 +351,13 @@ static void adb_printMessage(adb_message * message)
 /**
  * Writes an empty message (without payload) to the ADB device.
  *
- * @param device USB device handle.
+ * @param device ADB device.
  * @param command ADB command.
  * @param arg0 first ADB argument (command dependent).
  * @param arg0 second ADB argument (command dependent).
  * @return error code or 0 for success.
  */
-int ADB::writeEmptyMessage(usb_device * device, uint32_t command, uint32_t arg0, uint32_t arg1)
+int ADB::writeEmptyMessage(adb_device * device, uint32_t command, uint32_t arg0, uint32_t arg1)
 {
 	adb_message message;
 
@@ -180,14 +371,17 @@ int ADB::writeEmptyMessage(usb_device * device, uint32_t command, uint32_t arg0,
 #ifdef DEBUG
 	serialPrint("OUT << "); adb_printMessage(&message);
 #endif
+#if ADB_HAS(ADB_FEATURE_IDLE)
+	lastActivity = micros();
+#endif
 
-	return USB::bulkWrite(device, sizeof(adb_message), (uint8_t*)&message);
+	return USB::bulkWrite(device->usb, sizeof(adb_message), (uint8_t*)&message);
 }
 
 /**
  * Writes an ADB message with payload to the ADB device.
  *
- * @param device USB device handle.
+ * @param device ADB device.
  * @param command ADB command.
  * @param arg0 first ADB argument (command dependent).
  * @param arg0 second ADB argument (command dependent).
@@ -195,17 +389,56 @@ int ADB::writeEmptyMessage(usb_device * device, uint32_t command, uint32_t arg0,
  * @param data command payload.
  * @return error code or 0 for success.
  */
-int ADB::writeMessage(usb_device * device, uint32_t command, uint32_t arg0, uint32_t arg1, uint32_t length, uint8_t * data)
+int ADB::writeMessage(adb_device * device, uint32_t command, uint32_t arg0, uint32_t arg1, uint32_t length, uint8_t * data)
+{
+	usb_segment segment;
+
+	segment.data = data;
+	segment.length = length;
+	segment.progmem = false;
+
+	return ADB::writeMessagev(device, command, arg0, arg1, 1, &segment);
+}
+
+/**
+ * Sends an ADB message whose payload is gathered from a list of segments, which may reside in RAM or in program
+ * memory. The payload checksum is computed in a single pass over the segments, or skipped altogether when the
+ * device speaks A_VERSION_SKIP_CHECKSUM or later. The payload is then loaded into the USB FIFO straight from the
+ * segments, without building a contiguous copy.
+ *
+ * If a deadline is set (see ADB::enforceBudget) and the device NAKs until it passes, USB_TRANSFER_PENDING is returned,
+ * and the same call must be repeated to send the remainder of the message before anything else is sent to the device.
+ *
+ * @param device ADB device.
+ * @param command ADB command.
+ * @param arg0 first ADB argument (command dependent).
+ * @param arg0 second ADB argument (command dependent).
+ * @param count number of payload segments.
+ * @param segments payload segments.
+ * @return error code or 0 for success.
+ */
+int ADB::sendMessagev(adb_device * device, uint32_t command, uint32_t arg0, uint32_t arg1, uint8_t count, usb_segment * segments)
 {
 	adb_message message;
-	uint32_t count, sum = 0;
-	uint8_t * x;
-	uint8_t rcode;
+	uint32_t length = 0, sum = 0;
+	const uint8_t * x;
+	uint16_t n;
+	uint8_t i, rcode;
+
+	// Calculate payload length and checksum.
+	for (i = 0; i < count; i++)
+	{
+		length += segments[i].length;
 
-	// Calculate data checksum
-    count = length;
-    x = data;
-    while(count-- > 0) sum += *x++;
+		if (device->remoteVersion >= A_VERSION_SKIP_CHECKSUM) continue;
+
+		n = segments[i].length;
+		x = segments[i].data;
+		if (segments[i].progmem)
+			while (n-- > 0) sum += pgm_read_byte(x++);
+		else
+			while (n-- > 0) sum += *x++;
+	}
 
 	// Fill out the message record.
 	message.command = command;
@@ -218,49 +451,122 @@ int ADB::writeMessage(usb_device * device, uint32_t command, uint32_t arg0, uint
 #ifdef DEBUG
 	serialPrint("OUT << "); adb_printMessage(&message);
 #endif
+#if ADB_HAS(ADB_FEATURE_IDLE)
+	lastActivity = micros();
+#endif
+
+	// Send the header, unless it went out in an earlier call that ran out of time during the payload.
+	if (!device->headerSent)
+	{
+		rcode = USB::bulkWrite(device->usb, sizeof(adb_message), (uint8_t*)&message);
+		if (rcode) return rcode;
+
+		device->headerSent = true;
+	}
+
+	rcode = USB::bulkWritev(device->usb, count, segments);
+	if (rcode != USB_TRANSFER_PENDING) device->headerSent = false;
 
-	rcode = USB::bulkWrite(device, sizeof(adb_message), (uint8_t*)&message);
-	if (rcode) return rcode;
+#if ADB_HAS(ADB_FEATURE_STATS)
+	// Count the payload, and start the clock on the OKAY. A WRTE always carries our local ID in arg0.
+	if (rcode == 0 && command == A_WRTE && arg0 >= 1 && arg0 <= ADB_MAX_CONNECTIONS)
+	{
+		stats.bytesOut[arg0 - 1] += length;
+		writeStart[arg0 - 1] = micros();
+	}
+#endif
 
-	rcode = USB::bulkWrite(device, length, data);
 	return rcode;
 }
 
+/**
+ * Sends the remainder of a WRTE that ran out of time during a poll, without a deadline. Called before any other
+ * message is sent to the device.
+ *
+ * @param device ADB device.
+ */
+void ADB::finishSend(adb_device * device)
+{
+#if ADB_HAS(ADB_FEATURE_WRITE_QUEUE)
+	if (device->sending != NULL)
+		ADB::flushWriteQueue(device->sending);
+#else
+	(void)device;
+#endif
+}
+
+/**
+ * Sends an ADB message, see ADB::sendMessagev. A WRTE that ran out of time halfway is completed first.
+ *
+ * @param device ADB device.
+ * @param command ADB command.
+ * @param arg0 first ADB argument (command dependent).
+ * @param arg0 second ADB argument (command dependent).
+ * @param count number of payload segments.
+ * @param segments payload segments.
+ * @return error code or 0 for success.
+ */
+int ADB::writeMessagev(adb_device * device, uint32_t command, uint32_t arg0, uint32_t arg1, uint8_t count, usb_segment * segments)
+{
+	ADB::finishSend(device);
+
+	return ADB::sendMessagev(device, command, arg0, arg1, count, segments);
+}
+
 /**
  * Writes an ADB command with a string as payload.
  *
- * @param device USB device handle.
+ * @param device ADB device.
  * @param command ADB command.
  * @param arg0 first ADB argument (command dependent).
  * @param arg0 second ADB argument (command dependent).
  * @param str payload string.
  * @return error code or 0 for success.
  */
-int ADB::writeStringMessage(usb_device * device, uint32_t command, uint32_t arg0, uint32_t arg1, char * str)
+int ADB::writeStringMessage(adb_device * device, uint32_t command, uint32_t arg0, uint32_t arg1, char * str)
 {
 	return ADB::writeMessage(device, command, arg0, arg1, strlen(str) + 1, (uint8_t*)str);
 }
 
+/**
+ * Writes an ADB command with a string in program memory as payload. The string is streamed from flash straight
+ * into the USB FIFO, without a copy in SRAM.
+ *
+ * @param device ADB device.
+ * @param command ADB command.
+ * @param arg0 first ADB argument (command dependent).
+ * @param arg0 second ADB argument (command dependent).
+ * @param str payload string in program memory.
+ * @return error code or 0 for success.
+ */
+int ADB::writeStringMessage_P(adb_device * device, uint32_t command, uint32_t arg0, uint32_t arg1, const char * str)
+{
+	usb_segment segment;
+
+	segment.data = (const uint8_t*)str;
+	segment.length = strlen_P(str) + 1;
+	segment.progmem = true;
+
+	return ADB::writeMessagev(device, command, arg0, arg1, 1, &segment);
+}
+
 /**
  * Poll an ADB message.
+ * @param device ADB device.
  * @param message on success, the ADB message will be returned in this struct.
  * @param poll true to poll for a packet on the input endpoint, false to wait for a packet. Use false here when a packet is expected (i.e. OKAY in response to WRTE)
  * @return true iff a packet was successfully received, false otherwise.
  */
-boolean ADB::pollMessage(adb_message * message, boolean poll)
+boolean ADB::pollMessage(adb_device * device, adb_message * message, boolean poll)
 {
 	int bytesRead;
-	uint8_t buf[ADB_USB_PACKETSIZE];
 
-	// Poll a packet from the USB
-	bytesRead = USB::bulkRead(adbDevice, ADB_USB_PACKETSIZE, buf, poll);
+	// Poll a packet from the USB, straight into the message struct.
+	bytesRead = USB::bulkRead(device->usb, sizeof(adb_message), (uint8_t*)message, poll);
 
 	// Check if the USB in transfer was successful.
 	if (bytesRead<0) return false;
 
-	// Check if the buffer contains a valid message
-	memcpy((void*)message, (void*)buf, sizeof(adb_message));
-
 	// If the message is corrupt, return.
 	if (message->magic != (message->command ^ 0xffffffff))
 	{
@@ -273,33 +579,188 @@ boolean ADB::pollMessage(adb_message * message, boolean poll)
 	// Check if the received number of bytes matches our expected 24 bytes of ADB message header.
 	if (bytesRead != sizeof(adb_message)) return false;
 
+	// The payload follows right behind the header, let the USB layer read ahead into it.
+	USB::setReadAhead(device->usb, message->data_length);
+
 	return true;
 }
 
 /**
- * Sends an ADB OPEN message for any connections that are currently in the CLOSED state.
+ * Removes a connection from the retry timer wheel.
+ *
+ * @param connection ADB connection.
+ */
+void ADB::cancelOpen(Connection * connection)
+{
+	uint32_t mask = ~(1UL << (connection->localID - 1));
+	uint8_t i;
+
+	for (i = 0; i < ADB_TIMER_SLOTS; i++)
+		timerWheel[i] &= mask;
+
+	timerDue &= mask;
+}
+
+/**
+ * Schedules an OPEN attempt for a connection. Any attempt that was scheduled before is cancelled.
+ *
+ * @param connection ADB connection.
+ * @param delay delay in milliseconds.
+ */
+void ADB::scheduleOpen(Connection * connection, uint32_t delay)
+{
+	ADB::cancelOpen(connection);
+
+	connection->retryDeadline = millis() + delay;
+	timerWheel[(connection->retryDeadline / ADB_TIMER_TICK) & (ADB_TIMER_SLOTS - 1)] |= 1UL << (connection->localID - 1);
+}
+
+/**
+ * Schedules the next OPEN attempt for a persistent connection that failed to open or was closed. The delay starts at
+ * ADB_CONNECTION_RETRY_TIME and doubles with every consecutive failure up to ADB_CONNECTION_RETRY_MAX. Up to a
+ * quarter of the delay is added as random jitter, so that connections that failed together do not retry in lock
+ * step.
+ *
+ * @param connection ADB connection.
+ */
+void ADB::scheduleRetry(Connection * connection)
+{
+	uint32_t delay = ADB_CONNECTION_RETRY_TIME;
+	uint8_t i;
+
+	for (i = 0; i < connection->retryCount && delay < ADB_CONNECTION_RETRY_MAX; i++)
+		delay <<= 1;
+	if (delay >= ADB_CONNECTION_RETRY_MAX)
+		delay = ADB_CONNECTION_RETRY_MAX;
+	else
+		connection->retryCount++;
+
+	// Jitter, from a 16-bit xorshift generator.
+	jitter ^= jitter << 7;
+	jitter ^= jitter >> 9;
+	jitter ^= jitter << 8;
+	delay += jitter % (delay / 4 + 1);
+
+	ADB::scheduleOpen(connection, delay);
+}
+
+/**
+ * Advances the retry timer wheel. Visits every slot from the last tick that was processed up to the current one (at
+ * most one full round), and moves the connections whose deadline has passed to the set of due connections.
+ */
+void ADB::runTimers()
+{
+	uint32_t now = millis();
+	uint32_t tick = now / ADB_TIMER_TICK;
+	uint32_t mask, bit;
+	uint8_t slot, index;
+
+	if (tick - timerTick >= ADB_TIMER_SLOTS)
+		timerTick = tick - (ADB_TIMER_SLOTS - 1);
+
+	while (1)
+	{
+		slot = timerTick & (ADB_TIMER_SLOTS - 1);
+
+		for (mask = timerWheel[slot], index = 0; mask != 0; mask >>= 1, index++)
+		{
+			bit = 1UL << index;
+			if ((mask & 1) && (int32_t)(now - connections[index].retryDeadline) >= 0)
+			{
+				timerWheel[slot] &= ~bit;
+				timerDue |= bit;
+			}
+		}
+
+		if (timerTick == tick) break;
+		timerTick++;
+	}
+}
+
+/**
+ * Sends ADB OPEN messages for the closed connections of a device whose retry timers have expired, back to back and
+ * without waiting for the replies. The device answers each OPEN with an OKAY or CLSE addressed to its local ID, in
+ * whatever order, so all connections of a device open in a single round trip. With a poll budget, the OPENs that
+ * don't fit stay due for the next poll.
+ *
+ * An OPEN that can't be written is retried after the usual back-off. One that the device hasn't answered within
+ * ADB_OPEN_TIMEOUT fails as if the device had refused it. Either way, it no longer holds up ADB_READY.
+ *
+ * @param device ADB device.
  */
-void ADB::openClosedConnections()
+void ADB::openClosedConnections(adb_device * device)
 {
-	uint32_t timeSinceLastConnect;
 	Connection * connection;
+	uint8_t index;
+	int rcode;
 
-	// Iterate over the connection list and send "OPEN" for the ones that are currently closed.
-	for (connection = firstConnection; connection!=NULL; connection = connection->next)
+	ADB::runTimers();
+
+	// Take the due connections of this device in order.
+	for (index = 0; index < ADB_MAX_CONNECTIONS && timerDue != 0 && ADB::hasBudget(); index++)
 	{
-		timeSinceLastConnect = millis() - connection->lastConnectionAttempt;
-		if (connection->status==ADB_CLOSED && timeSinceLastConnect>ADB_CONNECTION_RETRY_TIME)
+		if (!(timerDue & (1UL << index)) || ADB::getDevice(&connections[index]) != device) continue;
+		timerDue &= ~(1UL << index);
+
+		connection = &connections[index];
+		if (connection->status == ADB_OPENING)
 		{
-			// Issue open command.
-			ADB::writeStringMessage(adbDevice, A_OPEN, connection->localID, 0, connection->connectionString);
+			ADB::handleClose(connection);
+			continue;
+		}
+		if (connection->status!=ADB_CLOSED) continue;
 
-			// Record the last attempt time
-			connection->lastConnectionAttempt = millis();
-			connection->status = ADB_OPENING;
+		// Issue open command, straight from flash if that is where the connection string is.
+#if ADB_CONNECTIONSTRING_LENGTH > 0
+		if (connection->progmemString == NULL)
+			rcode = ADB::writeStringMessage(device, A_OPEN, connection->localID, 0, connection->connectionString);
+		else
+#endif
+			rcode = ADB::writeStringMessage_P(device, A_OPEN, connection->localID, 0, connection->progmemString);
 
+		if (rcode != 0)
+		{
+			ADB::scheduleRetry(connection);
+			ADB::settleOpen(connection);
+			continue;
 		}
+
+		// The timer now runs out when the answer is overdue.
+		connection->status = ADB_OPENING;
+		ADB::scheduleOpen(connection, ADB_OPEN_TIMEOUT);
 	}
+}
+
+/**
+ * Fires ADB_READY for a device.
+ *
+ * @param device ADB device.
+ */
+void ADB::fireReady(adb_device * device)
+{
+#if ADB_HAS(ADB_FEATURE_HUB)
+	eventDevice = device - devices;
+#else
+	(void)device;
+#endif
+	ADB::fireEvent(NULL, ADB_READY, 0, NULL);
+}
+
+/**
+ * Takes a connection that has been answered out of the connections its device opened on connect, and fires
+ * ADB_READY when it was the last one.
+ *
+ * @param connection ADB connection.
+ */
+void ADB::settleOpen(Connection * connection)
+{
+	adb_device * device = ADB::getDevice(connection);
+	uint32_t bit = 1UL << (connection->localID - 1);
 
+	if (!(device->opening & bit)) return;
+
+	device->opening &= ~bit;
+	if (device->opening == 0) ADB::fireReady(device);
 }
 
 /**
@@ -315,14 +776,39 @@ void ADB::handleOkay(Connection * connection, adb_message * message)
 	{
 		connection->status = ADB_OPEN;
 		connection->remoteID = message->arg0;
+		connection->retryCount = 0;
+		ADB::cancelOpen(connection);
+
+#if ADB_HAS(ADB_FEATURE_RECEIVE_BUFFER)
+		// Start the new stream with an empty receive buffer.
+		connection->receiveHead = 0;
+		connection->receiveLength = 0;
+#endif
+#if ADB_HAS(ADB_FEATURE_FLOW_CONTROL)
+		connection->okayPending = false;
+		connection->unconsumed = 0;
+#endif
 
 		ADB::fireEvent(connection, ADB_CONNECTION_OPEN, 0, NULL);
+		ADB::settleOpen(connection);
 	}
 
 	// Check if the OKAY message was a response to a WRITE message.
 	if (connection->status == ADB_WRITING)
+	{
 		connection->status = ADB_OPEN;
 
+#if ADB_HAS(ADB_FEATURE_STATS)
+		ADB::record(stats.okayLatency, micros() - writeStart[connection->localID - 1]);
+#endif
+
+#if ADB_HAS(ADB_FEATURE_WRITE_QUEUE)
+		// Send the next batch of queued data right away.
+		if (ADB::isFlushDue(connection))
+			ADB::flushWriteQueue(connection);
+#endif
+	}
+
 }
 
 /**
@@ -334,99 +820,287 @@ void ADB::handleClose(Connection * connection)
 {
 	// Check if the CLOSE message was a response to a CONNECT message.
 	if (connection->status==ADB_OPENING)
+	{
 		ADB::fireEvent(connection, ADB_CONNECTION_FAILED, 0, NULL);
+		ADB::settleOpen(connection);
+	}
 	else
 		ADB::fireEvent(connection, ADB_CONNECTION_CLOSE, 0, NULL);
 
-	// Connection failed
+	// Persistent connections are retried after a back-off delay, others are done.
 	if (connection->reconnect)
+	{
 		connection->status = ADB_CLOSED;
+		ADB::scheduleRetry(connection);
+	}
 	else
+	{
 		connection->status = ADB_UNUSED;
+		ADB::cancelOpen(connection);
+	}
+
+#if ADB_HAS(ADB_FEATURE_WRITE_QUEUE)
+	// Discard any queued data, it was meant for the old stream.
+	connection->writeQueueHead = 0;
+	connection->writeQueueLength = 0;
+	connection->flushRequested = false;
+#endif
+
+#if ADB_HAS(ADB_FEATURE_FLOW_CONTROL)
+	// An OKAY that was being withheld is moot now.
+	connection->okayPending = false;
+	connection->unconsumed = 0;
+#endif
 
 }
 
 /**
- * Handles an ADB WRITE message.
+ * Handles an ADB WRITE message. The payload is read by ADB::receive, which may run out of time and be picked up
+ * again by the next poll.
  *
  * @param connection ADB connection
  * @param message ADB message struct.
  */
 void ADB::handleWrite(Connection * connection, adb_message * message)
 {
-	uint32_t bytesLeft = message->data_length;
-	uint8_t buf[ADB_USB_PACKETSIZE];
-	ConnectionStatus previousStatus;
-	int bytesRead;
-
-	previousStatus = connection->status;
+	receivingStatus = connection->status;
+	receivingStored = 0;
+	receiving = connection;
 
 	connection->status = ADB_RECEIVING;
 	connection->dataRead = 0;
 	connection->dataSize = message->data_length;
 
-	while (bytesLeft>0)
+	ADB::receive(connection);
+}
+
+/**
+ * Reads (the remainder of) the payload of an ADB WRITE message one USB packet at a time, and sends OKAY in reply
+ * once it is all in. The payload goes into the receive buffer of the connection if it has one, or is handed to the
+ * event handler one USB packet at a time otherwise.
+ *
+ * @param connection ADB connection
+ * @return true iff the payload is done, false if the poll ran out of time.
+ */
+boolean ADB::receive(Connection * connection)
+{
+	int bytesRead;
+
+	while (connection->dataRead < connection->dataSize)
 	{
-		int len = bytesLeft < ADB_USB_PACKETSIZE ? bytesLeft : ADB_USB_PACKETSIZE;
+		// Leave the rest for the next poll if we're out of time.
+		if (!ADB::hasBudget()) return false;
+
+		ADB::enforceBudget(true);
+#if ADB_HAS(ADB_FEATURE_RECEIVE_BUFFER)
+		if (connection->receiveBuffer != NULL)
+			bytesRead = ADB::receiveBuffered(connection);
+		else
+#endif
+#if ADB_HAS(ADB_FEATURE_PACKET_EVENTS)
+			bytesRead = ADB::receiveEvents(connection);
+#else
+		{
+			// Read a packet without storing any of it.
+			bytesRead = USB::bulkReadRing(ADB::getDevice(connection)->usb, 0, NULL, 0, 0, false);
+			if (bytesRead > 0) connection->dataRead += bytesRead;
+		}
+#endif
+		ADB::enforceBudget(false);
 
-		// Read payload
-		bytesRead = USB::bulkRead(adbDevice, len, buf, false);
+#if ADB_HAS(ADB_FEATURE_STATS)
+		if (bytesRead > 0) stats.bytesIn[connection->localID - 1] += bytesRead;
+#endif
 
-//		if (len != bytesRead)
-//			serialPrintf("bytes read mismatch: %d expected, %d read, %ld left\n", len, bytesRead, bytesLeft);
+		// A read that was NAKed until the deadline is retried by the next poll.
+		if (bytesRead < 0 && !ADB::hasBudget()) return false;
 
 		// Break out of the read loop if there's no data to read :(
-		if (bytesRead==-1) break;
+		if (bytesRead <= 0) break;
+	}
+
+#if ADB_HAS(ADB_FEATURE_RECEIVE_BUFFER)
+	if (connection->receiveBuffer != NULL)
+	{
+#if ADB_HAS(ADB_FEATURE_FLOW_CONTROL)
+		connection->unconsumed += receivingStored;
+#endif
+		ADB::fireEvent(connection, ADB_CONNECTION_RECEIVE, receivingStored, NULL);
+	}
+#endif
 
-		connection->dataRead += len;
-		ADB::fireEvent(connection, ADB_CONNECTION_RECEIVE, len, buf);
+	connection->status = receivingStatus;
+	receiving = NULL;
 
-		bytesLeft -= bytesRead;
+#if ADB_HAS(ADB_FEATURE_FLOW_CONTROL)
+	// Hold back the OKAY, and with it the next WRTE from the device, until the application has caught up. It is
+	// sent by ADB::poll once enough has been consumed.
+	if (connection->flowControl && connection->unconsumed > connection->window)
+	{
+		connection->okayPending = true;
+		ADB::fireEvent(connection, ADB_CONNECTION_THROTTLE, 0, NULL);
+		return true;
 	}
+#endif
 
 	// Send OKAY message in reply.
-	bytesRead = ADB::writeEmptyMessage(adbDevice, A_OKAY, message->arg1, message->arg0);
+	ADB::writeEmptyMessage(ADB::getDevice(connection), A_OKAY, connection->localID, connection->remoteID);
 
-	connection->status = previousStatus;
+	return true;
 }
 
+#if ADB_HAS(ADB_FEATURE_PACKET_EVENTS)
 /**
- * Close all ADB connections.
+ * Reads one USB packet of the payload of an ADB WRITE message and fires an ADB_CONNECTION_RECEIVE event for it.
  *
  * @param connection ADB connection
- * @param message ADB message struct.
+ * @return number of bytes read, or error code in case of failure.
  */
-void ADB::closeAll()
+int ADB::receiveEvents(Connection * connection)
 {
-	Connection * connection;
-
+	uint32_t bytesLeft = connection->dataSize - connection->dataRead;
+	uint16_t length = bytesLeft < ADB_USB_PACKETSIZE ? bytesLeft : ADB_USB_PACKETSIZE;
+	uint8_t buf[ADB_USB_PACKETSIZE];
+	int bytesRead;
+
+	// Read payload
+	bytesRead = USB::bulkRead(ADB::getDevice(connection)->usb, length, buf, false);
+	if (bytesRead < 0) return bytesRead;
+
+	if (length > bytesRead) length = bytesRead;
+	connection->dataRead += bytesRead;
+#if ADB_HAS(ADB_FEATURE_FLOW_CONTROL)
+	connection->unconsumed += length;
+#endif
+
+	// Writes from the event handler must not be cut short by the deadline.
+	ADB::enforceBudget(false);
+	ADB::fireEvent(connection, ADB_CONNECTION_RECEIVE, length, buf);
+
+	return bytesRead;
+}
+#endif
+
+#if ADB_HAS(ADB_FEATURE_RECEIVE_BUFFER)
+/**
+ * Reads one USB packet of the payload of an ADB WRITE message straight from the USB FIFO into the receive buffer of
+ * a connection. ADB::receive fires a single ADB_CONNECTION_RECEIVE event with a NULL data pointer once the whole
+ * payload is in. Data that does not fit in the receive buffer is dropped.
+ *
+ * @param connection ADB connection
+ * @return number of bytes read, or error code in case of failure.
+ */
+int ADB::receiveBuffered(Connection * connection)
+{
+	uint32_t bytesLeft = connection->dataSize - connection->dataRead;
+	uint16_t length = bytesLeft < ADB_USB_PACKETSIZE ? bytesLeft : ADB_USB_PACKETSIZE;
+	uint16_t space, tail;
+	int bytesRead;
+
+	// Store as much of the next packet as fits.
+	space = connection->receiveBufferSize - connection->receiveLength;
+	if (length > space) length = space;
+
+	tail = connection->receiveHead + connection->receiveLength;
+	if (tail >= connection->receiveBufferSize) tail -= connection->receiveBufferSize;
+
+	bytesRead = USB::bulkReadRing(ADB::getDevice(connection)->usb, length, connection->receiveBuffer, connection->receiveBufferSize, tail, false);
+	if (bytesRead < 0) return bytesRead;
+
+	if (length > bytesRead) length = bytesRead;
+	connection->receiveLength += length;
+	receivingStored += length;
+	connection->dataRead += bytesRead;
+
+	return bytesRead;
+}
+#endif
+
+/**
+ * Reads and discards a number of payload bytes.
+ *
+ * @param device ADB device.
+ * @param length number of bytes to discard.
+ */
+void ADB::skip(adb_device * device, uint32_t length)
+{
+	int bytesRead;
+
+	while (length > 0)
+	{
+		// Read a packet without storing any of it.
+		bytesRead = USB::bulkReadRing(device->usb, 0, NULL, 0, 0, false);
+		if (bytesRead <= 0) break;
+
+		length -= (uint32_t)bytesRead < length ? (uint32_t)bytesRead : length;
+	}
+
+	// Don't read ahead into a payload that was given up on halfway.
+	USB::setReadAhead(device->usb, 0);
+}
+
+/**
+ * Close all ADB connections of a device.
+ *
+ * @param device ADB device.
+ */
+void ADB::closeAll(adb_device * device)
+{
+	Connection * connection;
+
 	// Iterate over all connections and close the ones that are currently open.
-	for (connection = firstConnection; connection != NULL; connection = connection->next)
-		if (!(connection->status==ADB_UNUSED || connection->status==ADB_CLOSED))
+	for (connection = connections; connection < connections + ADB_MAX_CONNECTIONS; connection++)
+		if (!(connection->status==ADB_UNUSED || connection->status==ADB_CLOSED) && ADB::getDevice(connection) == device)
 			ADB::handleClose(connection);
 
 }
 
 /**
  * Handles an ADB connect message. This is a response to a connect message sent from our side.
+ * @param device ADB device.
  * @param message ADB message.
  */
-void ADB::handleConnect(adb_message * message)
+void ADB::handleConnect(adb_device * device, adb_message * message)
 {
-	unsigned int bytesRead;
-	uint8_t buf[MAX_BUF_SIZE];
+	Connection * connection;
+	int bytesRead;
+	uint8_t buf[ADB_CONNECT_BUFFER_SIZE > 0 ? ADB_CONNECT_BUFFER_SIZE : 1];
 	uint16_t len;
 
-	// Read payload (remote ADB device ID)
-	len = message->data_length < MAX_BUF_SIZE ? message->data_length : MAX_BUF_SIZE;
-	bytesRead = USB::bulkRead(adbDevice, len, buf, false);
+	// Read payload (remote ADB device ID), and discard what does not fit in the buffer.
+	len = message->data_length < ADB_CONNECT_BUFFER_SIZE ? message->data_length : ADB_CONNECT_BUFFER_SIZE;
+	bytesRead = message->data_length > 0 ? USB::bulkRead(device->usb, len, buf, false) : 0;
+	if (bytesRead > 0 && (uint32_t)bytesRead < message->data_length)
+		ADB::skip(device, message->data_length - bytesRead);
+	if (bytesRead < len) len = bytesRead < 0 ? 0 : bytesRead;
+
+	// CNXN(version, maxdata, "system-identity-string"). Remember how large a message the device accepts.
+	device->remoteVersion = message->arg0;
+	device->remoteMaxData = message->arg1 > 0 ? message->arg1 : MAX_PAYLOAD;
 
 	// Signal that we are now connected to an Android device (yay!)
-	connected = true;
+	device->connected = true;
+
+	// Open all persistent connections of the device right away, with a fresh back-off. The OPENs go out together,
+	// and ADB_READY follows once all of them have been answered.
+	device->opening = 0;
+	for (connection = connections; connection < connections + ADB_MAX_CONNECTIONS; connection++)
+		if (connection->status == ADB_CLOSED && ADB::getDevice(connection) == device)
+		{
+			connection->retryCount = 0;
+			ADB::scheduleOpen(connection, 0);
+			device->opening |= 1UL << (connection->localID - 1);
+		}
 
 	// Fire event.
+#if ADB_HAS(ADB_FEATURE_HUB)
+	eventDevice = device - devices;
+#endif
 	ADB::fireEvent(NULL, ADB_CONNECT, len, buf);
 
+	// Nothing to wait for.
+	if (device->opening == 0) ADB::fireReady(device);
+
 }
 
 /**
@@ -434,56 +1108,296 @@ void ADB::handleConnect(adb_message * message)
  */
 void ADB::poll()
 {
-	Connection * connection;
-	adb_message message;
+	ADB::poll(0);
+}
+
+/**
+ * Polls like ADB::poll(), but spends at most about budget microseconds on USB work. The budget is checked between USB
+ * transactions, so a call may overrun it by about one USB packet. Connecting (CNXN) and the replies to incoming
+ * messages are not split up, but are only started while there is budget left.
+ *
+ * WRTE payloads are the only long transfers. Reading one stops when the budget runs out, and the next poll picks up
+ * where it left off. Queued data (see ADB::setWriteQueue) is sent the same way, so a NAKing device cannot stall the
+ * caller either. A WRTE sent with ADB::write or ADB::writev is not split up.
+ *
+ * @param budget time budget in microseconds, or 0 for no limit.
+ */
+void ADB::poll(uint32_t budget)
+{
+#if ADB_HAS(ADB_FEATURE_STATS)
+	uint32_t duration;
+#endif
+
+	pollStart = micros();
+	pollBudget = budget;
+
+	ADB::service();
+
+#if ADB_HAS(ADB_FEATURE_STATS)
+	duration = micros() - pollStart;
+	ADB::record(stats.pollDuration, duration);
+	if (duration > stats.pollMax) stats.pollMax = duration;
+#endif
+
+	// Outside of the poll, writes run to completion.
+	pollBudget = 0;
+}
+
+#if ADB_HAS(ADB_FEATURE_IDLE)
+/**
+ * @return true iff nothing is halfway: no device being enumerated, no transfer in flight, no WRTE payload being
+ * read, and no message being sent.
+ */
+boolean ADB::isIdle()
+{
+	adb_device * device;
+
+	if (USB::isEnumerating() || USB::isTransferPending() || receiving != NULL) return false;
+
+	for (device = devices; device < devices + ADB_MAX_DEVICES; device++)
+		if (device->sending != NULL) return false;
+
+	return true;
+}
+
+/**
+ * Marks the receipt of an ADB message or accessory packet as activity that keeps ADB::run awake. The first one
+ * after a wake-up also counts the time since the wake-up.
+ */
+void ADB::noteReceive()
+{
+	lastActivity = micros();
+
+#if ADB_HAS(ADB_FEATURE_STATS)
+	if (awake)
+	{
+		ADB::record(stats.wakeLatency, lastActivity - wakeTime);
+		awake = false;
+	}
+#endif
+}
+
+/**
+ * Runs one turn of an event loop that sleeps while there is nothing to do, for battery powered bridges. Call it
+ * instead of ADB::poll in loop(). Each call polls like ADB::poll. Once no ADB message has come or gone for
+ * ADB_IDLE_TIME microseconds, it also puts the processor in idle sleep until the next interrupt, which is the timer
+ * 0 overflow behind millis() at the latest. The loop then wakes about once per millisecond and spends one empty
+ * poll per device, instead of polling flat out. The rest of loop() runs at every wake-up, and so do the timers,
+ * the serial port and SPI, which keep running in idle sleep.
+ *
+ * Data from the phone only arrives when the host asks for it with an IN transfer, so a quiet phone is polled
+ * once per tick. The first message after a quiet spell can wait for the end of a sleep, which is up to a tick, see
+ * adb_stats.sleepDuration, and then for the polls from the wake-up to its IN transfer, see adb_stats.wakeLatency.
+ * From then on, the loop polls flat out again, so the rest of an exchange arrives without that delay.
+ */
+void ADB::run()
+{
+#if ADB_HAS(ADB_FEATURE_STATS)
+	uint32_t start, slept;
+#endif
+
+	ADB::poll();
+
+	if (micros() - lastActivity < ADB_IDLE_TIME || !ADB::isIdle()) return;
+
+#if ADB_HAS(ADB_FEATURE_STATS)
+	start = micros();
+#endif
+
+	set_sleep_mode(SLEEP_MODE_IDLE);
+	sleep_enable();
+	sei();
+	sleep_cpu();
+	sleep_disable();
+
+#if ADB_HAS(ADB_FEATURE_STATS)
+	wakeTime = micros();
+	awake = true;
+	slept = wakeTime - start;
+	ADB::record(stats.sleepDuration, slept);
+	stats.sleepTime += slept;
+#endif
+}
+#endif
+
+/**
+ * @return true iff the poll in progress has time left.
+ */
+boolean ADB::hasBudget()
+{
+	return pollBudget == 0 || micros() - pollStart < pollBudget;
+}
+
+/**
+ * Makes the USB layer give up on NAKs once the budget of the poll in progress is spent (see USB::setDeadline). This
+ * is only enforced around transfers that can be resumed by the next poll.
+ *
+ * @param enforce true to enforce the budget, false to let transfers run to completion.
+ */
+void ADB::enforceBudget(boolean enforce)
+{
+	if (enforce && pollBudget != 0)
+		USB::setDeadline(pollStart + pollBudget);
+	else
+		USB::clearDeadline();
+}
+
+/**
+ * Does the work of one poll, see ADB::poll(uint32_t). The devices take turns: each poll starts with the next one, so
+ * that when the budget runs short, a busy device cannot keep the others from being served.
+ */
+void ADB::service()
+{
+	uint8_t first, i;
 
 	// Poll the USB layer.
 	USB::poll();
 
-	// If no USB device, there's no work for us to be done, so just return.
-	if (adbDevice==NULL) return;
+	// Read the remainder of a WRTE payload that ran out of time in the last poll, before any new message.
+	if (receiving != NULL && !ADB::receive(receiving)) return;
 
-	// If not connected, send a connection string to the device.
-	if (!connected)
+#if ADB_HAS(ADB_FEATURE_ACCESSORY)
+	// Not while a payload is being received: part of it may be waiting in the receive FIFO.
+	if (aoa != NULL && aoa->usb != NULL)
+		ADB::serviceAccessory();
+#endif
+
+	first = nextDevice;
+	nextDevice = (nextDevice + 1) % ADB_MAX_DEVICES;
+
+	for (i = 0; i < ADB_MAX_DEVICES; i++)
 	{
-		ADB::writeStringMessage(adbDevice, A_CNXN, 0x01000000, 4096, (char*)"host::microbridge");
-		delay(500); // Give the device some time to respond.
-	}
+		// If no USB device, there's no work for us to be done.
+		if (devices[(first + i) % ADB_MAX_DEVICES].usb == NULL) continue;
 
-	// If we are connected, check if there are connections that need to be opened
-	if (connected)
-		ADB::openClosedConnections();
+		ADB::serviceDevice(&devices[(first + i) % ADB_MAX_DEVICES]);
 
-	// Check for an incoming ADB message.
-	if (!ADB::pollMessage(&message, true))
-		return;
+		// A payload that ran out of time blocks the bus for all devices.
+		if (receiving != NULL) return;
+	}
+}
+
+/**
+ * Handles an incoming ADB message.
+ *
+ * @param device ADB device the message came from.
+ * @param message ADB message.
+ */
+void ADB::handleMessage(adb_device * device, adb_message * message)
+{
+	Connection * connection;
 
 	// Handle a response from the ADB device to our CONNECT message.
-	if (message.command == A_CNXN)
-		ADB::handleConnect(&message);
+	if (message->command == A_CNXN)
+		ADB::handleConnect(device, message);
+
+#if ADB_HAS(ADB_FEATURE_IDLE)
+	ADB::noteReceive();
+#endif
+
+	// Handle messages for specific connections. The device addresses them by our local ID in arg1.
+	connection = ADB::getConnection(message->arg1);
+	if (connection != NULL && ADB::getDevice(connection) == device)
+	{
+		switch(message->command)
+		{
+		case A_OKAY:
+			ADB::handleOkay(connection, message);
+			break;
+		case A_CLSE:
+			ADB::handleClose(connection);
+			break;
+		case A_WRTE:
+			ADB::handleWrite(connection, message);
+			return;
+		default:
+			break;
+		}
+	}
+
+	// Drain a payload that no handler takes, like that of a WRTE for a connection that is gone or of an OPEN from
+	// the device, so that it isn't read as the next message.
+	if (message->command != A_CNXN && message->data_length > 0)
+		ADB::skip(device, message->data_length);
+}
 
-	// Handle messages for specific connections
-	for (connection = firstConnection; connection != NULL; connection = connection->next)
+/**
+ * Does the work of one poll for one device: sends what is due and handles up to its weight in incoming messages
+ * (see ADB::setDeviceWeight).
+ *
+ * @param device ADB device.
+ */
+void ADB::serviceDevice(adb_device * device)
+{
+#if ADB_HAS(ADB_FEATURE_WRITE_QUEUE | ADB_FEATURE_FLOW_CONTROL)
+	Connection * connection;
+#endif
+	adb_message message;
+	uint8_t i;
+
+#if ADB_HAS(ADB_FEATURE_WRITE_QUEUE)
+	// Send the remainder of a WRTE that ran out of time in the last poll, before anything else.
+	if (device->sending != NULL)
 	{
-		if (connection->status!=ADB_UNUSED && connection->localID==message.arg1)
+		ADB::enforceBudget(true);
+		ADB::flushWriteQueue(device->sending);
+		ADB::enforceBudget(false);
+
+		if (device->sending != NULL) return;
+	}
+#endif
+
+#if ADB_HAS(ADB_FEATURE_FLOW_CONTROL)
+	// Send the OKAYs that were withheld for connections whose application has caught up.
+	for (connection = connections; connection < connections + ADB_MAX_CONNECTIONS && ADB::hasBudget(); connection++)
+		if (connection->okayPending && (!connection->flowControl || connection->unconsumed <= connection->window)
+				&& ADB::getDevice(connection) == device)
 		{
-			switch(message.command)
+			connection->okayPending = false;
+			ADB::writeEmptyMessage(device, A_OKAY, connection->localID, connection->remoteID);
+			ADB::fireEvent(connection, ADB_CONNECTION_RESUME, 0, NULL);
+		}
+#endif
+
+	// If not connected, send a connection string to the device, and give it some time to respond before trying
+	// again. The response is picked up by pollMessage below.
+	if (!device->connected && ADB::hasBudget() && (int32_t)(millis() - device->connectDeadline) >= 0)
+	{
+		ADB::writeStringMessage_P(device, A_CNXN, A_VERSION_SKIP_CHECKSUM, MAX_PAYLOAD, identity);
+		device->connectDeadline = millis() + ADB_CONNECT_RETRY_TIME;
+	}
+
+	// If we are connected, check if there are connections that need to be opened, or that have queued data
+	// waiting to be sent.
+	if (device->connected)
+	{
+		if (ADB::hasBudget())
+			ADB::openClosedConnections(device);
+
+#if ADB_HAS(ADB_FEATURE_WRITE_QUEUE)
+		for (connection = connections; connection < connections + ADB_MAX_CONNECTIONS && ADB::hasBudget(); connection++)
+			if (connection->status == ADB_OPEN && ADB::getDevice(connection) == device && ADB::isFlushDue(connection))
 			{
-			case A_OKAY:
-				ADB::handleOkay(connection, &message);
-				break;
-			case A_CLSE:
-				ADB::handleClose(connection);
-				break;
-			case A_WRTE:
-				ADB::handleWrite(connection, &message);
-				break;
-			default:
-				break;
+				ADB::enforceBudget(true);
+				ADB::flushWriteQueue(connection);
+				ADB::enforceBudget(false);
+
+				if (device->sending != NULL) return;
 			}
-		}
+#endif
 	}
 
+	// Check for incoming ADB messages.
+	for (i = 0; i < device->weight; i++)
+	{
+		if (!ADB::hasBudget() || !ADB::pollMessage(device, &message, true))
+			return;
+
+		ADB::handleMessage(device, &message);
+
+		// The rest of a payload that ran out of time comes first.
+		if (receiving != NULL) return;
+	}
 }
 
 /**
@@ -505,13 +1419,15 @@ boolean ADB::isAdbInterface(usb_interfaceDescriptor * interface)
 }
 
 /**
- * Checks whether the a connected USB device is an ADB device and populates a configuration record if it is.
+ * Looks for an interface in the configuration descriptor of a USB device, and populates a configuration record with
+ * it if it is found.
  *
  * @param device USB device.
  * @param handle pointer to a configuration record. The endpoint device address, configuration, and endpoint information will be stored here.
- * @return true iff the device is an ADB device.
+ * @param match function that tells whether an interface is the one looked for.
+ * @return true iff the interface was found.
  */
-boolean ADB::isAdbDevice(usb_device * device, int configuration, adb_usbConfiguration * handle)
+boolean ADB::findInterface(usb_device * device, int configuration, adb_usbConfiguration * handle, boolean (*match)(usb_interfaceDescriptor *))
 {
 	boolean ret = false;
 	uint8_t buf[MAX_BUF_SIZE];
@@ -542,13 +1458,14 @@ boolean ADB::isAdbDevice(usb_device * device, int configuration, adb_usbConfigur
 		case (USB_DESCRIPTOR_INTERFACE):
 			interface = (usb_interfaceDescriptor *)(buf + pos);
 
-			if (ADB::isAdbInterface(interface))
+			if (match(interface))
 			{
 				// handle->address = address;
 				handle->configuration = config->bConfigurationValue;
 				handle->interface = interface->bInterfaceNumber;
+				handle->totalLength = config->wTotalLength;
 
-				// Detected ADB interface!
+				// Detected the interface!
 				ret = true;
 			}
 			break;
@@ -577,147 +1494,2656 @@ boolean ADB::isAdbDevice(usb_device * device, int configuration, adb_usbConfigur
 }
 
 /**
- * Initialises an ADB device.
+ * Checks whether the a connected USB device is an ADB device and populates a configuration record if it is.
  *
- * @param device the USB device.
- * @param configuration configuration information.
+ * @param device USB device.
+ * @param handle pointer to a configuration record. The endpoint device address, configuration, and endpoint information will be stored here.
+ * @return true iff the device is an ADB device.
  */
-void ADB::initUsb(usb_device * device, adb_usbConfiguration * handle)
+boolean ADB::isAdbDevice(usb_device * device, int configuration, adb_usbConfiguration * handle)
 {
-	// Initialise/configure the USB device.
-	// TODO write a usb_initBulkDevice function?
-	USB::initDevice(device, handle->configuration);
+	return ADB::findInterface(device, configuration, handle, ADB::isAdbInterface);
+}
 
-	// Initialise bulk input endpoint.
-	USB::initEndPoint(&(device->bulk_in), handle->inputEndPointAddress);
-	device->bulk_in.attributes = USB_TRANSFER_TYPE_BULK;
-	device->bulk_in.maxPacketSize = ADB_USB_PACKETSIZE;
+#if ADB_HAS(ADB_FEATURE_PROFILE_CACHE)
+/**
+ * Looks up the cached interface layout of a device.
+ *
+ * @param device USB device.
+ * @return the profile of the device, or NULL if it has not been seen before.
+ */
+adb_profile * ADB::findProfile(usb_device * device)
+{
+	adb_profile * profile;
 
-	// Initialise bulk output endpoint.
-	USB::initEndPoint(&(device->bulk_out), handle->outputEndPointAddress);
-	device->bulk_out.attributes = USB_TRANSFER_TYPE_BULK;
-	device->bulk_out.maxPacketSize = ADB_USB_PACKETSIZE;
+	for (profile = profiles; profile < profiles + ADB_PROFILE_CACHE_SIZE; profile++)
+		if (profile->configuration != 0 && profile->vendorId == device->vendorId
+				&& profile->productId == device->productId && profile->releaseNumber == device->releaseNumber)
+			return profile;
 
-	// Success, signal that we are now connected.
-	adbDevice = device;
+	return NULL;
 }
 
 /**
- * Handles events from the USB layer.
+ * Reads the total length of the first configuration descriptor of a device, which only takes its first four bytes.
  *
- * @param device USB device that generated the event.
- * @param event USB event.
+ * @param device USB device.
+ * @return the total length, or 0 if the request failed.
  */
-static void usbEventHandler(usb_device * device, usb_eventType event)
+uint16_t ADB::getConfigurationLength(usb_device * device)
 {
-	adb_usbConfiguration handle;
+	uint8_t buf[4];
 
-	switch (event)
-	{
-	case USB_CONNECT:
+	if (USB::controlRequest(device, bmREQ_GET_DESCR, USB_REQUEST_GET_DESCRIPTOR, 0, USB_DESCRIPTOR_CONFIGURATION, 0x0000, sizeof(buf), buf))
+		return 0;
 
-		// Check if the newly connected device is an ADB device, and initialise it if so.
-		if (ADB::isAdbDevice(device, 0, &handle))
-			ADB::initUsb(device, &handle);
+	return buf[2] | (buf[3] << 8);
+}
 
-		break;
+/**
+ * Writes a cache entry through to EEPROM, if the cache is persistent. Only the bytes that changed are written.
+ *
+ * @param profile cache entry.
+ */
+void ADB::saveProfile(adb_profile * profile)
+{
+#ifdef ADB_PROFILE_EEPROM
+	eeprom_update_block(profile, (uint8_t *)ADB_PROFILE_EEPROM + 1 + (profile - profiles) * sizeof(adb_profile),
+			sizeof(adb_profile));
+#else
+	(void)profile;
+#endif
+}
 
-	case USB_DISCONNECT:
+/**
+ * Remembers the interface layout of a device that was just set up from its descriptors. A new device takes a free
+ * entry, or else replaces the entries in turn.
+ *
+ * @param device USB device.
+ * @param handle configuration record filled out by ADB::isAdbDevice.
+ */
+void ADB::storeProfile(usb_device * device, adb_usbConfiguration * handle)
+{
+	adb_profile * profile = ADB::findProfile(device);
 
-		// Check if the device that was disconnected is the ADB device we've been using.
-		if (device == adbDevice)
+	if (profile == NULL)
+	{
+		for (profile = profiles; profile < profiles + ADB_PROFILE_CACHE_SIZE && profile->configuration != 0; profile++);
+		if (profile == profiles + ADB_PROFILE_CACHE_SIZE)
 		{
-			// Close all open ADB connections.
-			ADB::closeAll();
-
-			// Signal that we're no longer connected by setting the global device handler to NULL;
-			adbDevice = NULL;
-			connected = false;
+			profile = &profiles[nextProfile];
+			nextProfile = (nextProfile + 1) % ADB_PROFILE_CACHE_SIZE;
 		}
+	}
 
-		break;
+	profile->vendorId = device->vendorId;
+	profile->productId = device->productId;
+	profile->releaseNumber = device->releaseNumber;
+	profile->configuration = handle->configuration;
+	profile->interface = handle->interface;
+	profile->inputEndPointAddress = handle->inputEndPointAddress;
+	profile->outputEndPointAddress = handle->outputEndPointAddress;
+	profile->language = device->firstStringLanguage;
+	profile->totalLength = handle->totalLength;
 
-	default:
-		// ignore
-		break;
-	}
+	ADB::saveProfile(profile);
 }
 
 /**
- * Write a set of bytes to an open ADB connection.
+ * Drops the cached interface layout of a device, so that its descriptors are parsed the next time it attaches.
  *
- * @param connection ADB connection to write the data to.
- * @param length number of bytes to transmit.
- * @param data data to send.
- * @return number of transmitted bytes, or -1 on failure.
+ * @param device USB device.
  */
-int ADB::write(Connection * connection, uint16_t length, uint8_t * data)
+void ADB::forgetProfile(usb_device * device)
 {
-	int ret;
-
-	// First check if we have a working ADB connection
-	if (adbDevice==NULL || !connected) return -1;
-
-	// Check if the connection is open for writing.
-	if (connection->status != ADB_OPEN) return -2;
+	adb_profile * profile = ADB::findProfile(device);
 
-	// Write payload
-	ret = ADB::writeMessage(adbDevice, A_WRTE, connection->localID, connection->remoteID, length, data);
-	if (ret==0)
-		connection->status = ADB_WRITING;
+	if (profile == NULL) return;
 
-	return ret;
+	memset(profile, 0, sizeof(adb_profile));
+	ADB::saveProfile(profile);
 }
 
 /**
- * Write a string to an open ADB connection. The trailing zero is not transmitted.
- *
- * @param connection ADB connection to write the data to.
- * @param length number of bytes to transmit.
- * @param data data to send.
- * @return number of transmitted bytes, or -1 on failure.
+ * Fills the profile cache from its EEPROM copy, if the cache is persistent and the copy is valid. Otherwise the cache
+ * starts out empty, and so does the EEPROM copy.
+ */
+void ADB::loadProfiles()
+{
+	nextProfile = 0;
+
+#ifdef ADB_PROFILE_EEPROM
+	if (eeprom_read_byte((uint8_t *)ADB_PROFILE_EEPROM) == ADB_PROFILE_TAG)
+	{
+		eeprom_read_block(profiles, (uint8_t *)ADB_PROFILE_EEPROM + 1, sizeof(profiles));
+		return;
+	}
+#endif
+
+	ADB::clearProfiles();
+
+#ifdef ADB_PROFILE_EEPROM
+	eeprom_update_byte((uint8_t *)ADB_PROFILE_EEPROM, ADB_PROFILE_TAG);
+#endif
+}
+#endif
+
+/**
+ * Initialises an ADB device. A device with a cached profile is only configured, its first supported language is
+ * taken from the profile.
+ *
+ * @param adbDevice free record in the device table.
+ * @param device the USB device.
+ * @param configuration configuration information.
+ * @param profile cached profile of the device, or NULL if its descriptors were parsed.
+ * @return error code or 0 for success. Only configuring a device with a cached profile can fail.
+ */
+int ADB::initUsb(adb_device * adbDevice, usb_device * device, adb_usbConfiguration * handle, adb_profile * profile)
+{
+	int rcode;
+
+	// Initialise/configure the USB device.
+	// TODO write a usb_initBulkDevice function?
+	if (profile != NULL)
+	{
+		rcode = USB::setConfiguration(device, handle->configuration);
+		if (rcode) return rcode;
+
+		device->firstStringLanguage = profile->language;
+	}
+	else
+		USB::initDevice(device, handle->configuration);
+
+	// Initialise bulk input endpoint.
+	USB::initEndPoint(&(device->bulk_in), handle->inputEndPointAddress);
+	device->bulk_in.attributes = USB_TRANSFER_TYPE_BULK;
+	device->bulk_in.maxPacketSize = ADB_USB_PACKETSIZE;
+
+	// Initialise bulk output endpoint.
+	USB::initEndPoint(&(device->bulk_out), handle->outputEndPointAddress);
+	device->bulk_out.attributes = USB_TRANSFER_TYPE_BULK;
+	device->bulk_out.maxPacketSize = ADB_USB_PACKETSIZE;
+
+	// Nothing has been negotiated with this device yet, send CNXN right away.
+	adbDevice->connected = false;
+	adbDevice->remoteVersion = 0;
+	adbDevice->remoteMaxData = MAX_PAYLOAD;
+	adbDevice->connectDeadline = millis();
+	adbDevice->opening = 0;
+
+	// No message can be halfway on a fresh device.
+	adbDevice->sending = NULL;
+	adbDevice->headerSent = false;
+
+	// Success, signal that we are now connected.
+	adbDevice->usb = device;
+
+	return 0;
+}
+
+/**
+ * Sets up a newly connected USB device if it is an ADB device. A device seen before goes straight to configuration,
+ * unless the length of its configuration descriptor has changed. If that fails, its profile is stale, and its
+ * descriptors are parsed after all.
+ *
+ * @param adbDevice free record in the device table.
+ * @param device the USB device.
+ */
+void ADB::attachUsb(adb_device * adbDevice, usb_device * device)
+{
+	adb_usbConfiguration handle;
+#if ADB_HAS(ADB_FEATURE_PROFILE_CACHE)
+	adb_profile * profile;
+
+	profile = ADB::findProfile(device);
+	if (profile != NULL)
+	{
+		handle.address = device->address;
+		handle.configuration = profile->configuration;
+		handle.interface = profile->interface;
+		handle.inputEndPointAddress = profile->inputEndPointAddress;
+		handle.outputEndPointAddress = profile->outputEndPointAddress;
+		handle.totalLength = profile->totalLength;
+
+		if (ADB::getConfigurationLength(device) == profile->totalLength
+				&& ADB::initUsb(adbDevice, device, &handle, profile) == 0)
+			return;
+
+		ADB::forgetProfile(device);
+	}
+#endif
+
+	// Check if the newly connected device is an ADB device, and initialise it if so.
+	if (ADB::isAdbDevice(device, 0, &handle))
+	{
+		ADB::initUsb(adbDevice, device, &handle, NULL);
+#if ADB_HAS(ADB_FEATURE_PROFILE_CACHE)
+		ADB::storeProfile(device, &handle);
+#endif
+	}
+}
+
+/**
+ * Releases an ADB device that was unplugged: closes its connections, frees its record in the device table and fires
+ * an ADB_DISCONNECT event.
+ *
+ * @param adbDevice record in the device table.
+ */
+void ADB::releaseUsb(adb_device * adbDevice)
+{
+	// Whatever was halfway on the device is lost.
+	adbDevice->sending = NULL;
+	adbDevice->headerSent = false;
+	if (receiving != NULL && ADB::getDevice(receiving) == adbDevice)
+		receiving = NULL;
+
+	// Close all open ADB connections.
+	ADB::closeAll(adbDevice);
+
+#if ADB_HAS(ADB_FEATURE_PROFILE_CACHE)
+	// A device that never answered our CNXN may have been set up from a stale profile (or with the wrong
+	// interface), have its descriptors parsed the next time.
+	if (!adbDevice->connected)
+		ADB::forgetProfile(adbDevice->usb);
+#endif
+
+	// Signal that we're no longer connected by setting the device handle to NULL.
+	adbDevice->usb = NULL;
+	adbDevice->connected = false;
+
+#if ADB_HAS(ADB_FEATURE_HUB)
+	eventDevice = adbDevice - devices;
+#endif
+	ADB::fireEvent(NULL, ADB_DISCONNECT, 0, NULL);
+}
+
+/**
+ * Handles events from the USB layer.
+ *
+ * @param device USB device that generated the event.
+ * @param event USB event.
+ */
+static void usbEventHandler(usb_device * device, usb_eventType event)
+{
+	adb_device * adbDevice;
+#if ADB_HAS(ADB_FEATURE_ACCESSORY)
+	adb_usbConfiguration handle;
+#endif
+
+	switch (event)
+	{
+	case USB_CONNECT:
+
+#if ADB_HAS(ADB_FEATURE_ACCESSORY)
+		// A phone in accessory mode becomes the accessory, any other device is asked to switch to accessory mode.
+		// Only devices that don't speak the protocol are tried as ADB devices.
+		if (aoa != NULL && aoa->usb == NULL)
+		{
+			if (ADB::isAccessoryDevice(device, &handle))
+			{
+				if (ADB::openAccessory(device, &handle) == 0) break;
+			}
+			else if (ADB::startAccessory(device) == 0)
+				break;
+		}
+#endif
+
+		// Take the first free record in the device table, if any.
+		for (adbDevice = devices; adbDevice < devices + ADB_MAX_DEVICES && adbDevice->usb != NULL; adbDevice++);
+		if (adbDevice == devices + ADB_MAX_DEVICES) break;
+
+		ADB::attachUsb(adbDevice, device);
+
+		break;
+
+	case USB_DISCONNECT:
+
+#if ADB_HAS(ADB_FEATURE_ACCESSORY)
+		if (aoa != NULL && aoa->usb == device)
+		{
+			aoa->usb = NULL;
+			aoa->handler(aoa, ADB_CONNECTION_CLOSE, 0, NULL);
+			break;
+		}
+#endif
+
+		// Check if the device that was disconnected is an ADB device we've been using.
+		for (adbDevice = devices; adbDevice < devices + ADB_MAX_DEVICES && adbDevice->usb != device; adbDevice++);
+		if (adbDevice == devices + ADB_MAX_DEVICES) break;
+
+		ADB::releaseUsb(adbDevice);
+
+		break;
+
+	default:
+		// ignore
+		break;
+	}
+}
+
+#if ADB_HAS(ADB_FEATURE_WRITE_QUEUE)
+/**
+ * Sets up an outbound queue for a connection. When a queue is set, writes are copied into the queue and sent
+ * as soon as the connection is ready, instead of failing while the previous write is waiting for its OKAY.
+ * Queued data is packed into WRTE messages of up to MAX_PAYLOAD bytes, and the next WRTE goes out from ADB::poll
+ * as soon as the OKAY for the previous one comes in. Queued data is discarded when the connection closes.
+ *
+ * @param connection ADB connection.
+ * @param buffer queue storage, must remain valid for the lifetime of the connection. NULL removes the queue.
+ * @param size size of the buffer in bytes.
+ */
+void ADB::setWriteQueue(Connection * connection, uint8_t * buffer, uint16_t size)
+{
+	connection->writeQueue = buffer;
+	connection->writeQueueSize = buffer==NULL ? 0 : size;
+	connection->writeQueueHead = 0;
+	connection->writeQueueLength = 0;
+}
+
+/**
+ * Appends data to the outbound queue of a connection, as far as it fits.
+ *
+ * @param connection ADB connection.
+ * @param length number of bytes to queue.
+ * @param data data to queue.
+ * @return number of bytes accepted.
+ */
+uint16_t ADB::enqueue(Connection * connection, uint16_t length, uint8_t * data)
+{
+	uint16_t tail, chunk;
+	uint16_t space = connection->writeQueueSize - connection->writeQueueLength;
+
+	if (length > space) length = space;
+
+	// Remember when the queue went from empty to non-empty, for the coalescing age threshold.
+	if (connection->writeQueueLength == 0 && length > 0)
+		connection->queueTime = millis();
+
+	// Copy the data in, wrapping around the end of the ring buffer if needed.
+	tail = connection->writeQueueHead + connection->writeQueueLength;
+	if (tail >= connection->writeQueueSize) tail -= connection->writeQueueSize;
+
+	chunk = connection->writeQueueSize - tail;
+	if (chunk > length) chunk = length;
+
+	memcpy(connection->writeQueue + tail, data, chunk);
+	memcpy(connection->writeQueue, data + chunk, length - chunk);
+
+	connection->writeQueueLength += length;
+
+	return length;
+}
+
+/**
+ * Sends the next batch of queued data as a single WRTE message. The connection must be open and not waiting for
+ * the OKAY of a previous write.
+ *
+ * @param connection ADB connection.
+ * @return error code or 0 for success.
+ */
+int ADB::flushWriteQueue(Connection * connection)
+{
+	adb_device * device = ADB::getDevice(connection);
+	usb_segment segment;
+	uint16_t length;
+	int ret;
+
+	// Another connection's WRTE that ran out of time has to go out first.
+	if (device->sending != NULL && device->sending != connection)
+		ADB::finishSend(device);
+
+	// Send the contiguous part of the queue, the remainder goes out with the next WRTE. A WRTE that ran out of time
+	// is resumed with the length it was started with, more data may have been queued since.
+	if (device->sending == connection)
+		length = device->sendingLength;
+	else
+	{
+		length = connection->writeQueueSize - connection->writeQueueHead;
+		if (length > connection->writeQueueLength) length = connection->writeQueueLength;
+		if (length > device->remoteMaxData) length = device->remoteMaxData;
+	}
+
+	segment.data = connection->writeQueue + connection->writeQueueHead;
+	segment.length = length;
+	segment.progmem = false;
+
+	ret = ADB::sendMessagev(device, A_WRTE, connection->localID, connection->remoteID, 1, &segment);
+
+	// Remember where we were, the next call picks up from there.
+	if (ret == USB_TRANSFER_PENDING)
+	{
+		device->sending = connection;
+		device->sendingLength = length;
+		return ret;
+	}
+
+	device->sending = NULL;
+
+	if (ret==0)
+	{
+		connection->writeQueueHead += length;
+		if (connection->writeQueueHead == connection->writeQueueSize) connection->writeQueueHead = 0;
+		connection->writeQueueLength -= length;
+		if (connection->writeQueueLength == 0) connection->flushRequested = false;
+
+		connection->status = ADB_WRITING;
+	}
+
+	return ret;
+}
+
+/**
+ * Checks whether queued data on a connection should be sent now. Without coalescing, any queued data is sent as
+ * soon as possible. With coalescing, data is held back until enough has been queued to fill a message, the oldest
+ * queued data reaches the maximum age, or a flush was requested.
+ *
+ * @param connection ADB connection.
+ * @return true iff the queued data should be sent.
+ */
+boolean ADB::isFlushDue(Connection * connection)
+{
+	uint32_t remoteMaxData = ADB::getDevice(connection)->remoteMaxData;
+	uint32_t size;
+
+	if (connection->writeQueueLength == 0) return false;
+	if (!connection->coalesce || connection->flushRequested) return true;
+
+	// Size threshold, defaults to a full message.
+	size = connection->coalesceSize;
+	if (size == 0 || size > remoteMaxData) size = remoteMaxData;
+	if (size > connection->writeQueueSize) size = connection->writeQueueSize;
+	if (connection->writeQueueLength >= size) return true;
+
+	// Age threshold.
+	if (connection->coalesceAge > 0 && (millis() - connection->queueTime) >= connection->coalesceAge) return true;
+
+	return false;
+}
+
+/**
+ * Enables or disables write coalescing on a connection with a write queue. With coalescing enabled, small writes
+ * are packed together into a single WRTE, up to the maximum payload size announced by the device in its CNXN
+ * message. Queued data is sent when at least size bytes are queued, when the oldest queued byte is age
+ * milliseconds old, or when ADB::flush is called, whichever comes first.
+ *
+ * @param connection ADB connection.
+ * @param enable true to enable coalescing, false to send queued data as soon as possible.
+ * @param size size threshold in bytes, or 0 to wait for a full message (maxdata or the queue size).
+ * @param age age threshold in milliseconds, or 0 to only flush on size or on request.
+ */
+void ADB::setCoalescing(Connection * connection, boolean enable, uint16_t size, uint16_t age)
+{
+	connection->coalesce = enable != false;
+	connection->coalesceSize = size;
+	connection->coalesceAge = age;
+}
+
+/**
+ * Appends data to the write queue of a connection without attempting to send it. The data goes out from ADB::poll
+ * according to the coalescing policy of the connection.
+ *
+ * @param connection ADB connection.
+ * @param length number of bytes to append.
+ * @param data data to append.
+ * @return number of bytes accepted.
+ */
+uint16_t ADB::append(Connection * connection, uint16_t length, uint8_t * data)
+{
+	if (connection->writeQueue == NULL) return 0;
+
+	// Only accept data for connections that are (being) used.
+	if (connection->status != ADB_OPEN && connection->status != ADB_WRITING && connection->status != ADB_RECEIVING)
+		return 0;
+
+	return ADB::enqueue(connection, length, data);
+}
+
+/**
+ * Queues the segments of a write and kicks off the transfer if the connection is idle. This is the queued path of
+ * ADB::write, which takes as much as fits, and of the clients that must not leave part of a message in the queue,
+ * which take all or nothing.
+ *
+ * @param connection ADB connection with an outbound queue.
+ * @param count number of segments, in RAM.
+ * @param segments segments to queue.
+ * @param whole true to queue nothing unless all segments fit.
+ * @return number of bytes accepted, -2 if the connection is not open, or -3 if whole is set and the segments don't
+ * fit.
+ */
+int ADB::queueWrite(Connection * connection, uint8_t count, usb_segment * segments, boolean whole)
+{
+	uint32_t length = 0;
+	uint16_t accepted = 0;
+	uint8_t i;
+
+	// Queued data can be accepted while the connection is busy, but not before it has been opened.
+	if (connection->status != ADB_OPEN && connection->status != ADB_WRITING && connection->status != ADB_RECEIVING)
+		return -2;
+
+	if (whole)
+	{
+		for (i = 0; i < count; i++)
+			length += segments[i].length;
+		if (length > (uint32_t)(connection->writeQueueSize - connection->writeQueueLength)) return -3;
+	}
+
+	for (i = 0; i < count; i++)
+		accepted += ADB::enqueue(connection, segments[i].length, (uint8_t*)segments[i].data);
+
+	// Kick off the transfer if the connection is idle.
+	if (connection->status == ADB_OPEN && ADB::isFlushDue(connection))
+		ADB::flushWriteQueue(connection);
+
+	return accepted;
+}
+
+/**
+ * Requests that all data currently queued on a connection is sent, regardless of the coalescing policy.
+ *
+ * @param connection ADB connection.
+ * @return error code or 0 for success.
+ */
+int ADB::flush(Connection * connection)
+{
+	adb_device * device = ADB::getDevice(connection);
+
+	if (connection->writeQueueLength == 0) return 0;
+
+	connection->flushRequested = true;
+
+	if (device->usb!=NULL && device->connected && connection->status == ADB_OPEN)
+		return ADB::flushWriteQueue(connection);
+
+	return 0;
+}
+#endif
+
+/**
+ * @return the protocol version announced by the (first) device in its CNXN message.
+ */
+uint32_t ADB::getRemoteVersion()
+{
+	return devices[0].remoteVersion;
+}
+
+/**
+ * @return the maximum message payload size announced by the (first) device in its CNXN message.
+ */
+uint32_t ADB::getRemoteMaxData()
+{
+	return devices[0].remoteMaxData;
+}
+
+#if ADB_HAS(ADB_FEATURE_HUB)
+/**
+ * Binds a connection to one of the ADB devices behind the hub. Devices are numbered in the order they attach, each
+ * taking the lowest number that is free. Connections are bound to device 0 when they are added; call this right
+ * after ADB::addConnection, before the next poll opens the connection.
+ *
+ * @param connection ADB connection.
+ * @param device device number, less than ADB_MAX_DEVICES.
+ */
+void ADB::setDevice(Connection * connection, uint8_t device)
+{
+	if (device < ADB_MAX_DEVICES)
+		connection->device = device;
+}
+
+/**
+ * Sets the share of a device in the polling schedule: the number of incoming messages handled for it per turn. The
+ * devices take turns in a round-robin, so a device with weight 2 gets twice the inbound bandwidth of a device
+ * with weight 1 when both are busy. The default is 1.
+ *
+ * @param device device number.
+ * @param weight number of messages per turn, at least 1.
+ */
+void ADB::setDeviceWeight(uint8_t device, uint8_t weight)
+{
+	if (device < ADB_MAX_DEVICES)
+		devices[device].weight = weight > 0 ? weight : 1;
+}
+
+/**
+ * @param device device number.
+ * @return true iff the device is attached and has answered our CNXN.
+ */
+boolean ADB::isDeviceConnected(uint8_t device)
+{
+	return device < ADB_MAX_DEVICES && devices[device].usb != NULL && devices[device].connected;
+}
+
+/**
+ * @return the number of the device an ADB_CONNECT, ADB_DISCONNECT or ADB_READY event refers to. Only valid from the event
+ * handler. The data of an ADB_CONNECT event is the identity banner the device sent with its CNXN.
+ */
+uint8_t ADB::getEventDevice()
+{
+	return eventDevice;
+}
+#endif
+
+#if ADB_HAS(ADB_FEATURE_PROFILE_CACHE)
+/**
+ * Forgets the interface layouts of all devices seen so far, including the EEPROM copy (see ADB_PROFILE_EEPROM).
+ * Devices that attach from now on have their descriptors parsed.
+ */
+void ADB::clearProfiles()
+{
+	memset(profiles, 0, sizeof(profiles));
+	nextProfile = 0;
+
+#ifdef ADB_PROFILE_EEPROM
+	eeprom_update_block(profiles, (uint8_t *)ADB_PROFILE_EEPROM + 1, sizeof(profiles));
+#endif
+}
+#endif
+
+/**
+ * Write a message to an open ADB connection, gathering the payload from a list of segments (see
+ * ADB::writeMessagev). This is useful to send a header and a body, or constant data from program memory, without
+ * assembling them in a buffer first. Like ADB::write, a single WRTE is sent, so the total length may not exceed
+ * ADB::getRemoteMaxData. The segments bypass the outbound queue, so if the connection has one it has to be empty.
+ *
+ * @param connection ADB connection to write the data to.
+ * @param count number of segments.
+ * @param segments payload segments.
+ * @return error code or 0 for success.
+ */
+int ADB::writev(Connection * connection, uint8_t count, usb_segment * segments)
+{
+	adb_device * device = ADB::getDevice(connection);
+	int ret;
+
+	// First check if we have a working ADB connection
+	if (device->usb==NULL || !device->connected) return -1;
+
+	// Check if the connection is open for writing, and that there is no queued data that should go out first.
+	if (connection->status != ADB_OPEN) return -2;
+#if ADB_HAS(ADB_FEATURE_WRITE_QUEUE)
+	if (connection->writeQueueLength > 0) return -2;
+#endif
+
+	// Write payload
+	ret = ADB::writeMessagev(device, A_WRTE, connection->localID, connection->remoteID, count, segments);
+	if (ret==0)
+		connection->status = ADB_WRITING;
+
+	return ret;
+}
+
+#if ADB_HAS(ADB_FEATURE_RECEIVE_BUFFER)
+/**
+ * Sets up an inbound ring buffer for a connection. When a buffer is set, the payload of incoming WRTE messages is
+ * read from the USB FIFO straight into the buffer, and the application takes it out with ADB::available and
+ * ADB::read. Instead of one ADB_CONNECTION_RECEIVE event per USB packet, a single event with a NULL data pointer
+ * is fired per WRTE message, its length being the number of bytes added to the buffer. Incoming data that does
+ * not fit in the buffer is dropped. The buffer is emptied when the connection (re)opens.
+ *
+ * @param connection ADB connection.
+ * @param buffer buffer storage, must remain valid for the lifetime of the connection. NULL removes the buffer.
+ * @param size size of the buffer in bytes.
+ */
+void ADB::setReceiveBuffer(Connection * connection, uint8_t * buffer, uint16_t size)
+{
+	connection->receiveBuffer = buffer;
+	connection->receiveBufferSize = buffer==NULL ? 0 : size;
+	connection->receiveHead = 0;
+	connection->receiveLength = 0;
+}
+
+/**
+ * @param connection ADB connection.
+ * @return the number of received bytes waiting in the receive buffer of the connection.
+ */
+uint16_t ADB::available(Connection * connection)
+{
+	return connection->receiveLength;
+}
+
+/**
+ * Takes a single byte out of the receive buffer of a connection.
+ *
+ * @param connection ADB connection.
+ * @return the next received byte, or -1 if the receive buffer is empty.
+ */
+int ADB::read(Connection * connection)
+{
+	uint8_t value;
+
+	if (connection->receiveLength == 0) return -1;
+
+	value = connection->receiveBuffer[connection->receiveHead];
+
+	connection->receiveHead++;
+	if (connection->receiveHead == connection->receiveBufferSize) connection->receiveHead = 0;
+	connection->receiveLength--;
+#if ADB_HAS(ADB_FEATURE_FLOW_CONTROL)
+	ADB::consume(connection, 1);
+#endif
+
+	return value;
+}
+
+/**
+ * Takes up to length bytes out of the receive buffer of a connection.
+ *
+ * @param connection ADB connection.
+ * @param length maximum number of bytes to read.
+ * @param data target buffer.
+ * @return number of bytes read.
+ */
+uint16_t ADB::read(Connection * connection, uint16_t length, uint8_t * data)
+{
+	uint16_t chunk, count;
+
+	if (length > connection->receiveLength) length = connection->receiveLength;
+
+	// Copy the data out, wrapping around the end of the ring buffer if needed.
+	count = length;
+	while (count > 0)
+	{
+		chunk = connection->receiveBufferSize - connection->receiveHead;
+		if (chunk > count) chunk = count;
+
+		memcpy(data, connection->receiveBuffer + connection->receiveHead, chunk);
+		data += chunk;
+
+		connection->receiveHead += chunk;
+		if (connection->receiveHead == connection->receiveBufferSize) connection->receiveHead = 0;
+		count -= chunk;
+	}
+
+	connection->receiveLength -= length;
+#if ADB_HAS(ADB_FEATURE_FLOW_CONTROL)
+	ADB::consume(connection, length);
+#endif
+
+	return length;
+}
+#endif
+
+#if ADB_HAS(ADB_FEATURE_FLOW_CONTROL)
+/**
+ * Sets up receive-side flow control for a connection. Normally each incoming WRTE is acknowledged (OKAY) as soon as
+ * its payload has been handed to the application, and the device sends the next one right away. With flow control
+ * the OKAY is withheld while more than window bytes have been received but not consumed, which keeps the device
+ * from sending more on this connection without stalling the others. The application reports progress with
+ * ADB::consume, ADB::read does so for connections with a receive buffer.
+ *
+ * ADB_CONNECTION_THROTTLE is fired when an OKAY is withheld, and ADB_CONNECTION_RESUME when it is sent by a later
+ * poll. At most window bytes plus one message (see MAX_PAYLOAD) are outstanding at any time, so a receive buffer of
+ * that size never drops data.
+ *
+ * @param connection ADB connection.
+ * @param enable true to withhold OKAYs, false to acknowledge every message right away.
+ * @param window number of unconsumed bytes up to which messages are still acknowledged right away.
+ */
+void ADB::setFlowControl(Connection * connection, boolean enable, uint16_t window)
+{
+	connection->flowControl = enable != false;
+	connection->window = window;
+
+	// Start counting from here, the application has had no way to report what it consumed so far.
+	connection->unconsumed = 0;
+}
+
+/**
+ * Reports that the application is done with received data of a connection, see ADB::setFlowControl. May be called
+ * from the event handler.
+ *
+ * @param connection ADB connection.
+ * @param length number of bytes consumed.
+ */
+void ADB::consume(Connection * connection, uint16_t length)
+{
+	connection->unconsumed -= length < connection->unconsumed ? length : connection->unconsumed;
+}
+#endif
+
+#if ADB_HAS(ADB_FEATURE_STATS)
+/**
+ * Maps a duration to its log2 histogram bucket, see ADB_STATS_BUCKETS.
+ *
+ * @param duration duration in microseconds.
+ * @return bucket index.
+ */
+uint8_t ADB::bucket(uint32_t duration)
+{
+	uint8_t i = 0;
+
+	while (duration > 1 && i < ADB_STATS_BUCKETS - 1)
+	{
+		duration >>= 1;
+		i++;
+	}
+
+	return i;
+}
+
+/**
+ * Adds a duration to a histogram. Counts saturate instead of wrapping around.
+ *
+ * @param histogram histogram of ADB_STATS_BUCKETS buckets.
+ * @param duration duration in microseconds.
+ */
+void ADB::record(uint16_t * histogram, uint32_t duration)
+{
+	uint16_t * count = histogram + ADB::bucket(duration);
+
+	if (*count != 0xffff) (*count)++;
+}
+
+/**
+ * Adds the counters of one endpoint to a running total.
+ *
+ * @param total total to add to.
+ * @param endpoint endpoint counters.
+ */
+void ADB::addEndpointStats(usb_endpointStats * total, usb_endpointStats * endpoint)
+{
+	total->naks += endpoint->naks;
+	total->timeouts += endpoint->timeouts;
+	total->toggleErrors += endpoint->toggleErrors;
+}
+
+/**
+ * Takes a snapshot of the statistics block: the NAK, timeout and toggle error counters of the bulk endpoints,
+ * payload bytes per connection, OKAY round-trip latencies, poll durations and the time ADB::run slept. Counting costs a
+ * few cycles per event and never touches the serial port, so it does not disturb the timing it measures.
+ *
+ * @param snapshot receives the statistics.
+ */
+void ADB::getStats(adb_stats * snapshot)
+{
+	adb_device * device;
+
+	*snapshot = stats;
+
+	snapshot->buckets = ADB_STATS_BUCKETS;
+	snapshot->connections = ADB_MAX_CONNECTIONS;
+
+	// The endpoint counters add up over all devices.
+	memset(&snapshot->in, 0, sizeof(usb_endpointStats));
+	memset(&snapshot->out, 0, sizeof(usb_endpointStats));
+
+	for (device = devices; device < devices + ADB_MAX_DEVICES; device++)
+		if (device->usb != NULL)
+		{
+			ADB::addEndpointStats(&snapshot->in, &device->usb->bulk_in.stats);
+			ADB::addEndpointStats(&snapshot->out, &device->usb->bulk_out.stats);
+		}
+}
+
+/**
+ * Clears all counters and histograms.
+ */
+void ADB::resetStats()
+{
+	adb_device * device;
+
+	memset(&stats, 0, sizeof(adb_stats));
+
+	for (device = devices; device < devices + ADB_MAX_DEVICES; device++)
+		if (device->usb != NULL)
+		{
+			memset(&device->usb->bulk_in.stats, 0, sizeof(usb_endpointStats));
+			memset(&device->usb->bulk_out.stats, 0, sizeof(usb_endpointStats));
+		}
+}
+
+/**
+ * Sends a snapshot of the statistics block (see ADB::getStats) as a single binary write on a connection, for
+ * instance one dedicated to monitoring that the host reads with "adb forward". Traffic on that connection is
+ * counted too.
+ *
+ * @param connection ADB connection to send the snapshot on.
+ * @return result of ADB::write.
+ */
+int ADB::writeStats(Connection * connection)
+{
+	adb_stats snapshot;
+
+	ADB::getStats(&snapshot);
+
+	return ADB::write(connection, sizeof(adb_stats), (uint8_t*)&snapshot);
+}
+#endif
+
+#if ADB_HAS(ADB_FEATURE_STATE | ADB_FEATURE_FRAMING | ADB_FEATURE_SYNC | ADB_FEATURE_SHELL | ADB_FEATURE_LOGCAT)
+/**
+ * Passes received data to the parser of a client built on top of a connection: a state channel, framer, sync
+ * client, shell session or logcat client. The event handler of the connection passes all its events on to the one
+ * of the client, which calls this for receive events. The data is either passed along with the event, or waiting in
+ * the receive buffer of the connection (data is NULL). Either way it goes to the parser in order, and is consumed.
+ *
+ * @param connection connection the data was received on.
+ * @param length payload length.
+ * @param data payload data, or NULL if it is in the receive buffer.
+ * @param receiver parser of the client.
+ * @param client client record, passed on to the parser.
+ */
+void ADB::receiveData(Connection * connection, uint16_t length, uint8_t * data, adb_receiver * receiver, void * client)
+{
+#if ADB_HAS(ADB_FEATURE_RECEIVE_BUFFER)
+	uint8_t buf[ADB_USB_PACKETSIZE];
+	uint16_t n;
+
+	if (data == NULL)
+	{
+		while ((n = ADB::read(connection, sizeof(buf), buf)) > 0)
+			receiver(client, n, buf);
+		return;
+	}
+#endif
+
+	receiver(client, length, data);
+#if ADB_HAS(ADB_FEATURE_FLOW_CONTROL)
+	ADB::consume(connection, length);
+#else
+	(void)connection;
+#endif
+}
+#endif
+
+#if ADB_HAS(ADB_FEATURE_STATE)
+/**
+ * Sets up a latest-value state channel on top of a connection. This is meant for control streams, like a joystick
+ * position or a sensor reading, where only the newest value matters: setting a key that has not been sent yet
+ * simply overwrites it, so a slow link makes updates skip values rather than lag behind, and the latency stays
+ * within one period plus one round trip.
+ *
+ * Values travel as records of ADB_STATE_RECORD_SIZE bytes, the key followed by the 16-bit value (little endian),
+ * and an update is a single WRTE with a record for every key that changed. At most one update is outstanding
+ * at any time. The application forwards the events of the connection with ADB::handleStateEvent, which takes in
+ * the records received from the other end, and calls ADB::flushState from its main loop.
+ *
+ * Each key is meant to have a single writer, at either end. If both ends set a key anyway, a value set locally
+ * but not sent yet wins: a record received for it is dropped, and the local value replaces it at the other end
+ * with the next update.
+ *
+ * @param channel state channel record.
+ * @param connection ADB connection to run the channel on.
+ * @param values table of count values, indexed by key. The initial values are not sent until they are set.
+ * @param count number of keys, at most ADB_STATE_MAX_KEYS.
+ * @param period minimum time between updates in milliseconds, or 0 to send changes as soon as the connection
+ * is ready.
+ */
+void ADB::initStateChannel(StateChannel * channel, Connection * connection, uint16_t * values, uint8_t count, uint16_t period)
+{
+	if (count > ADB_STATE_MAX_KEYS) count = ADB_STATE_MAX_KEYS;
+
+	channel->connection = connection;
+	channel->values = values;
+	channel->count = count;
+	channel->local = 0;
+	channel->dirty = 0;
+	channel->changed = 0;
+	channel->period = period;
+	channel->deadline = micros();
+	channel->partialLength = 0;
+}
+
+/**
+ * Sets the local value of a key. The new value is sent by the next due ADB::flushState, unless it is the same
+ * as the last one.
+ *
+ * @param channel state channel.
+ * @param key key, less than the number of keys of the channel.
+ * @param value new value.
+ */
+void ADB::setState(StateChannel * channel, uint8_t key, uint16_t value)
+{
+	uint32_t bit = (uint32_t)1 << key;
+
+	if (key >= channel->count) return;
+
+	if ((channel->local & bit) && channel->values[key] == value) return;
+
+	channel->values[key] = value;
+	channel->local |= bit;
+	channel->dirty |= bit;
+}
+
+/**
+ * @param channel state channel.
+ * @param key key, less than the number of keys of the channel.
+ * @return the latest value of a key, set locally or received from the other end.
+ */
+uint16_t ADB::getState(StateChannel * channel, uint8_t key)
+{
+	return key < channel->count ? channel->values[key] : 0;
+}
+
+/**
+ * Returns the set of keys received from the other end since the last call, and clears it.
+ *
+ * @param channel state channel.
+ * @return bit mask of changed keys, bit i standing for key i.
+ */
+uint32_t ADB::getStateChanges(StateChannel * channel)
+{
+	uint32_t changed = channel->changed;
+
+	channel->changed = 0;
+
+	return changed;
+}
+
+/**
+ * Stores received records in the value table, except for keys with a local value that has not been sent yet.
+ * A record may be split across calls.
+ *
+ * @param client state channel.
+ * @param length number of bytes.
+ * @param data received bytes.
+ */
+void ADB::receiveState(void * client, uint16_t length, uint8_t * data)
+{
+	StateChannel * channel = (StateChannel*)client;
+	uint8_t record[ADB_STATE_RECORD_SIZE];
+	uint8_t i;
+
+	while (length > 0)
+	{
+		// Complete the record, starting from the bytes left over from last time.
+		for (i = 0; i < channel->partialLength; i++)
+			record[i] = channel->partial[i];
+
+		while (i < ADB_STATE_RECORD_SIZE && length > 0)
+		{
+			record[i++] = *data++;
+			length--;
+		}
+
+		if (i < ADB_STATE_RECORD_SIZE)
+		{
+			memcpy(channel->partial, record, i);
+			channel->partialLength = i;
+			return;
+		}
+
+		channel->partialLength = 0;
+
+		// Keys the channel doesn't know are skipped, and so are those with a local value on its way.
+		if (record[0] < channel->count && !(channel->dirty & ((uint32_t)1 << record[0])))
+		{
+			channel->values[record[0]] = record[1] | (record[2] << 8);
+			channel->changed |= (uint32_t)1 << record[0];
+		}
+	}
+}
+
+/**
+ * Handles an event of the connection of a state channel, taking in the records received (see
+ * ADB::receiveData). When the connection opens, all local values are sent again so that the other end starts from
+ * the complete state.
+ *
+ * @param channel state channel.
+ * @param event event type.
+ * @param length payload length.
+ * @param data payload data, or NULL if it is in the receive buffer.
+ */
+void ADB::handleStateEvent(StateChannel * channel, adb_eventType event, uint16_t length, uint8_t * data)
+{
+	switch (event)
+	{
+	case ADB_CONNECTION_OPEN:
+		channel->dirty = channel->local;
+		channel->deadline = micros();
+		channel->partialLength = 0;
+		break;
+
+	case ADB_CONNECTION_RECEIVE:
+		ADB::receiveData(channel->connection, length, data, ADB::receiveState, channel);
+		break;
+
+	default:
+		break;
+	}
+}
+
+/**
+ * Sends the keys that changed since the last update, if any, and if the connection is idle and the period has
+ * passed. A connection with an outbound queue must have an empty queue, the update then goes out around it.
+ *
+ * @param channel state channel.
+ * @return number of keys sent, or error code if the update could not be written.
+ */
+int ADB::flushState(StateChannel * channel)
+{
+	Connection * connection = channel->connection;
+	adb_device * device = ADB::getDevice(connection);
+	uint8_t buf[ADB_STATE_MAX_KEYS * ADB_STATE_RECORD_SIZE];
+	uint8_t key, sent = 0;
+	uint16_t length = 0;
+	int ret;
+
+	if (channel->dirty == 0 || !USB::isPassed(channel->deadline)) return 0;
+
+	// Wait for the OKAY of the previous update, and for queued data to go out first.
+	if (device->usb == NULL || !device->connected || connection->status != ADB_OPEN) return 0;
+#if ADB_HAS(ADB_FEATURE_WRITE_QUEUE)
+	if (connection->writeQueue != NULL && connection->writeQueueLength > 0) return 0;
+#endif
+
+	for (key = 0; key < channel->count; key++)
+		if (channel->dirty & ((uint32_t)1 << key))
+		{
+			buf[length++] = key;
+			buf[length++] = channel->values[key] & 0xff;
+			buf[length++] = channel->values[key] >> 8;
+			sent++;
+		}
+
+	ret = ADB::writeMessage(device, A_WRTE, connection->localID, connection->remoteID, length, buf);
+	if (ret != 0) return ret;
+
+	connection->status = ADB_WRITING;
+	channel->dirty = 0;
+	channel->deadline = USB::getDeadline((uint32_t)channel->period * 1000);
+
+	return sent;
+}
+#endif
+
+#if ADB_HAS(ADB_FEATURE_FRAMING)
+/**
+ * Sets up message framing on top of a connection. Frames are typed, length-prefixed messages: a type byte and a
+ * 16-bit little endian payload length (ADB_FRAME_HEADER_SIZE bytes in all), followed by the payload. The parser
+ * works across the USB packet and WRTE boundaries the payload is split at, and hands every frame to the
+ * handler in one piece.
+ *
+ * A frame that arrives in one piece is handed over in place, without copying. A frame that is split is put
+ * together in the buffer, a split frame longer than the buffer is dropped (see Framer::dropped). The
+ * application forwards the events of the connection with ADB::handleFrameEvent.
+ *
+ * Frames written with ADB::writeFrame to a connection with an outbound queue are packed together: all frames
+ * queued while a WRTE is in flight go out in the next one, and ADB::setCoalescing packs them further.
+ *
+ * @param framer framer record.
+ * @param connection ADB connection to run the framing on.
+ * @param buffer buffer for frames that are split, or NULL if the frames are too short for it to matter.
+ * @param size size of the buffer in bytes.
+ * @param handler function to be called for every frame received.
+ */
+void ADB::initFramer(Framer * framer, Connection * connection, uint8_t * buffer, uint16_t size, adb_frameHandler * handler)
+{
+	framer->connection = connection;
+	framer->buffer = buffer;
+	framer->bufferSize = buffer != NULL ? size : 0;
+	framer->handler = handler;
+	framer->headerLength = 0;
+	framer->received = 0;
+	framer->dropped = 0;
+}
+
+/**
+ * Parses received data into frames, picking up where the previous call left off.
+ *
+ * @param framer framer.
+ * @param length number of bytes.
+ * @param data received bytes.
+ */
+void ADB::parseFrames(Framer * framer, uint16_t length, uint8_t * data)
+{
+	uint16_t chunk;
+
+	while (length > 0)
+	{
+		// Collect the header.
+		if (framer->headerLength < ADB_FRAME_HEADER_SIZE)
+		{
+			framer->header[framer->headerLength++] = *data++;
+			length--;
+
+			if (framer->headerLength < ADB_FRAME_HEADER_SIZE) continue;
+
+			framer->length = framer->header[1] | (framer->header[2] << 8);
+			framer->received = 0;
+		}
+
+		// The whole payload is here, hand it over in place.
+		if (framer->received == 0 && length >= framer->length)
+		{
+			framer->handler(framer, framer->header[0], framer->length, data);
+			data += framer->length;
+			length -= framer->length;
+			framer->headerLength = 0;
+			continue;
+		}
+
+		// Put a split frame together in the buffer, or skip it if it won't fit.
+		chunk = framer->length - framer->received;
+		if (chunk > length) chunk = length;
+
+		if (framer->length <= framer->bufferSize)
+			memcpy(framer->buffer + framer->received, data, chunk);
+
+		framer->received += chunk;
+		data += chunk;
+		length -= chunk;
+
+		if (framer->received < framer->length) continue;
+
+		if (framer->length <= framer->bufferSize)
+			framer->handler(framer, framer->header[0], framer->length, framer->buffer);
+		else
+			framer->dropped++;
+
+		framer->headerLength = 0;
+	}
+}
+
+/**
+ * Parser of a framer for ADB::receiveData, see ADB::parseFrames.
+ *
+ * @param client framer.
+ * @param length number of bytes.
+ * @param data received bytes.
+ */
+void ADB::receiveFrames(void * client, uint16_t length, uint8_t * data)
+{
+	ADB::parseFrames((Framer*)client, length, data);
+}
+
+/**
+ * Handles an event of the connection of a framer, parsing the data received into frames (see ADB::receiveData). A
+ * frame that was cut off by the connection closing is discarded.
+ *
+ * @param framer framer.
+ * @param event event type.
+ * @param length payload length.
+ * @param data payload data, or NULL if it is in the receive buffer.
+ */
+void ADB::handleFrameEvent(Framer * framer, adb_eventType event, uint16_t length, uint8_t * data)
+{
+	switch (event)
+	{
+	case ADB_CONNECTION_OPEN:
+		framer->headerLength = 0;
+		break;
+
+	case ADB_CONNECTION_RECEIVE:
+		ADB::receiveData(framer->connection, length, data, ADB::receiveFrames, framer);
+		break;
+
+	default:
+		break;
+	}
+}
+
+/**
+ * Writes a frame. If the connection has an outbound queue, the frame is queued whole or not at all, and sent
+ * together with the other frames in the queue. Otherwise it is sent right away as a WRTE of its own.
+ *
+ * @param framer framer.
+ * @param type frame type.
+ * @param length payload length.
+ * @param data payload.
+ * @return 0 for success, -2 if the connection is not open, -3 if the frame does not fit in the outbound queue, or
+ * the error code of ADB::writev.
+ */
+int ADB::writeFrame(Framer * framer, uint8_t type, uint16_t length, uint8_t * data)
+{
+	Connection * connection = framer->connection;
+	uint8_t header[ADB_FRAME_HEADER_SIZE];
+	usb_segment segments[2];
+#if ADB_HAS(ADB_FEATURE_WRITE_QUEUE)
+	int ret;
+#endif
+
+	header[0] = type;
+	header[1] = length & 0xff;
+	header[2] = length >> 8;
+
+	segments[0].data = header;
+	segments[0].length = ADB_FRAME_HEADER_SIZE;
+	segments[0].progmem = false;
+	segments[1].data = data;
+	segments[1].length = length;
+	segments[1].progmem = false;
+
+#if ADB_HAS(ADB_FEATURE_WRITE_QUEUE)
+	if (connection->writeQueue != NULL)
+	{
+		ret = ADB::queueWrite(connection, 2, segments, true);
+		return ret < 0 ? ret : 0;
+	}
+#endif
+
+	return ADB::writev(connection, 2, segments);
+}
+#endif
+
+#if ADB_HAS(ADB_FEATURE_SYNC)
+// Sync protocol request and response IDs, as they appear on the wire (little endian).
+#define ADB_SYNC_SEND 0x444e4553
+#define ADB_SYNC_RECV 0x56434552
+#define ADB_SYNC_DATA 0x41544144
+#define ADB_SYNC_DONE 0x454e4f44
+#define ADB_SYNC_OKAY 0x59414b4f
+#define ADB_SYNC_FAIL 0x4c494146
+
+// File type bits of a regular file, added to the permission bits passed to ADB::syncSend.
+#define ADB_SYNC_REGULAR 0100000
+
+/**
+ * Sets up a client for the file sync service of adbd on top of a connection, which must have been opened for
+ * "sync:". Files are pushed with ADB::syncSend and pulled with ADB::syncReceive, one at a time, and the connection
+ * can be used for any number of transfers. Unlike a shell command, this handles binary data of any size without
+ * quoting, and the file data is streamed through the buffer in chunks, so it never has to be in memory as a whole.
+ *
+ * The application forwards the events of the connection with ADB::handleSyncEvent, and calls ADB::pollSync from its
+ * main loop to keep a push going.
+ *
+ * @param sync sync client record.
+ * @param connection ADB connection to the "sync:" service.
+ * @param buffer buffer for the file data of a push, and for the error message of a failed transfer. A DATA
+ * chunk sent is at most its size, the larger the buffer the fewer round trips.
+ * @param size size of the buffer in bytes, at least ADB_SYNC_MIN_BUFFER. A client with a smaller buffer refuses
+ * all transfers.
+ * @param handler function to be called when a transfer is done.
+ * @return 0 for success, or -1 if the buffer is too small.
+ */
+int ADB::initSync(SyncClient * sync, Connection * connection, uint8_t * buffer, uint16_t size, adb_syncHandler * handler)
+{
+	if (buffer == NULL || size < ADB_SYNC_MIN_BUFFER) size = 0;
+
+	sync->connection = connection;
+	sync->buffer = buffer;
+	sync->bufferSize = size;
+	sync->handler = handler;
+	sync->reader = NULL;
+	sync->writer = NULL;
+	sync->state = ADB_SYNC_IDLE;
+	sync->headerLength = 0;
+
+	return size > 0 ? 0 : -1;
+}
+
+/**
+ * @param sync sync client.
+ * @return true iff the client is ready for a new transfer. A client without a usable buffer (see ADB::initSync)
+ * never is.
+ */
+boolean ADB::isSyncIdle(SyncClient * sync)
+{
+	return sync->state == ADB_SYNC_IDLE && sync->bufferSize > 0 && sync->connection->status == ADB_OPEN;
+}
+
+/**
+ * Fills out a sync request header.
+ *
+ * @param header 8-byte header.
+ * @param id request ID.
+ * @param length request length, or an argument for requests without data.
+ */
+void ADB::syncHeader(uint8_t * header, uint32_t id, uint32_t length)
+{
+	uint8_t i;
+
+	for (i = 0; i < 4; i++)
+	{
+		header[i] = id >> (8 * i);
+		header[i + 4] = length >> (8 * i);
+	}
+}
+
+/**
+ * Ends the current transfer and reports the result.
+ *
+ * @param sync sync client.
+ * @param result 0 for success, or a negative error code.
+ * @param message error message from the device, or NULL.
+ */
+void ADB::finishSync(SyncClient * sync, int result, const char * message)
+{
+	sync->state = ADB_SYNC_IDLE;
+	sync->headerLength = 0;
+
+	if (sync->handler != NULL)
+		sync->handler(sync, result, message);
+}
+
+/**
+ * Starts pushing a file to the device. The file data is pulled from the reader callback a chunk at a time, as
+ * fast as the device takes it, until the reader returns 0. The handler is called once the device has stored the
+ * file (result 0), has refused it (-1, with the message of the device), or the push has been cut off (-3 when the
+ * connection closed, -4 when a chunk could not be written).
+ *
+ * @param sync sync client, idle (see ADB::isSyncIdle).
+ * @param path path of the file on the device, for example "/sdcard/log.bin".
+ * @param mode permission bits of the file, for example 0644.
+ * @param mtime modification time of the file in seconds since the epoch.
+ * @param reader function that reads the next chunk of the file.
+ * @return 0 for success, -2 if the client or the connection is busy, or error code.
+ */
+int ADB::syncSend(SyncClient * sync, const char * path, uint16_t mode, uint32_t mtime, adb_syncReader * reader)
+{
+	uint8_t header[8];
+	char suffix[8];
+	usb_segment segments[3];
+	uint32_t bits = ADB_SYNC_REGULAR | mode;
+	uint8_t i = sizeof(suffix);
+	int ret;
+
+	if (!ADB::isSyncIdle(sync)) return -2;
+
+	// The request is the path and the mode in decimal, separated by a comma.
+	do
+	{
+		suffix[--i] = '0' + bits % 10;
+		bits /= 10;
+	} while (bits > 0);
+	suffix[--i] = ',';
+
+	segments[0].data = header;
+	segments[0].length = sizeof(header);
+	segments[0].progmem = false;
+	segments[1].data = (uint8_t*)path;
+	segments[1].length = strlen(path);
+	segments[1].progmem = false;
+	segments[2].data = (uint8_t*)suffix + i;
+	segments[2].length = sizeof(suffix) - i;
+	segments[2].progmem = false;
+
+	ADB::syncHeader(header, ADB_SYNC_SEND, segments[1].length + segments[2].length);
+
+	ret = ADB::writev(sync->connection, 3, segments);
+	if (ret != 0) return ret;
+
+	sync->reader = reader;
+	sync->mtime = mtime;
+	sync->size = 0;
+	sync->state = ADB_SYNC_SENDING;
+
+	return 0;
+}
+
+/**
+ * Starts pulling a file from the device. The file data is handed to the writer callback piece by piece as it
+ * comes in, and the handler is called at the end of the file, or if the device can't send it.
+ *
+ * @param sync sync client, idle (see ADB::isSyncIdle).
+ * @param path path of the file on the device.
+ * @param writer function that takes the next piece of the file.
+ * @return 0 for success, -2 if the client or the connection is busy, or error code.
+ */
+int ADB::syncReceive(SyncClient * sync, const char * path, adb_syncWriter * writer)
+{
+	uint8_t header[8];
+	usb_segment segments[2];
+	int ret;
+
+	if (!ADB::isSyncIdle(sync)) return -2;
+
+	segments[0].data = header;
+	segments[0].length = sizeof(header);
+	segments[0].progmem = false;
+	segments[1].data = (uint8_t*)path;
+	segments[1].length = strlen(path);
+	segments[1].progmem = false;
+
+	ADB::syncHeader(header, ADB_SYNC_RECV, segments[1].length);
+
+	ret = ADB::writev(sync->connection, 2, segments);
+	if (ret != 0) return ret;
+
+	sync->writer = writer;
+	sync->size = 0;
+	sync->state = ADB_SYNC_RECEIVING;
+
+	return 0;
+}
+
+/**
+ * Sends the next DATA chunk of a push, or the closing DONE, once the connection is ready for it. The main loop
+ * calls this as often as it can while a push is going on. The reader is only asked for a chunk when the
+ * connection can take it. A chunk can't be handed back to the reader, so if writing it fails anyway, the push ends
+ * with result -4 rather than leave a hole in the file.
+ *
+ * @param sync sync client.
+ * @return number of file bytes sent, or -1 if the chunk could not be written.
+ */
+int ADB::pollSync(SyncClient * sync)
+{
+	Connection * connection = sync->connection;
+	adb_device * device = ADB::getDevice(connection);
+	uint32_t maxData = device->remoteMaxData;
+	uint16_t length = sync->bufferSize;
+	uint8_t header[8];
+	usb_segment segments[2];
+
+	// Wait until the connection takes a write, see ADB::writev.
+	if (sync->state != ADB_SYNC_SENDING || device->usb == NULL || !device->connected || connection->status != ADB_OPEN)
+		return 0;
+#if ADB_HAS(ADB_FEATURE_WRITE_QUEUE)
+	if (connection->writeQueueLength > 0) return 0;
+#endif
+
+	// A DATA chunk and its header go in one WRTE, which a device with a tiny maximum payload can't take.
+	if (maxData <= sizeof(header))
+	{
+		ADB::finishSync(sync, -4, NULL);
+		return -1;
+	}
+	if (length > maxData - sizeof(header)) length = maxData - sizeof(header);
+	length = sync->reader(sync, length, sync->buffer);
+
+	segments[0].data = header;
+	segments[0].length = sizeof(header);
+	segments[0].progmem = false;
+	segments[1].data = sync->buffer;
+	segments[1].length = length;
+	segments[1].progmem = false;
+
+	// A DONE with the modification time ends the file.
+	if (length == 0)
+		ADB::syncHeader(header, ADB_SYNC_DONE, sync->mtime);
+	else
+		ADB::syncHeader(header, ADB_SYNC_DATA, length);
+
+	if (ADB::writev(connection, length > 0 ? 2 : 1, segments) != 0)
+	{
+		ADB::finishSync(sync, -4, NULL);
+		return -1;
+	}
+
+	if (length == 0)
+		sync->state = ADB_SYNC_WAITING;
+	sync->size += length;
+
+	return length;
+}
+
+/**
+ * Parses the responses of the sync service.
+ *
+ * @param client sync client.
+ * @param length number of bytes.
+ * @param data received bytes.
+ */
+void ADB::receiveSync(void * client, uint16_t length, uint8_t * data)
+{
+	SyncClient * sync = (SyncClient*)client;
+	uint32_t id, chunk, n;
+	uint8_t i;
+
+	while (length > 0)
+	{
+		// Collect the response header.
+		if (sync->headerLength < sizeof(sync->header))
+		{
+			sync->header[sync->headerLength++] = *data++;
+			length--;
+
+			if (sync->headerLength < sizeof(sync->header)) continue;
+
+			for (i = 0, sync->length = 0; i < 4; i++)
+				sync->length |= (uint32_t)sync->header[i + 4] << (8 * i);
+			sync->received = 0;
+		}
+
+		id = 0;
+		for (i = 0; i < 4; i++)
+			id |= (uint32_t)sync->header[i] << (8 * i);
+
+		// The length of OKAY and DONE is an argument, they carry no data.
+		if (id == ADB_SYNC_OKAY || id == ADB_SYNC_DONE)
+		{
+			sync->headerLength = 0;
+
+			if ((id == ADB_SYNC_OKAY && sync->state == ADB_SYNC_WAITING) || (id == ADB_SYNC_DONE && sync->state == ADB_SYNC_RECEIVING))
+				ADB::finishSync(sync, 0, NULL);
+
+			continue;
+		}
+
+		chunk = sync->length - sync->received;
+		if (chunk > length) chunk = length;
+
+		if (id == ADB_SYNC_DATA && sync->state == ADB_SYNC_RECEIVING)
+		{
+			if (chunk > 0) sync->writer(sync, chunk, data);
+			sync->size += chunk;
+		}
+		else if (id == ADB_SYNC_FAIL)
+		{
+			// Keep as much of the message as fits.
+			for (n = sync->received; n < sync->received + chunk && n < sync->bufferSize - 1u; n++)
+				sync->buffer[n] = data[n - sync->received];
+		}
+
+		sync->received += chunk;
+		data += chunk;
+		length -= chunk;
+
+		if (sync->received < sync->length) continue;
+
+		sync->headerLength = 0;
+
+		if (id == ADB_SYNC_FAIL && sync->state != ADB_SYNC_IDLE)
+		{
+			sync->buffer[sync->length < sync->bufferSize ? sync->length : sync->bufferSize - 1u] = 0;
+			ADB::finishSync(sync, -1, (char*)sync->buffer);
+		}
+	}
+}
+
+/**
+ * Handles an event of the connection of a sync client, parsing the responses received (see ADB::receiveData). A
+ * transfer that is cut off by the connection closing ends with error code -3.
+ *
+ * @param sync sync client.
+ * @param event event type.
+ * @param length payload length.
+ * @param data payload data, or NULL if it is in the receive buffer.
+ */
+void ADB::handleSyncEvent(SyncClient * sync, adb_eventType event, uint16_t length, uint8_t * data)
+{
+	switch (event)
+	{
+	case ADB_CONNECTION_CLOSE:
+	case ADB_CONNECTION_FAILED:
+		if (sync->state != ADB_SYNC_IDLE)
+			ADB::finishSync(sync, -3, NULL);
+		sync->headerLength = 0;
+		break;
+
+	case ADB_CONNECTION_RECEIVE:
+		ADB::receiveData(sync->connection, length, data, ADB::receiveSync, sync);
+		break;
+
+	default:
+		break;
+	}
+}
+#endif
+
+#if ADB_HAS(ADB_FEATURE_SHELL)
+// Sent ahead of the first command after the connection opens: no echo of the commands (which would otherwise mix
+// with the output of the command before them) and no prompt.
+static const char shellSetup[] PROGMEM = "stty -echo -onlcr 2>/dev/null; PS1=\n";
+
+// Markers the output of a command is framed with. These bytes don't occur in text output.
+#define ADB_SHELL_START 0x1e
+#define ADB_SHELL_END 0x1f
+
+/**
+ * Sets up a shell session on top of a connection, which must have been opened for "shell:". The session runs
+ * any number of commands in the one shell on the device, instead of paying for a connection and a shell per
+ * command. Commands are pipelined: ADB::shellCommand sends a command right away, the shell runs them one after the
+ * other, and the output and exit code of each go to the handler given with the command.
+ *
+ * To tell the output of the commands apart, each one is wrapped in printf statements that print a start marker
+ * and an end marker with the exit code, and everything outside the markers (like the prompt) is dropped. The
+ * shell on the device needs printf, and stty to switch the echo off.
+ *
+ * The application forwards the events of the connection with ADB::handleShellEvent. Give the connection an
+ * outbound queue (see ADB::setWriteQueue) to queue commands while the one before is still being sent.
+ *
+ * @param session shell session record.
+ * @param connection ADB connection to the "shell:" service.
+ */
+void ADB::initShell(ShellSession * session, Connection * connection)
+{
+	session->connection = connection;
+	session->head = 0;
+	session->count = 0;
+	session->nextId = 0;
+	session->state = ADB_SHELL_SKIPPING;
+	session->ready = false;
+	session->broken = false;
+}
+
+/**
+ * @param session shell session.
+ * @return number of commands sent that have not finished yet.
+ */
+uint8_t ADB::getShellPending(ShellSession * session)
+{
+	return session->count;
+}
+
+/**
+ * Writes a number in decimal.
+ *
+ * @param str buffer to write to, not zero terminated.
+ * @param number number.
+ * @return number of characters written.
+ */
+uint8_t ADB::shellNumber(char * str, uint8_t number)
+{
+	uint8_t length = number >= 100 ? 3 : number >= 10 ? 2 : 1, i;
+
+	for (i = length; i > 0; i--)
+	{
+		str[i - 1] = '0' + number % 10;
+		number /= 10;
+	}
+
+	return length;
+}
+
+/**
+ * Sends a command to the shell. The handler is called with the output of the command as it comes in, and once
+ * more at the end with a NULL data pointer and the exit code of the command. If the connection closes before, the
+ * exit code is -1. Commands go on a single line and must be complete, an unmatched quote stalls the session.
+ *
+ * A USB error while the command is being written may leave the shell with part of it, so the session is then
+ * broken: all commands fail with -1 until the connection reopens.
+ *
+ * @param session shell session.
+ * @param command command line, without the trailing newline.
+ * @param handler function to be called with the output and exit code.
+ * @return ID of the command, -1 if the session is broken, -2 if the connection is not open or busy, or -3 if the
+ * command does not fit in the outbound queue or ADB_SHELL_QUEUE_SIZE commands are pending already.
+ */
+int ADB::shellCommand(ShellSession * session, const char * command, adb_shellHandler * handler)
+{
+	Connection * connection = session->connection;
+	char setup[sizeof(shellSetup)];
+	char prefix[20], suffix[28];
+	usb_segment segments[4];
+	uint8_t id = session->nextId, count = 0, i, n;
+	int ret;
+
+	if (session->broken) return -1;
+	if (session->count == ADB_SHELL_QUEUE_SIZE) return -3;
+
+	// printf '\036<id>\n', the command, printf '\037<id> %d\n' $?
+	memcpy(prefix, "printf '\\036", 12);
+	n = 12;
+	n += ADB::shellNumber(prefix + n, id);
+	memcpy(prefix + n, "\\n'\n", 4); n += 4;
+
+	if (!session->ready)
+	{
+		memcpy_P(setup, shellSetup, sizeof(setup) - 1);
+		segments[count].data = (uint8_t*)setup;
+		segments[count++].length = sizeof(setup) - 1;
+	}
+	segments[count].data = (uint8_t*)prefix;
+	segments[count++].length = n;
+	segments[count].data = (uint8_t*)command;
+	segments[count++].length = strlen(command);
+
+	memcpy(suffix, "\nprintf '\\037", 13);
+	n = 13;
+	n += ADB::shellNumber(suffix + n, id);
+	memcpy(suffix + n, " %d\\n' $?\n", 10); n += 10;
+	segments[count].data = (uint8_t*)suffix;
+	segments[count++].length = n;
+
+	for (i = 0; i < count; i++)
+		segments[i].progmem = false;
+
+#if ADB_HAS(ADB_FEATURE_WRITE_QUEUE)
+	if (connection->writeQueue != NULL)
+	{
+		ret = ADB::queueWrite(connection, count, segments, true);
+		if (ret < 0) return ret;
+	}
+	else
+#endif
+	{
+		// -1 and -2 mean nothing was sent, a USB error may have cut the command short.
+		ret = ADB::writev(connection, count, segments);
+		if (ret < 0) return -2;
+		if (ret > 0)
+		{
+			session->broken = true;
+			return -1;
+		}
+	}
+
+	i = session->head + session->count;
+	if (i >= ADB_SHELL_QUEUE_SIZE) i -= ADB_SHELL_QUEUE_SIZE;
+	session->handlers[i] = handler;
+	session->count++;
+	session->nextId++;
+	session->ready = true;
+
+	return id;
+}
+
+/**
+ * Ends the oldest pending command.
+ *
+ * @param session shell session.
+ * @param exitCode exit code to report.
+ */
+void ADB::finishShellCommand(ShellSession * session, int exitCode)
+{
+	adb_shellHandler * handler = session->handlers[session->head];
+
+	if (++session->head == ADB_SHELL_QUEUE_SIZE) session->head = 0;
+	session->count--;
+
+	if (handler != NULL)
+		handler(session, 0, NULL, exitCode);
+}
+
+/**
+ * Parses the output of the shell: hands the output of the oldest pending command to its handler, and finishes
+ * the command at its end marker.
+ *
+ * @param client shell session.
+ * @param length number of bytes.
+ * @param data received bytes.
+ */
+void ADB::receiveShell(void * client, uint16_t length, uint8_t * data)
+{
+	ShellSession * session = (ShellSession*)client;
+	uint8_t id = session->nextId - session->count;
+	adb_shellHandler * handler;
+	uint16_t run;
+	uint8_t c;
+
+	while (length > 0)
+	{
+		// Command output goes to the handler in place, up to the end marker.
+		if (session->state == ADB_SHELL_OUTPUT)
+		{
+			for (run = 0; run < length && data[run] != ADB_SHELL_END; run++);
+
+			handler = session->handlers[session->head];
+			if (run > 0 && handler != NULL)
+				handler(session, run, data, 0);
+
+			data += run;
+			length -= run;
+			if (length == 0) break;
+
+			session->state = ADB_SHELL_END_ID;
+			session->number = 0;
+			data++;
+			length--;
+			continue;
+		}
+
+		c = *data++;
+		length--;
+
+		if (c == '\r') continue;
+
+		switch (session->state)
+		{
+		case ADB_SHELL_SKIPPING:
+			if (c == ADB_SHELL_START)
+			{
+				session->state = ADB_SHELL_START_ID;
+				session->number = 0;
+			}
+			break;
+
+		case ADB_SHELL_START_ID:
+		case ADB_SHELL_END_ID:
+		case ADB_SHELL_EXIT_CODE:
+			if (c >= '0' && c <= '9')
+			{
+				session->number = session->number * 10 + (c - '0');
+				break;
+			}
+
+			// A marker that doesn't belong to the oldest pending command can only be garbage.
+			if (session->count == 0 || (session->state != ADB_SHELL_EXIT_CODE && session->number != id))
+				session->state = ADB_SHELL_SKIPPING;
+			else if (session->state == ADB_SHELL_START_ID && c == '\n')
+				session->state = ADB_SHELL_OUTPUT;
+			else if (session->state == ADB_SHELL_END_ID && c == ' ')
+			{
+				session->state = ADB_SHELL_EXIT_CODE;
+				session->number = 0;
+			}
+			else if (session->state == ADB_SHELL_EXIT_CODE && c == '\n')
+			{
+				session->state = ADB_SHELL_SKIPPING;
+				ADB::finishShellCommand(session, session->number);
+				id++;
+			}
+			else
+				session->state = ADB_SHELL_SKIPPING;
+			break;
+
+		default:
+			break;
+		}
+	}
+}
+
+/**
+ * Handles an event of the connection of a shell session, splitting the output received by command (see
+ * ADB::receiveData). The commands still pending when the connection closes end with exit code -1, and a new
+ * shell is set up when it opens again.
+ *
+ * @param session shell session.
+ * @param event event type.
+ * @param length payload length.
+ * @param data payload data, or NULL if it is in the receive buffer.
+ */
+void ADB::handleShellEvent(ShellSession * session, adb_eventType event, uint16_t length, uint8_t * data)
+{
+	switch (event)
+	{
+	case ADB_CONNECTION_OPEN:
+	case ADB_CONNECTION_CLOSE:
+	case ADB_CONNECTION_FAILED:
+		while (session->count > 0)
+			ADB::finishShellCommand(session, -1);
+
+		session->state = ADB_SHELL_SKIPPING;
+		session->ready = false;
+		session->broken = false;
+		break;
+
+	case ADB_CONNECTION_RECEIVE:
+		ADB::receiveData(session->connection, length, data, ADB::receiveShell, session);
+		break;
+
+	default:
+		break;
+	}
+}
+#endif
+
+#if ADB_HAS(ADB_FEATURE_LOGCAT)
+/**
+ * Drops the partial line or entry of a logcat client.
+ *
+ * @param logcat logcat client.
+ */
+void ADB::resetLogcat(LogcatClient * logcat)
+{
+	logcat->position = 0;
+	logcat->overflow = false;
+	logcat->headerLength = 0;
+	logcat->headerSize = ADB_LOGCAT_HEADER_SIZE;
+}
+
+/**
+ * Sets up a logcat client. Log output is handed to the application either as text lines, or as parsed entries of
+ * the binary log format (logcat -B), whichever handler is given. Both go through the buffer: a text line longer
+ * than the buffer is cut short, and so is the payload of a binary entry.
+ *
+ * Open the logcat connection with ADB::addLogcat, and forward its events with ADB::handleLogcatEvent.
+ *
+ * @param logcat logcat client record.
+ * @param buffer line or entry buffer.
+ * @param size size of the buffer in bytes, at least ADB_LOGCAT_MIN_BUFFER. A client with a smaller buffer can't
+ * be connected.
+ * @param lineHandler function to be called for every line of text, or NULL.
+ * @param entryHandler function to be called for every binary entry, or NULL to receive text.
+ * @return 0 for success, or -1 if the buffer is too small.
+ */
+int ADB::initLogcat(LogcatClient * logcat, uint8_t * buffer, uint16_t size, adb_logcatLineHandler * lineHandler, adb_logcatEntryHandler * entryHandler)
+{
+	if (buffer == NULL || size < ADB_LOGCAT_MIN_BUFFER) size = 0;
+
+	logcat->connection = NULL;
+	logcat->buffer = buffer;
+	logcat->bufferSize = size;
+	logcat->lineHandler = lineHandler;
+	logcat->entryHandler = entryHandler;
+	logcat->truncated = 0;
+	ADB::resetLogcat(logcat);
+
+	return size > 0 ? 0 : -1;
+}
+
+/**
+ * Appends a string to a connection string being built.
+ *
+ * @param str connection string.
+ * @param length current length of the connection string.
+ * @param suffix string to append.
+ * @return new length, or ADB_CONNECTIONSTRING_LENGTH if it doesn't fit.
+ */
+uint8_t ADB::appendString(char * str, uint8_t length, const char * suffix)
+{
+	uint8_t n = strlen(suffix);
+
+	if (length + n >= ADB_CONNECTIONSTRING_LENGTH) return ADB_CONNECTIONSTRING_LENGTH;
+
+	memcpy(str + length, suffix, n + 1);
+
+	return length + n;
+}
+
+/**
+ * Adds the connection of a logcat client, with filter specs so that only the log lines of interest leave the
+ * phone. The filters are logcat filter specs separated by spaces, a tag and a priority (V, D, I, W, E, F) like
+ * "MyApp:D GPS:W", everything else is silenced. Binary entries come from the exec: service, which doesn't mangle
+ * binary data the way the terminal of shell: does, and needs Android 5.0 or later.
+ *
+ * @param logcat logcat client, see ADB::initLogcat.
+ * @param filters filter specs, or NULL for the whole log.
+ * @param reconnect true for automatic reconnect (persistent connections).
+ * @param handler event handler of the connection, which passes the events on to ADB::handleLogcatEvent.
+ * @return the connection, or NULL if there is no free slot, the client has no usable buffer, or the command does
+ * not fit in ADB_CONNECTIONSTRING_LENGTH (the command and filters take up to 22 characters more).
+ */
+Connection * ADB::addLogcat(LogcatClient * logcat, const char * filters, boolean reconnect, adb_eventHandler * handler)
+{
+#if ADB_CONNECTIONSTRING_LENGTH > 0
+	char command[ADB_CONNECTIONSTRING_LENGTH];
+	uint8_t length;
+
+	if (logcat->bufferSize == 0) return NULL;
+
+	length = ADB::appendString(command, 0, logcat->entryHandler != NULL ? "exec:logcat -B" : "shell:exec logcat");
+	if (filters != NULL && *filters != 0)
+	{
+		length = ADB::appendString(command, length, " ");
+		length = ADB::appendString(command, length, filters);
+		length = ADB::appendString(command, length, " *:S");
+	}
+	if (length >= ADB_CONNECTIONSTRING_LENGTH) return NULL;
+
+	logcat->connection = ADB::addConnection(command, reconnect, handler);
+	return logcat->connection;
+#else
+	return NULL;
+#endif
+}
+
+/**
+ * Assembles text lines.
+ *
+ * @param client logcat client.
+ * @param length number of bytes.
+ * @param data received bytes.
+ */
+void ADB::receiveLines(void * client, uint16_t length, uint8_t * data)
+{
+	LogcatClient * logcat = (LogcatClient*)client;
+	uint8_t c;
+
+	while (length-- > 0)
+	{
+		c = *data++;
+
+		if (c == '\r') continue;
+
+		if (c == '\n')
+		{
+			logcat->buffer[logcat->position] = 0;
+			logcat->lineHandler(logcat, logcat->position, (char*)logcat->buffer);
+			logcat->position = 0;
+			logcat->overflow = false;
+		}
+		else if (logcat->position < logcat->bufferSize - 1u)
+			logcat->buffer[logcat->position++] = c;
+		else if (!logcat->overflow)
+		{
+			logcat->overflow = true;
+			logcat->truncated++;
+		}
+	}
+}
+
+/**
+ * Reads a 32-bit little-endian field of a binary log entry header.
+ *
+ * @param data first byte of the field.
+ * @return field value.
+ */
+uint32_t ADB::getLogField(uint8_t * data)
+{
+	return data[0] | ((uint32_t)data[1] << 8) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+/**
+ * Parses binary log entries (logcat -B): a header of payload length, header size (0 in the original format, which
+ * has a header of ADB_LOGCAT_HEADER_SIZE bytes), pid, tid and time, followed by the payload of a priority byte,
+ * the tag and the message, both zero terminated. Header fields beyond the original ones are skipped.
+ *
+ * @param client logcat client.
+ * @param length number of bytes.
+ * @param data received bytes.
+ */
+void ADB::receiveEntries(void * client, uint16_t length, uint8_t * data)
+{
+	LogcatClient * logcat = (LogcatClient*)client;
+	uint8_t * header = logcat->header;
+	uint16_t payloadLength, chunk, n;
+	adb_logEntry entry;
+
+	while (length > 0)
+	{
+		if (logcat->headerLength < logcat->headerSize)
+		{
+			if (logcat->headerLength < ADB_LOGCAT_HEADER_SIZE) header[logcat->headerLength] = *data;
+			logcat->headerLength++;
+			data++;
+			length--;
+
+			if (logcat->headerLength == 4)
+			{
+				logcat->headerSize = header[2] | (header[3] << 8);
+				if (logcat->headerSize < ADB_LOGCAT_HEADER_SIZE) logcat->headerSize = ADB_LOGCAT_HEADER_SIZE;
+			}
+		}
+		else
+		{
+			// Keep as much of the payload as fits, leaving room for a terminating zero.
+			chunk = (header[0] | (header[1] << 8)) - logcat->position;
+			if (chunk > length) chunk = length;
+
+			if (logcat->position < logcat->bufferSize - 1u)
+			{
+				n = logcat->bufferSize - 1u - logcat->position;
+				memcpy(logcat->buffer + logcat->position, data, n < chunk ? n : chunk);
+			}
+
+			logcat->position += chunk;
+			data += chunk;
+			length -= chunk;
+		}
+
+		payloadLength = header[0] | (header[1] << 8);
+		if (logcat->headerLength < logcat->headerSize || logcat->position < payloadLength) continue;
+
+		if (payloadLength > logcat->bufferSize - 1u)
+		{
+			payloadLength = logcat->bufferSize - 1u;
+			logcat->truncated++;
+		}
+		logcat->buffer[payloadLength] = 0;
+
+		entry.priority = payloadLength > 0 ? logcat->buffer[0] : 0;
+		entry.tag = (char*)logcat->buffer + (payloadLength > 0);
+		entry.message = entry.tag + strlen(entry.tag);
+		if (entry.message < (char*)logcat->buffer + payloadLength) entry.message++;
+		entry.pid = ADB::getLogField(header + 4);
+		entry.tid = ADB::getLogField(header + 8);
+		entry.sec = ADB::getLogField(header + 12);
+		entry.nsec = ADB::getLogField(header + 16);
+
+		logcat->entryHandler(logcat, &entry);
+
+		logcat->headerLength = 0;
+		logcat->headerSize = ADB_LOGCAT_HEADER_SIZE;
+		logcat->position = 0;
+	}
+}
+
+/**
+ * Handles an event of the connection of a logcat client, assembling the data received into lines or entries for
+ * the handler (see ADB::receiveData).
+ *
+ * @param logcat logcat client.
+ * @param event event type.
+ * @param length payload length.
+ * @param data payload data, or NULL if it is in the receive buffer.
+ */
+void ADB::handleLogcatEvent(LogcatClient * logcat, adb_eventType event, uint16_t length, uint8_t * data)
+{
+	switch (event)
+	{
+	case ADB_CONNECTION_OPEN:
+		ADB::resetLogcat(logcat);
+		break;
+
+	case ADB_CONNECTION_RECEIVE:
+		ADB::receiveData(logcat->connection, length, data,
+				logcat->entryHandler != NULL ? ADB::receiveEntries : ADB::receiveLines, logcat);
+		break;
+
+	default:
+		break;
+	}
+}
+#endif
+
+#if ADB_HAS(ADB_FEATURE_ACCESSORY)
+/**
+ * Helper function for ADB::isAccessoryDevice to check whether an interface is the interface of an accessory.
+ * @param interface interface descriptor struct.
+ */
+boolean ADB::isAccessoryInterface(usb_interfaceDescriptor * interface)
+{
+	return interface->bNumEndpoints == 2 && interface->bInterfaceClass == ADB_AOA_CLASS
+			&& interface->bInterfaceSubClass == ADB_AOA_SUBCLASS && interface->bInterfaceProtocol == ADB_AOA_PROTOCOL;
+}
+
+/**
+ * Checks whether a connected USB device is a phone in accessory mode, and populates a configuration record with its
+ * accessory interface if it is.
+ *
+ * @param device USB device.
+ * @param handle pointer to a configuration record.
+ * @return true iff the device is a phone in accessory mode.
+ */
+boolean ADB::isAccessoryDevice(usb_device * device, adb_usbConfiguration * handle)
+{
+	if (device->vendorId != ADB_AOA_VENDOR_ID || device->productId < ADB_AOA_PRODUCT_ID
+			|| device->productId > ADB_AOA_PRODUCT_LAST)
+		return false;
+
+	return ADB::findInterface(device, 0, handle, ADB::isAccessoryInterface);
+}
+
+/**
+ * Asks a phone to switch to accessory mode: checks that it speaks the protocol, sends the identification strings
+ * and starts accessory mode. The phone then drops off the bus, and comes back as a new device in accessory mode.
+ *
+ * @param device USB device.
+ * @return 0 if the phone is switching, or a negative error code if the device doesn't speak the protocol or the
+ * switch failed.
+ */
+int ADB::startAccessory(usb_device * device)
+{
+	uint8_t version[2];
+	uint8_t i;
+
+	// Devices that don't know the protocol stall the request.
+	if (USB::controlRequest(device, bmREQ_AOA_GET, ADB_AOA_GET_PROTOCOL, 0, 0, 0, 2, version) != 0) return -1;
+	if (version[0] == 0 && version[1] == 0) return -1;
+
+	for (i = 0; i < ADB_AOA_STRINGS; i++)
+		if (aoa->strings[i] != NULL && USB::controlRequest(device, bmREQ_AOA_SET, ADB_AOA_SEND_STRING, 0, 0, i,
+				strlen(aoa->strings[i]) + 1, (uint8_t*)aoa->strings[i]) != 0)
+			return -2;
+
+	if (USB::controlRequest(device, bmREQ_AOA_SET, ADB_AOA_START, 0, 0, 0, 0, NULL) != 0) return -3;
+
+	return 0;
+}
+
+/**
+ * Configures a phone in accessory mode as the accessory, and tells the application.
+ *
+ * @param device USB device.
+ * @param handle accessory interface, filled out by ADB::isAccessoryDevice.
+ * @return error code or 0 for success.
+ */
+int ADB::openAccessory(usb_device * device, adb_usbConfiguration * handle)
+{
+	int rcode;
+
+	rcode = USB::initDevice(device, handle->configuration);
+	if (rcode < 0) return rcode;
+
+	USB::initEndPoint(&(device->bulk_in), handle->inputEndPointAddress);
+	device->bulk_in.attributes = USB_TRANSFER_TYPE_BULK;
+	device->bulk_in.maxPacketSize = ADB_USB_PACKETSIZE;
+
+	// The phone reads in blocks, a write has to end with a short packet for it to come through.
+	USB::initEndPoint(&(device->bulk_out), handle->outputEndPointAddress);
+	device->bulk_out.attributes = USB_TRANSFER_TYPE_BULK;
+	device->bulk_out.maxPacketSize = ADB_USB_PACKETSIZE;
+	device->bulk_out.zeroLengthPacket = true;
+
+	aoa->usb = device;
+	aoa->handler(aoa, ADB_CONNECTION_OPEN, 0, NULL);
+
+	return 0;
+}
+
+/**
+ * Sets up the Android Open Accessory transport. Phones that are plugged in from then on are asked to switch to
+ * accessory mode, and once a phone has switched, the application talks to the accessory app on the phone over the
+ * raw bulk endpoints: no message headers, no checksums and no OKAY round trips, and the phone doesn't need USB
+ * debugging. Phones that don't speak the protocol, and those plugged in while a phone is the accessory, are used
+ * through ADB as usual. There is one accessory.
+ *
+ * The phone picks the app for the accessory by manufacturer, model and version, and offers the URI to download it
+ * if there is none. The strings are sent as they are when a phone is plugged in, and must stay valid.
+ *
+ * @param accessory accessory record.
+ * @param manufacturer manufacturer name.
+ * @param model model name.
+ * @param description description, or NULL.
+ * @param version version, or NULL.
+ * @param uri URI, or NULL.
+ * @param serial serial number, or NULL.
+ * @param handler function to be called when the accessory opens, receives data and closes.
+ */
+void ADB::initAccessory(Accessory * accessory, const char * manufacturer, const char * model, const char * description,
+		const char * version, const char * uri, const char * serial, adb_accessoryHandler * handler)
+{
+	accessory->strings[0] = manufacturer;
+	accessory->strings[1] = model;
+	accessory->strings[2] = description;
+	accessory->strings[3] = version;
+	accessory->strings[4] = uri;
+	accessory->strings[5] = serial;
+	accessory->handler = handler;
+	accessory->usb = NULL;
+
+	aoa = accessory;
+}
+
+/**
+ * @param accessory accessory record.
+ * @return true iff a phone in accessory mode is attached.
+ */
+boolean ADB::isAccessoryOpen(Accessory * accessory)
+{
+	return accessory->usb != NULL;
+}
+
+/**
+ * Reads what the accessory app has sent, up to ADB_AOA_READS packets, and hands it to the application.
+ */
+void ADB::serviceAccessory()
+{
+	uint8_t buf[ADB_USB_PACKETSIZE];
+	uint8_t i;
+	int n;
+
+	for (i = 0; i < ADB_AOA_READS && ADB::hasBudget(); i++)
+	{
+		n = USB::bulkRead(aoa->usb, sizeof(buf), buf, true);
+		if (n <= 0) break;
+
+#if ADB_HAS(ADB_FEATURE_IDLE)
+		ADB::noteReceive();
+#endif
+		aoa->handler(aoa, ADB_CONNECTION_RECEIVE, n, buf);
+
+		// Nothing more until the app writes again.
+		if (n < (int)sizeof(buf)) break;
+	}
+}
+
+/**
+ * Writes a set of bytes to the accessory app. The write runs to completion.
+ *
+ * @param accessory accessory record.
+ * @param length number of bytes to transmit.
+ * @param data data to send.
+ * @return 0 on success, -1 if there is no accessory, or -2 if the transfer failed.
+ */
+int ADB::writeAccessory(Accessory * accessory, uint16_t length, uint8_t * data)
+{
+	usb_segment segment;
+
+	segment.data = data;
+	segment.length = length;
+	segment.progmem = false;
+
+	return ADB::writevAccessory(accessory, 1, &segment);
+}
+
+/**
+ * Writes data gathered from a list of segments to the accessory app, see ADB::writeAccessory. Segments may reside
+ * in program memory.
+ *
+ * @param accessory accessory record.
+ * @param count number of segments.
+ * @param segments payload segments.
+ * @return 0 on success, -1 if there is no accessory, or -2 if the transfer failed.
+ */
+int ADB::writevAccessory(Accessory * accessory, uint8_t count, usb_segment * segments)
+{
+	if (accessory->usb == NULL) return -1;
+
+#if ADB_HAS(ADB_FEATURE_IDLE)
+	lastActivity = micros();
+#endif
+	return USB::bulkWritev(accessory->usb, count, segments) == 0 ? 0 : -2;
+}
+#endif
+
+/**
+ * Write a set of bytes to an open ADB connection.
+ *
+ * If the connection has an outbound queue (see ADB::setWriteQueue), the data is queued and sent as soon as the
+ * connection is ready. In that case the return value is the number of bytes accepted, which is less than length
+ * when the queue is full.
+ *
+ * @param connection ADB connection to write the data to.
+ * @param length number of bytes to transmit.
+ * @param data data to send.
+ * @return number of transmitted bytes, or -1 on failure.
+ */
+int ADB::write(Connection * connection, uint16_t length, uint8_t * data)
+{
+	adb_device * device = ADB::getDevice(connection);
+#if ADB_HAS(ADB_FEATURE_WRITE_QUEUE)
+	usb_segment segment;
+#endif
+	int ret;
+
+	// First check if we have a working ADB connection
+	if (device->usb==NULL || !device->connected) return -1;
+
+#if ADB_HAS(ADB_FEATURE_WRITE_QUEUE)
+	if (connection->writeQueue != NULL)
+	{
+		segment.data = data;
+		segment.length = length;
+		segment.progmem = false;
+
+		return ADB::queueWrite(connection, 1, &segment, false);
+	}
+#endif
+
+	// Check if the connection is open for writing.
+	if (connection->status != ADB_OPEN) return -2;
+
+	// Write payload
+	ret = ADB::writeMessage(device, A_WRTE, connection->localID, connection->remoteID, length, data);
+	if (ret==0)
+		connection->status = ADB_WRITING;
+
+	return ret;
+}
+
+/**
+ * Write a string to an open ADB connection. The trailing zero is not transmitted.
+ *
+ * @param connection ADB connection to write the data to.
+ * @param length number of bytes to transmit.
+ * @param data data to send.
+ * @return number of transmitted bytes, or -1 on failure.
  */
 int ADB::writeString(Connection * connection, char * str)
 {
-	int ret;
+	adb_device * device = ADB::getDevice(connection);
+	int ret;
+
+#if ADB_HAS(ADB_FEATURE_WRITE_QUEUE)
+	// Queued connections take the string as plain data.
+	if (connection->writeQueue != NULL)
+		return ADB::write(connection, strlen(str), (uint8_t*)str);
+#endif
+
+	// First check if we have a working ADB connection
+	if (device->usb==NULL || !device->connected) return -1;
+
+	// Check if the connection is open for writing.
+	if (connection->status != ADB_OPEN) return -2;
+
+	// Write payload
+	ret = ADB::writeStringMessage(device, A_WRTE, connection->localID, connection->remoteID, str);
+	if (ret==0)
+		connection->status = ADB_WRITING;
+
+	return ret;
+}
+
+/**
+ * Write a set of bytes to this ADB connection.
+ *
+ * @param length number of bytes to transmit.
+ * @param data data to send.
+ * @return number of transmitted bytes, or -1 on failure.
+ */
+int Connection::write(uint16_t length, uint8_t * data)
+{
+	return ADB::write(this, length, data);
+}
+
+/**
+ * Write a string to this connection.
+ *
+ * @param length number of bytes to transmit.
+ * @param data data to send.
+ * @return number of transmitted bytes, or -1 on failure.
+ */
+int Connection::writeString(char * str)
+{
+	return ADB::writeString(this, str);
+}
+
+#if ADB_HAS(ADB_FEATURE_WRITE_QUEUE)
+/**
+ * Sets up an outbound queue for this connection, see ADB::setWriteQueue.
+ *
+ * @param buffer queue storage, must remain valid for the lifetime of the connection.
+ * @param size size of the buffer in bytes.
+ */
+void Connection::setWriteQueue(uint8_t * buffer, uint16_t size)
+{
+	ADB::setWriteQueue(this, buffer, size);
+}
+
+/**
+ * @return the number of bytes that can currently be written to the outbound queue without blocking.
+ */
+uint16_t Connection::getWriteQueueFree()
+{
+	return this->writeQueueSize - this->writeQueueLength;
+}
 
-	// First check if we have a working ADB connection
-	if (adbDevice==NULL || !connected) return -1;
+/**
+ * Enables or disables write coalescing on this connection, see ADB::setCoalescing.
+ *
+ * @param enable true to enable coalescing.
+ * @param size size threshold in bytes, or 0 to wait for a full message.
+ * @param age age threshold in milliseconds, or 0 to only flush on size or on request.
+ */
+void Connection::setCoalescing(boolean enable, uint16_t size, uint16_t age)
+{
+	ADB::setCoalescing(this, enable, size, age);
+}
 
-	// Check if the connection is open for writing.
-	if (connection->status != ADB_OPEN) return -2;
+/**
+ * Appends data to the write queue of this connection, see ADB::append.
+ *
+ * @param length number of bytes to append.
+ * @param data data to append.
+ * @return number of bytes accepted.
+ */
+uint16_t Connection::append(uint16_t length, uint8_t * data)
+{
+	return ADB::append(this, length, data);
+}
 
-	// Write payload
-	ret = ADB::writeStringMessage(adbDevice, A_WRTE, connection->localID, connection->remoteID, str);
-	if (ret==0)
-		connection->status = ADB_WRITING;
+/**
+ * Appends a string to the write queue of this connection. The trailing zero is not queued.
+ *
+ * @param str string to append.
+ * @return number of bytes accepted.
+ */
+uint16_t Connection::print(const char * str)
+{
+	return ADB::append(this, strlen(str), (uint8_t*)str);
+}
 
-	return ret;
+/**
+ * Sends all data queued on this connection, see ADB::flush.
+ *
+ * @return error code or 0 for success.
+ */
+int Connection::flush()
+{
+	return ADB::flush(this);
 }
+#endif
 
 /**
- * Write a set of bytes to this ADB connection.
+ * Write a message to this ADB connection, gathering the payload from a list of segments, see ADB::writev.
  *
- * @param length number of bytes to transmit.
- * @param data data to send.
- * @return number of transmitted bytes, or -1 on failure.
+ * @param count number of segments.
+ * @param segments payload segments.
+ * @return error code or 0 for success.
  */
-int Connection::write(uint16_t length, uint8_t * data)
+int Connection::writev(uint8_t count, usb_segment * segments)
 {
-	return ADB::write(this, length, data);
+	return ADB::writev(this, count, segments);
 }
 
+#if ADB_HAS(ADB_FEATURE_RECEIVE_BUFFER)
 /**
- * Write a string to this connection.
+ * Sets up an inbound ring buffer for this connection, see ADB::setReceiveBuffer.
  *
- * @param length number of bytes to transmit.
- * @param data data to send.
- * @return number of transmitted bytes, or -1 on failure.
+ * @param buffer buffer storage, must remain valid for the lifetime of the connection.
+ * @param size size of the buffer in bytes.
  */
-int Connection::writeString(char * str)
+void Connection::setReceiveBuffer(uint8_t * buffer, uint16_t size)
 {
-	return ADB::writeString(this, str);
+	ADB::setReceiveBuffer(this, buffer, size);
+}
+
+/**
+ * @return the number of received bytes waiting in the receive buffer.
+ */
+uint16_t Connection::available()
+{
+	return this->receiveLength;
+}
+
+/**
+ * Takes a single byte out of the receive buffer.
+ *
+ * @return the next received byte, or -1 if the receive buffer is empty.
+ */
+int Connection::read()
+{
+	return ADB::read(this);
+}
+
+/**
+ * Takes up to length bytes out of the receive buffer.
+ *
+ * @param length maximum number of bytes to read.
+ * @param data target buffer.
+ * @return number of bytes read.
+ */
+uint16_t Connection::read(uint16_t length, uint8_t * data)
+{
+	return ADB::read(this, length, data);
+}
+#endif
+
+#if ADB_HAS(ADB_FEATURE_FLOW_CONTROL)
+/**
+ * Sets up receive-side flow control for this connection, see ADB::setFlowControl.
+ *
+ * @param enable true to withhold OKAYs, false to acknowledge every message right away.
+ * @param window number of unconsumed bytes up to which messages are still acknowledged right away.
+ */
+void Connection::setFlowControl(boolean enable, uint16_t window)
+{
+	ADB::setFlowControl(this, enable, window);
+}
+
+/**
+ * Reports that the application is done with received data, see ADB::consume.
+ *
+ * @param length number of bytes consumed.
+ */
+void Connection::consume(uint16_t length)
+{
+	ADB::consume(this, length);
+}
+#endif
+
+#if ADB_HAS(ADB_FEATURE_HUB)
+/**
+ * Binds this connection to one of the ADB devices behind the hub, see ADB::setDevice.
+ *
+ * @param device device number.
+ */
+void Connection::setDevice(uint8_t device)
+{
+	ADB::setDevice(this, device);
 }
+#endif
 
 /**
  * Checks if the connection is open for writing.
@@ -728,3 +4154,328 @@ bool Connection::isOpen()
 	return this->status == ADB_OPEN;
 }
 
+
+#if ADB_HAS(ADB_FEATURE_STATE)
+/**
+ * Sets up this state channel on top of a connection, see ADB::initStateChannel.
+ *
+ * @param connection ADB connection to run the channel on.
+ * @param values table of count values, indexed by key.
+ * @param count number of keys, at most ADB_STATE_MAX_KEYS.
+ * @param period minimum time between updates in milliseconds, or 0 to send changes right away.
+ */
+void StateChannel::init(Connection * connection, uint16_t * values, uint8_t count, uint16_t period)
+{
+	ADB::initStateChannel(this, connection, values, count, period);
+}
+
+/**
+ * Sets the local value of a key, see ADB::setState.
+ *
+ * @param key key.
+ * @param value new value.
+ */
+void StateChannel::set(uint8_t key, uint16_t value)
+{
+	ADB::setState(this, key, value);
+}
+
+/**
+ * @param key key.
+ * @return the latest value of a key, see ADB::getState.
+ */
+uint16_t StateChannel::get(uint8_t key)
+{
+	return ADB::getState(this, key);
+}
+
+/**
+ * @return bit mask of the keys received since the last call, see ADB::getStateChanges.
+ */
+uint32_t StateChannel::getChanges()
+{
+	return ADB::getStateChanges(this);
+}
+
+/**
+ * Handles an event of the connection of this channel, see ADB::handleStateEvent.
+ *
+ * @param event event type.
+ * @param length payload length.
+ * @param data payload data, or NULL if it is in the receive buffer.
+ */
+void StateChannel::handleEvent(adb_eventType event, uint16_t length, uint8_t * data)
+{
+	ADB::handleStateEvent(this, event, length, data);
+}
+
+/**
+ * Sends the keys that changed since the last update, see ADB::flushState.
+ *
+ * @return number of keys sent, or error code.
+ */
+int StateChannel::flush()
+{
+	return ADB::flushState(this);
+}
+#endif
+
+#if ADB_HAS(ADB_FEATURE_FRAMING)
+/**
+ * Sets up this framer on top of a connection, see ADB::initFramer.
+ *
+ * @param connection ADB connection to run the framing on.
+ * @param buffer buffer for frames that are split, or NULL.
+ * @param size size of the buffer in bytes.
+ * @param handler function to be called for every frame received.
+ */
+void Framer::init(Connection * connection, uint8_t * buffer, uint16_t size, adb_frameHandler * handler)
+{
+	ADB::initFramer(this, connection, buffer, size, handler);
+}
+
+/**
+ * Parses received data into frames, see ADB::parseFrames.
+ *
+ * @param length number of bytes.
+ * @param data received bytes.
+ */
+void Framer::parse(uint16_t length, uint8_t * data)
+{
+	ADB::parseFrames(this, length, data);
+}
+
+/**
+ * Handles an event of the connection of this framer, see ADB::handleFrameEvent.
+ *
+ * @param event event type.
+ * @param length payload length.
+ * @param data payload data, or NULL if it is in the receive buffer.
+ */
+void Framer::handleEvent(adb_eventType event, uint16_t length, uint8_t * data)
+{
+	ADB::handleFrameEvent(this, event, length, data);
+}
+
+/**
+ * Writes a frame, see ADB::writeFrame.
+ *
+ * @param type frame type.
+ * @param length payload length.
+ * @param data payload.
+ * @return 0 for success, or error code.
+ */
+int Framer::write(uint8_t type, uint16_t length, uint8_t * data)
+{
+	return ADB::writeFrame(this, type, length, data);
+}
+#endif
+
+#if ADB_HAS(ADB_FEATURE_SYNC)
+/**
+ * Sets up this sync client on top of a connection to the "sync:" service, see ADB::initSync.
+ *
+ * @param connection ADB connection to the "sync:" service.
+ * @param buffer buffer for file data and error messages.
+ * @param size size of the buffer in bytes.
+ * @param handler function to be called when a transfer is done.
+ * @return 0 for success, or -1 if the buffer is too small.
+ */
+int SyncClient::init(Connection * connection, uint8_t * buffer, uint16_t size, adb_syncHandler * handler)
+{
+	return ADB::initSync(this, connection, buffer, size, handler);
+}
+
+/**
+ * @return true iff the client is ready for a new transfer. A client without a usable buffer (see ADB::initSync)
+ * never is.
+ */
+boolean SyncClient::isIdle()
+{
+	return ADB::isSyncIdle(this);
+}
+
+/**
+ * Starts pushing a file to the device, see ADB::syncSend.
+ *
+ * @param path path of the file on the device.
+ * @param mode permission bits of the file, for example 0644.
+ * @param mtime modification time of the file in seconds since the epoch.
+ * @param reader function that reads the next chunk of the file.
+ * @return 0 for success, or error code.
+ */
+int SyncClient::send(const char * path, uint16_t mode, uint32_t mtime, adb_syncReader * reader)
+{
+	return ADB::syncSend(this, path, mode, mtime, reader);
+}
+
+/**
+ * Starts pulling a file from the device, see ADB::syncReceive.
+ *
+ * @param path path of the file on the device.
+ * @param writer function that takes the next piece of the file.
+ * @return 0 for success, or error code.
+ */
+int SyncClient::receive(const char * path, adb_syncWriter * writer)
+{
+	return ADB::syncReceive(this, path, writer);
+}
+
+/**
+ * Sends the next chunk of a push, see ADB::pollSync.
+ *
+ * @return number of file bytes sent, or error code.
+ */
+int SyncClient::poll()
+{
+	return ADB::pollSync(this);
+}
+
+/**
+ * Handles an event of the connection of this client, see ADB::handleSyncEvent.
+ *
+ * @param event event type.
+ * @param length payload length.
+ * @param data payload data, or NULL if it is in the receive buffer.
+ */
+void SyncClient::handleEvent(adb_eventType event, uint16_t length, uint8_t * data)
+{
+	ADB::handleSyncEvent(this, event, length, data);
+}
+#endif
+
+#if ADB_HAS(ADB_FEATURE_SHELL)
+/**
+ * Sets up this shell session on top of a connection to the "shell:" service, see ADB::initShell.
+ *
+ * @param connection ADB connection to the "shell:" service.
+ */
+void ShellSession::init(Connection * connection)
+{
+	ADB::initShell(this, connection);
+}
+
+/**
+ * @return number of commands sent that have not finished yet.
+ */
+uint8_t ShellSession::getPending()
+{
+	return ADB::getShellPending(this);
+}
+
+/**
+ * Sends a command to the shell, see ADB::shellCommand.
+ *
+ * @param command command line, without the trailing newline.
+ * @param handler function to be called with the output and exit code.
+ * @return ID of the command, or error code.
+ */
+int ShellSession::run(const char * command, adb_shellHandler * handler)
+{
+	return ADB::shellCommand(this, command, handler);
+}
+
+/**
+ * Handles an event of the connection of this session, see ADB::handleShellEvent.
+ *
+ * @param event event type.
+ * @param length payload length.
+ * @param data payload data, or NULL if it is in the receive buffer.
+ */
+void ShellSession::handleEvent(adb_eventType event, uint16_t length, uint8_t * data)
+{
+	ADB::handleShellEvent(this, event, length, data);
+}
+#endif
+
+#if ADB_HAS(ADB_FEATURE_LOGCAT)
+/**
+ * Sets up this logcat client, see ADB::initLogcat.
+ *
+ * @param buffer line or entry buffer.
+ * @param size size of the buffer in bytes.
+ * @param lineHandler function to be called for every line of text, or NULL.
+ * @param entryHandler function to be called for every binary entry, or NULL to receive text.
+ * @return 0 for success, or -1 if the buffer is too small.
+ */
+int LogcatClient::init(uint8_t * buffer, uint16_t size, adb_logcatLineHandler * lineHandler, adb_logcatEntryHandler * entryHandler)
+{
+	return ADB::initLogcat(this, buffer, size, lineHandler, entryHandler);
+}
+
+/**
+ * Adds the connection of this logcat client, see ADB::addLogcat.
+ *
+ * @param filters filter specs, or NULL for the whole log.
+ * @param reconnect true for automatic reconnect (persistent connections).
+ * @param handler event handler of the connection, which passes the events on to handleEvent.
+ * @return the connection, or NULL on failure.
+ */
+Connection * LogcatClient::connect(const char * filters, boolean reconnect, adb_eventHandler * handler)
+{
+	return ADB::addLogcat(this, filters, reconnect, handler);
+}
+
+/**
+ * Handles an event of the connection of this client, see ADB::handleLogcatEvent.
+ *
+ * @param event event type.
+ * @param length payload length.
+ * @param data payload data, or NULL if it is in the receive buffer.
+ */
+void LogcatClient::handleEvent(adb_eventType event, uint16_t length, uint8_t * data)
+{
+	ADB::handleLogcatEvent(this, event, length, data);
+}
+#endif
+
+#if ADB_HAS(ADB_FEATURE_ACCESSORY)
+/**
+ * Sets up this accessory, see ADB::initAccessory.
+ *
+ * @param manufacturer manufacturer name.
+ * @param model model name.
+ * @param description description, or NULL.
+ * @param version version, or NULL.
+ * @param uri URI, or NULL.
+ * @param serial serial number, or NULL.
+ * @param handler function to be called when the accessory opens, receives data and closes.
+ */
+void Accessory::init(const char * manufacturer, const char * model, const char * description, const char * version,
+		const char * uri, const char * serial, adb_accessoryHandler * handler)
+{
+	ADB::initAccessory(this, manufacturer, model, description, version, uri, serial, handler);
+}
+
+/**
+ * @return true iff a phone in accessory mode is attached.
+ */
+boolean Accessory::isOpen()
+{
+	return ADB::isAccessoryOpen(this);
+}
+
+/**
+ * Writes a set of bytes to the accessory app, see ADB::writeAccessory.
+ *
+ * @param length number of bytes to transmit.
+ * @param data data to send.
+ * @return 0 on success, or a negative error code.
+ */
+int Accessory::write(uint16_t length, uint8_t * data)
+{
+	return ADB::writeAccessory(this, length, data);
+}
+
+/**
+ * Writes data gathered from a list of segments to the accessory app, see ADB::writevAccessory.
+ *
+ * @param count number of segments.
+ * @param segments payload segments.
+ * @return 0 on success, or a negative error code.
+ */
+int Accessory::writev(uint8_t count, usb_segment * segments)
+{
+	return ADB::writevAccessory(this, count, segments);
+}
+#endif
@@ -18,12 +18,13 @@
 #define __adb_h__
 
 #include "wiring.h"
+#include <AdbConfig.h>
 #include <usb.h>
 #include <ch9.h>
 
 typedef void(usb_eventHandler)(usb_device * device, usb_eventType event);
 
-#define MAX_PAYLOAD 4096;
+#define MAX_PAYLOAD 4096
 
 #define A_SYNC 0x434e5953
 #define A_CNXN 0x4e584e43
@@ -32,12 +33,41 @@ typedef void(usb_eventHandler)(usb_device * device, usb_eventType event);
 #define A_CLSE 0x45534c43
 #define A_WRTE 0x45545257
 
+// Protocol versions. Devices that speak A_VERSION_SKIP_CHECKSUM or later neither send nor verify payload checksums.
+#define A_VERSION 0x01000000
+#define A_VERSION_SKIP_CHECKSUM 0x01000001
+
 #define ADB_CLASS 0xff
 #define ADB_SUBCLASS 0x42
 #define ADB_PROTOCOL 0x1
 
 #define ADB_USB_PACKETSIZE 0x40
+
+#if ADB_HAS(ADB_FEATURE_ACCESSORY)
+// Android Open Accessory: vendor requests, the IDs of a phone in accessory mode (0x2D00 up to 0x2D05, with or
+// without ADB and audio), and its accessory interface.
+#define ADB_AOA_GET_PROTOCOL 51
+#define ADB_AOA_SEND_STRING 52
+#define ADB_AOA_START 53
+#define ADB_AOA_VENDOR_ID 0x18d1
+#define ADB_AOA_PRODUCT_ID 0x2d00
+#define ADB_AOA_PRODUCT_LAST 0x2d05
+#define ADB_AOA_CLASS 0xff
+#define ADB_AOA_SUBCLASS 0xff
+#define ADB_AOA_PROTOCOL 0x0
+
+// Number of identification strings: manufacturer, model, description, version, URI and serial number.
+#define ADB_AOA_STRINGS 6
+#endif
+
+// Delay between CNXN attempts while waiting for the device, and the initial and maximum delay between OPEN attempts
+// of a persistent connection (in milliseconds). The OPEN delay doubles after every failed attempt.
+#define ADB_CONNECT_RETRY_TIME 500
 #define ADB_CONNECTION_RETRY_TIME 1000
+#define ADB_CONNECTION_RETRY_MAX 32000
+
+// Time the device has to answer an OPEN (in milliseconds), after which the connection fails.
+#define ADB_OPEN_TIMEOUT 5000
 
 typedef struct
 {
@@ -46,8 +76,34 @@ typedef struct
 	uint8_t interface;
 	uint8_t inputEndPointAddress;
 	uint8_t outputEndPointAddress;
+
+	// Total length of the configuration descriptor, see adb_profile.
+	uint16_t totalLength;
 } adb_usbConfiguration;
 
+/**
+ * Cached ADB interface layout of a device, see ADB_FEATURE_PROFILE_CACHE. A device is recognised by its vendor and
+ * product ID and release number, and the total length of its configuration descriptor. A phone keeps its IDs when
+ * it changes its USB composition (when USB debugging is switched on or off, say), but that length changes with
+ * the interfaces. An entry with configuration 0 is free.
+ */
+typedef struct
+{
+	uint16_t vendorId;
+	uint16_t productId;
+	uint16_t releaseNumber;
+	uint8_t configuration;
+	uint8_t interface;
+	uint8_t inputEndPointAddress;
+	uint8_t outputEndPointAddress;
+
+	// First supported language, which spares the string descriptor request of USB::initDevice.
+	uint16_t language;
+
+	// Total length of the first configuration descriptor.
+	uint16_t totalLength;
+} adb_profile;
+
 typedef struct
 {
 	// Command identifier constant
@@ -80,6 +136,44 @@ typedef enum
 	ADB_WRITING
 } ConnectionStatus;
 
+#if ADB_HAS(ADB_FEATURE_STATS)
+/**
+ * Statistics block, see ADB::getStats. A snapshot streamed with ADB::writeStats is this struct as laid out in
+ * memory: little endian and without padding, so a host can parse it given the two sizes at the start.
+ */
+typedef struct
+{
+	// Number of histogram buckets and connections in this block, ADB_STATS_BUCKETS and ADB_MAX_CONNECTIONS.
+	uint8_t buckets;
+	uint8_t connections;
+
+	// Counters of the bulk endpoints of the ADB device.
+	usb_endpointStats in, out;
+
+	// Payload bytes received and sent, per connection (indexed by local ID - 1).
+	uint32_t bytesIn[ADB_MAX_CONNECTIONS];
+	uint32_t bytesOut[ADB_MAX_CONNECTIONS];
+
+	// Histograms of the time from sending a WRTE to receiving its OKAY, and of the time spent in ADB::poll. See
+	// ADB_STATS_BUCKETS for the bucket boundaries. Counts saturate at 0xffff.
+	uint16_t okayLatency[ADB_STATS_BUCKETS];
+	uint16_t pollDuration[ADB_STATS_BUCKETS];
+
+	// Longest poll, in microseconds.
+	uint32_t pollMax;
+
+	// Histogram of how long ADB::run slept each time, from going to sleep until the wake-up, and the total time
+	// asleep in microseconds. Only counted with ADB_FEATURE_IDLE.
+	uint16_t sleepDuration[ADB_STATS_BUCKETS];
+	uint32_t sleepTime;
+
+	// Histogram of the time from a wake-up in ADB::run to the first ADB message or accessory packet received before
+	// it sleeps again, in microseconds. Only counted with ADB_FEATURE_IDLE.
+	uint16_t wakeLatency[ADB_STATS_BUCKETS];
+
+} adb_stats;
+#endif
+
 typedef enum
 {
 	ADB_CONNECT = 0,
@@ -87,60 +181,605 @@ typedef enum
 	ADB_CONNECTION_OPEN,
 	ADB_CONNECTION_CLOSE,
 	ADB_CONNECTION_FAILED,
-	ADB_CONNECTION_RECEIVE
+	ADB_CONNECTION_RECEIVE,
+	ADB_CONNECTION_THROTTLE,
+	ADB_CONNECTION_RESUME,
+	// All connections opened when the device connected have been answered, with an OKAY or a CLSE.
+	ADB_READY
 } adb_eventType;
 
 class Connection;
+class __FlashStringHelper;
 
 // Event handler
 typedef void(adb_eventHandler)(Connection * connection, adb_eventType event, uint16_t length, uint8_t * data);
 
+// Parser of the data received by a client built on top of a connection, like a state channel or a framer.
+typedef void(adb_receiver)(void * client, uint16_t length, uint8_t * data);
+
 class Connection
 {
 private:
 public:
-	char * connectionString;
-	uint32_t localID, remoteID;
-	uint32_t lastConnectionAttempt;
+#if ADB_CONNECTIONSTRING_LENGTH > 0
+	char connectionString[ADB_CONNECTIONSTRING_LENGTH];
+#endif
+	// Connection string in program memory, see ADB::addConnection(const __FlashStringHelper *, ...), or NULL if it
+	// is in connectionString.
+	const char * progmemString;
+	uint32_t remoteID;
+	uint32_t retryDeadline;
 	uint16_t dataSize, dataRead;
-	ConnectionStatus status;
-	boolean reconnect;
+	uint8_t localID;
+
+	// Packed to save SRAM: the connection status, the exponent of the OPEN retry back-off, and the flags of the
+	// write queue (see ADB::setCoalescing) and the receive window (see ADB::setFlowControl).
+	ConnectionStatus status : 3;
+	unsigned int retryCount : 4;
+	unsigned int reconnect : 1;
+#if ADB_HAS(ADB_FEATURE_WRITE_QUEUE)
+	unsigned int coalesce : 1;
+	unsigned int flushRequested : 1;
+#endif
+#if ADB_HAS(ADB_FEATURE_FLOW_CONTROL)
+	unsigned int flowControl : 1;
+	unsigned int okayPending : 1;
+#endif
+
 	adb_eventHandler * eventHandler;
-	Connection * next;
+
+#if ADB_HAS(ADB_FEATURE_HUB)
+	// Index of the ADB device the connection is bound to, see ADB::setDevice.
+	uint8_t device;
+#endif
+
+#if ADB_HAS(ADB_FEATURE_WRITE_QUEUE)
+	// Optional outbound queue, see ADB::setWriteQueue.
+	uint8_t * writeQueue;
+	uint16_t writeQueueSize, writeQueueHead, writeQueueLength;
+
+	// Write coalescing policy, see ADB::setCoalescing.
+	uint16_t coalesceSize, coalesceAge;
+	uint32_t queueTime;
+#endif
+
+#if ADB_HAS(ADB_FEATURE_RECEIVE_BUFFER)
+	// Optional inbound ring buffer, see ADB::setReceiveBuffer.
+	uint8_t * receiveBuffer;
+	uint16_t receiveBufferSize, receiveHead, receiveLength;
+#endif
+
+#if ADB_HAS(ADB_FEATURE_FLOW_CONTROL)
+	// Receive window, see ADB::setFlowControl, and the number of bytes received but not consumed yet. The okayPending
+	// flag tells whether the OKAY for the last WRTE is being withheld.
+	uint16_t window;
+	uint32_t unconsumed;
+#endif
 
 	int write(uint16_t length, uint8_t * data);
 	int writeString(char * str);
+	int writev(uint8_t count, usb_segment * segments);
 	bool isOpen();
+
+#if ADB_HAS(ADB_FEATURE_WRITE_QUEUE)
+	void setWriteQueue(uint8_t * buffer, uint16_t size);
+	uint16_t getWriteQueueFree();
+
+	void setCoalescing(boolean enable, uint16_t size, uint16_t age);
+	uint16_t append(uint16_t length, uint8_t * data);
+	uint16_t print(const char * str);
+	int flush();
+#endif
+
+#if ADB_HAS(ADB_FEATURE_RECEIVE_BUFFER)
+	void setReceiveBuffer(uint8_t * buffer, uint16_t size);
+	uint16_t available();
+	int read();
+	uint16_t read(uint16_t length, uint8_t * data);
+#endif
+
+#if ADB_HAS(ADB_FEATURE_FLOW_CONTROL)
+	void setFlowControl(boolean enable, uint16_t window);
+	void consume(uint16_t length);
+#endif
+
+#if ADB_HAS(ADB_FEATURE_HUB)
+	void setDevice(uint8_t device);
+#endif
+};
+
+#if ADB_HAS(ADB_FEATURE_STATE)
+// Maximum number of keys of a state channel, and the size of a record on the wire: the key and a 16-bit little
+// endian value.
+#define ADB_STATE_MAX_KEYS 32
+#define ADB_STATE_RECORD_SIZE 3
+
+/**
+ * Latest-value state channel on top of a connection, see ADB::initStateChannel. Both ends keep a table of 16-bit
+ * values indexed by key, and only the newest value of each key is ever sent.
+ */
+class StateChannel
+{
+public:
+	Connection * connection;
+
+	// Value table of the application, and its number of keys (at most ADB_STATE_MAX_KEYS).
+	uint16_t * values;
+	uint8_t count;
+
+	// Keys set locally, keys set locally but not sent yet, and keys received since the last getChanges.
+	uint32_t local, dirty, changed;
+
+	// Minimum time between updates in milliseconds (0 sends every change right away), and the time of the next.
+	uint16_t period;
+	uint32_t deadline;
+
+	// Start of a record whose remainder is still to come.
+	uint8_t partial[ADB_STATE_RECORD_SIZE - 1];
+	uint8_t partialLength;
+
+	void init(Connection * connection, uint16_t * values, uint8_t count, uint16_t period);
+	void set(uint8_t key, uint16_t value);
+	uint16_t get(uint8_t key);
+	uint32_t getChanges();
+	void handleEvent(adb_eventType event, uint16_t length, uint8_t * data);
+	int flush();
+};
+#endif
+
+#if ADB_HAS(ADB_FEATURE_FRAMING)
+// Size of a frame header: the frame type and the 16-bit little endian payload length.
+#define ADB_FRAME_HEADER_SIZE 3
+
+class Framer;
+
+// Frame handler, see ADB::initFramer. The data is only valid during the call.
+typedef void(adb_frameHandler)(Framer * framer, uint8_t type, uint16_t length, uint8_t * data);
+
+/**
+ * Message framing on top of a connection, see ADB::initFramer.
+ */
+class Framer
+{
+public:
+	Connection * connection;
+	adb_frameHandler * handler;
+
+	// Buffer for frames that arrive split, see ADB::initFramer.
+	uint8_t * buffer;
+	uint16_t bufferSize;
+
+	// Header of the frame being received and how much of it is in, and the payload length and how much of that
+	// is in. Only a frame that is split across calls to ADB::parseFrames is received into the buffer.
+	uint8_t header[ADB_FRAME_HEADER_SIZE];
+	uint8_t headerLength;
+	uint16_t length, received;
+
+	// Number of split frames dropped because they were longer than the buffer.
+	uint16_t dropped;
+
+	void init(Connection * connection, uint8_t * buffer, uint16_t size, adb_frameHandler * handler);
+	void parse(uint16_t length, uint8_t * data);
+	void handleEvent(adb_eventType event, uint16_t length, uint8_t * data);
+	int write(uint8_t type, uint16_t length, uint8_t * data);
 };
+#endif
+
+#if ADB_HAS(ADB_FEATURE_SYNC)
+// Smallest buffer a sync client takes, see ADB::initSync: the size of a DATA header plus one byte.
+#define ADB_SYNC_MIN_BUFFER 9
+
+typedef enum
+{
+	ADB_SYNC_IDLE = 0,
+	ADB_SYNC_SENDING,
+	ADB_SYNC_WAITING,
+	ADB_SYNC_RECEIVING
+} adb_syncState;
+
+class SyncClient;
+
+// Callbacks of a sync client, see ADB::syncSend, ADB::syncReceive and ADB::initSync. The reader fills the buffer with
+// up to length bytes of the file being pushed and returns the number of bytes, 0 at the end of the file.
+typedef uint16_t(adb_syncReader)(SyncClient * sync, uint16_t length, uint8_t * data);
+typedef void(adb_syncWriter)(SyncClient * sync, uint16_t length, uint8_t * data);
+typedef void(adb_syncHandler)(SyncClient * sync, int result, const char * message);
+
+/**
+ * Client of the file sync service, see ADB::initSync.
+ */
+class SyncClient
+{
+public:
+	Connection * connection;
+	adb_syncHandler * handler;
+	adb_syncReader * reader;
+	adb_syncWriter * writer;
+
+	// Buffer for file data and error messages.
+	uint8_t * buffer;
+	uint16_t bufferSize;
+
+	// An adb_syncState, the modification time of the file being pushed, and the number of file bytes transferred.
+	uint8_t state;
+	uint32_t mtime;
+	uint32_t size;
+
+	// Header of the response being received and how much of it is in, and the response length and how much of
+	// its data is in.
+	uint8_t header[8];
+	uint8_t headerLength;
+	uint32_t length, received;
+
+	int init(Connection * connection, uint8_t * buffer, uint16_t size, adb_syncHandler * handler);
+	boolean isIdle();
+	int send(const char * path, uint16_t mode, uint32_t mtime, adb_syncReader * reader);
+	int receive(const char * path, adb_syncWriter * writer);
+	int poll();
+	void handleEvent(adb_eventType event, uint16_t length, uint8_t * data);
+};
+#endif
+
+#if ADB_HAS(ADB_FEATURE_SHELL)
+typedef enum
+{
+	ADB_SHELL_SKIPPING = 0,
+	ADB_SHELL_START_ID,
+	ADB_SHELL_OUTPUT,
+	ADB_SHELL_END_ID,
+	ADB_SHELL_EXIT_CODE
+} adb_shellState;
+
+class ShellSession;
+
+// Command handler, see ADB::shellCommand. Called with pieces of output, and at the end with a NULL data pointer
+// and the exit code.
+typedef void(adb_shellHandler)(ShellSession * session, uint16_t length, uint8_t * data, int exitCode);
+
+/**
+ * Persistent shell that runs pipelined commands, see ADB::initShell.
+ */
+class ShellSession
+{
+public:
+	Connection * connection;
+
+	// Handlers of the commands sent and not finished yet, oldest first, in a ring. Commands are numbered
+	// modulo 256, the oldest pending one is nextId - count.
+	adb_shellHandler * handlers[ADB_SHELL_QUEUE_SIZE];
+	uint8_t head, count;
+	uint8_t nextId;
+
+	// An adb_shellState, and the number in the marker being parsed.
+	uint8_t state;
+	uint16_t number;
+
+	// Whether the shell has been set up since the connection opened, and whether a write of a command failed
+	// halfway, which leaves the shell with part of a line until the connection reopens.
+	boolean ready, broken;
+
+	void init(Connection * connection);
+	uint8_t getPending();
+	int run(const char * command, adb_shellHandler * handler);
+	void handleEvent(adb_eventType event, uint16_t length, uint8_t * data);
+};
+#endif
+
+#if ADB_HAS(ADB_FEATURE_LOGCAT)
+// Size of the header of a binary log entry in the original format: payload length, header size, pid, tid, seconds
+// and nanoseconds.
+#define ADB_LOGCAT_HEADER_SIZE 20
+
+// Smallest buffer a logcat client takes, see ADB::initLogcat: one byte of a line or payload plus the terminating zero.
+#define ADB_LOGCAT_MIN_BUFFER 2
+
+/**
+ * Binary log entry, see ADB::initLogcat. The strings are only valid during the call of the entry handler.
+ */
+typedef struct
+{
+	// Android log priority, from 2 (verbose) up to 7 (fatal).
+	uint8_t priority;
+	const char * tag;
+	const char * message;
+	int32_t pid, tid;
+	uint32_t sec, nsec;
+} adb_logEntry;
+
+class LogcatClient;
+
+// Line handler, see ADB::initLogcat. The line is zero terminated, without the line end, and only valid during the call.
+typedef void(adb_logcatLineHandler)(LogcatClient * logcat, uint16_t length, char * line);
+
+// Entry handler, see ADB::initLogcat.
+typedef void(adb_logcatEntryHandler)(LogcatClient * logcat, adb_logEntry * entry);
+
+/**
+ * Logcat client, see ADB::initLogcat.
+ */
+class LogcatClient
+{
+public:
+	Connection * connection;
+	adb_logcatLineHandler * lineHandler;
+	adb_logcatEntryHandler * entryHandler;
+
+	// Line or entry payload, and the number of bytes of it received so far.
+	uint8_t * buffer;
+	uint16_t bufferSize;
+	uint16_t position;
+
+	// Whether the current line is too long for the buffer, and the number of lines and entries cut short so far.
+	boolean overflow;
+	uint16_t truncated;
+
+	// Header of the current binary entry, the number of header bytes received and the size of the header.
+	uint8_t header[ADB_LOGCAT_HEADER_SIZE];
+	uint16_t headerLength, headerSize;
+
+	int init(uint8_t * buffer, uint16_t size, adb_logcatLineHandler * lineHandler, adb_logcatEntryHandler * entryHandler);
+	Connection * connect(const char * filters, boolean reconnect, adb_eventHandler * handler);
+	void handleEvent(adb_eventType event, uint16_t length, uint8_t * data);
+};
+#endif
+
+#if ADB_HAS(ADB_FEATURE_ACCESSORY)
+class Accessory;
+
+// Accessory event handler, see ADB::initAccessory. Gets ADB_CONNECTION_OPEN, ADB_CONNECTION_RECEIVE and
+// ADB_CONNECTION_CLOSE, like the handler of a connection. Received data is only valid during the call.
+typedef void(adb_accessoryHandler)(Accessory * accessory, adb_eventType event, uint16_t length, uint8_t * data);
+
+/**
+ * Android Open Accessory transport, see ADB::initAccessory.
+ */
+class Accessory
+{
+public:
+	// Identification sent to the phone, see ADB_AOA_STRINGS. Entries may be NULL.
+	const char * strings[ADB_AOA_STRINGS];
+
+	adb_accessoryHandler * handler;
+
+	// Phone in accessory mode, or NULL.
+	usb_device * usb;
+
+	void init(const char * manufacturer, const char * model, const char * description, const char * version,
+			const char * uri, const char * serial, adb_accessoryHandler * handler);
+	boolean isOpen();
+	int write(uint16_t length, uint8_t * data);
+	int writev(uint8_t count, usb_segment * segments);
+};
+#endif
+
+/**
+ * ADB device. There is one record per Android device that can be served at the same time, see ADB_MAX_DEVICES.
+ */
+typedef struct
+{
+	// USB device, or NULL if the record is free.
+	usb_device * usb;
+
+	// Whether the device has answered our CNXN, and the time of the next CNXN attempt while it has not.
+	boolean connected;
+	uint32_t connectDeadline;
+
+	// Connections opened when the device connected that have not been answered yet, a bit per local ID - 1. See
+	// ADB_READY.
+	uint32_t opening;
+
+	// Protocol version and maximum message payload size announced by the device in its CNXN message.
+	uint32_t remoteVersion;
+	uint32_t remoteMaxData;
+
+	// A WRTE to this device that ran out of time halfway, and the payload length it was started with. Nothing else
+	// can be sent to the device before its remainder.
+	Connection * sending;
+#if ADB_HAS(ADB_FEATURE_WRITE_QUEUE)
+	uint16_t sendingLength;
+#endif
+
+	// Set when the header of the message being sent is out, but (part of) its payload is not.
+	boolean headerSent;
+
+	// Number of incoming messages handled per turn, see ADB::setDeviceWeight.
+	uint8_t weight;
+
+} adb_device;
 
 class ADB
 {
 
 private:
 	static void fireEvent(Connection * connection, adb_eventType type, uint16_t length, uint8_t * data);
-	static int writeEmptyMessage(usb_device * device, uint32_t command, uint32_t arg0, uint32_t arg1);
-	static int writeMessage(usb_device * device, uint32_t command, uint32_t arg0, uint32_t arg1, uint32_t length, uint8_t * data);
-	static int writeStringMessage(usb_device * device, uint32_t command, uint32_t arg0, uint32_t arg1, char * str);
-	static boolean pollMessage(adb_message * message, boolean poll);
-	static void openClosedConnections();
+	static Connection * getConnection(uint32_t localID);
+	static adb_device * getDevice(Connection * connection);
+	static int writeEmptyMessage(adb_device * device, uint32_t command, uint32_t arg0, uint32_t arg1);
+	static int writeMessage(adb_device * device, uint32_t command, uint32_t arg0, uint32_t arg1, uint32_t length, uint8_t * data);
+	static int writeMessagev(adb_device * device, uint32_t command, uint32_t arg0, uint32_t arg1, uint8_t count, usb_segment * segments);
+	static int sendMessagev(adb_device * device, uint32_t command, uint32_t arg0, uint32_t arg1, uint8_t count, usb_segment * segments);
+	static void finishSend(adb_device * device);
+	static int writeStringMessage(adb_device * device, uint32_t command, uint32_t arg0, uint32_t arg1, char * str);
+	static int writeStringMessage_P(adb_device * device, uint32_t command, uint32_t arg0, uint32_t arg1, const char * str);
+	static boolean pollMessage(adb_device * device, adb_message * message, boolean poll);
+	static Connection * newConnection(boolean reconnect, adb_eventHandler * handler);
+	static void openClosedConnections(adb_device * device);
+	static void fireReady(adb_device * device);
+	static void settleOpen(Connection * connection);
+	static void scheduleOpen(Connection * connection, uint32_t delay);
+	static void scheduleRetry(Connection * connection);
+	static void cancelOpen(Connection * connection);
+	static void runTimers();
 	static void handleOkay(Connection * connection, adb_message * message);
 	static void handleClose(Connection * connection);
 	static void handleWrite(Connection * connection, adb_message * message);
-	static void handleConnect(adb_message * message);
+	static boolean receive(Connection * connection);
+#if ADB_HAS(ADB_FEATURE_PACKET_EVENTS)
+	static int receiveEvents(Connection * connection);
+#endif
+#if ADB_HAS(ADB_FEATURE_RECEIVE_BUFFER)
+	static int receiveBuffered(Connection * connection);
+#endif
+	static void skip(adb_device * device, uint32_t length);
+	static void handleConnect(adb_device * device, adb_message * message);
+	static boolean hasBudget();
+	static void enforceBudget(boolean enforce);
+#if ADB_HAS(ADB_FEATURE_IDLE)
+	static boolean isIdle();
+	static void noteReceive();
+#endif
+	static void service();
+	static void serviceDevice(adb_device * device);
+	static void handleMessage(adb_device * device, adb_message * message);
 	static boolean isAdbInterface(usb_interfaceDescriptor * interface);
+#if ADB_HAS(ADB_FEATURE_WRITE_QUEUE)
+	static uint16_t enqueue(Connection * connection, uint16_t length, uint8_t * data);
+	static int queueWrite(Connection * connection, uint8_t count, usb_segment * segments, boolean whole);
+	static int flushWriteQueue(Connection * connection);
+	static boolean isFlushDue(Connection * connection);
+#endif
+#if ADB_HAS(ADB_FEATURE_STATS)
+	static uint8_t bucket(uint32_t duration);
+	static void record(uint16_t * histogram, uint32_t duration);
+	static void addEndpointStats(usb_endpointStats * total, usb_endpointStats * endpoint);
+#endif
+#if ADB_HAS(ADB_FEATURE_PROFILE_CACHE)
+	static adb_profile * findProfile(usb_device * device);
+	static uint16_t getConfigurationLength(usb_device * device);
+	static void saveProfile(adb_profile * profile);
+	static void storeProfile(usb_device * device, adb_usbConfiguration * handle);
+	static void forgetProfile(usb_device * device);
+	static void loadProfiles();
+#endif
+#if ADB_HAS(ADB_FEATURE_STATE | ADB_FEATURE_FRAMING | ADB_FEATURE_SYNC | ADB_FEATURE_SHELL | ADB_FEATURE_LOGCAT)
+	static void receiveData(Connection * connection, uint16_t length, uint8_t * data, adb_receiver * receiver, void * client);
+#endif
+#if ADB_HAS(ADB_FEATURE_FRAMING)
+	static void receiveFrames(void * client, uint16_t length, uint8_t * data);
+#endif
+#if ADB_HAS(ADB_FEATURE_STATE)
+	static void receiveState(void * client, uint16_t length, uint8_t * data);
+#endif
+#if ADB_HAS(ADB_FEATURE_SYNC)
+	static void syncHeader(uint8_t * header, uint32_t id, uint32_t length);
+	static void finishSync(SyncClient * sync, int result, const char * message);
+	static void receiveSync(void * client, uint16_t length, uint8_t * data);
+#endif
+#if ADB_HAS(ADB_FEATURE_SHELL)
+	static uint8_t shellNumber(char * str, uint8_t number);
+	static void finishShellCommand(ShellSession * session, int exitCode);
+	static void receiveShell(void * client, uint16_t length, uint8_t * data);
+#endif
+#if ADB_HAS(ADB_FEATURE_LOGCAT)
+	static void resetLogcat(LogcatClient * logcat);
+	static uint8_t appendString(char * str, uint8_t length, const char * suffix);
+	static void receiveLines(void * client, uint16_t length, uint8_t * data);
+	static uint32_t getLogField(uint8_t * data);
+	static void receiveEntries(void * client, uint16_t length, uint8_t * data);
+#endif
+#if ADB_HAS(ADB_FEATURE_ACCESSORY)
+	static boolean isAccessoryInterface(usb_interfaceDescriptor * interface);
+	static void serviceAccessory();
+#endif
 
 public:
 	static void init();
 	static void poll();
+	static void poll(uint32_t budget);
+#if ADB_HAS(ADB_FEATURE_IDLE)
+	static void run();
+#endif
 
 	static void setEventHandler(adb_eventHandler * handler);
 	static Connection * addConnection(const char * connectionString, boolean reconnect, adb_eventHandler * eventHandler);
+	static Connection * addConnection(const __FlashStringHelper * connectionString, boolean reconnect, adb_eventHandler * eventHandler);
 	static int write(Connection * connection, uint16_t length, uint8_t * data);
 	static int writeString(Connection * connection, char * str);
+	static int writev(Connection * connection, uint8_t count, usb_segment * segments);
+#if ADB_HAS(ADB_FEATURE_WRITE_QUEUE)
+	static void setWriteQueue(Connection * connection, uint8_t * buffer, uint16_t size);
+	static void setCoalescing(Connection * connection, boolean enable, uint16_t size, uint16_t age);
+	static uint16_t append(Connection * connection, uint16_t length, uint8_t * data);
+	static int flush(Connection * connection);
+#endif
+	static uint32_t getRemoteVersion();
+	static uint32_t getRemoteMaxData();
+#if ADB_HAS(ADB_FEATURE_HUB)
+	static void setDevice(Connection * connection, uint8_t device);
+	static void setDeviceWeight(uint8_t device, uint8_t weight);
+	static boolean isDeviceConnected(uint8_t device);
+	static uint8_t getEventDevice();
+#endif
+#if ADB_HAS(ADB_FEATURE_PROFILE_CACHE)
+	static void clearProfiles();
+#endif
+#if ADB_HAS(ADB_FEATURE_RECEIVE_BUFFER)
+	static void setReceiveBuffer(Connection * connection, uint8_t * buffer, uint16_t size);
+	static uint16_t available(Connection * connection);
+	static int read(Connection * connection);
+	static uint16_t read(Connection * connection, uint16_t length, uint8_t * data);
+#endif
+#if ADB_HAS(ADB_FEATURE_FLOW_CONTROL)
+	static void setFlowControl(Connection * connection, boolean enable, uint16_t window);
+	static void consume(Connection * connection, uint16_t length);
+#endif
+#if ADB_HAS(ADB_FEATURE_STATS)
+	static void getStats(adb_stats * snapshot);
+	static void resetStats();
+	static int writeStats(Connection * connection);
+#endif
+#if ADB_HAS(ADB_FEATURE_STATE)
+	static void initStateChannel(StateChannel * channel, Connection * connection, uint16_t * values, uint8_t count, uint16_t period);
+	static void setState(StateChannel * channel, uint8_t key, uint16_t value);
+	static uint16_t getState(StateChannel * channel, uint8_t key);
+	static uint32_t getStateChanges(StateChannel * channel);
+	static void handleStateEvent(StateChannel * channel, adb_eventType event, uint16_t length, uint8_t * data);
+	static int flushState(StateChannel * channel);
+#endif
+#if ADB_HAS(ADB_FEATURE_FRAMING)
+	static void initFramer(Framer * framer, Connection * connection, uint8_t * buffer, uint16_t size, adb_frameHandler * handler);
+	static void parseFrames(Framer * framer, uint16_t length, uint8_t * data);
+	static void handleFrameEvent(Framer * framer, adb_eventType event, uint16_t length, uint8_t * data);
+	static int writeFrame(Framer * framer, uint8_t type, uint16_t length, uint8_t * data);
+#endif
+#if ADB_HAS(ADB_FEATURE_SYNC)
+	static int initSync(SyncClient * sync, Connection * connection, uint8_t * buffer, uint16_t size, adb_syncHandler * handler);
+	static boolean isSyncIdle(SyncClient * sync);
+	static int syncSend(SyncClient * sync, const char * path, uint16_t mode, uint32_t mtime, adb_syncReader * reader);
+	static int syncReceive(SyncClient * sync, const char * path, adb_syncWriter * writer);
+	static int pollSync(SyncClient * sync);
+	static void handleSyncEvent(SyncClient * sync, adb_eventType event, uint16_t length, uint8_t * data);
+#endif
+#if ADB_HAS(ADB_FEATURE_SHELL)
+	static void initShell(ShellSession * session, Connection * connection);
+	static uint8_t getShellPending(ShellSession * session);
+	static int shellCommand(ShellSession * session, const char * command, adb_shellHandler * handler);
+	static void handleShellEvent(ShellSession * session, adb_eventType event, uint16_t length, uint8_t * data);
+#endif
+#if ADB_HAS(ADB_FEATURE_LOGCAT)
+	static int initLogcat(LogcatClient * logcat, uint8_t * buffer, uint16_t size, adb_logcatLineHandler * lineHandler, adb_logcatEntryHandler * entryHandler);
+	static Connection * addLogcat(LogcatClient * logcat, const char * filters, boolean reconnect, adb_eventHandler * handler);
+	static void handleLogcatEvent(LogcatClient * logcat, adb_eventType event, uint16_t length, uint8_t * data);
+#endif
+#if ADB_HAS(ADB_FEATURE_ACCESSORY)
+	static void initAccessory(Accessory * accessory, const char * manufacturer, const char * model, const char * description,
+			const char * version, const char * uri, const char * serial, adb_accessoryHandler * handler);
+	static boolean isAccessoryOpen(Accessory * accessory);
+	static int writeAccessory(Accessory * accessory, uint16_t length, uint8_t * data);
+	static int writevAccessory(Accessory * accessory, uint8_t count, usb_segment * segments);
+#endif
 
+	static boolean findInterface(usb_device * device, int configuration, adb_usbConfiguration * handle, boolean (*match)(usb_interfaceDescriptor *));
 	static boolean isAdbDevice(usb_device * device, int configuration, adb_usbConfiguration * handle);
-	static void initUsb(usb_device * device, adb_usbConfiguration * handle);
-	static void closeAll();
+	static int initUsb(adb_device * adbDevice, usb_device * device, adb_usbConfiguration * handle, adb_profile * profile);
+	static void attachUsb(adb_device * adbDevice, usb_device * device);
+	static void releaseUsb(adb_device * adbDevice);
+#if ADB_HAS(ADB_FEATURE_ACCESSORY)
+	static boolean isAccessoryDevice(usb_device * device, adb_usbConfiguration * handle);
+	static int startAccessory(usb_device * device);
+	static int openAccessory(usb_device * device, adb_usbConfiguration * handle);
+#endif
+	static void closeAll(adb_device * device);
 };
 
 #endif
@@ -0,0 +1,110 @@
+/*
+	Copyright 2011 Niels Brouwers
+
+	Licensed under the Apache License, Version 2.0 (the "License");
+	you may not use this file except in compliance with the License.
+	You may obtain a copy of the License at
+
+	   http://www.apache.org/licenses/LICENSE-2.0
+
+	Unless required by applicable law or agreed to in writing, software
+	distributed under the License is distributed on an "AS IS" BASIS,
+	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+	See the License for the specific language governing permissions and
+	limitations under the License.
+*/
+
+#ifndef __adbconfig_h__
+#define __adbconfig_h__
+
+/**
+ * Compile-time configuration of the USB/ADB stack. The Arduino IDE builds libraries separately from the sketch, so
+ * defines in a sketch do not reach the library: change the defaults below instead. Leaving out what a sketch does
+ * not use saves flash and SRAM that can go into larger receive and transmit buffers.
+ */
+
+// Capacity of the static connection table, and maximum length of a connection string (including the trailing zero).
+// Connection strings passed to ADB::addConnection as F("...") stay in flash and do not count against the length; use
+// 0 when all connections are added that way, which leaves the connection string buffers out of the table.
+#ifndef ADB_MAX_CONNECTIONS
+#define ADB_MAX_CONNECTIONS 8
+#endif
+// The retry timer wheel and the set of OPENs a device has outstanding on connect are 32-bit masks of connections.
+#if ADB_MAX_CONNECTIONS > 32
+#error "ADB_MAX_CONNECTIONS may not exceed 32"
+#endif
+#ifndef ADB_CONNECTIONSTRING_LENGTH
+#define ADB_CONNECTIONSTRING_LENGTH 48
+#endif
+
+// Number of bytes of the device identity string passed along with the ADB_CONNECT event. The identity is read
+// into a stack buffer of this size, anything beyond it is discarded. Use 0 if the sketch does not look at it.
+#ifndef ADB_CONNECT_BUFFER_SIZE
+#define ADB_CONNECT_BUFFER_SIZE 256
+#endif
+
+// Optional features.
+#define ADB_FEATURE_WRITE_QUEUE		0x01	// Outbound queues and write coalescing (ADB::setWriteQueue).
+#define ADB_FEATURE_RECEIVE_BUFFER	0x02	// Inbound ring buffers (ADB::setReceiveBuffer).
+#define ADB_FEATURE_PACKET_EVENTS	0x04	// ADB_CONNECTION_RECEIVE per USB packet for connections without a receive buffer.
+#define ADB_FEATURE_STATS			0x08	// Counters and latency histograms (ADB::getStats).
+#define ADB_FEATURE_FLOW_CONTROL	0x10	// OKAY withheld until the application consumes received data (ADB::setFlowControl).
+#define ADB_FEATURE_HUB				0x20	// Several ADB devices behind a USB hub on the root port (ADB_MAX_DEVICES).
+#define ADB_FEATURE_PROFILE_CACHE	0x40	// Skip descriptor parsing for devices seen before (ADB_PROFILE_CACHE_SIZE).
+#define ADB_FEATURE_STATE			0x200	// Latest-value state channels on top of a connection (ADB::initStateChannel).
+#define ADB_FEATURE_FRAMING			0x400	// Typed, length-prefixed messages on top of a connection (ADB::initFramer).
+#define ADB_FEATURE_SYNC			0x800	// File push and pull through the sync service (ADB::initSync).
+#define ADB_FEATURE_SHELL			0x1000	// Pipelined commands in one persistent shell (ADB::initShell).
+#define ADB_FEATURE_LOGCAT			0x2000	// Filtered logcat lines or binary entries (ADB::initLogcat).
+#define ADB_FEATURE_ACCESSORY		0x4000	// Android Open Accessory transport alongside ADB (ADB::initAccessory).
+#define ADB_FEATURE_IDLE			0x8000	// Event loop that sleeps while the devices are quiet (ADB::run).
+
+// Enabled features. Without ADB_FEATURE_PACKET_EVENTS, data for connections without a receive buffer is discarded.
+#ifndef ADB_FEATURES
+#define ADB_FEATURES (ADB_FEATURE_WRITE_QUEUE | ADB_FEATURE_RECEIVE_BUFFER | ADB_FEATURE_PACKET_EVENTS | ADB_FEATURE_FLOW_CONTROL | ADB_FEATURE_STATE | \
+		ADB_FEATURE_FRAMING | ADB_FEATURE_SYNC | ADB_FEATURE_SHELL | ADB_FEATURE_LOGCAT | ADB_FEATURE_ACCESSORY | \
+		ADB_FEATURE_IDLE)
+#endif
+
+#define ADB_HAS(feature) ((ADB_FEATURES & (feature)) != 0)
+
+// Number of ADB devices that are served at the same time. More than one needs ADB_FEATURE_HUB.
+#ifndef ADB_MAX_DEVICES
+#define ADB_MAX_DEVICES 1
+#endif
+
+// Size of the USB device table, not counting address 0. Devices get addresses 1 to USB_NUMDEVICES - 1, which leaves
+// room for the ADB devices and the hub.
+#ifndef USB_NUMDEVICES
+#define USB_NUMDEVICES (ADB_MAX_DEVICES + 1 + ADB_HAS(ADB_FEATURE_HUB))
+#endif
+
+// Number of devices whose ADB interface layout is remembered (with ADB_FEATURE_PROFILE_CACHE). A device that has
+// been seen before is configured right away on replug, without reading and parsing its configuration descriptor.
+#ifndef ADB_PROFILE_CACHE_SIZE
+#define ADB_PROFILE_CACHE_SIZE 4
+#endif
+
+// EEPROM address of a persistent copy of the profile cache, which then survives a reset. It takes
+// 1 + 14 * ADB_PROFILE_CACHE_SIZE bytes, keep them clear of the EEPROM the sketch uses. Leave undefined to keep the
+// cache in SRAM only.
+// #define ADB_PROFILE_EEPROM 0
+
+// Number of commands a shell session can have pending (with ADB_FEATURE_SHELL), see ADB::shellCommand.
+#ifndef ADB_SHELL_QUEUE_SIZE
+#define ADB_SHELL_QUEUE_SIZE 8
+#endif
+
+// Time without ADB traffic after which ADB::run starts sleeping between polls (with ADB_FEATURE_IDLE), in
+// microseconds. While messages come and go, the loop keeps polling flat out, so replies are picked up right away.
+#ifndef ADB_IDLE_TIME
+#define ADB_IDLE_TIME 5000
+#endif
+
+// Number of log2 buckets of the latency histograms (with ADB_FEATURE_STATS). Bucket i counts durations of 2^i up to
+// 2^(i+1) microseconds, the last bucket counts everything beyond.
+#ifndef ADB_STATS_BUCKETS
+#define ADB_STATS_BUCKETS 16
+#endif
+
+#endif
@@ -0,0 +1,44 @@
+#include <SPI.h>
+#include <Adb.h>
+
+// The phone as an Android Open Accessory.
+Accessory accessory;
+
+// Event handler for the accessory, echoes whatever the phone sends.
+void accessoryHandler(Accessory * accessory, adb_eventType event, uint16_t length, uint8_t * data)
+{
+  switch (event)
+  {
+  case ADB_CONNECTION_OPEN:
+    Serial.println("Accessory open");
+    break;
+  case ADB_CONNECTION_CLOSE:
+    Serial.println("Accessory closed");
+    break;
+  case ADB_CONNECTION_RECEIVE:
+    accessory->write(length, data);
+    break;
+  default:
+    break;
+  }
+}
+
+void setup()
+{
+
+  // Initialise serial port
+  Serial.begin(57600);
+
+  // Initialise the ADB subsystem.  
+  ADB::init();
+
+  // Ask phones to switch to accessory mode. The strings pick the application on the phone, phones that don't
+  // speak the protocol are used through ADB as usual.
+  accessory.init("microbridge", "Echo", "MicroBridge echo accessory", "1.0", NULL, NULL, accessoryHandler);
+}
+
+void loop()
+{
+  // Poll the ADB subsystem. The echo only answers the phone, so the processor can sleep while the phone is quiet.
+  ADB::run();
+}
@@ -0,0 +1,286 @@
+#include <SPI.h>
+#include <Adb.h>
+
+// Throughput and latency benchmark. Install and start the Benchmark service on the phone (src/android/Benchmark):
+//
+//   adb shell am startservice -n org.microbridge.benchmark/.BenchmarkService
+//
+// The sketch then runs every test once per connection and reports the results on the serial port, one
+// machine-readable line per measurement:
+//
+//   BENCH config f_cpu=16000000 spcr=0x50 spsr=0x00 maxdata=4096
+//   BENCH connect open_ms=212 first_byte_ms=230
+//   BENCH tx size=64 bytes=23104 ms=2000 bps=11552
+//   BENCH rx size=64 bytes=2048 ms=171 bps=11976
+//   BENCH latency kind=okay n=32 p50=1712 p90=2344 p99=3120 max=3120
+//   BENCH done
+//
+// Latencies are in microseconds. Replug the phone to run the tests again.
+
+// Payload sizes of the throughput tests.
+const uint16_t sizes[] = { 1, 16, 64, 256, 1024, 4096 };
+#define SIZES (sizeof(sizes) / sizeof(sizes[0]))
+
+// Duration of each device->phone test, and the number of chunks requested in each phone->device test.
+#define TX_DURATION 2000
+#define RX_CHUNKS 32
+#define RX_TIMEOUT 10000
+
+// Number of round trips in the latency test, and how long to wait for each one.
+#define SAMPLES 32
+#define LATENCY_TIMEOUT 1000
+
+// One packet worth of data. Larger payloads are gathered from it with writev, so no 4 KB buffer is needed.
+uint8_t pattern[64];
+usb_segment segments[4096 / sizeof(pattern)];
+
+// The phone discards data sent to sink, echoes data sent to echo, and answers requests on source.
+Connection * sink, * echo, * source;
+
+// Time of the ADB_CONNECT event, of the last stream opening, and of the first byte the phone sent (milliseconds).
+uint32_t connectTime, openTime, firstByteTime;
+
+// Bytes received on source, and when the last echo came in (microseconds).
+uint32_t received;
+boolean echoed;
+uint32_t echoTime;
+
+// Latency samples.
+uint32_t okayLatency[SAMPLES], echoLatency[SAMPLES];
+
+// Set after the tests ran, cleared on the next CNXN.
+boolean done;
+
+void adbEventHandler(Connection * connection, adb_eventType event, uint16_t length, uint8_t * data)
+{
+  switch (event)
+  {
+  case ADB_CONNECT:
+    connectTime = millis();
+    firstByteTime = 0;
+    done = false;
+    break;
+
+  case ADB_CONNECTION_OPEN:
+    openTime = millis();
+    break;
+
+  case ADB_CONNECTION_RECEIVE:
+    if (connection == sink && firstByteTime == 0)
+      firstByteTime = millis();
+    else if (connection == source)
+      received += length;
+    else if (connection == echo)
+    {
+      echoTime = micros();
+      echoed = true;
+    }
+    break;
+
+  default:
+    break;
+  }
+}
+
+// Prints a throughput line.
+void report(const char * test, uint16_t size, uint32_t bytes, uint32_t ms)
+{
+  Serial.print("BENCH ");
+  Serial.print(test);
+  Serial.print(" size=");
+  Serial.print(size);
+  Serial.print(" bytes=");
+  Serial.print(bytes);
+  Serial.print(" ms=");
+  Serial.print(ms);
+  Serial.print(" bps=");
+  Serial.println(ms > 0 ? bytes * 1000 / ms : 0);
+}
+
+// Sorts a set of samples and prints its percentiles.
+void reportLatency(const char * kind, uint32_t * samples, uint8_t n)
+{
+  uint8_t i, j;
+  uint32_t x;
+
+  for (i = 1; i < n; i++)
+  {
+    x = samples[i];
+    for (j = i; j > 0 && samples[j - 1] > x; j--)
+      samples[j] = samples[j - 1];
+    samples[j] = x;
+  }
+
+  Serial.print("BENCH latency kind=");
+  Serial.print(kind);
+  Serial.print(" n=");
+  Serial.print(n);
+  if (n > 0)
+  {
+    Serial.print(" p50=");
+    Serial.print(samples[n / 2]);
+    Serial.print(" p90=");
+    Serial.print(samples[n * 9 / 10]);
+    Serial.print(" p99=");
+    Serial.print(samples[n * 99 / 100]);
+    Serial.print(" max=");
+    Serial.print(samples[n - 1]);
+  }
+  Serial.println();
+}
+
+// Polls until a connection is ready for the next write. Returns false if it closed or the timeout expired.
+boolean waitOpen(Connection * connection, uint32_t start, uint32_t timeout)
+{
+  while (connection->status != ADB_OPEN)
+  {
+    if (connection->status != ADB_WRITING && connection->status != ADB_RECEIVING) return false;
+    if (millis() - start > timeout) return false;
+    ADB::poll();
+  }
+
+  return true;
+}
+
+// Device -> phone: sends WRTEs of a given size to the sink for TX_DURATION milliseconds.
+void benchmarkTx(uint16_t size)
+{
+  uint8_t count = 0;
+  uint16_t left;
+  uint32_t bytes = 0, start = millis();
+
+  // Describe the payload as a list of segments that all point to the same pattern.
+  for (left = size; left > 0; left -= segments[count++].length)
+  {
+    segments[count].data = pattern;
+    segments[count].length = left < sizeof(pattern) ? left : sizeof(pattern);
+    segments[count].progmem = false;
+  }
+
+  while (millis() - start < TX_DURATION)
+  {
+    if (!waitOpen(sink, start, TX_DURATION)) break;
+    if (sink->writev(count, segments) == 0) bytes += size;
+  }
+
+  // Wait for the last OKAY, so that only acknowledged data is counted.
+  waitOpen(sink, millis(), LATENCY_TIMEOUT);
+  report("tx", size, bytes, millis() - start);
+}
+
+// Phone -> device: asks the source for RX_CHUNKS writes of a given size, and times their arrival.
+void benchmarkRx(uint16_t size)
+{
+  uint8_t request[4];
+  uint32_t total = (uint32_t)size * RX_CHUNKS, start;
+
+  // Request: chunk size and number of chunks, little endian.
+  request[0] = size & 0xff;
+  request[1] = size >> 8;
+  request[2] = RX_CHUNKS & 0xff;
+  request[3] = RX_CHUNKS >> 8;
+
+  if (!waitOpen(source, millis(), LATENCY_TIMEOUT)) return;
+
+  received = 0;
+  start = millis();
+  source->write(sizeof(request), request);
+
+  while (received < total && millis() - start < RX_TIMEOUT && source->status != ADB_CLOSED)
+    ADB::poll();
+
+  report("rx", size, received, millis() - start);
+}
+
+// Round trips: times the OKAY to a one-byte WRTE, and the echo of that byte.
+void benchmarkLatency()
+{
+  uint8_t okays = 0, echoes = 0, i;
+  uint32_t start, timeout;
+  boolean okay;
+
+  for (i = 0; i < SAMPLES; i++)
+  {
+    if (!waitOpen(echo, millis(), LATENCY_TIMEOUT)) break;
+
+    echoed = false;
+    okay = false;
+    timeout = millis();
+    start = micros();
+    if (echo->write(1, pattern) != 0) break;
+
+    while ((!okay || !echoed) && millis() - timeout < LATENCY_TIMEOUT)
+    {
+      ADB::poll();
+
+      if (!okay && echo->status != ADB_WRITING)
+      {
+        okayLatency[okays++] = micros() - start;
+        okay = true;
+      }
+    }
+
+    if (echoed) echoLatency[echoes++] = echoTime - start;
+  }
+
+  reportLatency("okay", okayLatency, okays);
+  reportLatency("echo", echoLatency, echoes);
+}
+
+void setup()
+{
+  uint8_t i;
+
+  // Initialise serial port
+  Serial.begin(57600);
+
+  for (i = 0; i < sizeof(pattern); i++)
+    pattern[i] = i;
+
+  // Initialise the ADB subsystem.
+  ADB::init();
+  ADB::setEventHandler(adbEventHandler);
+
+  // Open the benchmark streams to the phone. Auto-reconnect
+  sink = ADB::addConnection("tcp:4568", true, NULL);
+  echo = ADB::addConnection("tcp:4569", true, NULL);
+  source = ADB::addConnection("tcp:4570", true, NULL);
+}
+
+void loop()
+{
+  uint8_t i;
+
+  // Poll the ADB subsystem.
+  ADB::poll();
+
+  // Start once all streams are open and the phone said hello.
+  if (done || !sink->isOpen() || !echo->isOpen() || !source->isOpen() || firstByteTime == 0)
+    return;
+
+  Serial.print("BENCH config f_cpu=");
+  Serial.print(F_CPU);
+  Serial.print(" spcr=0x");
+  Serial.print(SPCR, HEX);
+  Serial.print(" spsr=0x");
+  Serial.print(SPSR, HEX);
+  Serial.print(" maxdata=");
+  Serial.println(ADB::getRemoteMaxData());
+
+  Serial.print("BENCH connect open_ms=");
+  Serial.print(openTime - connectTime);
+  Serial.print(" first_byte_ms=");
+  Serial.println(firstByteTime - connectTime);
+
+  for (i = 0; i < SIZES; i++)
+    if (sizes[i] <= ADB::getRemoteMaxData())
+      benchmarkTx(sizes[i]);
+
+  for (i = 0; i < SIZES; i++)
+    benchmarkRx(sizes[i]);
+
+  benchmarkLatency();
+
+  Serial.println("BENCH done");
+  done = true;
+}
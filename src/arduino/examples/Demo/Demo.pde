@@ -8,21 +8,22 @@ Servo servos[2];
 // Adb connection.
 Connection * connection;
 
+// State shared with the phone: the servo positions in the range of [0..180] come in, the sensor reading goes out.
+// Only the latest value of each is sent, so the servos never lag behind the joystick.
+#define KEY_SERVO0 0
+#define KEY_SERVO1 1
+#define KEY_SENSOR 2
+
+StateChannel state;
+uint16_t values[3];
+
 // Elapsed time for ADC sampling
 long lastTime;
 
-// Event handler for the shell connection. 
+// Event handler for the connection, the state channel takes care of the data.
 void adbEventHandler(Connection * connection, adb_eventType event, uint16_t length, uint8_t * data)
 {
-  int i;
-
-  // Data packets contain two bytes, one for each servo, in the range of [0..180]
-  if (event == ADB_CONNECTION_RECEIVE)
-  {
-    servos[0].write(data[0]);
-    servos[1].write(data[1]);
-  }
-
+  state.handleEvent(event, length, data);
 }
 
 void setup()
@@ -43,6 +44,9 @@ void setup()
 
   // Open an ADB stream to the phone's shell. Auto-reconnect
   connection = ADB::addConnection("tcp:4567", true, adbEventHandler);  
+
+  // Send the sensor reading at most every 20ms.
+  state.init(connection, values, 3, 20);
 }
 
 void loop()
@@ -50,12 +54,19 @@ void loop()
   
   if ((millis() - lastTime) > 20)
   {
-    uint16_t data = analogRead(A0);
-    connection->write(2, (uint8_t*)&data);
+    state.set(KEY_SENSOR, analogRead(A0));
     lastTime = millis();
   }
 
   // Poll the ADB subsystem.
   ADB::poll();
+
+  // Move the servos to the latest position from the phone, and send the sensor reading if it's time.
+  if (state.getChanges())
+  {
+    servos[0].write(state.get(KEY_SERVO0));
+    servos[1].write(state.get(KEY_SERVO1));
+  }
+  state.flush();
 }
 
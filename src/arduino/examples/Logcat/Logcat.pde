@@ -1,15 +1,20 @@
 #include <SPI.h>
 #include <Adb.h>
 
-// Event handler for the shell connection. 
-void adbEventHandler(Connection * connection, adb_eventType event, uint16_t length, uint8_t * data)
-{
-  int i;
+// Logcat client and its line buffer, longer lines are cut short.
+LogcatClient logcat;
+uint8_t line[128];
 
-  if (event == ADB_CONNECTION_RECEIVE)
-    for (i=0; i<length; i++)
-      Serial.print(data[i]);
+// Called once per log line.
+void logcatHandler(LogcatClient * logcat, uint16_t length, char * line)
+{
+  Serial.println(line);
+}
 
+// Event handler for the logcat connection, the logcat client assembles the lines.
+void adbEventHandler(Connection * connection, adb_eventType event, uint16_t length, uint8_t * data)
+{
+  logcat.handleEvent(event, length, data);
 }
 
 void setup()
@@ -21,8 +26,10 @@ void setup()
   // Initialise the ADB subsystem.  
   ADB::init();
 
-  // Open an ADB stream to the phone's shell. Auto-reconnect
-  ADB::addConnection("shell:exec logcat", true, adbEventHandler);  
+  // Open an ADB stream to the phone's logcat. Auto-reconnect. The phone filters the log and only sends the
+  // messages of the ActivityManager of priority info and up, and all messages tagged MicroBridge.
+  logcat.init(line, sizeof(line), logcatHandler, NULL);
+  logcat.connect("ActivityManager:I MicroBridge:V", true, adbEventHandler);
 }
 
 void loop()
@@ -30,4 +37,3 @@ void loop()
   // Poll the ADB subsystem.
   ADB::poll();
 }
-
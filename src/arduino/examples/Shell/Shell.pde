@@ -2,16 +2,35 @@
 #include <Adb.h>
 
 Connection * shell;
+ShellSession session;
 
-// Event handler for the shell connection. 
-void adbEventHandler(Connection * connection, adb_eventType event, uint16_t length, uint8_t * data)
+// Outbound queue, so commands can be sent while the one before is still on its way.
+uint8_t writeQueue[128];
+
+// Command line being typed on the serial port.
+char line[64];
+uint8_t lineLength = 0;
+
+// Handler for the output of a command.
+void commandHandler(ShellSession * session, uint16_t length, uint8_t * data, int exitCode)
 {
   int i;
 
-  if (event == ADB_CONNECTION_RECEIVE)
+  if (data != NULL)
     for (i=0; i<length; i++)
       Serial.print(data[i]);
+  else
+  {
+    Serial.print("[exit ");
+    Serial.print(exitCode);
+    Serial.println("]");
+  }
+}
 
+// Event handler for the shell connection, the shell session takes care of the data.
+void adbEventHandler(Connection * connection, adb_eventType event, uint16_t length, uint8_t * data)
+{
+  session.handleEvent(event, length, data);
 }
 
 void setup()
@@ -23,29 +42,34 @@ void setup()
   // Initialise the ADB subsystem.  
   ADB::init();
 
-  // Open an ADB stream to the phone's shell. Auto-reconnect
+  // Open an ADB stream to the phone's shell. Auto-reconnect. All commands run in this one shell.
   shell = ADB::addConnection("shell:", true, adbEventHandler);  
+  shell->setWriteQueue(writeQueue, sizeof(writeQueue));
+  session.init(shell);
 }
 
 void loop()
 {
   byte ch;
   
-  // Check for incoming serial data
+  // Collect a command line from the serial port, and run it when it's complete.
   if (Serial.available() > 0)
   {
     // read the incoming byte:
     ch = Serial.read();
-    
-    // Write to shell
-    if (shell->status == ADB_OPEN)
-      shell->write(1, &ch);
-    else
-      Serial.print("Shell not open");
+
+    if (ch == '\r' || ch == '\n')
+    {
+      line[lineLength] = 0;
+      if (lineLength > 0 && session.run(line, commandHandler) < 0)
+        Serial.println("Shell not open");
+      lineLength = 0;
+    }
+    else if (lineLength < sizeof(line) - 1)
+      line[lineLength++] = ch;
 
   }
 
   // Poll the ADB subsystem.
   ADB::poll();
 }
-
@@ -1,6 +1,50 @@
 #include <SPI.h>
 #include <Adb.h>
 
+// Adb connection to the file sync service of the phone.
+Connection * connection;
+SyncClient sync;
+
+// Buffer for the file data, one DATA chunk is at most this size.
+uint8_t buffer[256];
+
+// File contents, and how much of it has been sent.
+const char text[] = "hello world\n";
+uint16_t position;
+
+boolean done = false;
+
+// Hands the sync client the next chunk of the file. This is where a larger file would be read from an SD card,
+// a chunk at a time, instead of being held in memory.
+uint16_t readFile(SyncClient * sync, uint16_t length, uint8_t * data)
+{
+  uint16_t left = sizeof(text) - 1 - position;
+
+  if (length > left) length = left;
+  memcpy(data, text + position, length);
+  position += length;
+
+  return length;
+}
+
+// Called when the phone has stored the file, or refused it.
+void fileHandler(SyncClient * sync, int result, const char * message)
+{
+  if (result == 0)
+    Serial.println("file written");
+  else
+  {
+    Serial.print("write failed: ");
+    Serial.println(message != NULL ? message : "connection closed");
+  }
+}
+
+// Event handler for the sync connection, the sync client takes care of the data.
+void adbEventHandler(Connection * connection, adb_eventType event, uint16_t length, uint8_t * data)
+{
+  sync.handleEvent(event, length, data);
+}
+
 void setup()
 {
 
@@ -10,14 +54,23 @@ void setup()
   // Initialise the ADB subsystem.  
   ADB::init();
 
-  // Execute the UNIX shell command 'echo "hello world" > /sdcard/hello', which creates a
-  // new text file on the sd card called 'hello', containing the text 'hello world'.
-  ADB::addConnection("shell:echo \"hello world\" > /sdcard/hello", false, NULL);
+  // Open a connection to the file sync service, which writes files on the phone without going through the shell.
+  connection = ADB::addConnection("sync:", false, adbEventHandler);
+  sync.init(connection, buffer, sizeof(buffer), fileHandler);
 }
 
 void loop()
 {
   // Poll the ADB subsystem.
   ADB::poll();
-}
 
+  // Create a new file on the sd card called 'hello', containing the text 'hello world', once the connection is open.
+  if (!done && sync.isIdle())
+  {
+    position = 0;
+    done = sync.send("/sdcard/hello", 0644, 0, readFile) == 0;
+  }
+
+  // Keep the file data flowing.
+  sync.poll();
+}
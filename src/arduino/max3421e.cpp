@@ -31,12 +31,16 @@ limitations under the License.#include <string.h>
 
 #include "../SPI/SPI.h"
 #include "wiring.h"
+#include <avr/pgmspace.h>
 #include "max3421e.h"
 #include "HardwareSerial.h"
 
 
 static uint8_t vbusState;
 
+// Called when a host transfer completes.
+static max3421e_transferHandler * transferHandler = NULL;
+
 /*
  * Initialises the max3421e host shield. Initialises the SPI bus and sets the required pin directions.
  * Must be called before powerOn.
@@ -127,7 +131,7 @@ void max3421e_powerOn(void)
 
 	// Configure host operation.
 	max3421e_write(MAX_REG_MODE, bmDPPULLDN | bmDMPULLDN | bmHOST | bmSEPIRQ ); // set pull-downs, Host, Separate GPIN IRQ on GPX
-	max3421e_write(MAX_REG_HIEN, bmCONDETIE | bmFRAMEIE ); //connection detection
+	max3421e_write(MAX_REG_HIEN, bmCONDETIE | bmFRAMEIE | bmHXFRDNIE ); //connection detection, transfer done
 
 	// Check if device is connected.
 	max3421e_write(MAX_REG_HCTL, bmSAMPLEBUS ); // sample USB bus
@@ -174,23 +178,61 @@ void max3421e_write(uint8_t reg, uint8_t value)
  */
 uint8_t * max3421e_writeMultiple(uint8_t reg, uint8_t count, uint8_t * values)
 {
+	uint8_t next;
+
 	// Pull slave select low to indicate start of transfer.
 	MAX_SS(0);
 
 	// Transfer command byte, 0x02 indicates write.
 	SPDR = (reg | 0x02);
-	while (!(SPSR & (1 << SPIF)));
 
-	// Transfer values.
+	// Transfer values. SPDR isn't buffered, so fetch the next byte while the last one is still shifting out and
+	// load it as soon as SPIF is up.
 	while (count--)
 	{
-		// Send next value byte.
-		SPDR = (*values);
+		next = *values++;
 		while (!(SPSR & (1 << SPIF)));
+		SPDR = next;
+	}
+
+	// Wait for the last byte to go out.
+	while (!(SPSR & (1 << SPIF)));
+
+	// Pull slave select high to indicate end of transfer.
+	MAX_SS(1);
+
+	return (values);
+}
+
+/**
+ * Writes multiple bytes from program memory (flash) to a register.
+ * @param reg register address.
+ * @param count number of bytes to write.
+ * @param values input values, in program memory.
+ * @return a pointer to values, incremented by the number of bytes written (values + length).
+ */
+const uint8_t * max3421e_writeMultiple_P(uint8_t reg, uint8_t count, const uint8_t * values)
+{
+	uint8_t next;
+
+	// Pull slave select low to indicate start of transfer.
+	MAX_SS(0);
+
+	// Transfer command byte, 0x02 indicates write.
+	SPDR = (reg | 0x02);
 
-		values++;
+	// Transfer values, pipelined like max3421e_writeMultiple. The flash read (lpm) is slow enough that overlapping
+	// it with the transfer matters even more here.
+	while (count--)
+	{
+		next = pgm_read_byte(values++);
+		while (!(SPSR & (1 << SPIF)));
+		SPDR = next;
 	}
 
+	// Wait for the last byte to go out.
+	while (!(SPSR & (1 << SPIF)));
+
 	// Pull slave select high to indicate end of transfer.
 	MAX_SS(1);
 
@@ -233,6 +275,8 @@ uint8_t max3421e_read(uint8_t reg)
  */
 uint8_t * max3421e_readMultiple(uint8_t reg, uint8_t count, uint8_t * values)
 {
+	uint8_t value;
+
 	// Pull slave-select high to initiate transfer.
 	MAX_SS(0);
 
@@ -240,15 +284,23 @@ uint8_t * max3421e_readMultiple(uint8_t reg, uint8_t count, uint8_t * values)
 	SPDR = reg;
 	while (!(SPSR & (1 << SPIF))); //wait
 
-	// Read [count] bytes.
-	while (count--)
+	// Read [count] bytes. Each byte is picked up and the next one started right away, and stored while that one is
+	// shifting in.
+	if (count > 0)
 	{
-		// Send empty byte while reading.
 		SPDR = 0;
-		while (!(SPSR & (1 << SPIF)));
 
-		*values = SPDR;
-		values++;
+		while (--count)
+		{
+			while (!(SPSR & (1 << SPIF)));
+			value = SPDR;
+			SPDR = 0;
+
+			*values++ = value;
+		}
+
+		while (!(SPSR & (1 << SPIF)));
+		*values++ = SPDR;
 	}
 
 	// Pull slave-select low to signal transfer complete.
@@ -327,6 +379,17 @@ uint8_t max3421e_poll(void)
 	return (rcode);
 }
 
+/**
+ * Sets the function that is called when a host transfer completes. The handler is called from
+ * max3421e_interruptHandler, after HXFRDNIRQ has been cleared, so it may launch a new transfer right away.
+ *
+ * @param handler transfer completion handler, or NULL to ignore transfer completion.
+ */
+void max3421e_setTransferHandler(max3421e_transferHandler * handler)
+{
+	transferHandler = handler;
+}
+
 /**
  * Interrupt handler.
  */
@@ -338,6 +401,15 @@ uint8_t max3421e_interruptHandler(void)
 	// Determine interrupt source.
 	interruptStatus = max3421e_read(MAX_REG_HIRQ);
 
+	if (interruptStatus & bmHXFRDNIRQ)
+	{
+		// Clear the interrupt first, the handler may dispatch the next transfer (or a retry).
+		max3421e_write(MAX_REG_HIRQ, bmHXFRDNIRQ);
+
+		if (transferHandler != NULL)
+			transferHandler(max3421e_read(MAX_REG_HRSL));
+	}
+
 	if (interruptStatus & bmFRAMEIRQ)
 	{
 		//->1ms SOF interrupt handler
@@ -66,7 +66,7 @@ typedef enum
 
 #define MAX_SS(x) digitalWrite(SS, x)
 #define MAX_INT() digitalRead(PIN_MAX_INT)
-#define MAX_GPX() digitalRead(PIN_MAX_INT)
+#define MAX_GPX() digitalRead(PIN_MAX_GPX)
 #define MAX_RESET(x) digitalWrite(PIN_MAX_RESET, x)
 
 // Completely untested guesswork for the ADK reference board
@@ -78,15 +78,22 @@ typedef enum
 #define PIN_MAX_RESET 7
 
 #define MAX_SS(x) digitalWrite(SS, x)
-#define MAX_INT() ((PORTE & 0x40) >> 6)
-#define MAX_GPX() ((PORTJ & 0x08) >> 3)
+#define MAX_INT() ((PINE & 0x40) >> 6)
+#define MAX_GPX() ((PINJ & 0x08) >> 3)
 #define MAX_RESET(x) { if (x) PORTJ |= 0x04; else PORTJ &= ~0x04; }
 
 #endif
 
+/**
+ * Callback for host transfer completion. Called from max3421e_interruptHandler when HXFRDNIRQ is raised,
+ * with the contents of the HRSL register (result code in the lower four bits, toggle and bus state above).
+ */
+typedef void(max3421e_transferHandler)(uint8_t hrsl);
+
 void max3421e_init();
 void max3421e_write(uint8_t reg, uint8_t val);
 uint8_t * max3421e_writeMultiple(uint8_t reg, uint8_t count, uint8_t * values);
+const uint8_t * max3421e_writeMultiple_P(uint8_t reg, uint8_t count, const uint8_t * values);
 void max3421e_gpioWr(uint8_t val);
 uint8_t max3421e_read(uint8_t reg);
 uint8_t * max3421e_readMultiple(uint8_t reg, uint8_t count, uint8_t * values);
@@ -100,6 +107,7 @@ uint8_t max3421e_getVbusState();
 uint8_t max3421e_poll(void);
 
 uint8_t max3421e_interruptHandler(void);
+void max3421e_setTransferHandler(max3421e_transferHandler * handler);
 uint8_t max3421e_gpxInterruptHandler(void);
 
 #endif //_MAX3421E_H_
@@ -15,6 +15,7 @@
 */
 
 #include "wiring.h"
+#include <avr/pgmspace.h>
 #include "usb.h"
 #include "ch9.h"
 #include "max3421e.h"
@@ -28,6 +29,27 @@ static usb_eventHandler * eventHandler = NULL;
 
 usb_device deviceTable[USB_NUMDEVICES + 1];
 
+// The transfer currently in flight (or the last one that completed).
+static usb_transfer transfer;
+
+// Deadline (in microseconds) after which NAKed transfers are no longer retried, see USB::setDeadline.
+static uint32_t deadline;
+static boolean deadlineSet = false;
+
+// Endpoint of the IN transfer that was launched ahead of time into the second receive FIFO, or NULL, and its
+// outcome once it has completed. See USB::setReadAhead.
+static usb_endpoint * ahead = NULL;
+static uint8_t aheadResult, aheadHrsl;
+
+#if ADB_HAS(ADB_FEATURE_HUB)
+// Class of the device on the root port, the hub on the root port (or NULL), its number of downstream ports, and the
+// time of its next status change poll.
+static uint8_t rootClass;
+static usb_device * hub = NULL;
+static uint8_t hubPorts;
+static uint32_t hubPollTime;
+#endif
+
 /**
  * Initialises the USB layer.
  */
@@ -49,6 +71,14 @@ void USB::init()
 	deviceTable[0].address = 0;
 	USB::initEndPoint(&(deviceTable[0].control), 0);
 
+	// Complete transfers from the max3421e interrupt handler.
+	transfer.state = USB_TRANSFER_IDLE;
+	ahead = NULL;
+	max3421e_setTransferHandler(USB::transferHandler);
+
+#if ADB_HAS(ADB_FEATURE_HUB)
+	hub = NULL;
+#endif
 }
 
 /**
@@ -61,6 +91,28 @@ void USB::initEndPoint(usb_endpoint * endpoint, uint8_t address)
 	endpoint->address = address;
 	endpoint->sendToggle = bmSNDTOG0;
 	endpoint->receiveToggle = bmRCVTOG0;
+	endpoint->transferred = 0;
+	endpoint->nakCount = 0;
+	endpoint->readAhead = 0;
+	endpoint->nakLimit = 0;
+	endpoint->nakTime = 0;
+	endpoint->zeroLengthPacket = false;
+}
+
+/**
+ * Limits the NAKs a transfer on an endpoint may take, on top of the limit the caller passes and the deadline of
+ * USB::setDeadline. A transfer that reaches the NAK count fails with hrNAK. One that is still NAKed once the time is
+ * up completes with hrNAK as well, but USB::bulkWritev treats that like the deadline, i.e. the write can be resumed.
+ * Endpoints start without a budget every time the device is enumerated, so set it after USB_CONNECT.
+ *
+ * @param endpoint USB endpoint.
+ * @param naks maximum number of NAKs per transfer, or 0 for no limit of its own.
+ * @param time maximum time per transfer in microseconds that NAKs are retried for, or 0 for no limit.
+ */
+void USB::setNakBudget(usb_endpoint * endpoint, unsigned int naks, uint16_t time)
+{
+	endpoint->nakLimit = naks;
+	endpoint->nakTime = time;
 }
 
 /**
@@ -132,69 +184,262 @@ usb_device * usb_getDevice(uint8_t address)
 	return &(deviceTable[address]);
 }
 
-int usb_dispatchPacket(uint8_t token, usb_endpoint * endpoint, unsigned int nakLimit)
+/**
+ * Starts a host transfer and returns immediately. The transfer is retried on NAK (up to nakLimit) and on bus
+ * timeouts (up to USB_RETRY_LIMIT) from the max3421e interrupt handler, which runs whenever the INT pin is found
+ * asserted by max3421e_poll (i.e. from USB::poll or USB::waitTransfer). Only one transfer can be in flight.
+ *
+ * @param device USB device to address, or NULL to keep the current peripheral address.
+ * @param endpoint endpoint to dispatch the token on.
+ * @param token transfer token (tokIN, tokOUT, tokSETUP, ...).
+ * @param length for OUT and SETUP transfers, the number of bytes to load into the FIFO. Ignored otherwise.
+ * @param data for OUT and SETUP transfers, the packet payload. Ignored otherwise. For OUT transfers this may be
+ *             NULL if the caller has already loaded SNDFIFO and set transfer.first (see USB::writev).
+ * @param nakLimit maximum number of NAKs before giving up.
+ * @param callback function to call when the transfer is done, or NULL.
+ * @return 0 on success, -1 if another transfer is still in flight.
+ */
+int USB::startTransfer(usb_device * device, usb_endpoint * endpoint, uint8_t token, uint8_t length, uint8_t * data, unsigned int nakLimit, usb_transferCallback * callback)
 {
-	uint32_t timeout = millis() + USB_XFER_TIMEOUT;
-	uint8_t tmpdata;
-	uint8_t rcode = 0;
-	unsigned int nak_count = 0;
-	char retry_count = 0;
+	uint32_t now;
+
+	if (transfer.state == USB_TRANSFER_BUSY) return -1;
+
+	// Apply the NAK budget of the endpoint, see USB::setNakBudget.
+	if (endpoint->nakLimit != 0 && endpoint->nakLimit < nakLimit)
+		nakLimit = endpoint->nakLimit;
+
+	now = micros();
+
+	transfer.token = token;
+	transfer.endpoint = endpoint;
+	transfer.length = length;
+	transfer.nakLimit = nakLimit;
+	transfer.nakCount = 0;
+	transfer.retryCount = 0;
+	transfer.nakTimed = endpoint->nakTime != 0;
+	transfer.nakDeadline = now + endpoint->nakTime;
+	transfer.result = 0;
+	transfer.hrsl = 0;
+	transfer.deadline = now + USB_XFER_TIMEOUT * 1000UL;
+	transfer.callback = callback;
+	transfer.state = USB_TRANSFER_BUSY;
+
+	// Set device address.
+	if (device != NULL)
+		max3421e_write(MAX_REG_PERADDR, device->address);
 
-	while (timeout > millis())
+	// Load the payload.
+	if (token == tokSETUP)
+		max3421e_writeMultiple(MAX_REG_SUDFIFO, length, data);
+	else if (token == tokOUT)
 	{
-		// Analyze transfer result.
+		if (data != NULL)
+		{
+			transfer.first = *data;
+			max3421e_writeMultiple(MAX_REG_SNDFIFO, length, data);
+		}
+		max3421e_write(MAX_REG_SNDBC, length);
+	}
 
-		// Launch the transfer.
-		max3421e_write(MAX_REG_HXFR, (token | endpoint->address));
-		rcode = 0xff;
+	// Launch the transfer.
+	max3421e_write(MAX_REG_HXFR, (token | endpoint->address));
 
-		// Wait for interrupt
-		while (timeout > millis())
-		{
-			tmpdata = max3421e_read(MAX_REG_HIRQ);
-			if (tmpdata & bmHXFRDNIRQ)
-			{
-				// Clear the interrupt.
-				max3421e_write(MAX_REG_HIRQ, bmHXFRDNIRQ);
+	return 0;
+}
 
-				rcode = 0x00;
-				break;
-			}
-		}
+/**
+ * Relaunches the transfer in flight after a NAK or a bus timeout.
+ */
+void USB::retryTransfer()
+{
+	// Process NAK according to Host out NAK bug.
+	if (transfer.token == tokOUT)
+	{
+		max3421e_write(MAX_REG_SNDBC, 0);
+		max3421e_write(MAX_REG_SNDFIFO, transfer.first);
+		max3421e_write(MAX_REG_SNDBC, transfer.length);
+	}
 
-		// Exit if timeout.
-		if (rcode != 0x00)
-			return (rcode);
+	max3421e_write(MAX_REG_HXFR, (transfer.token | transfer.endpoint->address));
+}
 
-		// Wait for HRSL
-		while (timeout > millis())
-		{
-			rcode = (max3421e_read(MAX_REG_HRSL) & 0x0f);
-			if (rcode != hrBUSY)
-				break;
-//			else
-//				serialPrintf("busy!\n");
-		}
+/**
+ * Transfer completion handler, called by the max3421e interrupt handler after HXFRDNIRQ. Either relaunches the
+ * transfer (NAK, bus timeout) or marks it as done and fires the completion callback.
+ *
+ * @param hrsl value of the HRSL register.
+ */
+void USB::transferHandler(uint8_t hrsl)
+{
+	// Ignore completions of transfers that have been aborted.
+	if (transfer.state != USB_TRANSFER_BUSY) return;
 
+	// Wait for HRSL
+	while ((hrsl & 0x0f) == hrBUSY && !USB::isPassed(transfer.deadline))
+		hrsl = max3421e_read(MAX_REG_HRSL);
 
-		switch (rcode)
+	transfer.hrsl = hrsl;
+	transfer.result = hrsl & 0x0f;
+
+	if (!USB::isPassed(transfer.deadline))
+	{
+		switch (transfer.result)
 		{
 			case hrNAK:
-				nak_count++;
-				if (nak_count == nakLimit)
-					return (rcode);
-				break;
+#if ADB_HAS(ADB_FEATURE_STATS)
+				transfer.endpoint->stats.naks++;
+#endif
+				transfer.nakCount++;
+				if (transfer.nakCount == transfer.nakLimit || USB::isDeadlinePassed())
+					break;
+				if (transfer.nakTimed && USB::isPassed(transfer.nakDeadline))
+					break;
+
+				USB::retryTransfer();
+				return;
 			case hrTIMEOUT:
-				retry_count++;
-				if (retry_count == USB_RETRY_LIMIT)
-					return (rcode);
-				break;
+#if ADB_HAS(ADB_FEATURE_STATS)
+				transfer.endpoint->stats.timeouts++;
+#endif
+				transfer.retryCount++;
+				if (transfer.retryCount == USB_RETRY_LIMIT)
+					break;
+
+				USB::retryTransfer();
+				return;
 			default:
-				return (rcode);
+				break;
 		}
 	}
 
-	return (rcode);
+	transfer.state = USB_TRANSFER_DONE;
+
+	if (transfer.callback != NULL)
+		transfer.callback(&transfer);
+}
+
+/**
+ * Waits for the transfer in flight to complete. The max3421e is only accessed when its INT pin is asserted, so
+ * waiting doesn't generate any SPI traffic.
+ *
+ * @return result code of the transfer (hrSUCCESS on success), or USB_TRANSFER_ABORTED on timeout.
+ */
+uint8_t USB::waitTransfer()
+{
+	while (transfer.state == USB_TRANSFER_BUSY)
+	{
+		max3421e_poll();
+
+		// Abort the transfer if the max3421e doesn't respond in time.
+		if (transfer.state == USB_TRANSFER_BUSY && USB::isPassed(transfer.deadline))
+		{
+#if ADB_HAS(ADB_FEATURE_STATS)
+			transfer.endpoint->stats.timeouts++;
+#endif
+			transfer.result = USB_TRANSFER_ABORTED;
+			transfer.state = USB_TRANSFER_DONE;
+
+			if (transfer.callback != NULL)
+				transfer.callback(&transfer);
+		}
+	}
+
+	return transfer.result;
+}
+
+/**
+ * Sets a deadline for NAK retries. A transfer that is NAKed after the deadline has passed is not retried but
+ * completes with hrNAK, and USB::writev returns USB_TRANSFER_PENDING so that the write can be resumed later. This
+ * bounds the time spent on a device that is not ready, which would otherwise be up to USB_NAK_LIMIT NAKs or
+ * USB_XFER_TIMEOUT per packet.
+ *
+ * @param time deadline in microseconds, as returned by micros().
+ */
+void USB::setDeadline(uint32_t time)
+{
+	deadline = time;
+	deadlineSet = true;
+}
+
+/**
+ * Removes the deadline, see USB::setDeadline.
+ */
+void USB::clearDeadline()
+{
+	deadlineSet = false;
+}
+
+/**
+ * @return true iff a deadline is set and it has passed.
+ */
+boolean USB::isDeadlinePassed()
+{
+	return deadlineSet && USB::isPassed(deadline);
+}
+
+/**
+ * @param us number of microseconds from now.
+ * @return a deadline, to be checked with USB::isPassed.
+ */
+uint32_t USB::getDeadline(uint32_t us)
+{
+	return micros() + us;
+}
+
+/**
+ * Checks a deadline. The comparison is wrap-safe for deadlines up to 2^31 microseconds (some 35 minutes) away.
+ *
+ * @param deadline deadline in microseconds, as returned by USB::getDeadline or micros().
+ * @return true iff the deadline has passed.
+ */
+boolean USB::isPassed(uint32_t deadline)
+{
+	return (int32_t)(micros() - deadline) >= 0;
+}
+
+/**
+ * @return true iff a transfer is in flight.
+ */
+boolean USB::isTransferPending()
+{
+	return transfer.state == USB_TRANSFER_BUSY;
+}
+
+/**
+ * @return true iff a newly attached device is being reset or enumerated. Enumeration waits for SOF frames, whose
+ * interrupt flag every poll clears, so it needs the poll loop to keep running.
+ */
+boolean USB::isEnumerating()
+{
+	uint8_t state = usb_task_state & USB_STATE_MASK;
+
+	return state != USB_STATE_DETACHED && state < USB_STATE_RUNNING;
+}
+
+/**
+ * @return the record of the transfer in flight, or of the last completed transfer.
+ */
+usb_transfer * USB::getTransfer()
+{
+	return &transfer;
+}
+
+/**
+ * Dispatches a single packet and waits for it to complete.
+ *
+ * @param token transfer token.
+ * @param endpoint endpoint to dispatch the token on.
+ * @param nakLimit maximum number of NAKs before giving up.
+ * @return result code of the transfer (hrSUCCESS on success).
+ */
+uint8_t USB::dispatchPacket(uint8_t token, usb_endpoint * endpoint, unsigned int nakLimit)
+{
+	// Let a transfer started by someone else finish first.
+	USB::waitTransfer();
+
+	USB::startTransfer(NULL, endpoint, token, 0, NULL, nakLimit, NULL);
+	return USB::waitTransfer();
 }
 
 /**
@@ -205,8 +450,9 @@ void USB::poll()
 	uint8_t i;
 	uint8_t rcode;
 	uint8_t tmpdata;
-	static unsigned long delay = 0;
+	static uint32_t delay = 0;
 	usb_deviceDescriptor deviceDescriptor;
+	usb_device * device;
 
 	// Poll the MAX3421E device.
 	max3421e_poll();
@@ -229,7 +475,7 @@ void USB::poll()
 	case LSHOST:
 		if ((usb_task_state & USB_STATE_MASK) == USB_STATE_DETACHED)
 		{
-			delay = millis() + USB_SETTLE_DELAY;
+			delay = USB::getDeadline(USB_SETTLE_DELAY * 1000UL);
 			usb_task_state = USB_ATTACHED_SUBSTATE_SETTLE;
 		}
 		break;
@@ -256,7 +502,7 @@ void USB::poll()
 	case USB_DETACHED_SUBSTATE_ILLEGAL: //just sit here
 		break;
 	case USB_ATTACHED_SUBSTATE_SETTLE: //setlle time for just attached device
-		if (delay < millis())
+		if (USB::isPassed(delay))
 		{
 			usb_task_state = USB_ATTACHED_SUBSTATE_RESET_DEVICE;
 		}
@@ -275,14 +521,14 @@ void USB::poll()
 			max3421e_write(MAX_REG_MODE, tmpdata);
 			//                  max3421e_regWr( rMODE, bmSOFKAENAB );
 			usb_task_state = USB_ATTACHED_SUBSTATE_WAIT_SOF;
-			delay = millis() + 20; //20ms wait after reset per USB spec
+			delay = USB::getDeadline(20000UL); //20ms wait after reset per USB spec
 		}
 		break;
 
 	case USB_ATTACHED_SUBSTATE_WAIT_SOF: //todo: change check order
 		if (max3421e_read(MAX_REG_HIRQ) & bmFRAMEIRQ)
 		{ //when first SOF received we can continue
-			if (delay < millis())
+			if (USB::isPassed(delay))
 			{ //20ms passed
 				usb_task_state
 						= USB_ATTACHED_SUBSTATE_GET_DEVICE_DESCRIPTOR_SIZE;
@@ -299,6 +545,12 @@ void USB::poll()
 		if (rcode == 0)
 		{
 			deviceTable[0].control.maxPacketSize = deviceDescriptor.bMaxPacketSize0;
+			deviceTable[0].vendorId = deviceDescriptor.idVendor;
+			deviceTable[0].productId = deviceDescriptor.idProduct;
+			deviceTable[0].releaseNumber = deviceDescriptor.bcdDevice;
+#if ADB_HAS(ADB_FEATURE_HUB)
+			rootClass = deviceDescriptor.bDeviceClass;
+#endif
 			usb_task_state = USB_STATE_ADDRESSING;
 		} else
 		{
@@ -309,55 +561,37 @@ void USB::poll()
 
 	case USB_STATE_ADDRESSING:
 
-		// Look for an empty spot
-		for (i = 1; i < USB_NUMDEVICES; i++)
+		device = USB::addressDevice(0);
+		if (device == NULL)
 		{
-			if (!deviceTable[i].active)
-			{
-				// Set correct MaxPktSize
-				// deviceTable[i].epinfo = deviceTable[0].epinfo;
-
-				deviceTable[i].address = i;
-				deviceTable[i].active = true;
-
-				USB::initEndPoint(&(deviceTable[i].control), 0);
-
-				// temporary record until plugged with real device endpoint structure
-				rcode = USB::setAddress(&deviceTable[0], i);
-
-				if (rcode == 0)
-				{
-					USB::fireEvent(&deviceTable[i], USB_CONNECT);
-					// usb_task_state = USB_STATE_CONFIGURING;
-					// NB: I've bypassed the configuring state, because configuration should be handled
-					// in the usb event handler.
-					usb_task_state = USB_STATE_RUNNING;
-				} else
-				{
-					USB::fireEvent(&deviceTable[i], USB_ADRESSING_ERROR);
-
-					// TODO remove usb_error at some point?
-					usb_error = USB_STATE_ADDRESSING;
-					usb_task_state = USB_STATE_ERROR;
-				}
-				break; //break if address assigned or error occured during address assignment attempt
-			}
+			usb_task_state = USB_STATE_ERROR;
+			break;
 		}
 
-		// If no vacant spot was found in the device table, fire an error.
-		if (usb_task_state == USB_STATE_ADDRESSING)
+#if ADB_HAS(ADB_FEATURE_HUB)
+		// A hub is served by the USB layer itself, the devices behind it are reported as they come and go.
+		if (rootClass == USB_CLASS_HUB)
 		{
-			USB::fireEvent(&deviceTable[i], USB_ADRESSING_ERROR);
-
-			// No vacant place in devtable
-			usb_error = 0xfe;
-			usb_task_state = USB_STATE_ERROR;
+			USB::initHub(device);
+			usb_task_state = USB_STATE_RUNNING;
+			break;
 		}
+#endif
+
+		USB::fireEvent(device, USB_CONNECT);
+		// usb_task_state = USB_STATE_CONFIGURING;
+		// NB: I've bypassed the configuring state, because configuration should be handled
+		// in the usb event handler.
+		usb_task_state = USB_STATE_RUNNING;
 
 		break;
 	case USB_STATE_CONFIGURING:
 		break;
 	case USB_STATE_RUNNING:
+#if ADB_HAS(ADB_FEATURE_HUB)
+		if (hub != NULL)
+			USB::pollHub();
+#endif
 		break;
 	case USB_STATE_ERROR:
 		break;
@@ -411,22 +645,93 @@ int USB::getString(usb_device * device, uint8_t index, uint8_t languageId, uint1
  */
 int USB::read(usb_device * device, usb_endpoint * endpoint, uint16_t length, uint8_t * data, unsigned int nakLimit)
 {
-	uint16_t rcode, bytesRead;
+	return USB::readRing(device, endpoint, length, data, length, 0, nakLimit);
+}
+
+/**
+ * Completion callback of an IN transfer launched ahead of time. Keeps its outcome, the transfer record may be
+ * reused by someone else before USB::readRing picks it up.
+ *
+ * @param transfer the completed transfer.
+ */
+void USB::readAheadDone(usb_transfer * transfer)
+{
+	aheadResult = transfer->result;
+	aheadHrsl = transfer->hrsl;
+}
+
+/**
+ * Tells the USB layer how many bytes are about to be read from the bulk IN endpoint of a device, for instance the
+ * payload of a message whose header was just read. While more is expected, USB::readRing launches the IN transfer
+ * for the next packet before draining the full packet it has, so that the max3421e receives it into its second
+ * FIFO while the first one is read out over SPI.
+ *
+ * The packet read ahead is the next one in the stream, and is returned by the next read from the same endpoint. No
+ * IN transfers on other endpoints may be made in the meantime. The read ahead gives up at the first NAK, because any
+ * other transfer has to wait for it to finish first. The next read then dispatches the IN again with its own NAK
+ * limit.
+ *
+ * @param device USB bulk device.
+ * @param length number of bytes expected, 0 to stop reading ahead.
+ */
+void USB::setReadAhead(usb_device * device, uint32_t length)
+{
+	device->bulk_in.readAhead = length;
+}
+
+/**
+ * Performs an in transfer from a USB device from an arbitrary endpoint, draining the receive FIFO straight into a
+ * ring buffer. At most length bytes are stored, starting at ring[offset] and wrapping around at ring[size]. Any
+ * bytes beyond that in the last packet are dropped when the FIFO is released.
+ *
+ * If the endpoint expects more data (see USB::setReadAhead), the IN transfer for the next packet is launched right
+ * after a full packet has come in, and picked up by the next call.
+ *
+ * @param device USB bulk device.
+ * @param endpoint endpoint to read from.
+ * @param length maximum number of bytes to store.
+ * @param ring target ring buffer, may be NULL if length is 0.
+ * @param size size of the ring buffer.
+ * @param offset position in the ring buffer of the first byte.
+ * @param nakLimit NAK limit.
+ * @return number of bytes received from the device, or error code in case of failure.
+ */
+int USB::readRing(usb_device * device, usb_endpoint * endpoint, uint16_t length, uint8_t * ring, uint16_t size, uint16_t offset, unsigned int nakLimit)
+{
+	uint16_t rcode, bytesRead, count, chunk;
 	uint16_t maxPacketSize = endpoint->maxPacketSize;
+	uint8_t hrsl;
 
 	unsigned int totalTransferred = 0;
+	unsigned int totalStored = 0;
 
 	// Set device address.
 	max3421e_write(MAX_REG_PERADDR, device->address);
 
-	// Set toggle value.
-	max3421e_write(MAX_REG_HCTL, endpoint->receiveToggle);
+	// Set toggle value, unless a transfer read ahead has already moved it on.
+	if (ahead != endpoint)
+		max3421e_write(MAX_REG_HCTL, endpoint->receiveToggle);
 
 	while (1)
 	{
 
-		// Start IN transfer
-		rcode = usb_dispatchPacket(tokIN, endpoint, nakLimit);
+		rcode = hrNAK;
+		if (ahead == endpoint)
+		{
+			// Pick up the IN transfer that was launched by the last read.
+			USB::waitTransfer();
+			ahead = NULL;
+
+			rcode = aheadResult;
+			hrsl = aheadHrsl;
+		}
+
+		// Start IN transfer, or start it again if the one read ahead was NAKed.
+		if (rcode == hrNAK)
+		{
+			rcode = USB::dispatchPacket(tokIN, endpoint, nakLimit);
+			hrsl = transfer.hrsl;
+		}
 
 		if (rcode)
 		{
@@ -442,14 +747,41 @@ int USB::read(usb_device * device, usb_endpoint * endpoint, uint16_t length, uin
 //			serialPrintf("USB::read: toggle error? %d\n", rcode);
 
 			// TODO: the absence of RCVDAVIRQ indicates a toggle error. Need to add handling for that.
+#if ADB_HAS(ADB_FEATURE_STATS)
+			endpoint->stats.toggleErrors++;
+#endif
 			return -2;
 		}
 
 		// Obtain the number of bytes in FIFO.
 		bytesRead = max3421e_read(MAX_REG_RCVBC);
 
-		// Read the data from the FIFO.
-		data = max3421e_readMultiple(MAX_REG_RCVFIFO, bytesRead, data);
+		// If more is on its way, have the max3421e receive the next packet into its second FIFO while this one is
+		// being drained.
+		endpoint->readAhead -= endpoint->readAhead < bytesRead ? endpoint->readAhead : bytesRead;
+		if (bytesRead == maxPacketSize && endpoint->readAhead > 0)
+		{
+			USB::startTransfer(NULL, endpoint, tokIN, 0, NULL, USB_NAK_NOWAIT, USB::readAheadDone);
+			ahead = endpoint;
+		}
+
+		// Never store more than the caller asked for.
+		count = length - totalStored;
+		if (count > bytesRead) count = bytesRead;
+		totalStored += count;
+
+		// Read the data from the FIFO, splitting the read where it wraps around the end of the ring.
+		while (count > 0)
+		{
+			chunk = size - offset;
+			if (chunk > count) chunk = count;
+
+			max3421e_readMultiple(MAX_REG_RCVFIFO, chunk, ring + offset);
+
+			offset += chunk;
+			if (offset == size) offset = 0;
+			count -= chunk;
+		}
 
 		// Clear the interrupt to free the buffer.
 		max3421e_write(MAX_REG_HIRQ, bmRCVDAVIRQ);
@@ -461,7 +793,7 @@ int USB::read(usb_device * device, usb_endpoint * endpoint, uint16_t length, uin
 		if ((bytesRead < maxPacketSize) || (totalTransferred >= length))
 		{
 			// Remember the toggle value for the next transfer.
-			if (max3421e_read(MAX_REG_HRSL) & bmRCVTOGRD)
+			if (hrsl & bmRCVTOGRD)
 				endpoint->receiveToggle = bmRCVTOG1;
 			else
 				endpoint->receiveToggle = bmRCVTOG0;
@@ -475,7 +807,6 @@ int USB::read(usb_device * device, usb_endpoint * endpoint, uint16_t length, uin
 	return totalTransferred;
 }
 
-
 /**
  * Performs a bulk in transfer from a USB device.
  *
@@ -490,6 +821,23 @@ int USB::bulkRead(usb_device * device, uint16_t length, uint8_t * data, boolean
 	return USB::read(device, &(device->bulk_in), length, data, poll ? 1 : USB_NAK_LIMIT);
 }
 
+/**
+ * Performs a bulk in transfer from a USB device into a ring buffer, see USB::readRing.
+ *
+ * @param device USB bulk device.
+ * @param length maximum number of bytes to store.
+ * @param ring target ring buffer.
+ * @param size size of the ring buffer.
+ * @param offset position in the ring buffer of the first byte.
+ * @param poll true to poll for a packet, false to wait for one.
+ *
+ * @return number of bytes received from the device, or error code in case of failure.
+ */
+int USB::bulkReadRing(usb_device * device, uint16_t length, uint8_t * ring, uint16_t size, uint16_t offset, boolean poll)
+{
+	return USB::readRing(device, &(device->bulk_in), length, ring, size, offset, poll ? 1 : USB_NAK_LIMIT);
+}
+
 
 /**
  * Performs ab out transfer to a USB device on an arbitrary endpoint.
@@ -497,99 +845,131 @@ int USB::bulkRead(usb_device * device, uint16_t length, uint8_t * data, boolean
  * @param device USB bulk device.
  * @param device length number of bytes to read.
  * @param data target buffer.
- * @return number of bytes written, or error code in case of failure.
+ * @return 0 on success, or error code in case of failure.
  */
 int USB::write(usb_device * device, usb_endpoint * endpoint, uint16_t length, uint8_t * data)
 {
-	uint8_t rcode = 0, retry_count;
-
-	// Set device address.
-	max3421e_write(MAX_REG_PERADDR, device->address);
-
-	// Local copy of the data pointer.
-	uint8_t * data_p = data;
+	usb_segment segment;
 
-	unsigned int bytes_tosend, nak_count;
-	unsigned int bytes_left = length;
-	unsigned int nak_limit = USB_NAK_LIMIT;
+	segment.data = data;
+	segment.length = length;
+	segment.progmem = false;
 
-	uint32_t timeout = millis() + USB_XFER_TIMEOUT;
+	return USB::writev(device, endpoint, 1, &segment);
+}
 
+/**
+ * Performs an out transfer to a USB device on an arbitrary endpoint, gathering the payload from a list of segments.
+ * Each packet is loaded into the FIFO straight from the segments it spans, so no contiguous copy of the payload is
+ * needed. Segments may reside in program memory.
+ *
+ * If a deadline is set (see USB::setDeadline) and the device NAKs a packet until it has passed, USB_TRANSFER_PENDING
+ * is returned. The number of bytes sent and the NAK count are kept in the endpoint, and calling this function again
+ * with the same segments resumes the write with the packet that was NAKed.
+ *
+ * On an endpoint with zeroLengthPacket set, a write that fills its last packet is ended with a zero-length packet.
+ *
+ * @param device USB bulk device.
+ * @param endpoint endpoint to write to.
+ * @param count number of segments.
+ * @param segments payload segments.
+ * @return 0 on success, USB_TRANSFER_PENDING if cut short by the deadline, or error code in case of failure.
+ */
+int USB::writev(usb_device * device, usb_endpoint * endpoint, uint8_t count, usb_segment * segments)
+{
+	uint8_t rcode = 0;
 	uint8_t maxPacketSize = endpoint->maxPacketSize;
+	uint8_t packetLength, chunk, i;
+	uint16_t offset = endpoint->transferred;
+	uint32_t total = 0;
+	boolean terminate;
 
 	// If maximum packet size is not set, return.
 	if (!maxPacketSize) return 0xFE;
 
-	max3421e_write(MAX_REG_HCTL, endpoint->sendToggle); //set toggle value
-
-	while (bytes_left)
-	{
-		retry_count = 0;
-		nak_count = 0;
+	for (i = 0; i < count; i++)
+		total += segments[i].length;
+	terminate = endpoint->zeroLengthPacket && total > 0 && total % maxPacketSize == 0;
 
-		bytes_tosend = (bytes_left >= maxPacketSize) ? maxPacketSize : bytes_left;
+	// Let a transfer started by someone else finish before touching the toggle and FIFO.
+	USB::waitTransfer();
 
-		// Filling output FIFO
-		max3421e_writeMultiple(MAX_REG_SNDFIFO, bytes_tosend, data_p);
+	// Set device address.
+	max3421e_write(MAX_REG_PERADDR, device->address);
 
-		// Set number of bytes to send.
-		max3421e_write(MAX_REG_SNDBC, bytes_tosend);
+	max3421e_write(MAX_REG_HCTL, endpoint->sendToggle); //set toggle value
 
-		// Dispatch packet.
-		max3421e_write(MAX_REG_HXFR, (tokOUT | endpoint->address));
+	// Skip what was sent before the last call was cut short, and leading empty segments.
+	while (count > 0 && offset >= segments->length)
+	{
+		offset -= segments->length;
+		segments++;
+		count--;
+	}
 
-		// Wait for completion.
-		while (!(max3421e_read(MAX_REG_HIRQ) & bmHXFRDNIRQ));
+	// A zero-length packet at the end takes one more round with nothing left to load.
+	while (count > 0 || terminate)
+	{
+		// Fill the FIFO with up to one packet worth of data, taken from as many segments as needed.
+		packetLength = 0;
+		transfer.first = 0;
+		while (count > 0 && packetLength < maxPacketSize)
+		{
+			chunk = maxPacketSize - packetLength;
+			if (chunk > segments->length - offset) chunk = segments->length - offset;
 
-		// Clear IRQ.
-		max3421e_write(MAX_REG_HIRQ, bmHXFRDNIRQ);
+			if (segments->progmem)
+			{
+				if (packetLength == 0) transfer.first = pgm_read_byte(segments->data + offset);
+				max3421e_writeMultiple_P(MAX_REG_SNDFIFO, chunk, segments->data + offset);
+			}
+			else
+			{
+				if (packetLength == 0) transfer.first = segments->data[offset];
+				max3421e_writeMultiple(MAX_REG_SNDFIFO, chunk, (uint8_t*)segments->data + offset);
+			}
 
-		rcode = (max3421e_read(MAX_REG_HRSL) & 0x0f);
+			packetLength += chunk;
+			offset += chunk;
 
-		while (rcode && (timeout > millis()))
-		{
-			switch (rcode)
+			// Move on to the next non-empty segment.
+			while (count > 0 && offset == segments->length)
 			{
-			case hrNAK:
-				nak_count++;
-				if (nak_limit && (nak_count == USB_NAK_LIMIT))
-				{
-					return (rcode); //return NAK
-				}
-				break;
-			case hrTIMEOUT:
-				retry_count++;
-				if (retry_count == USB_RETRY_LIMIT)
-				{
-					return (rcode); //return TIMEOUT
-				}
-				break;
-			default:
-				return (rcode);
+				segments++;
+				count--;
+				offset = 0;
 			}
+		}
 
-			// Process NAK according to Host out NAK bug.
-			max3421e_write(MAX_REG_SNDBC, 0);
-			max3421e_write(MAX_REG_SNDFIFO, *data_p);
-			max3421e_write(MAX_REG_SNDBC, bytes_tosend);
-			max3421e_write(MAX_REG_HXFR, (tokOUT | endpoint->address)); //dispatch packet
+		if (packetLength < maxPacketSize) terminate = false;
+
+		// Dispatch the packet. NAKs and timeouts are retried by the transfer handler, NAKs only until the deadline.
+		USB::startTransfer(NULL, endpoint, tokOUT, packetLength, NULL, USB_NAK_LIMIT - endpoint->nakCount, NULL);
+		rcode = USB::waitTransfer();
 
-			// Wait for the completion interrupt.
-			while (!(max3421e_read(MAX_REG_HIRQ) & bmHXFRDNIRQ));
+		// Cut short by the deadline or the NAK time of the endpoint, the next call picks up with this packet. Rewind the FIFO, so that it is empty for
+		// writes to other endpoints in the meantime. The packet is loaded again when the write is resumed.
+		if (rcode == hrNAK && transfer.nakCount < transfer.nakLimit)
+		{
+			max3421e_write(MAX_REG_SNDBC, 0);
+			endpoint->nakCount += transfer.nakCount;
+			return USB_TRANSFER_PENDING;
+		}
 
-			// Clear interrupt.
-			max3421e_write(MAX_REG_HIRQ, bmHXFRDNIRQ);
+		endpoint->nakCount = 0;
 
-			rcode = (max3421e_read(MAX_REG_HRSL) & 0x0f);
+		if (rcode)
+		{
+			endpoint->transferred = 0;
+			return (rcode);
 		}
 
-		bytes_left -= bytes_tosend;
-		data_p += bytes_tosend;
+		endpoint->transferred += packetLength;
+		endpoint->sendToggle = (transfer.hrsl & bmSNDTOGRD) ? bmSNDTOG1 : bmSNDTOG0; //update toggle
 	}
 
-	endpoint->sendToggle = (max3421e_read(MAX_REG_HRSL) & bmSNDTOGRD) ? bmSNDTOG1 : bmSNDTOG0; //update toggle
+	endpoint->transferred = 0;
 
-	// Should be 0 in all cases.
 	return (rcode);
 }
 
@@ -606,6 +986,19 @@ int USB::bulkWrite(usb_device * device, uint16_t length, uint8_t * data)
 	return USB::write(device, &(device->bulk_out) , length, data);
 }
 
+/**
+ * Performs a bulk out transfer to a USB device, gathering the payload from a list of segments, see USB::writev.
+ *
+ * @param device USB bulk device.
+ * @param count number of segments.
+ * @param segments payload segments.
+ * @return 0 on success, or error code in case of failure.
+ */
+int USB::bulkWritev(usb_device * device, uint8_t count, usb_segment * segments)
+{
+	return USB::writev(device, &(device->bulk_out), count, segments);
+}
+
 /**
  * Read/write data to/from the control endpoint of a device.
  *
@@ -671,8 +1064,9 @@ int USB::controlRequest(
 	setup_pkt.wLength = length;
 
 	// Write setup packet to the FIFO and dispatch
-	max3421e_writeMultiple(MAX_REG_SUDFIFO, 8, (uint8_t *) &setup_pkt);
-	rcode = usb_dispatchPacket(tokSETUP, &(device->control), USB_NAK_LIMIT);
+	USB::waitTransfer();
+	USB::startTransfer(NULL, &(device->control), tokSETUP, 8, (uint8_t *) &setup_pkt, USB_NAK_LIMIT, NULL);
+	rcode = USB::waitTransfer();
 
 	// Print error in case of failure.
 	if (rcode)
@@ -696,9 +1090,9 @@ int USB::controlRequest(
 
 	// Status stage.
 	if (direction)
-		rcode = usb_dispatchPacket(tokOUTHS, &(device->control), USB_NAK_LIMIT);
+		rcode = USB::dispatchPacket(tokOUTHS, &(device->control), USB_NAK_LIMIT);
 	else
-		rcode = usb_dispatchPacket(tokINHS, &(device->control), USB_NAK_LIMIT);
+		rcode = USB::dispatchPacket(tokINHS, &(device->control), USB_NAK_LIMIT);
 
 	if (rcode)
 		return -3;
@@ -765,3 +1159,230 @@ int USB::setConfiguration(usb_device * device, uint8_t configuration)
 {
     return(USB::controlRequest(device, bmREQ_SET, USB_REQUEST_SET_CONFIGURATION, configuration, 0x00, 0x0000, 0x0000, NULL));
 }
+
+/**
+ * Assigns an address to the device that answers at address 0, once the packet size of its control endpoint and its
+ * IDs have been read into deviceTable[0]. The lowest free entry of the device table is taken, a USB_ADRESSING_ERROR event is fired
+ * if there is none or SET_ADDRESS fails.
+ *
+ * @param port hub port the device is attached to, or 0 for the root port.
+ * @return the device, or NULL in case of failure.
+ */
+usb_device * USB::addressDevice(uint8_t port)
+{
+	uint8_t i;
+
+	// Look for an empty spot
+	for (i = 1; i < USB_NUMDEVICES; i++)
+		if (!deviceTable[i].active) break;
+
+	// If no vacant spot was found in the device table, fire an error.
+	if (i == USB_NUMDEVICES)
+	{
+		USB::fireEvent(&deviceTable[i], USB_ADRESSING_ERROR);
+
+		// No vacant place in devtable
+		usb_error = 0xfe;
+		return NULL;
+	}
+
+	deviceTable[i].address = i;
+	deviceTable[i].port = port;
+
+	USB::initEndPoint(&(deviceTable[i].control), 0);
+	deviceTable[i].control.maxPacketSize = deviceTable[0].control.maxPacketSize;
+	deviceTable[i].vendorId = deviceTable[0].vendorId;
+	deviceTable[i].productId = deviceTable[0].productId;
+	deviceTable[i].releaseNumber = deviceTable[0].releaseNumber;
+
+	if (USB::setAddress(&deviceTable[0], i))
+	{
+		USB::fireEvent(&deviceTable[i], USB_ADRESSING_ERROR);
+
+		// TODO remove usb_error at some point?
+		usb_error = USB_STATE_ADDRESSING;
+		return NULL;
+	}
+
+	deviceTable[i].active = true;
+
+	return &deviceTable[i];
+}
+
+#if ADB_HAS(ADB_FEATURE_HUB)
+/**
+ * Sets up the hub on the root port: configures it, looks up its status change endpoint, and powers its ports.
+ * Ports that have a device attached report a connection change, which is picked up by USB::pollHub. Hubs behind the
+ * hub and low speed devices are not supported.
+ *
+ * @param device the hub.
+ */
+void USB::initHub(usb_device * device)
+{
+	uint8_t buf[64];
+	int bytesRead, pos;
+	uint8_t port;
+
+	// The configuration holds a single interface with a single (interrupt IN) endpoint.
+	bytesRead = USB::getConfigurationDescriptor(device, 0, sizeof(buf), buf);
+	if (bytesRead < 0) return;
+
+	for (pos = 0; pos + 1 < bytesRead && buf[pos] > 0; pos += buf[pos])
+		if (buf[pos + 1] == USB_DESCRIPTOR_ENDPOINT && (buf[pos + 2] & 0x80))
+		{
+			USB::initEndPoint(&(device->bulk_in), buf[pos + 2] & 0x0f);
+			device->bulk_in.attributes = USB_TRANSFER_TYPE_INTERRUPT;
+			device->bulk_in.maxPacketSize = buf[pos + 4];
+			break;
+		}
+
+	if (pos + 1 >= bytesRead || buf[pos] == 0) return;
+
+	if (USB::setConfiguration(device, buf[5])) return;
+
+	// Hub descriptor: bNbrPorts at offset 2, bPwrOn2PwrGood (in units of 2 ms) at offset 5.
+	if (USB::controlRequest(device, bmREQ_HUB_GET_DESCR, USB_REQUEST_GET_DESCRIPTOR, 0x00, USB_DESCRIPTOR_HUB, 0x0000, 7, buf))
+		return;
+
+	hubPorts = buf[2] < USB_HUB_MAX_PORTS ? buf[2] : USB_HUB_MAX_PORTS;
+
+	for (port = 1; port <= hubPorts; port++)
+		USB::controlRequest(device, bmREQ_PORT_FEATURE, USB_REQUEST_SET_FEATURE, HUB_FEATURE_PORT_POWER, 0x00, port, 0x0000, NULL);
+
+	delay(buf[5] * 2);
+
+	hub = device;
+	hubPollTime = micros();
+}
+
+/**
+ * Reads the status of a hub port.
+ *
+ * @param port port number, 1 based.
+ * @param status receives wPortStatus.
+ * @param change receives wPortChange.
+ * @return 0 on success, error code otherwise.
+ */
+int USB::getPortStatus(uint8_t port, uint16_t * status, uint16_t * change)
+{
+	uint8_t buf[4];
+	int rcode;
+
+	rcode = USB::controlRequest(hub, bmREQ_PORT_GET_STATUS, USB_REQUEST_GET_STATUS, 0x00, 0x00, port, 4, buf);
+	*status = buf[0] | (buf[1] << 8);
+	*change = buf[2] | (buf[3] << 8);
+
+	return rcode;
+}
+
+/**
+ * Clears a hub port feature.
+ *
+ * @param port port number, 1 based.
+ * @param feature feature selector.
+ * @return 0 on success, error code otherwise.
+ */
+int USB::clearPortFeature(uint8_t port, uint8_t feature)
+{
+	return USB::controlRequest(hub, bmREQ_PORT_FEATURE, USB_REQUEST_CLEAR_FEATURE, feature, 0x00, port, 0x0000, NULL);
+}
+
+/**
+ * Resets a hub port a device has just been plugged into, and assigns the device an address. This blocks for the
+ * duration of the port reset and the reset recovery time, some 20 milliseconds.
+ *
+ * @param port port number, 1 based.
+ */
+void USB::enumeratePort(uint8_t port)
+{
+	usb_deviceDescriptor deviceDescriptor;
+	usb_device * device;
+	uint16_t status, change;
+	uint32_t timeout;
+
+	// The hub enables the port once the reset is done.
+	if (USB::controlRequest(hub, bmREQ_PORT_FEATURE, USB_REQUEST_SET_FEATURE, HUB_FEATURE_PORT_RESET, 0x00, port, 0x0000, NULL))
+		return;
+
+	timeout = USB::getDeadline(USB_HUB_RESET_TIMEOUT * 1000UL);
+	do
+	{
+		if (USB::getPortStatus(port, &status, &change)) return;
+		if (USB::isPassed(timeout)) return;
+	}
+	while ((change & bmHUB_PORT_C_RESET) == 0);
+
+	USB::clearPortFeature(port, HUB_FEATURE_C_PORT_RESET);
+
+	// Low speed devices need PRE packets, which the stack does not send.
+	if ((status & bmHUB_PORT_ENABLE) == 0 || (status & bmHUB_PORT_LOW_SPEED))
+		return;
+
+	delay(USB_HUB_RESET_RECOVERY);
+
+	// The same steps as for the root port: read the packet size of the control endpoint, then assign an address.
+	USB::initEndPoint(&(deviceTable[0].control), 0);
+	deviceTable[0].control.maxPacketSize = 8;
+
+	if (USB::getDeviceDescriptor(&deviceTable[0], &deviceDescriptor)) return;
+	deviceTable[0].control.maxPacketSize = deviceDescriptor.bMaxPacketSize0;
+	deviceTable[0].vendorId = deviceDescriptor.idVendor;
+	deviceTable[0].productId = deviceDescriptor.idProduct;
+	deviceTable[0].releaseNumber = deviceDescriptor.bcdDevice;
+
+	device = USB::addressDevice(port);
+	if (device == NULL || deviceDescriptor.bDeviceClass == USB_CLASS_HUB) return;
+
+	USB::fireEvent(device, USB_CONNECT);
+}
+
+/**
+ * Handles a status change of a hub port. A device that was on the port is reported as disconnected if the port lost
+ * its connection (even if another device has been plugged in since), and a device that is on the port now is
+ * enumerated.
+ *
+ * @param port port number, 1 based.
+ */
+void USB::hubPortChange(uint8_t port)
+{
+	uint16_t status, change;
+	uint8_t i;
+
+	if (USB::getPortStatus(port, &status, &change)) return;
+
+	if (change & bmHUB_PORT_C_CONNECTION) USB::clearPortFeature(port, HUB_FEATURE_C_PORT_CONNECTION);
+	if (change & bmHUB_PORT_C_ENABLE) USB::clearPortFeature(port, HUB_FEATURE_C_PORT_ENABLE);
+	if (change & bmHUB_PORT_C_RESET) USB::clearPortFeature(port, HUB_FEATURE_C_PORT_RESET);
+
+	if ((change & bmHUB_PORT_C_CONNECTION) || (status & bmHUB_PORT_ENABLE) == 0)
+		for (i = 1; i < USB_NUMDEVICES; i++)
+			if (deviceTable[i].active && deviceTable[i].port == port)
+			{
+				deviceTable[i].active = false;
+				USB::fireEvent(&(deviceTable[i]), USB_DISCONNECT);
+			}
+
+	if ((change & bmHUB_PORT_C_CONNECTION) && (status & bmHUB_PORT_CONNECTION))
+		USB::enumeratePort(port);
+}
+
+/**
+ * Polls the status change endpoint of the hub every USB_HUB_POLL_INTERVAL milliseconds, and handles the ports that
+ * report a change. Skipped while data read ahead for a bulk endpoint is waiting in the receive FIFO (see
+ * USB::setReadAhead), since the control transfers would land behind it.
+ */
+void USB::pollHub()
+{
+	uint8_t changes, port;
+
+	if (ahead != NULL || !USB::isPassed(hubPollTime)) return;
+	hubPollTime = USB::getDeadline(USB_HUB_POLL_INTERVAL * 1000UL);
+
+	// One bit per port, bit 0 is the hub itself. The hub NAKs while nothing has changed.
+	if (USB::read(hub, &(hub->bulk_in), 1, &changes, 1) <= 0) return;
+
+	for (port = 1; port <= hubPorts; port++)
+		if (changes & (1 << port))
+			USB::hubPortChange(port);
+}
+#endif
@@ -20,6 +20,8 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#include "AdbConfig.h"
+
 // Device descriptor.
 typedef struct
 {
@@ -87,6 +89,21 @@ typedef struct
 	uint16_t wLength;				// 6 Depends on bRequest
 } usb_setupPacket;
 
+#if ADB_HAS(ADB_FEATURE_STATS)
+/**
+ * Per-endpoint counters, see ADB::getStats.
+ */
+typedef struct
+{
+	// Number of NAKs received.
+	uint32_t naks;
+	// Number of bus timeouts, including transfers aborted after USB_XFER_TIMEOUT.
+	uint16_t timeouts;
+	// Number of IN transfers that completed without data (toggle errors).
+	uint16_t toggleErrors;
+} usb_endpointStats;
+#endif
+
 /**
  * USB endpoint.
  */
@@ -104,6 +121,22 @@ typedef struct
     // The max3421e uses these bits to toggle between DATA0 and DATA1.
     uint8_t sendToggle;
     uint8_t receiveToggle;
+    // Progress of a write that was cut short by the deadline (see USB::setDeadline): number of bytes sent, and
+    // number of NAKs so far for the packet that is next.
+    uint16_t transferred;
+    unsigned int nakCount;
+    // Number of bytes still expected on an IN endpoint, see USB::setReadAhead.
+    uint32_t readAhead;
+    // NAK budget of each transfer on the endpoint: the maximum number of NAKs, and the time in microseconds after
+    // which NAKs are no longer retried. 0 means no limit of its own, see USB::setNakBudget.
+    unsigned int nakLimit;
+    uint16_t nakTime;
+    // End writes that fill their last packet with a zero-length packet, for devices that read in blocks of more
+    // than a packet and would otherwise wait for the rest of the block (Android accessories).
+    boolean zeroLengthPacket;
+#if ADB_HAS(ADB_FEATURE_STATS)
+    usb_endpointStats stats;
+#endif
 
 } usb_endpoint;
 
@@ -118,6 +151,9 @@ typedef struct
 	// Indicates whether this device is active.
 	uint8_t active;
 
+	// Hub port the device is attached to, or 0 if it is on the root port.
+	uint8_t port;
+
 	// Endpoints.
 	usb_endpoint control;
 	usb_endpoint bulk_in, bulk_out;
@@ -125,8 +161,79 @@ typedef struct
 	// First supported language (for retrieving Strings)
 	uint16_t firstStringLanguage;
 
+	// Vendor and product ID and release number, from the device descriptor.
+	uint16_t vendorId, productId, releaseNumber;
+
 } usb_device;
 
+/**
+ * A contiguous piece of an outgoing payload, see USB::bulkWritev. Segments can live in RAM or in program memory.
+ */
+typedef struct
+{
+	// Segment data.
+	const uint8_t * data;
+
+	// Number of bytes in the segment.
+	uint16_t length;
+
+	// True iff data points into program memory (PROGMEM).
+	boolean progmem;
+
+} usb_segment;
+
+typedef enum
+{
+	USB_TRANSFER_IDLE = 0,
+	USB_TRANSFER_BUSY,
+	USB_TRANSFER_DONE
+} usb_transferState;
+
+typedef struct _usb_transfer usb_transfer;
+
+// Transfer completion callback.
+typedef void(usb_transferCallback)(usb_transfer * transfer);
+
+/**
+ * Host transfer in flight. The max3421e executes one transfer at a time, so there is a single instance of this
+ * record. A transfer is launched by USB::startTransfer and completed (or retried on NAK/timeout) from the max3421e
+ * interrupt handler. The handler is not an ISR: max3421e_poll calls it when it finds the INT pin asserted, from
+ * USB::poll and USB::waitTransfer. So transfers are pin-polled, and still synchronous. Every caller except the
+ * read-ahead (see USB::setReadAhead) waits for its transfer to finish, and the time spent waiting is only bounded by
+ * the NAK limit and the poll budget. The pin is polled rather than attached to an interrupt because the handler
+ * talks to the max3421e over SPI, a bus the application may be using itself when the interrupt fires.
+ */
+struct _usb_transfer
+{
+	// Transfer state, see usb_transferState.
+	volatile uint8_t state;
+
+	// Token and endpoint the transfer was dispatched on.
+	uint8_t token;
+	usb_endpoint * endpoint;
+
+	// Length and first byte of the payload of an OUT transfer, needed to re-arm the FIFO after a NAK.
+	uint8_t length;
+	uint8_t first;
+
+	// NAK and retry bookkeeping, and the time after which NAKs are no longer retried if nakTimed is set.
+	unsigned int nakLimit;
+	unsigned int nakCount;
+	uint8_t retryCount;
+	boolean nakTimed;
+	uint32_t nakDeadline;
+
+	// Result code (lower four bits of HRSL) and raw HRSL value of the last attempt.
+	uint8_t result;
+	uint8_t hrsl;
+
+	// Deadline of the transfer in microseconds (see USB::getDeadline), after which it is aborted.
+	uint32_t deadline;
+
+	// Called when the transfer is done, may be NULL.
+	usb_transferCallback * callback;
+};
+
 typedef enum
 {
 	USB_CONNECT,
@@ -139,6 +246,34 @@ typedef enum
 #define bmREQ_SET           USB_SETUP_HOST_TO_DEVICE|USB_SETUP_TYPE_STANDARD|USB_SETUP_RECIPIENT_DEVICE     //set request type for all but 'set feature' and 'set interface'
 #define bmREQ_CL_GET_INTF   USB_SETUP_DEVICE_TO_HOST|USB_SETUP_TYPE_CLASS|USB_SETUP_RECIPIENT_INTERFACE     //get interface request type
 
+/* Hub class (USB 2.0 chapter 11) */
+#define USB_CLASS_HUB               0x09
+#define USB_DESCRIPTOR_HUB          0x29
+#define bmREQ_HUB_GET_DESCR     USB_SETUP_DEVICE_TO_HOST|USB_SETUP_TYPE_CLASS|USB_SETUP_RECIPIENT_DEVICE   //get hub descriptor request type
+#define bmREQ_PORT_GET_STATUS   USB_SETUP_DEVICE_TO_HOST|USB_SETUP_TYPE_CLASS|USB_SETUP_RECIPIENT_OTHER    //get port status request type
+#define bmREQ_PORT_FEATURE      USB_SETUP_HOST_TO_DEVICE|USB_SETUP_TYPE_CLASS|USB_SETUP_RECIPIENT_OTHER    //set/clear port feature request type
+
+#define HUB_FEATURE_PORT_ENABLE     1       // port feature selectors
+#define HUB_FEATURE_PORT_RESET      4
+#define HUB_FEATURE_PORT_POWER      8
+#define HUB_FEATURE_C_PORT_CONNECTION   16
+#define HUB_FEATURE_C_PORT_ENABLE   17
+#define HUB_FEATURE_C_PORT_RESET    20
+
+#define bmHUB_PORT_CONNECTION       0x0001  // wPortStatus bits
+#define bmHUB_PORT_ENABLE           0x0002
+#define bmHUB_PORT_RESET            0x0010
+#define bmHUB_PORT_POWER            0x0100
+#define bmHUB_PORT_LOW_SPEED        0x0200
+#define bmHUB_PORT_C_CONNECTION     0x0001  // wPortChange bits
+#define bmHUB_PORT_C_ENABLE         0x0002
+#define bmHUB_PORT_C_RESET          0x0010
+
+#define USB_HUB_MAX_PORTS           7       // downstream ports served, so that the status change bitmap fits one byte
+#define USB_HUB_POLL_INTERVAL       32      // interval between status change polls in milliseconds
+#define USB_HUB_RESET_TIMEOUT       100     // time a port reset may take in milliseconds
+#define USB_HUB_RESET_RECOVERY      10      // reset recovery time in milliseconds, per section 7.1.7.5 of USB 2.0 spec
+
 /* HID requests */
 /*
 #define bmREQ_HIDOUT        USB_SETUP_HOST_TO_DEVICE|USB_SETUP_TYPE_CLASS|USB_SETUP_RECIPIENT_INTERFACE
@@ -151,8 +286,9 @@ typedef enum
 #define USB_RETRY_LIMIT     3       // retry limit for a transfer
 #define USB_SETTLE_DELAY    200     // settle delay in milliseconds
 #define USB_NAK_NOWAIT      1       // used in Richard's PS2/Wiimote code
+#define USB_TRANSFER_ABORTED 0xff   // result code of a transfer that timed out while waiting for HXFRDNIRQ
+#define USB_TRANSFER_PENDING 0xfd   // a write was cut short by the deadline, and can be resumed
 
-#define USB_NUMDEVICES  2           // Number of USB devices
 
 /* USB state machine states */
 
@@ -187,10 +323,24 @@ class USB
 private:
 	static void fireEvent(usb_device * device, usb_eventType event);
 	static int setAddress(usb_device * device, uint8_t address);
-	static int controlRequest(usb_device * device, uint8_t requestType, uint8_t request, uint8_t valueLow, uint8_t valueHigh, uint16_t index, uint16_t length, uint8_t * data);
 	static int read(usb_device * device, usb_endpoint * endpoint, uint16_t length, uint8_t * data, unsigned int nakLimit);
+	static int readRing(usb_device * device, usb_endpoint * endpoint, uint16_t length, uint8_t * ring, uint16_t size, uint16_t offset, unsigned int nakLimit);
 	static int write(usb_device * device, usb_endpoint * endpoint, uint16_t length, uint8_t * data);
+	static int writev(usb_device * device, usb_endpoint * endpoint, uint8_t count, usb_segment * segments);
 	static uint8_t ctrlData(usb_device * device, boolean direction, uint16_t length, uint8_t * data);
+	static uint8_t dispatchPacket(uint8_t token, usb_endpoint * endpoint, unsigned int nakLimit);
+	static void transferHandler(uint8_t hrsl);
+	static void retryTransfer();
+	static void readAheadDone(usb_transfer * transfer);
+	static usb_device * addressDevice(uint8_t port);
+#if ADB_HAS(ADB_FEATURE_HUB)
+	static void initHub(usb_device * device);
+	static void pollHub();
+	static int getPortStatus(uint8_t port, uint16_t * status, uint16_t * change);
+	static int clearPortFeature(uint8_t port, uint8_t feature);
+	static void enumeratePort(uint8_t port);
+	static void hubPortChange(uint8_t port);
+#endif
 
 public:
 	static void init();
@@ -205,11 +355,27 @@ public:
 	static int getDeviceDescriptor(usb_device * device, usb_deviceDescriptor * descriptor);
 	static int getConfigurationDescriptor(usb_device * device, uint8_t conf, uint16_t length, uint8_t * data);
 	static int getString(usb_device * device, uint8_t index, uint8_t languageId, uint16_t length, char * str);
+	static int controlRequest(usb_device * device, uint8_t requestType, uint8_t request, uint8_t valueLow, uint8_t valueHigh, uint16_t index, uint16_t length, uint8_t * data);
 
 	static void initEndPoint(usb_endpoint * endpoint, uint8_t address);
+	static void setNakBudget(usb_endpoint * endpoint, unsigned int naks, uint16_t time);
+
+	static int startTransfer(usb_device * device, usb_endpoint * endpoint, uint8_t token, uint8_t length, uint8_t * data, unsigned int nakLimit, usb_transferCallback * callback);
+	static uint8_t waitTransfer();
+	static void setDeadline(uint32_t deadline);
+	static void clearDeadline();
+	static boolean isDeadlinePassed();
+	static uint32_t getDeadline(uint32_t us);
+	static boolean isPassed(uint32_t deadline);
+	static boolean isTransferPending();
+	static boolean isEnumerating();
+	static usb_transfer * getTransfer();
 
 	static int bulkRead(usb_device * device, uint16_t length, uint8_t * data, boolean poll);
+	static int bulkReadRing(usb_device * device, uint16_t length, uint8_t * ring, uint16_t size, uint16_t offset, boolean poll);
+	static void setReadAhead(usb_device * device, uint32_t length);
 	static int bulkWrite(usb_device * device, uint16_t length, uint8_t * data);
+	static int bulkWritev(usb_device * device, uint8_t count, usb_segment * segments);
 
 };
 
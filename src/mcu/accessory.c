@@ -0,0 +1,62 @@
+/*
+Copyright 2011 Niels Brouwers
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include "avr.h"
+#include "adb.h"
+
+// The phone as an Android Open Accessory.
+static adb_accessory accessory;
+
+// Event handler for the accessory, echoes whatever the phone sends.
+void accessoryHandler(adb_accessory * accessory, adb_eventType event, uint16_t length, uint8_t * data)
+{
+	switch (event)
+	{
+	case ADB_CONNECTION_OPEN:
+		avr_serialPrintf("Accessory open\n");
+		break;
+	case ADB_CONNECTION_CLOSE:
+		avr_serialPrintf("Accessory closed\n");
+		break;
+	case ADB_CONNECTION_RECEIVE:
+		adb_writeAccessory(accessory, length, data);
+		break;
+	default:
+		break;
+	}
+}
+
+int main()
+{
+	// Initialise avr timers
+	avr_timerInit();
+
+	// Initialise serial port
+	avr_serialInit(57600);
+
+ 	// Initialise ADB connection
+	adb_init();
+
+	// Ask phones to switch to accessory mode. The strings pick the application on the phone, phones that don't
+	// speak the protocol are used through ADB as usual.
+	adb_initAccessory(&accessory, "microbridge", "Echo", "MicroBridge echo accessory", "1.0", NULL, NULL,
+			accessoryHandler);
+
+	// ADB polling. The echo only answers the phone, so the processor can sleep while the phone is quiet.
+	while (1)
+		adb_run();
+
+	return 0;
+}
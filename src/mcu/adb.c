@@ -16,22 +16,139 @@ limitations under the License.
 
 #include <string.h>
 #include <stdlib.h>
+#include <avr/pgmspace.h>
 #include "adb.h"
 
 #include "max3421e/max3421e_usb.h"
 
-// #define DEBUG
+#ifdef ADB_PROFILE_EEPROM
+#include <avr/eeprom.h>
+#endif
+
+#if ADB_HAS(ADB_FEATURE_DEBUG)
+#define DEBUG
+#endif
 
 #define MAX_BUF_SIZE 256
 
-static usb_device * adbDevice;
-static adb_connection * firstConnection;
-static boolean connected;
-static int connectionLocalId = 1;
+// System identity sent in our CNXN message, kept in flash.
+static const char identity[] PROGMEM = "host::microbridge";
+
+#if ADB_MAX_DEVICES > 1 && !ADB_HAS(ADB_FEATURE_HUB)
+#error "ADB_MAX_DEVICES > 1 needs ADB_FEATURE_HUB"
+#endif
+
+// Device table, and the device that goes first in the next poll. See adb_service.
+static adb_device devices[ADB_MAX_DEVICES];
+static uint8_t nextDevice;
+
+#if ADB_HAS(ADB_FEATURE_HUB)
+// Index of the device an ADB_CONNECT, ADB_DISCONNECT or ADB_READY event is about, see adb_getEventDevice.
+static uint8_t eventDevice;
+#endif
+
+#if ADB_HAS(ADB_FEATURE_ACCESSORY)
+// Accessory transport, or NULL if phones are only used through ADB. See adb_initAccessory.
+static adb_accessory * aoa;
+
+// Maximum number of packets read from the accessory per poll.
+#define ADB_AOA_READS 8
+
+// Request types of the accessory vendor requests.
+#define bmREQ_AOA_GET (USB_SETUP_DEVICE_TO_HOST | USB_SETUP_TYPE_VENDOR | USB_SETUP_RECIPIENT_DEVICE)
+#define bmREQ_AOA_SET (USB_SETUP_HOST_TO_DEVICE | USB_SETUP_TYPE_VENDOR | USB_SETUP_RECIPIENT_DEVICE)
+#endif
+
+#if ADB_HAS(ADB_FEATURE_IDLE)
+// Time of the last ADB message or accessory transfer, see adb_run.
+static uint32_t lastActivity;
+#endif
+
+#if ADB_HAS(ADB_FEATURE_IDLE) && ADB_HAS(ADB_FEATURE_STATS)
+// Time adb_run last woke up, and whether nothing has been received since, see adb_stats.wakeLatency.
+static uint32_t wakeTime;
+static boolean awake;
+#endif
+
+#if ADB_HAS(ADB_FEATURE_PROFILE_CACHE)
+// Interface layouts of the devices seen before, and the entry that a new device replaces when the cache is full.
+static adb_profile profiles[ADB_PROFILE_CACHE_SIZE];
+static uint8_t nextProfile;
+
+#ifdef ADB_PROFILE_EEPROM
+// The EEPROM copy of the cache starts with a tag byte, which includes the number of entries so that a copy written
+// by a build with another cache size is ignored. The base changes with the layout of an entry.
+#define ADB_PROFILE_TAG (0xb0 + ADB_PROFILE_CACHE_SIZE)
+#endif
+#endif
+
+#if ADB_HAS(ADB_FEATURE_TRACE)
+// Number of trace frames dropped since the last one that was sent, see adb_trace.
+static uint16_t traceDropped;
+#endif
+
+// Connection table. The local ID of a connection is its index in the table plus one, as ADB reserves ID 0.
+static adb_connection connections[ADB_MAX_CONNECTIONS];
+
+// Retry timer wheel. Each slot holds a bit mask of connections (by table index) whose OPEN retry deadline falls
+// in that tick. Deadlines more than one round ahead simply stay in their slot for another round. Connections whose
+// deadline has passed move to timerDue, and one of them is opened per poll.
+#define ADB_TIMER_SLOTS 8
+#define ADB_TIMER_TICK 128
+
+static uint32_t timerWheel[ADB_TIMER_SLOTS];
+static uint32_t timerDue;
+static uint32_t timerTick;
+
+// State of the pseudo random generator that adds jitter to the retry delays.
+static uint16_t jitter = 0xace1;
+
+// Time budget of the poll in progress (in microseconds), see adb_pollBudget. 0 means unbounded.
+static uint32_t pollStart;
+static uint32_t pollBudget;
+
+// A connection whose WRTE payload is still being received, and the state of the connection before the WRTE. No new
+// messages can be read, from any device, before the remainder of the payload: part of it may already be waiting in
+// the receive FIFO (see usb_setReadAhead).
+static adb_connection * receiving;
+static adb_connectionStatus receivingStatus;
+static uint16_t receivingStored;
+
+#if ADB_HAS(ADB_FEATURE_STATS)
+// Statistics block, and the time each connection's last WRTE went out (to measure the OKAY round trip).
+static adb_stats stats;
+static uint32_t writeStart[ADB_MAX_CONNECTIONS];
+#endif
 
 // Event handler callback function.
 adb_eventHandler * eventHandler;
 
+#if ADB_HAS(ADB_FEATURE_WRITE_QUEUE)
+static int adb_flushWriteQueue(adb_connection * connection);
+static boolean adb_isFlushDue(adb_connection * connection);
+#endif
+static void adb_finishSend(adb_device * device);
+static boolean adb_receive(adb_connection * connection);
+static boolean adb_hasBudget();
+static void adb_enforceBudget(boolean enforce);
+static void adb_service();
+static void adb_serviceDevice(adb_device * device);
+#if ADB_HAS(ADB_FEATURE_ACCESSORY)
+static void adb_serviceAccessory();
+#endif
+#if ADB_HAS(ADB_FEATURE_STATS)
+static void adb_record(uint16_t * histogram, uint32_t duration);
+#endif
+#if ADB_HAS(ADB_FEATURE_IDLE)
+static void adb_noteReceive();
+#endif
+static adb_connection * adb_newConnection(boolean reconnect, adb_eventHandler * handler);
+static void adb_cancelOpen(adb_connection * connection);
+static void adb_scheduleOpen(adb_connection * connection, uint32_t delay);
+static void adb_scheduleRetry(adb_connection * connection);
+static void adb_settleOpen(adb_connection * connection);
+static void adb_handleClose(adb_connection * connection);
+
 /**
  * Sets the ADB event handler function. This function will be called by the ADB layer
  * when interesting events occur, such as ADB connect/disconnect, connection open/close, and
@@ -67,10 +184,12 @@ static void adb_fireEvent(adb_connection * connection, adb_eventType type, uint1
  * connection to tcp port 1234, and "shell:ls" outputs a listing of the phone root filesystem. Connections
  * can be made persistent by setting reconnect to true. Persistent connections will be automatically
  * reconnected when the USB cable is re-plugged in. Non-persistent connections will connect only once,
- * and should never be used after they are closed.
+ * and should never be used after they are closed, since their slot in the connection table is then free to be
+ * taken by the next connection that is added.
  *
- * The connection string is copied into the adb_connection record and may not exceed ADB_CONNECTIONSTRING_LENGTH-1
- * characters.
+ * Connections live in a static table of ADB_MAX_CONNECTIONS slots, so no heap memory is used. The connection
+ * string is copied into the adb_connection record and may not exceed ADB_CONNECTIONSTRING_LENGTH-1 characters.
+ * Use adb_addConnection_P for a constant connection string, which then stays in flash.
  *
  * @param connectionString ADB connectionstring. I.e. "tcp:1234" or "shell:ls".
  * @param reconnect true for automatic reconnect (persistent connections).
@@ -79,36 +198,218 @@ static void adb_fireEvent(adb_connection * connection, adb_eventType type, uint1
  */
 adb_connection * adb_addConnection(const char * connectionString, boolean reconnect, adb_eventHandler * handler)
 {
+	adb_connection * connection;
 
-	// Allocate a new ADB connection object
-	adb_connection * connection = (adb_connection*)malloc(sizeof(adb_connection));
-	if (connection == NULL) return NULL;
+	if (strlen(connectionString) >= ADB_CONNECTIONSTRING_LENGTH) return NULL;
 
-	// Allocate memory for the connection string
-	connection->connectionString = (char*)strdup(connectionString);
-	if (connection->connectionString==NULL)
-	{
-		// Free the connection object and return null
-		free(connection);
-		return NULL;
-	}
+	connection = adb_newConnection(reconnect, handler);
+#if ADB_CONNECTIONSTRING_LENGTH > 0
+	if (connection != NULL) strcpy(connection->connectionString, connectionString);
+#endif
+
+	return connection;
+}
+
+/**
+ * Adds a connection whose connection string is in program memory, e.g. adb_addConnection_P(PSTR("tcp:1234"), ...).
+ * The string is not copied, it goes from flash straight into the USB FIFO when the connection is opened, so it may
+ * be of any length and takes no SRAM. When all connections are added this way, ADB_CONNECTIONSTRING_LENGTH can be
+ * set to 0 to drop the connection string buffers altogether. See adb_addConnection.
+ *
+ * @param connectionString ADB connectionstring in program memory.
+ * @param reconnect true for automatic reconnect (persistent connections).
+ * @param handler event handler.
+ * @return an ADB connection record or NULL on failure (not enough slots).
+ */
+adb_connection * adb_addConnection_P(const char * connectionString, boolean reconnect, adb_eventHandler * handler)
+{
+	adb_connection * connection = adb_newConnection(reconnect, handler);
+
+	if (connection != NULL) connection->progmemString = connectionString;
+
+	return connection;
+}
+
+/**
+ * Takes a free slot in the connection table and initialises it, except for the connection string, which is left
+ * empty. The connection is opened on the next poll.
+ *
+ * @param reconnect true for automatic reconnect (persistent connections).
+ * @param handler event handler.
+ * @return an ADB connection record or NULL if all slots are in use.
+ */
+static adb_connection * adb_newConnection(boolean reconnect, adb_eventHandler * handler)
+{
+	adb_connection * connection = NULL;
+	uint8_t i;
+
+	// Find a free slot in the connection table.
+	for (i = 0; i < ADB_MAX_CONNECTIONS; i++)
+		if (connections[i].status == ADB_UNUSED)
+		{
+			connection = &connections[i];
+			break;
+		}
+
+	// Unable to find an empty spot, all connection slots in use.
+	if (connection == NULL) return NULL;
 
-	// Initialise the newly created object.
-	connection->localID = connectionLocalId ++;
+	// Initialise the connection record.
+#if ADB_CONNECTIONSTRING_LENGTH > 0
+	connection->connectionString[0] = 0;
+#endif
+	connection->progmemString = NULL;
+	connection->localID = i + 1;
+	connection->remoteID = 0;
 	connection->status = ADB_CLOSED;
-	connection->lastConnectionAttempt = 0;
-	connection->reconnect = reconnect;
+	connection->retryCount = 0;
+	connection->reconnect = reconnect != false;
 	connection->eventHandler = handler;
+#if ADB_HAS(ADB_FEATURE_HUB)
+	connection->device = 0;
+#endif
+#if ADB_HAS(ADB_FEATURE_WRITE_QUEUE)
+	connection->writeQueue = NULL;
+	connection->writeQueueSize = 0;
+	connection->writeQueueHead = 0;
+	connection->writeQueueLength = 0;
+	connection->coalesce = false;
+	connection->flushRequested = false;
+#endif
+#if ADB_HAS(ADB_FEATURE_RECEIVE_BUFFER)
+	connection->receiveBuffer = NULL;
+	connection->receiveBufferSize = 0;
+	connection->receiveHead = 0;
+	connection->receiveLength = 0;
+#endif
+#if ADB_HAS(ADB_FEATURE_FLOW_CONTROL)
+	connection->flowControl = false;
+	connection->okayPending = false;
+	connection->unconsumed = 0;
+#endif
 
-	// Add the connection to the linked list. Note that it's easier to just insert
-	// at position 0 because you don't have to traverse the list :)
-	connection->next = firstConnection;
-	firstConnection = connection;
+	// Open the connection as soon as possible.
+	adb_scheduleOpen(connection, 0);
 
-	// Unable to find an empty spot, all connection slots in use.
 	return connection;
 }
 
+/**
+ * Looks up a connection by its local ID.
+ *
+ * @param localID local ID of the connection, as sent by the device in arg1 of OKAY, CLSE, and WRTE messages.
+ * @return the connection, or NULL if the ID does not refer to a connection in use.
+ */
+static adb_connection * adb_getConnection(uint32_t localID)
+{
+	adb_connection * connection;
+
+	if (localID == 0 || localID > ADB_MAX_CONNECTIONS) return NULL;
+
+	connection = &connections[localID - 1];
+	return connection->status == ADB_UNUSED ? NULL : connection;
+}
+
+/**
+ * @param connection ADB connection.
+ * @return the ADB device the connection is bound to.
+ */
+static adb_device * adb_getDevice(adb_connection * connection)
+{
+#if ADB_HAS(ADB_FEATURE_HUB)
+	return &devices[connection->device];
+#else
+	(void)connection;
+	return &devices[0];
+#endif
+}
+
+#if ADB_HAS(ADB_FEATURE_TRACE)
+/**
+ * Sends a trace frame to the serial port: the sync byte, the event ID, the payload length, a 32-bit timestamp in
+ * microseconds (little endian), and the payload. The frame is only sent if the transmit ring has room for all of
+ * it, so that tracing never waits for the UART.
+ *
+ * @param event event ID.
+ * @param length payload length.
+ * @param data payload.
+ * @return true iff the frame was sent.
+ */
+static boolean adb_traceFrame(uint8_t event, uint8_t length, const uint8_t * data)
+{
+	uint32_t time;
+	uint8_t i;
+
+	if (avr_serialWriteAvailable() < length + 7) return false;
+
+	time = avr_micros();
+
+	avr_serialWrite(ADB_TRACE_SYNC);
+	avr_serialWrite(event);
+	avr_serialWrite(length);
+	for (i = 0; i < 4; i++)
+		avr_serialWrite(time >> (i * 8));
+	for (i = 0; i < length; i++)
+		avr_serialWrite(data[i]);
+
+	return true;
+}
+
+/**
+ * Logs an event to the binary trace, which trace.py formats on the host. Frames are interleaved with ordinary serial
+ * output. A frame that does not fit in the serial transmit ring is dropped instead of waited for, and the number
+ * of frames dropped is logged (as ADB_TRACE_DROPPED) ahead of the next frame that fits.
+ *
+ * @param event event ID, ADB_TRACE_USER or higher for application events.
+ * @param length payload length, at most AVR_SERIAL_TX_BUFFER_SIZE - 8 bytes.
+ * @param data payload.
+ */
+void adb_trace(uint8_t event, uint8_t length, const void * data)
+{
+	uint8_t dropped[2];
+
+	if (traceDropped > 0)
+	{
+		dropped[0] = traceDropped;
+		dropped[1] = traceDropped >> 8;
+
+		if (!adb_traceFrame(ADB_TRACE_DROPPED, sizeof(dropped), dropped))
+		{
+			if (traceDropped < 0xffff) traceDropped++;
+			return;
+		}
+
+		traceDropped = 0;
+	}
+
+	if (!adb_traceFrame(event, length, (const uint8_t *)data)) traceDropped = 1;
+}
+
+/**
+ * Logs an ADB message header to the binary trace: the low half of the command (which tells the commands apart),
+ * both arguments and the payload length, 12 bytes in all.
+ *
+ * @param event ADB_TRACE_IN or ADB_TRACE_OUT.
+ * @param message ADB message.
+ */
+static void adb_traceMessage(uint8_t event, adb_message * message)
+{
+	uint8_t data[12], i;
+
+	data[0] = message->command;
+	data[1] = message->command >> 8;
+	for (i = 0; i < 4; i++)
+	{
+		data[2 + i] = message->arg0 >> (i * 8);
+		data[6 + i] = message->arg1 >> (i * 8);
+	}
+	data[10] = message->data_length;
+	data[11] = message->data_length >> 8;
+
+	adb_trace(event, sizeof(data), data);
+}
+#endif
+
 /**
  * Prints an ADB_message, for debugging purposes.
  * @param message ADB message to print.
@@ -146,13 +447,13 @@ static void adb_printMessage(adb_message * message)
 /**
  * Writes an empty message (without payload) to the ADB device.
  *
- * @param device USB device handle.
+ * @param device ADB device.
  * @param command ADB command.
  * @param arg0 first ADB argument (command dependent).
  * @param arg0 second ADB argument (command dependent).
  * @return error code or 0 for success.
  */
-static int adb_writeEmptyMessage(usb_device * device, uint32_t command, uint32_t arg0, uint32_t arg1)
+static int adb_writeEmptyMessage(adb_device * device, uint32_t command, uint32_t arg0, uint32_t arg1)
 {
 	adb_message message;
 
@@ -166,32 +467,55 @@ static int adb_writeEmptyMessage(usb_device * device, uint32_t command, uint32_t
 #ifdef DEBUG
 	avr_serialPrint("OUT << "); adb_printMessage(&message);
 #endif
+#if ADB_HAS(ADB_FEATURE_TRACE)
+	adb_traceMessage(ADB_TRACE_OUT, &message);
+#endif
+#if ADB_HAS(ADB_FEATURE_IDLE)
+	lastActivity = avr_micros();
+#endif
 
-	return usb_bulkWrite(device, sizeof(adb_message), (uint8_t*)&message);
+	return usb_bulkWrite(device->usb, sizeof(adb_message), (uint8_t*)&message);
 }
 
 /**
- * Writes an ADB message with payload to the ADB device.
+ * Sends an ADB message whose payload is gathered from a list of segments, which may reside in RAM or in program
+ * memory. The payload checksum is computed in a single pass over the segments, or skipped altogether when the
+ * device speaks A_VERSION_SKIP_CHECKSUM or later. The payload is then loaded into the USB FIFO straight from the
+ * segments, without building a contiguous copy.
  *
- * @param device USB device handle.
+ * If a deadline is set (see adb_enforceBudget) and the device NAKs until it passes, USB_TRANSFER_PENDING is returned,
+ * and the same call must be repeated to send the remainder of the message before anything else is sent to the device.
+ *
+ * @param device ADB device.
  * @param command ADB command.
  * @param arg0 first ADB argument (command dependent).
  * @param arg0 second ADB argument (command dependent).
- * @param length payload length.
- * @param data command payload.
+ * @param count number of payload segments.
+ * @param segments payload segments.
  * @return error code or 0 for success.
  */
-int adb_writeMessage(usb_device * device, uint32_t command, uint32_t arg0, uint32_t arg1, uint32_t length, uint8_t * data)
+static int adb_sendMessagev(adb_device * device, uint32_t command, uint32_t arg0, uint32_t arg1, uint8_t count, usb_segment * segments)
 {
 	adb_message message;
-	uint32_t count, sum = 0;
-	uint8_t * x;
-	uint8_t rcode;
+	uint32_t length = 0, sum = 0;
+	const uint8_t * x;
+	uint16_t n;
+	uint8_t i, rcode;
+
+	// Calculate payload length and checksum.
+	for (i = 0; i < count; i++)
+	{
+		length += segments[i].length;
+
+		if (device->remoteVersion >= A_VERSION_SKIP_CHECKSUM) continue;
 
-	// Calculate data checksum
-    count = length;
-    x = data;
-    while(count-- > 0) sum += *x++;
+		n = segments[i].length;
+		x = segments[i].data;
+		if (segments[i].progmem)
+			while (n-- > 0) sum += pgm_read_byte(x++);
+		else
+			while (n-- > 0) sum += *x++;
+	}
 
 	// Fill out the message record.
 	message.command = command;
@@ -204,438 +528,3391 @@ int adb_writeMessage(usb_device * device, uint32_t command, uint32_t arg0, uint3
 #ifdef DEBUG
 	avr_serialPrint("OUT << "); adb_printMessage(&message);
 #endif
+#if ADB_HAS(ADB_FEATURE_TRACE)
+	adb_traceMessage(ADB_TRACE_OUT, &message);
+#endif
+#if ADB_HAS(ADB_FEATURE_IDLE)
+	lastActivity = avr_micros();
+#endif
+
+	// Send the header, unless it went out in an earlier call that ran out of time during the payload.
+	if (!device->headerSent)
+	{
+		rcode = usb_bulkWrite(device->usb, sizeof(adb_message), (uint8_t*)&message);
+		if (rcode) return rcode;
+
+		device->headerSent = true;
+	}
+
+	rcode = usb_bulkWritev(device->usb, count, segments);
+	if (rcode != USB_TRANSFER_PENDING) device->headerSent = false;
 
-	rcode = usb_bulkWrite(device, sizeof(adb_message), (uint8_t*)&message);
-	if (rcode) return rcode;
+#if ADB_HAS(ADB_FEATURE_STATS)
+	// Count the payload, and start the clock on the OKAY. A WRTE always carries our local ID in arg0.
+	if (rcode == 0 && command == A_WRTE && arg0 >= 1 && arg0 <= ADB_MAX_CONNECTIONS)
+	{
+		stats.bytesOut[arg0 - 1] += length;
+		writeStart[arg0 - 1] = avr_micros();
+	}
+#endif
 
-	rcode = usb_bulkWrite(device, length, data);
 	return rcode;
 }
 
+/**
+ * Sends the remainder of a WRTE that ran out of time during a poll, without a deadline. Called before any other
+ * message is sent to the device.
+ *
+ * @param device ADB device.
+ */
+static void adb_finishSend(adb_device * device)
+{
+#if ADB_HAS(ADB_FEATURE_WRITE_QUEUE)
+	if (device->sending != NULL)
+		adb_flushWriteQueue(device->sending);
+#else
+	(void)device;
+#endif
+}
+
+/**
+ * Sends an ADB message, see adb_sendMessagev. A WRTE that ran out of time halfway is completed first.
+ *
+ * @param device ADB device.
+ * @param command ADB command.
+ * @param arg0 first ADB argument (command dependent).
+ * @param arg0 second ADB argument (command dependent).
+ * @param count number of payload segments.
+ * @param segments payload segments.
+ * @return error code or 0 for success.
+ */
+int adb_writeMessagev(adb_device * device, uint32_t command, uint32_t arg0, uint32_t arg1, uint8_t count, usb_segment * segments)
+{
+	adb_finishSend(device);
+
+	return adb_sendMessagev(device, command, arg0, arg1, count, segments);
+}
+
+/**
+ * Writes an ADB message with payload to the ADB device.
+ *
+ * @param device ADB device.
+ * @param command ADB command.
+ * @param arg0 first ADB argument (command dependent).
+ * @param arg0 second ADB argument (command dependent).
+ * @param length payload length.
+ * @param data command payload.
+ * @return error code or 0 for success.
+ */
+int adb_writeMessage(adb_device * device, uint32_t command, uint32_t arg0, uint32_t arg1, uint32_t length, uint8_t * data)
+{
+	usb_segment segment;
+
+	segment.data = data;
+	segment.length = length;
+	segment.progmem = false;
+
+	return adb_writeMessagev(device, command, arg0, arg1, 1, &segment);
+}
+
 /**
  * Writes an ADB command with a string as payload.
  *
- * @param device USB device handle.
+ * @param device ADB device.
  * @param command ADB command.
  * @param arg0 first ADB argument (command dependent).
  * @param arg0 second ADB argument (command dependent).
  * @param str payload string.
  * @return error code or 0 for success.
  */
-int adb_writeStringMessage(usb_device * device, uint32_t command, uint32_t arg0, uint32_t arg1, char * str)
+int adb_writeStringMessage(adb_device * device, uint32_t command, uint32_t arg0, uint32_t arg1, char * str)
 {
 	return adb_writeMessage(device, command, arg0, arg1, strlen(str) + 1, (uint8_t*)str);
 }
 
+/**
+ * Writes an ADB command with a string in program memory as payload. The string is streamed from flash straight
+ * into the USB FIFO, without a copy in SRAM.
+ *
+ * @param device ADB device.
+ * @param command ADB command.
+ * @param arg0 first ADB argument (command dependent).
+ * @param arg0 second ADB argument (command dependent).
+ * @param str payload string in program memory.
+ * @return error code or 0 for success.
+ */
+int adb_writeStringMessage_P(adb_device * device, uint32_t command, uint32_t arg0, uint32_t arg1, const char * str)
+{
+	usb_segment segment;
+
+	segment.data = (const uint8_t*)str;
+	segment.length = strlen_P(str) + 1;
+	segment.progmem = true;
+
+	return adb_writeMessagev(device, command, arg0, arg1, 1, &segment);
+}
+
 /**
  * Poll an ADB message.
+ * @param device ADB device.
  * @param message on success, the ADB message will be returned in this struct.
  * @param poll true to poll for a packet on the input endpoint, false to wait for a packet. Use false here when a packet is expected (i.e. OKAY in response to WRTE)
  * @return true iff a packet was successfully received, false otherwise.
  */
-static boolean adb_pollMessage(adb_message * message, boolean poll)
+static boolean adb_pollMessage(adb_device * device, adb_message * message, boolean poll)
 {
 	int bytesRead;
-	uint8_t buf[ADB_USB_PACKETSIZE];
 
-	// Poll a packet from the USB
-	bytesRead = usb_bulkRead(adbDevice, ADB_USB_PACKETSIZE, buf, poll);
+	// Poll a packet from the USB, straight into the message struct.
+	bytesRead = usb_bulkRead(device->usb, sizeof(adb_message), (uint8_t*)message, poll);
 
 	// Check if the USB in transfer was successful.
 	if (bytesRead<0) return false;
 
-	// Check if the buffer contains a valid message
-	memcpy((void*)message, (void*)buf, sizeof(adb_message));
-
 	// If the message is corrupt, return.
 	if (message->magic != (message->command ^ 0xffffffff))
 	{
 #ifdef DEBUG
 		avr_serialPrintf("Broken message, magic mismatch, %d bytes\n", bytesRead);
-		return false;
 #endif
+#if ADB_HAS(ADB_FEATURE_TRACE)
+		adb_trace(ADB_TRACE_BROKEN, sizeof(adb_message), message);
+#endif
+		return false;
 	}
 
 	// Check if the received number of bytes matches our expected 24 bytes of ADB message header.
 	if (bytesRead != sizeof(adb_message)) return false;
 
+	// The payload follows right behind the header, let the USB layer read ahead into it.
+	usb_setReadAhead(device->usb, message->data_length);
+
 	return true;
 }
 
 /**
- * Sends an ADB OPEN message for any connections that are currently in the CLOSED state.
+ * Removes a connection from the retry timer wheel.
+ *
+ * @param connection ADB connection.
  */
-static void adb_openClosedConnections()
+static void adb_cancelOpen(adb_connection * connection)
 {
-	uint32_t timeSinceLastConnect;
-	adb_connection * connection;
+	uint32_t mask = ~(1UL << (connection->localID - 1));
+	uint8_t i;
 
-	// Iterate over the connection list and send "OPEN" for the ones that are currently closed.
-	for (connection = firstConnection; connection!=NULL; connection = connection->next)
-	{
-		timeSinceLastConnect = avr_millis() - connection->lastConnectionAttempt;
-		if (connection->status==ADB_CLOSED && timeSinceLastConnect>ADB_CONNECTION_RETRY_TIME)
-		{
-			// Issue open command.
-			adb_writeStringMessage(adbDevice, A_OPEN, connection->localID, 0, connection->connectionString);
-
-			// Record the last attempt time
-			connection->lastConnectionAttempt = avr_millis();
-			connection->status = ADB_OPENING;
-
-		}
-	}
+	for (i = 0; i < ADB_TIMER_SLOTS; i++)
+		timerWheel[i] &= mask;
 
+	timerDue &= mask;
 }
 
 /**
- * Handles and ADB OKAY message, which represents a transition in the connection state machine. 
+ * Schedules an OPEN attempt for a connection. Any attempt that was scheduled before is cancelled.
  *
- * @param connection ADB connection
- * @param message ADB message struct.
+ * @param connection ADB connection.
+ * @param delay delay in milliseconds.
  */
-static void adb_handleOkay(adb_connection * connection, adb_message * message)
+static void adb_scheduleOpen(adb_connection * connection, uint32_t delay)
 {
-	// Check if the OKAY message was a response to a CONNECT message.
-	if (connection->status==ADB_OPENING)
-	{
-		connection->status = ADB_OPEN;
-		connection->remoteID = message->arg0;
-
-		adb_fireEvent(connection, ADB_CONNECTION_OPEN, 0, NULL);
-	}
-
-	// Check if the OKAY message was a response to a WRITE message.
-	if (connection->status == ADB_WRITING)
-		connection->status = ADB_OPEN;
+	adb_cancelOpen(connection);
 
+	connection->retryDeadline = avr_millis() + delay;
+	timerWheel[(connection->retryDeadline / ADB_TIMER_TICK) & (ADB_TIMER_SLOTS - 1)] |= 1UL << (connection->localID - 1);
 }
 
 /**
- * Handles an ADB CLOSE message, and fires an ADB event accordingly.
+ * Schedules the next OPEN attempt for a persistent connection that failed to open or was closed. The delay starts at
+ * ADB_CONNECTION_RETRY_TIME and doubles with every consecutive failure up to ADB_CONNECTION_RETRY_MAX. Up to a
+ * quarter of the delay is added as random jitter, so that connections that failed together do not retry in lock
+ * step.
  *
- * @param connection ADB connection
+ * @param connection ADB connection.
  */
-static void adb_handleClose(adb_connection * connection)
+static void adb_scheduleRetry(adb_connection * connection)
 {
-	// Check if the CLOSE message was a response to a CONNECT message.
-	if (connection->status==ADB_OPENING)
-		adb_fireEvent(connection, ADB_CONNECTION_FAILED, 0, NULL);
-	else
-		adb_fireEvent(connection, ADB_CONNECTION_CLOSE, 0, NULL);
+	uint32_t delay = ADB_CONNECTION_RETRY_TIME;
+	uint8_t i;
 
-	// Connection failed
-	if (connection->reconnect)
-		connection->status = ADB_CLOSED;
+	for (i = 0; i < connection->retryCount && delay < ADB_CONNECTION_RETRY_MAX; i++)
+		delay <<= 1;
+	if (delay >= ADB_CONNECTION_RETRY_MAX)
+		delay = ADB_CONNECTION_RETRY_MAX;
 	else
-		connection->status = ADB_UNUSED;
+		connection->retryCount++;
+
+	// Jitter, from a 16-bit xorshift generator.
+	jitter ^= jitter << 7;
+	jitter ^= jitter >> 9;
+	jitter ^= jitter << 8;
+	delay += jitter % (delay / 4 + 1);
 
+	adb_scheduleOpen(connection, delay);
 }
 
 /**
- * Handles an ADB WRITE message.
- *
- * @param connection ADB connection
- * @param message ADB message struct.
+ * Advances the retry timer wheel. Visits every slot from the last tick that was processed up to the current one (at
+ * most one full round), and moves the connections whose deadline has passed to the set of due connections.
  */
-static void adb_handleWrite(adb_connection * connection, adb_message * message)
+static void adb_runTimers()
 {
-	uint32_t bytesLeft = message->data_length;
-	uint8_t buf[ADB_USB_PACKETSIZE];
-	adb_connectionStatus previousStatus;
-	int bytesRead;
-
-	previousStatus = connection->status;
+	uint32_t now = avr_millis();
+	uint32_t tick = now / ADB_TIMER_TICK;
+	uint32_t mask, bit;
+	uint8_t slot, index;
 
-	connection->status = ADB_RECEIVING;
-	connection->dataRead = 0;
-	connection->dataSize = message->data_length;
+	if (tick - timerTick >= ADB_TIMER_SLOTS)
+		timerTick = tick - (ADB_TIMER_SLOTS - 1);
 
-	while (bytesLeft>0)
+	while (1)
 	{
-		int len = bytesLeft < ADB_USB_PACKETSIZE ? bytesLeft : ADB_USB_PACKETSIZE;
-
-		// Read payload
-		bytesRead = usb_bulkRead(adbDevice, len, buf, false);
+		slot = timerTick & (ADB_TIMER_SLOTS - 1);
 
-		if (len != bytesRead)
-			avr_serialPrintf("bytes read mismatch: %d expected, %d read, %ld left\n", len, bytesRead, bytesLeft);
-
-		// Break out of the read loop if there's no data to read :(
-		if (bytesRead==-1) break;
-
-		connection->dataRead += len;
-		adb_fireEvent(connection, ADB_CONNECTION_RECEIVE, len, buf);
+		for (mask = timerWheel[slot], index = 0; mask != 0; mask >>= 1, index++)
+		{
+			bit = 1UL << index;
+			if ((mask & 1) && (int32_t)(now - connections[index].retryDeadline) >= 0)
+			{
+				timerWheel[slot] &= ~bit;
+				timerDue |= bit;
+			}
+		}
 
-		bytesLeft -= bytesRead;
+		if (timerTick == tick) break;
+		timerTick++;
 	}
-
-	// Send OKAY message in reply.
-	bytesRead = adb_writeEmptyMessage(adbDevice, A_OKAY, message->arg1, message->arg0);
-
-	connection->status = previousStatus;
 }
 
 /**
- * Close all ADB connections.
+ * Sends ADB OPEN messages for the closed connections of a device whose retry timers have expired, back to back and
+ * without waiting for the replies. The device answers each OPEN with an OKAY or CLSE addressed to its local ID, in
+ * whatever order, so all connections of a device open in a single round trip. With a poll budget, the OPENs that
+ * don't fit stay due for the next poll.
  *
- * @param connection ADB connection
- * @param message ADB message struct.
+ * An OPEN that can't be written is retried after the usual back-off. One that the device hasn't answered within
+ * ADB_OPEN_TIMEOUT fails as if the device had refused it. Either way, it no longer holds up ADB_READY.
+ *
+ * @param device ADB device.
+ */
+static void adb_openClosedConnections(adb_device * device)
+{
+	adb_connection * connection;
+	uint8_t index;
+	int rcode;
+
+	adb_runTimers();
+
+	// Take the due connections of this device in order.
+	for (index = 0; index < ADB_MAX_CONNECTIONS && timerDue != 0 && adb_hasBudget(); index++)
+	{
+		if (!(timerDue & (1UL << index)) || adb_getDevice(&connections[index]) != device) continue;
+		timerDue &= ~(1UL << index);
+
+		connection = &connections[index];
+		if (connection->status == ADB_OPENING)
+		{
+			adb_handleClose(connection);
+			continue;
+		}
+		if (connection->status!=ADB_CLOSED) continue;
+
+		// Issue open command, straight from flash if that is where the connection string is.
+#if ADB_CONNECTIONSTRING_LENGTH > 0
+		if (connection->progmemString == NULL)
+			rcode = adb_writeStringMessage(device, A_OPEN, connection->localID, 0, connection->connectionString);
+		else
+#endif
+			rcode = adb_writeStringMessage_P(device, A_OPEN, connection->localID, 0, connection->progmemString);
+
+		if (rcode != 0)
+		{
+			adb_scheduleRetry(connection);
+			adb_settleOpen(connection);
+			continue;
+		}
+
+		// The timer now runs out when the answer is overdue.
+		connection->status = ADB_OPENING;
+		adb_scheduleOpen(connection, ADB_OPEN_TIMEOUT);
+	}
+}
+
+/**
+ * Fires ADB_READY for a device.
+ *
+ * @param device ADB device.
+ */
+static void adb_fireReady(adb_device * device)
+{
+#if ADB_HAS(ADB_FEATURE_HUB)
+	eventDevice = device - devices;
+#else
+	(void)device;
+#endif
+	adb_fireEvent(NULL, ADB_READY, 0, NULL);
+}
+
+/**
+ * Takes a connection that has been answered out of the connections its device opened on connect, and fires
+ * ADB_READY when it was the last one.
+ *
+ * @param connection ADB connection.
+ */
+static void adb_settleOpen(adb_connection * connection)
+{
+	adb_device * device = adb_getDevice(connection);
+	uint32_t bit = 1UL << (connection->localID - 1);
+
+	if (!(device->opening & bit)) return;
+
+	device->opening &= ~bit;
+	if (device->opening == 0) adb_fireReady(device);
+}
+
+/**
+ * Handles and ADB OKAY message, which represents a transition in the connection state machine. 
+ *
+ * @param connection ADB connection
+ * @param message ADB message struct.
+ */
+static void adb_handleOkay(adb_connection * connection, adb_message * message)
+{
+	// Check if the OKAY message was a response to a CONNECT message.
+	if (connection->status==ADB_OPENING)
+	{
+		connection->status = ADB_OPEN;
+		connection->remoteID = message->arg0;
+		connection->retryCount = 0;
+		adb_cancelOpen(connection);
+
+#if ADB_HAS(ADB_FEATURE_RECEIVE_BUFFER)
+		// Start the new stream with an empty receive buffer.
+		connection->receiveHead = 0;
+		connection->receiveLength = 0;
+#endif
+#if ADB_HAS(ADB_FEATURE_FLOW_CONTROL)
+		connection->okayPending = false;
+		connection->unconsumed = 0;
+#endif
+
+		adb_fireEvent(connection, ADB_CONNECTION_OPEN, 0, NULL);
+		adb_settleOpen(connection);
+	}
+
+	// Check if the OKAY message was a response to a WRITE message.
+	if (connection->status == ADB_WRITING)
+	{
+		connection->status = ADB_OPEN;
+
+#if ADB_HAS(ADB_FEATURE_STATS)
+		adb_record(stats.okayLatency, avr_micros() - writeStart[connection->localID - 1]);
+#endif
+
+#if ADB_HAS(ADB_FEATURE_WRITE_QUEUE)
+		// Send the next batch of queued data right away.
+		if (adb_isFlushDue(connection))
+			adb_flushWriteQueue(connection);
+#endif
+	}
+
+}
+
+/**
+ * Handles an ADB CLOSE message, and fires an ADB event accordingly.
+ *
+ * @param connection ADB connection
+ */
+static void adb_handleClose(adb_connection * connection)
+{
+	// Check if the CLOSE message was a response to a CONNECT message.
+	if (connection->status==ADB_OPENING)
+	{
+		adb_fireEvent(connection, ADB_CONNECTION_FAILED, 0, NULL);
+		adb_settleOpen(connection);
+	}
+	else
+		adb_fireEvent(connection, ADB_CONNECTION_CLOSE, 0, NULL);
+
+	// Persistent connections are retried after a back-off delay, others are done.
+	if (connection->reconnect)
+	{
+		connection->status = ADB_CLOSED;
+		adb_scheduleRetry(connection);
+	}
+	else
+	{
+		connection->status = ADB_UNUSED;
+		adb_cancelOpen(connection);
+	}
+
+#if ADB_HAS(ADB_FEATURE_WRITE_QUEUE)
+	// Discard any queued data, it was meant for the old stream.
+	connection->writeQueueHead = 0;
+	connection->writeQueueLength = 0;
+	connection->flushRequested = false;
+#endif
+
+#if ADB_HAS(ADB_FEATURE_FLOW_CONTROL)
+	// An OKAY that was being withheld is moot now.
+	connection->okayPending = false;
+	connection->unconsumed = 0;
+#endif
+
+}
+
+#if ADB_HAS(ADB_FEATURE_PACKET_EVENTS)
+/**
+ * Reads one USB packet of the payload of an ADB WRITE message and fires an ADB_CONNECTION_RECEIVE event for it.
+ *
+ * @param connection ADB connection
+ * @return number of bytes read, or error code in case of failure.
+ */
+static int adb_receiveEvents(adb_connection * connection)
+{
+	uint32_t bytesLeft = connection->dataSize - connection->dataRead;
+	uint16_t length = bytesLeft < ADB_USB_PACKETSIZE ? bytesLeft : ADB_USB_PACKETSIZE;
+	uint8_t buf[ADB_USB_PACKETSIZE];
+	int bytesRead;
+
+	// Read payload
+	bytesRead = usb_bulkRead(adb_getDevice(connection)->usb, length, buf, false);
+	if (bytesRead < 0) return bytesRead;
+
+	if (length > bytesRead) length = bytesRead;
+	connection->dataRead += bytesRead;
+#if ADB_HAS(ADB_FEATURE_FLOW_CONTROL)
+	connection->unconsumed += length;
+#endif
+
+	// Writes from the event handler must not be cut short by the deadline.
+	adb_enforceBudget(false);
+	adb_fireEvent(connection, ADB_CONNECTION_RECEIVE, length, buf);
+
+	return bytesRead;
+}
+#endif
+
+#if ADB_HAS(ADB_FEATURE_RECEIVE_BUFFER)
+/**
+ * Reads one USB packet of the payload of an ADB WRITE message straight from the USB FIFO into the receive buffer of
+ * a connection. adb_receive fires a single ADB_CONNECTION_RECEIVE event with a NULL data pointer once the whole
+ * payload is in. Data that does not fit in the receive buffer is dropped.
+ *
+ * @param connection ADB connection
+ * @return number of bytes read, or error code in case of failure.
+ */
+static int adb_receiveBuffered(adb_connection * connection)
+{
+	uint32_t bytesLeft = connection->dataSize - connection->dataRead;
+	uint16_t length = bytesLeft < ADB_USB_PACKETSIZE ? bytesLeft : ADB_USB_PACKETSIZE;
+	uint16_t space, tail;
+	int bytesRead;
+
+	// Store as much of the next packet as fits.
+	space = connection->receiveBufferSize - connection->receiveLength;
+	if (length > space) length = space;
+
+	tail = connection->receiveHead + connection->receiveLength;
+	if (tail >= connection->receiveBufferSize) tail -= connection->receiveBufferSize;
+
+	bytesRead = usb_bulkReadRing(adb_getDevice(connection)->usb, length, connection->receiveBuffer, connection->receiveBufferSize, tail, false);
+	if (bytesRead < 0) return bytesRead;
+
+	if (length > bytesRead) length = bytesRead;
+	connection->receiveLength += length;
+	receivingStored += length;
+	connection->dataRead += bytesRead;
+
+	return bytesRead;
+}
+#endif
+
+/**
+ * Reads and discards a number of payload bytes.
+ *
+ * @param device ADB device.
+ * @param length number of bytes to discard.
+ */
+static void adb_skip(adb_device * device, uint32_t length)
+{
+	int bytesRead;
+
+	while (length > 0)
+	{
+		// Read a packet without storing any of it.
+		bytesRead = usb_bulkReadRing(device->usb, 0, NULL, 0, 0, false);
+		if (bytesRead <= 0) break;
+
+		length -= (uint32_t)bytesRead < length ? (uint32_t)bytesRead : length;
+	}
+
+	// Don't read ahead into a payload that was given up on halfway.
+	usb_setReadAhead(device->usb, 0);
+}
+
+/**
+ * Handles an ADB WRITE message. The payload is read by adb_receive, which may run out of time and be picked up
+ * again by the next poll.
+ *
+ * @param connection ADB connection
+ * @param message ADB message struct.
+ */
+void adb_handleWrite(adb_connection * connection, adb_message * message)
+{
+	receivingStatus = connection->status;
+	receivingStored = 0;
+	receiving = connection;
+
+	connection->status = ADB_RECEIVING;
+	connection->dataRead = 0;
+	connection->dataSize = message->data_length;
+
+	adb_receive(connection);
+}
+
+/**
+ * Reads (the remainder of) the payload of an ADB WRITE message one USB packet at a time, and sends OKAY in reply
+ * once it is all in. The payload goes into the receive buffer of the connection if it has one, or is handed to the
+ * event handler one USB packet at a time otherwise.
+ *
+ * @param connection ADB connection
+ * @return true iff the payload is done, false if the poll ran out of time.
+ */
+static boolean adb_receive(adb_connection * connection)
+{
+	int bytesRead;
+
+	while (connection->dataRead < connection->dataSize)
+	{
+		// Leave the rest for the next poll if we're out of time.
+		if (!adb_hasBudget()) return false;
+
+		adb_enforceBudget(true);
+#if ADB_HAS(ADB_FEATURE_RECEIVE_BUFFER)
+		if (connection->receiveBuffer != NULL)
+			bytesRead = adb_receiveBuffered(connection);
+		else
+#endif
+#if ADB_HAS(ADB_FEATURE_PACKET_EVENTS)
+			bytesRead = adb_receiveEvents(connection);
+#else
+		{
+			// Read a packet without storing any of it.
+			bytesRead = usb_bulkReadRing(adb_getDevice(connection)->usb, 0, NULL, 0, 0, false);
+			if (bytesRead > 0) connection->dataRead += bytesRead;
+		}
+#endif
+		adb_enforceBudget(false);
+
+#if ADB_HAS(ADB_FEATURE_STATS)
+		if (bytesRead > 0) stats.bytesIn[connection->localID - 1] += bytesRead;
+#endif
+
+		// A read that was NAKed until the deadline is retried by the next poll.
+		if (bytesRead < 0 && !adb_hasBudget()) return false;
+
+		// Break out of the read loop if there's no data to read :(
+		if (bytesRead <= 0) break;
+	}
+
+#if ADB_HAS(ADB_FEATURE_RECEIVE_BUFFER)
+	if (connection->receiveBuffer != NULL)
+	{
+#if ADB_HAS(ADB_FEATURE_FLOW_CONTROL)
+		connection->unconsumed += receivingStored;
+#endif
+		adb_fireEvent(connection, ADB_CONNECTION_RECEIVE, receivingStored, NULL);
+	}
+#endif
+
+	connection->status = receivingStatus;
+	receiving = NULL;
+
+#if ADB_HAS(ADB_FEATURE_FLOW_CONTROL)
+	// Hold back the OKAY, and with it the next WRTE from the device, until the application has caught up. It is
+	// sent by adb_pollBudget once enough has been consumed.
+	if (connection->flowControl && connection->unconsumed > connection->window)
+	{
+		connection->okayPending = true;
+		adb_fireEvent(connection, ADB_CONNECTION_THROTTLE, 0, NULL);
+		return true;
+	}
+#endif
+
+	// Send OKAY message in reply.
+	adb_writeEmptyMessage(adb_getDevice(connection), A_OKAY, connection->localID, connection->remoteID);
+
+	return true;
+}
+
+/**
+ * Close all ADB connections of a device.
+ *
+ * @param device ADB device.
+ */
+static void adb_closeAll(adb_device * device)
+{
+	adb_connection * connection;
+
+	// Iterate over all connections and close the ones that are currently open.
+	for (connection = connections; connection < connections + ADB_MAX_CONNECTIONS; connection++)
+		if (!(connection->status==ADB_UNUSED || connection->status==ADB_CLOSED) && adb_getDevice(connection) == device)
+			adb_handleClose(connection);
+
+}
+
+/**
+ * Handles an ADB connect message. This is a response to a connect message sent from our side.
+ * @param device ADB device.
+ * @param message ADB message.
+ */
+static void adb_handleConnect(adb_device * device, adb_message * message)
+{
+	adb_connection * connection;
+	int bytesRead;
+	uint8_t buf[ADB_CONNECT_BUFFER_SIZE > 0 ? ADB_CONNECT_BUFFER_SIZE : 1];
+	uint16_t len;
+
+	// Read payload (remote ADB device ID), and discard what does not fit in the buffer.
+	len = message->data_length < ADB_CONNECT_BUFFER_SIZE ? message->data_length : ADB_CONNECT_BUFFER_SIZE;
+	bytesRead = message->data_length > 0 ? usb_bulkRead(device->usb, len, buf, false) : 0;
+	if (bytesRead > 0 && (uint32_t)bytesRead < message->data_length)
+		adb_skip(device, message->data_length - bytesRead);
+	if (bytesRead < len) len = bytesRead < 0 ? 0 : bytesRead;
+
+	// CNXN(version, maxdata, "system-identity-string"). Remember how large a message the device accepts.
+	device->remoteVersion = message->arg0;
+	device->remoteMaxData = message->arg1 > 0 ? message->arg1 : MAX_PAYLOAD;
+
+	// Signal that we are now connected to an Android device (yay!)
+	device->connected = true;
+
+	// Open all persistent connections of the device right away, with a fresh back-off. The OPENs go out together,
+	// and ADB_READY follows once all of them have been answered.
+	device->opening = 0;
+	for (connection = connections; connection < connections + ADB_MAX_CONNECTIONS; connection++)
+		if (connection->status == ADB_CLOSED && adb_getDevice(connection) == device)
+		{
+			connection->retryCount = 0;
+			adb_scheduleOpen(connection, 0);
+			device->opening |= 1UL << (connection->localID - 1);
+		}
+
+	// Fire event.
+#if ADB_HAS(ADB_FEATURE_HUB)
+	eventDevice = device - devices;
+#endif
+	adb_fireEvent(NULL, ADB_CONNECT, len, buf);
+
+	// Nothing to wait for.
+	if (device->opening == 0) adb_fireReady(device);
+
+}
+
+/**
+ * This method is called periodically to check for new messages on the USB bus and process them.
+ */
+void adb_poll()
+{
+	adb_pollBudget(0);
+}
+
+/**
+ * Polls like adb_poll, but spends at most about budget microseconds on USB work. The budget is checked between USB
+ * transactions, so a call may overrun it by about one USB packet. Connecting (CNXN) and the replies to incoming
+ * messages are not split up, but are only started while there is budget left.
+ *
+ * WRTE payloads are the only long transfers. Reading one stops when the budget runs out, and the next poll picks up
+ * where it left off. Queued data (see adb_setWriteQueue) is sent the same way, so a NAKing device cannot stall the
+ * caller either. A WRTE sent with adb_write or adb_writev is not split up.
+ *
+ * @param budget time budget in microseconds, or 0 for no limit.
+ */
+void adb_pollBudget(uint32_t budget)
+{
+#if ADB_HAS(ADB_FEATURE_STATS)
+	uint32_t duration;
+#endif
+
+	pollStart = avr_micros();
+	pollBudget = budget;
+
+	adb_service();
+
+#if ADB_HAS(ADB_FEATURE_STATS)
+	duration = avr_micros() - pollStart;
+	adb_record(stats.pollDuration, duration);
+	if (duration > stats.pollMax) stats.pollMax = duration;
+#endif
+
+	// Outside of the poll, writes run to completion.
+	pollBudget = 0;
+}
+
+#if ADB_HAS(ADB_FEATURE_IDLE)
+/**
+ * @return true iff nothing is halfway: no device being enumerated, no transfer in flight, no WRTE payload being
+ * read, and no message being sent.
+ */
+static boolean adb_isIdle()
+{
+	adb_device * device;
+
+	if (usb_isEnumerating() || usb_isTransferPending() || receiving != NULL) return false;
+
+	for (device = devices; device < devices + ADB_MAX_DEVICES; device++)
+		if (device->sending != NULL) return false;
+
+	return true;
+}
+
+/**
+ * Marks the receipt of an ADB message or accessory packet as activity that keeps adb_run awake. The first one
+ * after a wake-up also counts the time since the wake-up.
+ */
+static void adb_noteReceive()
+{
+	lastActivity = avr_micros();
+
+#if ADB_HAS(ADB_FEATURE_STATS)
+	if (awake)
+	{
+		adb_record(stats.wakeLatency, lastActivity - wakeTime);
+		awake = false;
+	}
+#endif
+}
+
+/**
+ * Runs one turn of an event loop that sleeps while there is nothing to do, for battery powered bridges. Call it
+ * instead of adb_poll in the main loop. Each call polls like adb_poll. Once no ADB message has come or gone for
+ * ADB_IDLE_TIME microseconds, it also puts the processor to sleep until the next interrupt, which is the timer tick
+ * at the latest. The loop then wakes about once per millisecond and spends one empty poll per device, instead of
+ * polling flat out. The application code in the main loop and its timers run at every wake-up.
+ *
+ * Data from the phone only arrives when the host asks for it with an IN transfer, so a quiet phone is polled
+ * once per tick. The first message after a quiet spell can wait for the end of a sleep, which is up to a tick, see
+ * adb_stats.sleepDuration, and then for the polls from the wake-up to its IN transfer, see adb_stats.wakeLatency.
+ * From then on, the loop polls flat out again, so the rest of an exchange arrives without that delay.
+ */
+void adb_run()
+{
+#if ADB_HAS(ADB_FEATURE_STATS)
+	uint32_t start, slept;
+#endif
+
+	adb_poll();
+
+	if (avr_micros() - lastActivity < ADB_IDLE_TIME || !adb_isIdle()) return;
+
+#if ADB_HAS(ADB_FEATURE_STATS)
+	start = avr_micros();
+	avr_idle();
+	wakeTime = avr_micros();
+	awake = true;
+	slept = wakeTime - start;
+	adb_record(stats.sleepDuration, slept);
+	stats.sleepTime += slept;
+#else
+	avr_idle();
+#endif
+}
+#endif
+
+/**
+ * @return true iff the poll in progress has time left.
+ */
+static boolean adb_hasBudget()
+{
+	return pollBudget == 0 || avr_micros() - pollStart < pollBudget;
+}
+
+/**
+ * Makes the USB layer give up on NAKs once the budget of the poll in progress is spent (see usb_setDeadline). This
+ * is only enforced around transfers that can be resumed by the next poll.
+ *
+ * @param enforce true to enforce the budget, false to let transfers run to completion.
+ */
+static void adb_enforceBudget(boolean enforce)
+{
+	if (enforce && pollBudget != 0)
+		usb_setDeadline(pollStart + pollBudget);
+	else
+		usb_clearDeadline();
+}
+
+/**
+ * Does the work of one poll, see adb_pollBudget. The devices take turns: each poll starts with the next one, so that
+ * when the budget runs short, a busy device cannot keep the others from being served.
+ */
+static void adb_service()
+{
+	uint8_t first, i;
+
+	// Poll the USB layer.
+	usb_poll();
+
+	// Read the remainder of a WRTE payload that ran out of time in the last poll, before any new message.
+	if (receiving != NULL && !adb_receive(receiving)) return;
+
+#if ADB_HAS(ADB_FEATURE_ACCESSORY)
+	// Not while a payload is being received: part of it may be waiting in the receive FIFO.
+	if (aoa != NULL && aoa->usb != NULL)
+		adb_serviceAccessory();
+#endif
+
+	first = nextDevice;
+	nextDevice = (nextDevice + 1) % ADB_MAX_DEVICES;
+
+	for (i = 0; i < ADB_MAX_DEVICES; i++)
+	{
+		// If no USB device, there's no work for us to be done.
+		if (devices[(first + i) % ADB_MAX_DEVICES].usb == NULL) continue;
+
+		adb_serviceDevice(&devices[(first + i) % ADB_MAX_DEVICES]);
+
+		// A payload that ran out of time blocks the bus for all devices.
+		if (receiving != NULL) return;
+	}
+}
+
+/**
+ * Handles an incoming ADB message.
+ *
+ * @param device ADB device the message came from.
+ * @param message ADB message.
+ */
+static void adb_handleMessage(adb_device * device, adb_message * message)
+{
+	adb_connection * connection;
+
+	// Handle a response from the ADB device to our CONNECT message.
+	if (message->command == A_CNXN)
+		adb_handleConnect(device, message);
+
+#ifdef DEBUG
+	avr_serialPrint("IN >> "); adb_printMessage(message);
+#endif
+#if ADB_HAS(ADB_FEATURE_TRACE)
+	adb_traceMessage(ADB_TRACE_IN, message);
+#endif
+#if ADB_HAS(ADB_FEATURE_IDLE)
+	adb_noteReceive();
+#endif
+
+	// Handle messages for specific connections. The device addresses them by our local ID in arg1.
+	connection = adb_getConnection(message->arg1);
+	if (connection != NULL && adb_getDevice(connection) == device)
+	{
+		switch(message->command)
+		{
+		case A_OKAY:
+			adb_handleOkay(connection, message);
+			break;
+		case A_CLSE:
+			adb_handleClose(connection);
+			break;
+		case A_WRTE:
+			adb_handleWrite(connection, message);
+			return;
+		default:
+			break;
+		}
+	}
+
+	// Drain a payload that no handler takes, like that of a WRTE for a connection that is gone or of an OPEN from
+	// the device, so that it isn't read as the next message.
+	if (message->command != A_CNXN && message->data_length > 0)
+		adb_skip(device, message->data_length);
+}
+
+/**
+ * Does the work of one poll for one device: sends what is due and handles up to its weight in incoming messages
+ * (see adb_setDeviceWeight).
+ *
+ * @param device ADB device.
+ */
+static void adb_serviceDevice(adb_device * device)
+{
+#if ADB_HAS(ADB_FEATURE_WRITE_QUEUE | ADB_FEATURE_FLOW_CONTROL)
+	adb_connection * connection;
+#endif
+	adb_message message;
+	uint8_t i;
+
+#if ADB_HAS(ADB_FEATURE_WRITE_QUEUE)
+	// Send the remainder of a WRTE that ran out of time in the last poll, before anything else.
+	if (device->sending != NULL)
+	{
+		adb_enforceBudget(true);
+		adb_flushWriteQueue(device->sending);
+		adb_enforceBudget(false);
+
+		if (device->sending != NULL) return;
+	}
+#endif
+
+#if ADB_HAS(ADB_FEATURE_FLOW_CONTROL)
+	// Send the OKAYs that were withheld for connections whose application has caught up.
+	for (connection = connections; connection < connections + ADB_MAX_CONNECTIONS && adb_hasBudget(); connection++)
+		if (connection->okayPending && (!connection->flowControl || connection->unconsumed <= connection->window)
+				&& adb_getDevice(connection) == device)
+		{
+			connection->okayPending = false;
+			adb_writeEmptyMessage(device, A_OKAY, connection->localID, connection->remoteID);
+			adb_fireEvent(connection, ADB_CONNECTION_RESUME, 0, NULL);
+		}
+#endif
+
+	// If not connected, send a connection string to the device, and give it some time to respond before trying
+	// again. The response is picked up by pollMessage below.
+	if (!device->connected && adb_hasBudget() && (int32_t)(avr_millis() - device->connectDeadline) >= 0)
+	{
+		adb_writeStringMessage_P(device, A_CNXN, A_VERSION_SKIP_CHECKSUM, MAX_PAYLOAD, identity);
+		device->connectDeadline = avr_millis() + ADB_CONNECT_RETRY_TIME;
+	}
+
+	// If we are connected, check if there are connections that need to be opened, or that have queued data
+	// waiting to be sent.
+	if (device->connected)
+	{
+		if (adb_hasBudget())
+			adb_openClosedConnections(device);
+
+#if ADB_HAS(ADB_FEATURE_WRITE_QUEUE)
+		for (connection = connections; connection < connections + ADB_MAX_CONNECTIONS && adb_hasBudget(); connection++)
+			if (connection->status == ADB_OPEN && adb_getDevice(connection) == device && adb_isFlushDue(connection))
+			{
+				adb_enforceBudget(true);
+				adb_flushWriteQueue(connection);
+				adb_enforceBudget(false);
+
+				if (device->sending != NULL) return;
+			}
+#endif
+	}
+
+	// Check for incoming ADB messages.
+	for (i = 0; i < device->weight; i++)
+	{
+		if (!adb_hasBudget() || !adb_pollMessage(device, &message, true))
+			return;
+
+		adb_handleMessage(device, &message);
+
+		// The rest of a payload that ran out of time comes first.
+		if (receiving != NULL) return;
+	}
+}
+
+/**
+ * Helper function for usb_isAdbDevice to check whether an interface is a valid ADB interface.
+ * @param interface interface descriptor struct.
+ */
+static boolean usb_isAdbInterface(usb_interfaceDescriptor * interface)
+{
+
+	// Check if the interface has exactly two endpoints.
+	if (interface->bNumEndpoints!=2) return false;
+
+	// Check if the endpoint supports bulk transfer.
+	if (interface->bInterfaceProtocol != ADB_PROTOCOL) return false;
+	if (interface->bInterfaceClass != ADB_CLASS) return false;
+	if (interface->bInterfaceSubClass != ADB_SUBCLASS) return false;
+
+	return true;
+}
+
+/**
+ * Looks for an interface in the configuration descriptor of a USB device, and populates a configuration record with
+ * it if it is found.
+ *
+ * @param device USB device.
+ * @param handle pointer to a configuration record. The endpoint device address, configuration, and endpoint information will be stored here.
+ * @param match function that tells whether an interface is the one looked for.
+ * @return true iff the interface was found.
+ */
+static boolean adb_findInterface(usb_device * device, int configuration, adb_usbConfiguration * handle, boolean (*match)(usb_interfaceDescriptor *))
+{
+	boolean ret = false;
+	uint8_t buf[MAX_BUF_SIZE];
+	int bytesRead;
+
+	// Read the length of the configuration descriptor.
+	bytesRead = usb_getConfigurationDescriptor(device, configuration, MAX_BUF_SIZE, buf);
+	if (bytesRead<0) return false;
+
+	uint16_t pos = 0;
+	uint8_t descriptorLength;
+	uint8_t descriptorType;
+
+	usb_configurationDescriptor * config = NULL;
+	usb_interfaceDescriptor * interface = NULL;
+	usb_endpointDescriptor * endpoint = NULL;
+
+	while (pos < bytesRead)
+	{
+		descriptorLength = buf[pos];
+		descriptorType = buf[pos + 1];
+
+		switch (descriptorType)
+		{
+		case (USB_DESCRIPTOR_CONFIGURATION):
+			config = (usb_configurationDescriptor *)(buf + pos);
+			break;
+		case (USB_DESCRIPTOR_INTERFACE):
+			interface = (usb_interfaceDescriptor *)(buf + pos);
+
+			if (match(interface))
+			{
+				// handle->address = address;
+				handle->configuration = config->bConfigurationValue;
+				handle->interface = interface->bInterfaceNumber;
+				handle->totalLength = config->wTotalLength;
+
+				// Detected the interface!
+				ret = true;
+			}
+			break;
+		case (USB_DESCRIPTOR_ENDPOINT):
+			endpoint = (usb_endpointDescriptor *)(buf + pos);
+
+			// If this endpoint descriptor is found right after the ADB interface descriptor, it belong to that interface.
+			if (interface->bInterfaceNumber == handle->interface)
+			{
+				if (endpoint->bEndpointAddress & 0x80)
+					handle->inputEndPointAddress = endpoint->bEndpointAddress & ~0x80;
+				else
+					handle->outputEndPointAddress = endpoint->bEndpointAddress;
+			}
+
+			break;
+		default:
+			break;
+		}
+
+		pos += descriptorLength;
+	}
+
+	return ret;
+
+}
+
+/**
+ * Checks whether the a connected USB device is an ADB device and populates a configuration record if it is.
+ *
+ * @param device USB device.
+ * @param handle pointer to a configuration record. The endpoint device address, configuration, and endpoint information will be stored here.
+ * @return true iff the device is an ADB device.
+ */
+static boolean adb_isAdbDevice(usb_device * device, int configuration, adb_usbConfiguration * handle)
+{
+	return adb_findInterface(device, configuration, handle, usb_isAdbInterface);
+}
+
+#if ADB_HAS(ADB_FEATURE_PROFILE_CACHE)
+/**
+ * Looks up the cached interface layout of a device.
+ *
+ * @param device USB device.
+ * @return the profile of the device, or NULL if it has not been seen before.
+ */
+static adb_profile * adb_findProfile(usb_device * device)
+{
+	adb_profile * profile;
+
+	for (profile = profiles; profile < profiles + ADB_PROFILE_CACHE_SIZE; profile++)
+		if (profile->configuration != 0 && profile->vendorId == device->vendorId
+				&& profile->productId == device->productId && profile->releaseNumber == device->releaseNumber)
+			return profile;
+
+	return NULL;
+}
+
+/**
+ * Reads the total length of the first configuration descriptor of a device, which only takes its first four bytes.
+ *
+ * @param device USB device.
+ * @return the total length, or 0 if the request failed.
+ */
+static uint16_t adb_getConfigurationLength(usb_device * device)
+{
+	uint8_t buf[4];
+
+	if (usb_controlRequest(device, bmREQ_GET_DESCR, USB_REQUEST_GET_DESCRIPTOR, 0, USB_DESCRIPTOR_CONFIGURATION, 0x0000, sizeof(buf), buf))
+		return 0;
+
+	return buf[2] | (buf[3] << 8);
+}
+
+/**
+ * Writes a cache entry through to EEPROM, if the cache is persistent. Only the bytes that changed are written.
+ *
+ * @param profile cache entry.
+ */
+static void adb_saveProfile(adb_profile * profile)
+{
+#ifdef ADB_PROFILE_EEPROM
+	eeprom_update_block(profile, (uint8_t *)ADB_PROFILE_EEPROM + 1 + (profile - profiles) * sizeof(adb_profile),
+			sizeof(adb_profile));
+#else
+	(void)profile;
+#endif
+}
+
+/**
+ * Remembers the interface layout of a device that was just set up from its descriptors. A new device takes a free
+ * entry, or else replaces the entries in turn.
+ *
+ * @param device USB device.
+ * @param handle configuration record filled out by adb_isAdbDevice.
+ */
+static void adb_storeProfile(usb_device * device, adb_usbConfiguration * handle)
+{
+	adb_profile * profile = adb_findProfile(device);
+
+	if (profile == NULL)
+	{
+		for (profile = profiles; profile < profiles + ADB_PROFILE_CACHE_SIZE && profile->configuration != 0; profile++);
+		if (profile == profiles + ADB_PROFILE_CACHE_SIZE)
+		{
+			profile = &profiles[nextProfile];
+			nextProfile = (nextProfile + 1) % ADB_PROFILE_CACHE_SIZE;
+		}
+	}
+
+	profile->vendorId = device->vendorId;
+	profile->productId = device->productId;
+	profile->releaseNumber = device->releaseNumber;
+	profile->configuration = handle->configuration;
+	profile->interface = handle->interface;
+	profile->inputEndPointAddress = handle->inputEndPointAddress;
+	profile->outputEndPointAddress = handle->outputEndPointAddress;
+	profile->language = device->firstStringLanguage;
+	profile->totalLength = handle->totalLength;
+
+	adb_saveProfile(profile);
+}
+
+/**
+ * Drops the cached interface layout of a device, so that its descriptors are parsed the next time it attaches.
+ *
+ * @param device USB device.
+ */
+static void adb_forgetProfile(usb_device * device)
+{
+	adb_profile * profile = adb_findProfile(device);
+
+	if (profile == NULL) return;
+
+	memset(profile, 0, sizeof(adb_profile));
+	adb_saveProfile(profile);
+}
+
+/**
+ * Fills the profile cache from its EEPROM copy, if the cache is persistent and the copy is valid. Otherwise the cache
+ * starts out empty, and so does the EEPROM copy.
+ */
+static void adb_loadProfiles()
+{
+	nextProfile = 0;
+
+#ifdef ADB_PROFILE_EEPROM
+	if (eeprom_read_byte((uint8_t *)ADB_PROFILE_EEPROM) == ADB_PROFILE_TAG)
+	{
+		eeprom_read_block(profiles, (uint8_t *)ADB_PROFILE_EEPROM + 1, sizeof(profiles));
+		return;
+	}
+#endif
+
+	adb_clearProfiles();
+
+#ifdef ADB_PROFILE_EEPROM
+	eeprom_update_byte((uint8_t *)ADB_PROFILE_EEPROM, ADB_PROFILE_TAG);
+#endif
+}
+#endif
+
+/**
+ * Initialises an ADB device. A device with a cached profile is only configured, its first supported language is
+ * taken from the profile.
+ *
+ * @param adbDevice free record in the device table.
+ * @param device the USB device.
+ * @param configuration configuration information.
+ * @param profile cached profile of the device, or NULL if its descriptors were parsed.
+ * @return error code or 0 for success. Only configuring a device with a cached profile can fail.
+ */
+static int adb_initUsb(adb_device * adbDevice, usb_device * device, adb_usbConfiguration * handle, adb_profile * profile)
+{
+	int rcode;
+
+	// Initialise/configure the USB device.
+	// TODO write a usb_initBulkDevice function?
+	if (profile != NULL)
+	{
+		rcode = usb_setConfiguration(device, handle->configuration);
+		if (rcode) return rcode;
+
+		device->firstStringLanguage = profile->language;
+	}
+	else
+		usb_initDevice(device, handle->configuration);
+
+	// Initialise bulk input endpoint.
+	usb_initEndPoint(&(device->bulk_in), handle->inputEndPointAddress);
+	device->bulk_in.attributes = USB_TRANSFER_TYPE_BULK;
+	device->bulk_in.maxPacketSize = ADB_USB_PACKETSIZE;
+
+	// Initialise bulk output endpoint.
+	usb_initEndPoint(&(device->bulk_out), handle->outputEndPointAddress);
+	device->bulk_out.attributes = USB_TRANSFER_TYPE_BULK;
+	device->bulk_out.maxPacketSize = ADB_USB_PACKETSIZE;
+
+	// Nothing has been negotiated with this device yet, send CNXN right away.
+	adbDevice->connected = false;
+	adbDevice->remoteVersion = 0;
+	adbDevice->remoteMaxData = MAX_PAYLOAD;
+	adbDevice->connectDeadline = avr_millis();
+	adbDevice->opening = 0;
+
+	// No message can be halfway on a fresh device.
+	adbDevice->sending = NULL;
+	adbDevice->headerSent = false;
+
+	// Success, signal that we are now connected.
+	adbDevice->usb = device;
+
+	return 0;
+}
+
+#if ADB_HAS(ADB_FEATURE_ACCESSORY)
+/**
+ * Helper function for adb_isAccessoryDevice to check whether an interface is the interface of an accessory.
+ * @param interface interface descriptor struct.
+ */
+static boolean usb_isAccessoryInterface(usb_interfaceDescriptor * interface)
+{
+	return interface->bNumEndpoints == 2 && interface->bInterfaceClass == ADB_AOA_CLASS
+			&& interface->bInterfaceSubClass == ADB_AOA_SUBCLASS && interface->bInterfaceProtocol == ADB_AOA_PROTOCOL;
+}
+
+/**
+ * Checks whether a connected USB device is a phone in accessory mode, and populates a configuration record with its
+ * accessory interface if it is.
+ *
+ * @param device USB device.
+ * @param handle pointer to a configuration record.
+ * @return true iff the device is a phone in accessory mode.
+ */
+static boolean adb_isAccessoryDevice(usb_device * device, adb_usbConfiguration * handle)
+{
+	if (device->vendorId != ADB_AOA_VENDOR_ID || device->productId < ADB_AOA_PRODUCT_ID
+			|| device->productId > ADB_AOA_PRODUCT_LAST)
+		return false;
+
+	return adb_findInterface(device, 0, handle, usb_isAccessoryInterface);
+}
+
+/**
+ * Asks a phone to switch to accessory mode: checks that it speaks the protocol, sends the identification strings
+ * and starts accessory mode. The phone then drops off the bus, and comes back as a new device in accessory mode.
+ *
+ * @param device USB device.
+ * @return 0 if the phone is switching, or a negative error code if the device doesn't speak the protocol or the
+ * switch failed.
+ */
+static int adb_startAccessory(usb_device * device)
+{
+	uint8_t version[2];
+	uint8_t i;
+
+	// Devices that don't know the protocol stall the request.
+	if (usb_controlRequest(device, bmREQ_AOA_GET, ADB_AOA_GET_PROTOCOL, 0, 0, 0, 2, version) != 0) return -1;
+	if (version[0] == 0 && version[1] == 0) return -1;
+
+	for (i = 0; i < ADB_AOA_STRINGS; i++)
+		if (aoa->strings[i] != NULL && usb_controlRequest(device, bmREQ_AOA_SET, ADB_AOA_SEND_STRING, 0, 0, i,
+				strlen(aoa->strings[i]) + 1, (uint8_t*)aoa->strings[i]) != 0)
+			return -2;
+
+	if (usb_controlRequest(device, bmREQ_AOA_SET, ADB_AOA_START, 0, 0, 0, 0, NULL) != 0) return -3;
+
+	return 0;
+}
+
+/**
+ * Configures a phone in accessory mode as the accessory, and tells the application.
+ *
+ * @param device USB device.
+ * @param handle accessory interface, filled out by adb_isAccessoryDevice.
+ * @return error code or 0 for success.
+ */
+static int adb_openAccessory(usb_device * device, adb_usbConfiguration * handle)
+{
+	int rcode;
+
+	rcode = usb_initDevice(device, handle->configuration);
+	if (rcode < 0) return rcode;
+
+	usb_initEndPoint(&(device->bulk_in), handle->inputEndPointAddress);
+	device->bulk_in.attributes = USB_TRANSFER_TYPE_BULK;
+	device->bulk_in.maxPacketSize = ADB_USB_PACKETSIZE;
+
+	// The phone reads in blocks, a write has to end with a short packet for it to come through.
+	usb_initEndPoint(&(device->bulk_out), handle->outputEndPointAddress);
+	device->bulk_out.attributes = USB_TRANSFER_TYPE_BULK;
+	device->bulk_out.maxPacketSize = ADB_USB_PACKETSIZE;
+	device->bulk_out.zeroLengthPacket = true;
+
+	aoa->usb = device;
+	aoa->handler(aoa, ADB_CONNECTION_OPEN, 0, NULL);
+
+	return 0;
+}
+#endif
+
+/**
+ * Handles events from the USB layer.
+ *
+ * @param device USB device that generated the event.
+ * @param event USB event.
+ */
+static void adb_usbEventHandler(usb_device * device, usb_eventType event)
+{
+	adb_usbConfiguration handle;
+	adb_device * adbDevice;
+#if ADB_HAS(ADB_FEATURE_PROFILE_CACHE)
+	adb_profile * profile;
+#endif
+
+	switch (event)
+	{
+	case USB_CONNECT:
+
+#if ADB_HAS(ADB_FEATURE_ACCESSORY)
+		// A phone in accessory mode becomes the accessory, any other device is asked to switch to accessory mode.
+		// Only devices that don't speak the protocol are tried as ADB devices.
+		if (aoa != NULL && aoa->usb == NULL)
+		{
+			if (adb_isAccessoryDevice(device, &handle))
+			{
+				if (adb_openAccessory(device, &handle) == 0) break;
+			}
+			else if (adb_startAccessory(device) == 0)
+				break;
+		}
+#endif
+
+		// Take the first free record in the device table, if any.
+		for (adbDevice = devices; adbDevice < devices + ADB_MAX_DEVICES && adbDevice->usb != NULL; adbDevice++);
+		if (adbDevice == devices + ADB_MAX_DEVICES) break;
+
+#if ADB_HAS(ADB_FEATURE_PROFILE_CACHE)
+		// A device seen before goes straight to configuration, unless the length of its configuration descriptor
+		// has changed. If that fails, its profile is stale, and its descriptors are parsed after all.
+		profile = adb_findProfile(device);
+		if (profile != NULL)
+		{
+			handle.address = device->address;
+			handle.configuration = profile->configuration;
+			handle.interface = profile->interface;
+			handle.inputEndPointAddress = profile->inputEndPointAddress;
+			handle.outputEndPointAddress = profile->outputEndPointAddress;
+			handle.totalLength = profile->totalLength;
+
+			if (adb_getConfigurationLength(device) == profile->totalLength
+					&& adb_initUsb(adbDevice, device, &handle, profile) == 0)
+				break;
+
+			adb_forgetProfile(device);
+		}
+#endif
+
+		// Check if the newly connected device is an ADB device, and initialise it if so.
+		if (adb_isAdbDevice(device, 0, &handle))
+		{
+			adb_initUsb(adbDevice, device, &handle, NULL);
+#if ADB_HAS(ADB_FEATURE_PROFILE_CACHE)
+			adb_storeProfile(device, &handle);
+#endif
+		}
+
+		break;
+
+	case USB_DISCONNECT:
+
+#if ADB_HAS(ADB_FEATURE_ACCESSORY)
+		if (aoa != NULL && aoa->usb == device)
+		{
+			aoa->usb = NULL;
+			aoa->handler(aoa, ADB_CONNECTION_CLOSE, 0, NULL);
+			break;
+		}
+#endif
+
+		// Check if the device that was disconnected is an ADB device we've been using.
+		for (adbDevice = devices; adbDevice < devices + ADB_MAX_DEVICES && adbDevice->usb != device; adbDevice++);
+		if (adbDevice == devices + ADB_MAX_DEVICES) break;
+
+		// Whatever was halfway on the device is lost.
+		adbDevice->sending = NULL;
+		adbDevice->headerSent = false;
+		if (receiving != NULL && adb_getDevice(receiving) == adbDevice)
+			receiving = NULL;
+
+		// Close all open ADB connections.
+		adb_closeAll(adbDevice);
+
+#if ADB_HAS(ADB_FEATURE_PROFILE_CACHE)
+		// A device that never answered our CNXN may have been set up from a stale profile (or with the wrong
+		// interface), have its descriptors parsed the next time.
+		if (!adbDevice->connected)
+			adb_forgetProfile(device);
+#endif
+
+		// Signal that we're no longer connected by setting the device handle to NULL.
+		adbDevice->usb = NULL;
+		adbDevice->connected = false;
+
+#if ADB_HAS(ADB_FEATURE_HUB)
+		eventDevice = adbDevice - devices;
+#endif
+		adb_fireEvent(NULL, ADB_DISCONNECT, 0, NULL);
+
+		break;
+
+	default:
+		// ignore
+		break;
+	}
+}
+
+#if ADB_HAS(ADB_FEATURE_WRITE_QUEUE)
+/**
+ * Sets up an outbound queue for a connection. When a queue is set, writes are copied into the queue and sent
+ * as soon as the connection is ready, instead of failing while the previous write is waiting for its OKAY.
+ * Queued data is packed into WRTE messages of up to MAX_PAYLOAD bytes, and the next WRTE goes out from adb_poll
+ * as soon as the OKAY for the previous one comes in. Queued data is discarded when the connection closes.
+ *
+ * @param connection ADB connection.
+ * @param buffer queue storage, must remain valid for the lifetime of the connection. NULL removes the queue.
+ * @param size size of the buffer in bytes.
+ */
+void adb_setWriteQueue(adb_connection * connection, uint8_t * buffer, uint16_t size)
+{
+	connection->writeQueue = buffer;
+	connection->writeQueueSize = buffer==NULL ? 0 : size;
+	connection->writeQueueHead = 0;
+	connection->writeQueueLength = 0;
+}
+
+/**
+ * Appends data to the outbound queue of a connection, as far as it fits.
+ *
+ * @param connection ADB connection.
+ * @param length number of bytes to queue.
+ * @param data data to queue.
+ * @return number of bytes accepted.
+ */
+static uint16_t adb_enqueue(adb_connection * connection, uint16_t length, uint8_t * data)
+{
+	uint16_t tail, chunk;
+	uint16_t space = connection->writeQueueSize - connection->writeQueueLength;
+
+	if (length > space) length = space;
+
+	// Remember when the queue went from empty to non-empty, for the coalescing age threshold.
+	if (connection->writeQueueLength == 0 && length > 0)
+		connection->queueTime = avr_millis();
+
+	// Copy the data in, wrapping around the end of the ring buffer if needed.
+	tail = connection->writeQueueHead + connection->writeQueueLength;
+	if (tail >= connection->writeQueueSize) tail -= connection->writeQueueSize;
+
+	chunk = connection->writeQueueSize - tail;
+	if (chunk > length) chunk = length;
+
+	memcpy(connection->writeQueue + tail, data, chunk);
+	memcpy(connection->writeQueue, data + chunk, length - chunk);
+
+	connection->writeQueueLength += length;
+
+	return length;
+}
+
+/**
+ * Sends the next batch of queued data as a single WRTE message. The connection must be open and not waiting for
+ * the OKAY of a previous write.
+ *
+ * @param connection ADB connection.
+ * @return error code or 0 for success.
+ */
+static int adb_flushWriteQueue(adb_connection * connection)
+{
+	adb_device * device = adb_getDevice(connection);
+	usb_segment segment;
+	uint16_t length;
+	int ret;
+
+	// Another connection's WRTE that ran out of time has to go out first.
+	if (device->sending != NULL && device->sending != connection)
+		adb_finishSend(device);
+
+	// Send the contiguous part of the queue, the remainder goes out with the next WRTE. A WRTE that ran out of time
+	// is resumed with the length it was started with, more data may have been queued since.
+	if (device->sending == connection)
+		length = device->sendingLength;
+	else
+	{
+		length = connection->writeQueueSize - connection->writeQueueHead;
+		if (length > connection->writeQueueLength) length = connection->writeQueueLength;
+		if (length > device->remoteMaxData) length = device->remoteMaxData;
+	}
+
+	segment.data = connection->writeQueue + connection->writeQueueHead;
+	segment.length = length;
+	segment.progmem = false;
+
+	ret = adb_sendMessagev(device, A_WRTE, connection->localID, connection->remoteID, 1, &segment);
+
+	// Remember where we were, the next call picks up from there.
+	if (ret == USB_TRANSFER_PENDING)
+	{
+		device->sending = connection;
+		device->sendingLength = length;
+		return ret;
+	}
+
+	device->sending = NULL;
+
+	if (ret==0)
+	{
+		connection->writeQueueHead += length;
+		if (connection->writeQueueHead == connection->writeQueueSize) connection->writeQueueHead = 0;
+		connection->writeQueueLength -= length;
+		if (connection->writeQueueLength == 0) connection->flushRequested = false;
+
+		connection->status = ADB_WRITING;
+	}
+
+	return ret;
+}
+
+/**
+ * Checks whether queued data on a connection should be sent now. Without coalescing, any queued data is sent as
+ * soon as possible. With coalescing, data is held back until enough has been queued to fill a message, the oldest
+ * queued data reaches the maximum age, or a flush was requested.
+ *
+ * @param connection ADB connection.
+ * @return true iff the queued data should be sent.
+ */
+static boolean adb_isFlushDue(adb_connection * connection)
+{
+	uint32_t remoteMaxData = adb_getDevice(connection)->remoteMaxData;
+	uint32_t size;
+
+	if (connection->writeQueueLength == 0) return false;
+	if (!connection->coalesce || connection->flushRequested) return true;
+
+	// Size threshold, defaults to a full message.
+	size = connection->coalesceSize;
+	if (size == 0 || size > remoteMaxData) size = remoteMaxData;
+	if (size > connection->writeQueueSize) size = connection->writeQueueSize;
+	if (connection->writeQueueLength >= size) return true;
+
+	// Age threshold.
+	if (connection->coalesceAge > 0 && (avr_millis() - connection->queueTime) >= connection->coalesceAge) return true;
+
+	return false;
+}
+
+/**
+ * Enables or disables write coalescing on a connection with a write queue. With coalescing enabled, small writes
+ * are packed together into a single WRTE, up to the maximum payload size announced by the device in its CNXN
+ * message. Queued data is sent when at least size bytes are queued, when the oldest queued byte is age
+ * milliseconds old, or when adb_flush is called, whichever comes first.
+ *
+ * @param connection ADB connection.
+ * @param enable true to enable coalescing, false to send queued data as soon as possible.
+ * @param size size threshold in bytes, or 0 to wait for a full message (maxdata or the queue size).
+ * @param age age threshold in milliseconds, or 0 to only flush on size or on request.
+ */
+void adb_setCoalescing(adb_connection * connection, boolean enable, uint16_t size, uint16_t age)
+{
+	connection->coalesce = enable != false;
+	connection->coalesceSize = size;
+	connection->coalesceAge = age;
+}
+
+/**
+ * Appends data to the write queue of a connection without attempting to send it. The data goes out from adb_poll
+ * according to the coalescing policy of the connection.
+ *
+ * @param connection ADB connection.
+ * @param length number of bytes to append.
+ * @param data data to append.
+ * @return number of bytes accepted.
+ */
+uint16_t adb_append(adb_connection * connection, uint16_t length, uint8_t * data)
+{
+	if (connection->writeQueue == NULL) return 0;
+
+	// Only accept data for connections that are (being) used.
+	if (connection->status != ADB_OPEN && connection->status != ADB_WRITING && connection->status != ADB_RECEIVING)
+		return 0;
+
+	return adb_enqueue(connection, length, data);
+}
+
+/**
+ * Queues the segments of a write and kicks off the transfer if the connection is idle. This is the queued path of
+ * adb_write, which takes as much as fits, and of the clients that must not leave part of a message in the queue,
+ * which take all or nothing.
+ *
+ * @param connection ADB connection with an outbound queue.
+ * @param count number of segments, in RAM.
+ * @param segments segments to queue.
+ * @param whole true to queue nothing unless all segments fit.
+ * @return number of bytes accepted, -2 if the connection is not open, or -3 if whole is set and the segments don't
+ * fit.
+ */
+static int adb_queueWrite(adb_connection * connection, uint8_t count, usb_segment * segments, boolean whole)
+{
+	uint32_t length = 0;
+	uint16_t accepted = 0;
+	uint8_t i;
+
+	// Queued data can be accepted while the connection is busy, but not before it has been opened.
+	if (connection->status != ADB_OPEN && connection->status != ADB_WRITING && connection->status != ADB_RECEIVING)
+		return -2;
+
+	if (whole)
+	{
+		for (i = 0; i < count; i++)
+			length += segments[i].length;
+		if (length > (uint32_t)(connection->writeQueueSize - connection->writeQueueLength)) return -3;
+	}
+
+	for (i = 0; i < count; i++)
+		accepted += adb_enqueue(connection, segments[i].length, (uint8_t*)segments[i].data);
+
+	// Kick off the transfer if the connection is idle.
+	if (connection->status == ADB_OPEN && adb_isFlushDue(connection))
+		adb_flushWriteQueue(connection);
+
+	return accepted;
+}
+
+/**
+ * Requests that all data currently queued on a connection is sent, regardless of the coalescing policy.
+ *
+ * @param connection ADB connection.
+ * @return error code or 0 for success.
+ */
+int adb_flush(adb_connection * connection)
+{
+	adb_device * device = adb_getDevice(connection);
+
+	if (connection->writeQueueLength == 0) return 0;
+
+	connection->flushRequested = true;
+
+	if (device->usb!=NULL && device->connected && connection->status == ADB_OPEN)
+		return adb_flushWriteQueue(connection);
+
+	return 0;
+}
+#endif
+
+/**
+ * @return the protocol version announced by the (first) device in its CNXN message.
+ */
+uint32_t adb_getRemoteVersion()
+{
+	return devices[0].remoteVersion;
+}
+
+/**
+ * @return the maximum message payload size announced by the (first) device in its CNXN message.
+ */
+uint32_t adb_getRemoteMaxData()
+{
+	return devices[0].remoteMaxData;
+}
+
+/**
+ * Write a message to an open ADB connection, gathering the payload from a list of segments (see
+ * adb_writeMessagev). This is useful to send a header and a body, or constant data from program memory, without
+ * assembling them in a buffer first. Like adb_write, a single WRTE is sent, so the total length may not exceed
+ * adb_getRemoteMaxData. The segments bypass the outbound queue, so if the connection has one it has to be empty.
+ *
+ * @param connection ADB connection to write the data to.
+ * @param count number of segments.
+ * @param segments payload segments.
+ * @return error code or 0 for success.
+ */
+int adb_writev(adb_connection * connection, uint8_t count, usb_segment * segments)
+{
+	adb_device * device = adb_getDevice(connection);
+	int ret;
+
+	// First check if we have a working ADB connection
+	if (device->usb==NULL || !device->connected) return -1;
+
+	// Check if the connection is open for writing, and that there is no queued data that should go out first.
+	if (connection->status != ADB_OPEN) return -2;
+#if ADB_HAS(ADB_FEATURE_WRITE_QUEUE)
+	if (connection->writeQueueLength > 0) return -2;
+#endif
+
+	// Write payload
+	ret = adb_writeMessagev(device, A_WRTE, connection->localID, connection->remoteID, count, segments);
+	if (ret==0)
+		connection->status = ADB_WRITING;
+
+	return ret;
+}
+
+#if ADB_HAS(ADB_FEATURE_RECEIVE_BUFFER)
+/**
+ * Sets up an inbound ring buffer for a connection. When a buffer is set, the payload of incoming WRTE messages is
+ * read from the USB FIFO straight into the buffer, and the application takes it out with adb_available, adb_read
+ * and adb_readByte. Instead of one ADB_CONNECTION_RECEIVE event per USB packet, a single event with a NULL data pointer
+ * is fired per WRTE message, its length being the number of bytes added to the buffer. Incoming data that does
+ * not fit in the buffer is dropped. The buffer is emptied when the connection (re)opens.
+ *
+ * @param connection ADB connection.
+ * @param buffer buffer storage, must remain valid for the lifetime of the connection. NULL removes the buffer.
+ * @param size size of the buffer in bytes.
+ */
+void adb_setReceiveBuffer(adb_connection * connection, uint8_t * buffer, uint16_t size)
+{
+	connection->receiveBuffer = buffer;
+	connection->receiveBufferSize = buffer==NULL ? 0 : size;
+	connection->receiveHead = 0;
+	connection->receiveLength = 0;
+}
+
+/**
+ * @param connection ADB connection.
+ * @return the number of received bytes waiting in the receive buffer of the connection.
+ */
+uint16_t adb_available(adb_connection * connection)
+{
+	return connection->receiveLength;
+}
+
+/**
+ * Takes a single byte out of the receive buffer of a connection.
+ *
+ * @param connection ADB connection.
+ * @return the next received byte, or -1 if the receive buffer is empty.
+ */
+int adb_readByte(adb_connection * connection)
+{
+	uint8_t value;
+
+	if (connection->receiveLength == 0) return -1;
+
+	value = connection->receiveBuffer[connection->receiveHead];
+
+	connection->receiveHead++;
+	if (connection->receiveHead == connection->receiveBufferSize) connection->receiveHead = 0;
+	connection->receiveLength--;
+#if ADB_HAS(ADB_FEATURE_FLOW_CONTROL)
+	adb_consume(connection, 1);
+#endif
+
+	return value;
+}
+
+/**
+ * Takes up to length bytes out of the receive buffer of a connection.
+ *
+ * @param connection ADB connection.
+ * @param length maximum number of bytes to read.
+ * @param data target buffer.
+ * @return number of bytes read.
+ */
+uint16_t adb_read(adb_connection * connection, uint16_t length, uint8_t * data)
+{
+	uint16_t chunk, count;
+
+	if (length > connection->receiveLength) length = connection->receiveLength;
+
+	// Copy the data out, wrapping around the end of the ring buffer if needed.
+	count = length;
+	while (count > 0)
+	{
+		chunk = connection->receiveBufferSize - connection->receiveHead;
+		if (chunk > count) chunk = count;
+
+		memcpy(data, connection->receiveBuffer + connection->receiveHead, chunk);
+		data += chunk;
+
+		connection->receiveHead += chunk;
+		if (connection->receiveHead == connection->receiveBufferSize) connection->receiveHead = 0;
+		count -= chunk;
+	}
+
+	connection->receiveLength -= length;
+#if ADB_HAS(ADB_FEATURE_FLOW_CONTROL)
+	adb_consume(connection, length);
+#endif
+
+	return length;
+}
+#endif
+
+#if ADB_HAS(ADB_FEATURE_FLOW_CONTROL)
+/**
+ * Sets up receive-side flow control for a connection. Normally each incoming WRTE is acknowledged (OKAY) as soon as
+ * its payload has been handed to the application, and the device sends the next one right away. With flow control
+ * the OKAY is withheld while more than window bytes have been received but not consumed, which keeps the device
+ * from sending more on this connection without stalling the others. The application reports progress with
+ * adb_consume, adb_read and adb_readByte do so for connections with a receive buffer.
+ *
+ * ADB_CONNECTION_THROTTLE is fired when an OKAY is withheld, and ADB_CONNECTION_RESUME when it is sent by a later
+ * poll. At most window bytes plus one message (see MAX_PAYLOAD) are outstanding at any time, so a receive buffer of
+ * that size never drops data.
+ *
+ * @param connection ADB connection.
+ * @param enable true to withhold OKAYs, false to acknowledge every message right away.
+ * @param window number of unconsumed bytes up to which messages are still acknowledged right away.
+ */
+void adb_setFlowControl(adb_connection * connection, boolean enable, uint16_t window)
+{
+	connection->flowControl = enable != false;
+	connection->window = window;
+
+	// Start counting from here, the application has had no way to report what it consumed so far.
+	connection->unconsumed = 0;
+}
+
+/**
+ * Reports that the application is done with received data of a connection, see adb_setFlowControl. May be called
+ * from the event handler.
+ *
+ * @param connection ADB connection.
+ * @param length number of bytes consumed.
+ */
+void adb_consume(adb_connection * connection, uint16_t length)
+{
+	connection->unconsumed -= length < connection->unconsumed ? length : connection->unconsumed;
+}
+#endif
+
+#if ADB_HAS(ADB_FEATURE_STATS)
+/**
+ * Maps a duration to its log2 histogram bucket, see ADB_STATS_BUCKETS.
+ *
+ * @param duration duration in microseconds.
+ * @return bucket index.
+ */
+static uint8_t adb_bucket(uint32_t duration)
+{
+	uint8_t i = 0;
+
+	while (duration > 1 && i < ADB_STATS_BUCKETS - 1)
+	{
+		duration >>= 1;
+		i++;
+	}
+
+	return i;
+}
+
+/**
+ * Adds a duration to a histogram. Counts saturate instead of wrapping around.
+ *
+ * @param histogram histogram of ADB_STATS_BUCKETS buckets.
+ * @param duration duration in microseconds.
+ */
+static void adb_record(uint16_t * histogram, uint32_t duration)
+{
+	uint16_t * count = histogram + adb_bucket(duration);
+
+	if (*count != 0xffff) (*count)++;
+}
+
+/**
+ * Adds the counters of one endpoint to a running total.
+ *
+ * @param total total to add to.
+ * @param endpoint endpoint counters.
+ */
+static void adb_addEndpointStats(usb_endpointStats * total, usb_endpointStats * endpoint)
+{
+	total->naks += endpoint->naks;
+	total->timeouts += endpoint->timeouts;
+	total->toggleErrors += endpoint->toggleErrors;
+}
+
+/**
+ * Takes a snapshot of the statistics block: the NAK, timeout and toggle error counters of the bulk endpoints,
+ * payload bytes per connection, OKAY round-trip latencies, poll durations and the time adb_run slept. Counting costs a
+ * few cycles per event and never touches the serial port, so it does not disturb the timing it measures.
+ *
+ * @param snapshot receives the statistics.
+ */
+void adb_getStats(adb_stats * snapshot)
+{
+	adb_device * device;
+
+	*snapshot = stats;
+
+	snapshot->buckets = ADB_STATS_BUCKETS;
+	snapshot->connections = ADB_MAX_CONNECTIONS;
+
+	// The endpoint counters add up over all devices.
+	memset(&snapshot->in, 0, sizeof(usb_endpointStats));
+	memset(&snapshot->out, 0, sizeof(usb_endpointStats));
+
+	for (device = devices; device < devices + ADB_MAX_DEVICES; device++)
+		if (device->usb != NULL)
+		{
+			adb_addEndpointStats(&snapshot->in, &device->usb->bulk_in.stats);
+			adb_addEndpointStats(&snapshot->out, &device->usb->bulk_out.stats);
+		}
+}
+
+/**
+ * Clears all counters and histograms.
+ */
+void adb_resetStats()
+{
+	adb_device * device;
+
+	memset(&stats, 0, sizeof(adb_stats));
+
+	for (device = devices; device < devices + ADB_MAX_DEVICES; device++)
+		if (device->usb != NULL)
+		{
+			memset(&device->usb->bulk_in.stats, 0, sizeof(usb_endpointStats));
+			memset(&device->usb->bulk_out.stats, 0, sizeof(usb_endpointStats));
+		}
+}
+
+/**
+ * Sends a snapshot of the statistics block (see adb_getStats) as a single binary write on a connection, for
+ * instance one dedicated to monitoring that the host reads with "adb forward". Traffic on that connection is
+ * counted too.
+ *
+ * @param connection ADB connection to send the snapshot on.
+ * @return result of adb_write.
+ */
+int adb_writeStats(adb_connection * connection)
+{
+	adb_stats snapshot;
+
+	adb_getStats(&snapshot);
+
+	return adb_write(connection, sizeof(adb_stats), (uint8_t*)&snapshot);
+}
+#endif
+
+#if ADB_HAS(ADB_FEATURE_STATE | ADB_FEATURE_FRAMING | ADB_FEATURE_SYNC | ADB_FEATURE_SHELL | ADB_FEATURE_LOGCAT)
+/**
+ * Passes received data to the parser of a client built on top of a connection: a state channel, framer, sync
+ * client, shell session or logcat client. The event handler of the connection passes all its events on to the one
+ * of the client, which calls this for receive events. The data is either passed along with the event, or waiting in
+ * the receive buffer of the connection (data is NULL). Either way it goes to the parser in order, and is consumed.
+ *
+ * @param connection connection the data was received on.
+ * @param length payload length.
+ * @param data payload data, or NULL if it is in the receive buffer.
+ * @param receiver parser of the client.
+ * @param client client record, passed on to the parser.
+ */
+static void adb_receiveData(adb_connection * connection, uint16_t length, uint8_t * data, adb_receiver * receiver, void * client)
+{
+#if ADB_HAS(ADB_FEATURE_RECEIVE_BUFFER)
+	uint8_t buf[ADB_USB_PACKETSIZE];
+	uint16_t n;
+
+	if (data == NULL)
+	{
+		while ((n = adb_read(connection, sizeof(buf), buf)) > 0)
+			receiver(client, n, buf);
+		return;
+	}
+#endif
+
+	receiver(client, length, data);
+#if ADB_HAS(ADB_FEATURE_FLOW_CONTROL)
+	adb_consume(connection, length);
+#else
+	(void)connection;
+#endif
+}
+#endif
+
+#if ADB_HAS(ADB_FEATURE_STATE)
+/**
+ * Sets up a latest-value state channel on top of a connection. This is meant for control streams, like a joystick
+ * position or a sensor reading, where only the newest value matters: setting a key that has not been sent yet
+ * simply overwrites it, so a slow link makes updates skip values rather than lag behind, and the latency stays
+ * within one period plus one round trip.
+ *
+ * Values travel as records of ADB_STATE_RECORD_SIZE bytes, the key followed by the 16-bit value (little endian),
+ * and an update is a single WRTE with a record for every key that changed. At most one update is outstanding
+ * at any time. The application forwards the events of the connection with adb_handleStateEvent, which takes in
+ * the records received from the other end, and calls adb_flushState from its main loop.
+ *
+ * Each key is meant to have a single writer, at either end. If both ends set a key anyway, a value set locally
+ * but not sent yet wins: a record received for it is dropped, and the local value replaces it at the other end
+ * with the next update.
+ *
+ * @param channel state channel record.
+ * @param connection ADB connection to run the channel on.
+ * @param values table of count values, indexed by key. The initial values are not sent until they are set.
+ * @param count number of keys, at most ADB_STATE_MAX_KEYS.
+ * @param period minimum time between updates in milliseconds, or 0 to send changes as soon as the connection
+ * is ready.
+ */
+void adb_initStateChannel(adb_stateChannel * channel, adb_connection * connection, uint16_t * values, uint8_t count, uint16_t period)
+{
+	if (count > ADB_STATE_MAX_KEYS) count = ADB_STATE_MAX_KEYS;
+
+	channel->connection = connection;
+	channel->values = values;
+	channel->count = count;
+	channel->local = 0;
+	channel->dirty = 0;
+	channel->changed = 0;
+	channel->period = period;
+	channel->deadline = avr_micros();
+	channel->partialLength = 0;
+}
+
+/**
+ * Sets the local value of a key. The new value is sent by the next due adb_flushState, unless it is the same
+ * as the last one.
+ *
+ * @param channel state channel.
+ * @param key key, less than the number of keys of the channel.
+ * @param value new value.
+ */
+void adb_setState(adb_stateChannel * channel, uint8_t key, uint16_t value)
+{
+	uint32_t bit;
+
+	if (key >= channel->count) return;
+
+	bit = (uint32_t)1 << key;
+	if ((channel->local & bit) && channel->values[key] == value) return;
+
+	channel->values[key] = value;
+	channel->local |= bit;
+	channel->dirty |= bit;
+}
+
+/**
+ * @param channel state channel.
+ * @param key key, less than the number of keys of the channel.
+ * @return the latest value of a key, set locally or received from the other end.
+ */
+uint16_t adb_getState(adb_stateChannel * channel, uint8_t key)
+{
+	return key < channel->count ? channel->values[key] : 0;
+}
+
+/**
+ * Returns the set of keys received from the other end since the last call, and clears it.
+ *
+ * @param channel state channel.
+ * @return bit mask of changed keys, bit i standing for key i.
+ */
+uint32_t adb_getStateChanges(adb_stateChannel * channel)
+{
+	uint32_t changed = channel->changed;
+
+	channel->changed = 0;
+
+	return changed;
+}
+
+/**
+ * Stores received records in the value table, except for keys with a local value that has not been sent yet.
+ * A record may be split across calls.
+ *
+ * @param client state channel.
+ * @param length number of bytes.
+ * @param data received bytes.
+ */
+static void adb_receiveState(void * client, uint16_t length, uint8_t * data)
+{
+	adb_stateChannel * channel = (adb_stateChannel*)client;
+	uint8_t record[ADB_STATE_RECORD_SIZE];
+	uint8_t i;
+
+	while (length > 0)
+	{
+		// Complete the record, starting from the bytes left over from last time.
+		for (i = 0; i < channel->partialLength; i++)
+			record[i] = channel->partial[i];
+
+		while (i < ADB_STATE_RECORD_SIZE && length > 0)
+		{
+			record[i++] = *data++;
+			length--;
+		}
+
+		if (i < ADB_STATE_RECORD_SIZE)
+		{
+			memcpy(channel->partial, record, i);
+			channel->partialLength = i;
+			return;
+		}
+
+		channel->partialLength = 0;
+
+		// Keys the channel doesn't know are skipped, and so are those with a local value on its way.
+		if (record[0] < channel->count && !(channel->dirty & ((uint32_t)1 << record[0])))
+		{
+			channel->values[record[0]] = record[1] | (record[2] << 8);
+			channel->changed |= (uint32_t)1 << record[0];
+		}
+	}
+}
+
+/**
+ * Handles an event of the connection of a state channel, taking in the records received (see
+ * adb_receiveData). When the connection opens, all local values are sent again so that the other end starts from
+ * the complete state.
+ *
+ * @param channel state channel.
+ * @param event event type.
+ * @param length payload length.
+ * @param data payload data, or NULL if it is in the receive buffer.
+ */
+void adb_handleStateEvent(adb_stateChannel * channel, adb_eventType event, uint16_t length, uint8_t * data)
+{
+	switch (event)
+	{
+	case ADB_CONNECTION_OPEN:
+		channel->dirty = channel->local;
+		channel->deadline = avr_micros();
+		channel->partialLength = 0;
+		break;
+
+	case ADB_CONNECTION_RECEIVE:
+		adb_receiveData(channel->connection, length, data, adb_receiveState, channel);
+		break;
+
+	default:
+		break;
+	}
+}
+
+/**
+ * Sends the keys that changed since the last update, if any, and if the connection is idle and the period has
+ * passed. A connection with an outbound queue must have an empty queue, the update then goes out around it.
+ *
+ * @param channel state channel.
+ * @return number of keys sent, or error code if the update could not be written.
+ */
+int adb_flushState(adb_stateChannel * channel)
+{
+	adb_connection * connection = channel->connection;
+	adb_device * device = adb_getDevice(connection);
+	uint8_t buf[ADB_STATE_MAX_KEYS * ADB_STATE_RECORD_SIZE];
+	uint8_t key, sent = 0;
+	uint16_t length = 0;
+	int ret;
+
+	if (channel->dirty == 0 || !avr_isPassed(channel->deadline)) return 0;
+
+	// Wait for the OKAY of the previous update, and for queued data to go out first.
+	if (device->usb == NULL || !device->connected || connection->status != ADB_OPEN) return 0;
+#if ADB_HAS(ADB_FEATURE_WRITE_QUEUE)
+	if (connection->writeQueue != NULL && connection->writeQueueLength > 0) return 0;
+#endif
+
+	for (key = 0; key < channel->count; key++)
+		if (channel->dirty & ((uint32_t)1 << key))
+		{
+			buf[length++] = key;
+			buf[length++] = channel->values[key] & 0xff;
+			buf[length++] = channel->values[key] >> 8;
+			sent++;
+		}
+
+	ret = adb_writeMessage(device, A_WRTE, connection->localID, connection->remoteID, length, buf);
+	if (ret != 0) return ret;
+
+	connection->status = ADB_WRITING;
+	channel->dirty = 0;
+	channel->deadline = avr_deadline((uint32_t)channel->period * 1000);
+
+	return sent;
+}
+#endif
+
+#if ADB_HAS(ADB_FEATURE_FRAMING)
+/**
+ * Sets up message framing on top of a connection. Frames are typed, length-prefixed messages: a type byte and a
+ * 16-bit little endian payload length (ADB_FRAME_HEADER_SIZE bytes in all), followed by the payload. The parser
+ * works across the USB packet and WRTE boundaries the payload is split at, and hands every frame to the
+ * handler in one piece.
+ *
+ * A frame that arrives in one piece is handed over in place, without copying. A frame that is split is put
+ * together in the buffer, a split frame longer than the buffer is dropped (see adb_framer.dropped). The
+ * application forwards the events of the connection with adb_handleFrameEvent.
+ *
+ * Frames written with adb_writeFrame to a connection with an outbound queue are packed together: all frames
+ * queued while a WRTE is in flight go out in the next one, and adb_setCoalescing packs them further.
+ *
+ * @param framer framer record.
+ * @param connection ADB connection to run the framing on.
+ * @param buffer buffer for frames that are split, or NULL if the frames are too short for it to matter.
+ * @param size size of the buffer in bytes.
+ * @param handler function to be called for every frame received.
+ */
+void adb_initFramer(adb_framer * framer, adb_connection * connection, uint8_t * buffer, uint16_t size, adb_frameHandler * handler)
+{
+	framer->connection = connection;
+	framer->buffer = buffer;
+	framer->bufferSize = buffer != NULL ? size : 0;
+	framer->handler = handler;
+	framer->headerLength = 0;
+	framer->received = 0;
+	framer->dropped = 0;
+}
+
+/**
+ * Parses received data into frames, picking up where the previous call left off.
+ *
+ * @param framer framer.
+ * @param length number of bytes.
+ * @param data received bytes.
+ */
+void adb_parseFrames(adb_framer * framer, uint16_t length, uint8_t * data)
+{
+	uint16_t chunk;
+
+	while (length > 0)
+	{
+		// Collect the header.
+		if (framer->headerLength < ADB_FRAME_HEADER_SIZE)
+		{
+			framer->header[framer->headerLength++] = *data++;
+			length--;
+
+			if (framer->headerLength < ADB_FRAME_HEADER_SIZE) continue;
+
+			framer->length = framer->header[1] | (framer->header[2] << 8);
+			framer->received = 0;
+		}
+
+		// The whole payload is here, hand it over in place.
+		if (framer->received == 0 && length >= framer->length)
+		{
+			framer->handler(framer, framer->header[0], framer->length, data);
+			data += framer->length;
+			length -= framer->length;
+			framer->headerLength = 0;
+			continue;
+		}
+
+		// Put a split frame together in the buffer, or skip it if it won't fit.
+		chunk = framer->length - framer->received;
+		if (chunk > length) chunk = length;
+
+		if (framer->length <= framer->bufferSize)
+			memcpy(framer->buffer + framer->received, data, chunk);
+
+		framer->received += chunk;
+		data += chunk;
+		length -= chunk;
+
+		if (framer->received < framer->length) continue;
+
+		if (framer->length <= framer->bufferSize)
+			framer->handler(framer, framer->header[0], framer->length, framer->buffer);
+		else
+			framer->dropped++;
+
+		framer->headerLength = 0;
+	}
+}
+
+/**
+ * Parser of a framer for adb_receiveData, see adb_parseFrames.
+ *
+ * @param client framer.
+ * @param length number of bytes.
+ * @param data received bytes.
+ */
+static void adb_receiveFrames(void * client, uint16_t length, uint8_t * data)
+{
+	adb_parseFrames((adb_framer*)client, length, data);
+}
+
+/**
+ * Handles an event of the connection of a framer, parsing the data received into frames (see adb_receiveData). A
+ * frame that was cut off by the connection closing is discarded.
+ *
+ * @param framer framer.
+ * @param event event type.
+ * @param length payload length.
+ * @param data payload data, or NULL if it is in the receive buffer.
+ */
+void adb_handleFrameEvent(adb_framer * framer, adb_eventType event, uint16_t length, uint8_t * data)
+{
+	switch (event)
+	{
+	case ADB_CONNECTION_OPEN:
+		framer->headerLength = 0;
+		break;
+
+	case ADB_CONNECTION_RECEIVE:
+		adb_receiveData(framer->connection, length, data, adb_receiveFrames, framer);
+		break;
+
+	default:
+		break;
+	}
+}
+
+/**
+ * Writes a frame. If the connection has an outbound queue, the frame is queued whole or not at all, and sent
+ * together with the other frames in the queue. Otherwise it is sent right away as a WRTE of its own.
+ *
+ * @param framer framer.
+ * @param type frame type.
+ * @param length payload length.
+ * @param data payload.
+ * @return 0 for success, -2 if the connection is not open, -3 if the frame does not fit in the outbound queue, or
+ * the error code of adb_writev.
+ */
+int adb_writeFrame(adb_framer * framer, uint8_t type, uint16_t length, uint8_t * data)
+{
+	adb_connection * connection = framer->connection;
+	uint8_t header[ADB_FRAME_HEADER_SIZE];
+	usb_segment segments[2];
+#if ADB_HAS(ADB_FEATURE_WRITE_QUEUE)
+	int ret;
+#endif
+
+	header[0] = type;
+	header[1] = length & 0xff;
+	header[2] = length >> 8;
+
+	segments[0].data = header;
+	segments[0].length = ADB_FRAME_HEADER_SIZE;
+	segments[0].progmem = false;
+	segments[1].data = data;
+	segments[1].length = length;
+	segments[1].progmem = false;
+
+#if ADB_HAS(ADB_FEATURE_WRITE_QUEUE)
+	if (connection->writeQueue != NULL)
+	{
+		ret = adb_queueWrite(connection, 2, segments, true);
+		return ret < 0 ? ret : 0;
+	}
+#endif
+
+	return adb_writev(connection, 2, segments);
+}
+#endif
+
+#if ADB_HAS(ADB_FEATURE_SYNC)
+// Sync protocol request and response IDs, as they appear on the wire (little endian).
+#define ADB_SYNC_SEND 0x444e4553
+#define ADB_SYNC_RECV 0x56434552
+#define ADB_SYNC_DATA 0x41544144
+#define ADB_SYNC_DONE 0x454e4f44
+#define ADB_SYNC_OKAY 0x59414b4f
+#define ADB_SYNC_FAIL 0x4c494146
+
+// File type bits of a regular file, added to the permission bits passed to adb_syncSend.
+#define ADB_SYNC_REGULAR 0100000
+
+/**
+ * Sets up a client for the file sync service of adbd on top of a connection, which must have been opened for
+ * "sync:". Files are pushed with adb_syncSend and pulled with adb_syncReceive, one at a time, and the connection
+ * can be used for any number of transfers. Unlike a shell command, this handles binary data of any size without
+ * quoting, and the file data is streamed through the buffer in chunks, so it never has to be in memory as a whole.
+ *
+ * The application forwards the events of the connection with adb_handleSyncEvent, and calls adb_pollSync from its
+ * main loop to keep a push going.
+ *
+ * @param sync sync client record.
+ * @param connection ADB connection to the "sync:" service.
+ * @param buffer buffer for the file data of a push, and for the error message of a failed transfer. A DATA
+ * chunk sent is at most its size, the larger the buffer the fewer round trips.
+ * @param size size of the buffer in bytes, at least ADB_SYNC_MIN_BUFFER. A client with a smaller buffer refuses
+ * all transfers.
+ * @param handler function to be called when a transfer is done.
+ * @return 0 for success, or -1 if the buffer is too small.
+ */
+int adb_initSync(adb_syncClient * sync, adb_connection * connection, uint8_t * buffer, uint16_t size, adb_syncHandler * handler)
+{
+	if (buffer == NULL || size < ADB_SYNC_MIN_BUFFER) size = 0;
+
+	sync->connection = connection;
+	sync->buffer = buffer;
+	sync->bufferSize = size;
+	sync->handler = handler;
+	sync->reader = NULL;
+	sync->writer = NULL;
+	sync->state = ADB_SYNC_IDLE;
+	sync->headerLength = 0;
+
+	return size > 0 ? 0 : -1;
+}
+
+/**
+ * @param sync sync client.
+ * @return true iff the client is ready for a new transfer. A client without a usable buffer (see adb_initSync)
+ * never is.
+ */
+boolean adb_isSyncIdle(adb_syncClient * sync)
+{
+	return sync->state == ADB_SYNC_IDLE && sync->bufferSize > 0 && sync->connection->status == ADB_OPEN;
+}
+
+/**
+ * Fills out a sync request header.
+ *
+ * @param header 8-byte header.
+ * @param id request ID.
+ * @param length request length, or an argument for requests without data.
+ */
+static void adb_syncHeader(uint8_t * header, uint32_t id, uint32_t length)
+{
+	uint8_t i;
+
+	for (i = 0; i < 4; i++)
+	{
+		header[i] = id >> (8 * i);
+		header[i + 4] = length >> (8 * i);
+	}
+}
+
+/**
+ * Ends the current transfer and reports the result.
+ *
+ * @param sync sync client.
+ * @param result 0 for success, or a negative error code.
+ * @param message error message from the device, or NULL.
+ */
+static void adb_finishSync(adb_syncClient * sync, int result, const char * message)
+{
+	sync->state = ADB_SYNC_IDLE;
+	sync->headerLength = 0;
+
+	if (sync->handler != NULL)
+		sync->handler(sync, result, message);
+}
+
+/**
+ * Starts pushing a file to the device. The file data is pulled from the reader callback a chunk at a time, as
+ * fast as the device takes it, until the reader returns 0. The handler is called once the device has stored the
+ * file (result 0), has refused it (-1, with the message of the device), or the push has been cut off (-3 when the
+ * connection closed, -4 when a chunk could not be written).
+ *
+ * @param sync sync client, idle (see adb_isSyncIdle).
+ * @param path path of the file on the device, for example "/sdcard/log.bin".
+ * @param mode permission bits of the file, for example 0644.
+ * @param mtime modification time of the file in seconds since the epoch.
+ * @param reader function that reads the next chunk of the file.
+ * @return 0 for success, -2 if the client or the connection is busy, or error code.
+ */
+int adb_syncSend(adb_syncClient * sync, const char * path, uint16_t mode, uint32_t mtime, adb_syncReader * reader)
+{
+	uint8_t header[8];
+	char suffix[8];
+	usb_segment segments[3];
+	uint32_t bits = ADB_SYNC_REGULAR | mode;
+	uint8_t i = sizeof(suffix);
+	int ret;
+
+	if (!adb_isSyncIdle(sync)) return -2;
+
+	// The request is the path and the mode in decimal, separated by a comma.
+	do
+	{
+		suffix[--i] = '0' + bits % 10;
+		bits /= 10;
+	} while (bits > 0);
+	suffix[--i] = ',';
+
+	segments[0].data = header;
+	segments[0].length = sizeof(header);
+	segments[0].progmem = false;
+	segments[1].data = (uint8_t*)path;
+	segments[1].length = strlen(path);
+	segments[1].progmem = false;
+	segments[2].data = (uint8_t*)suffix + i;
+	segments[2].length = sizeof(suffix) - i;
+	segments[2].progmem = false;
+
+	adb_syncHeader(header, ADB_SYNC_SEND, segments[1].length + segments[2].length);
+
+	ret = adb_writev(sync->connection, 3, segments);
+	if (ret != 0) return ret;
+
+	sync->reader = reader;
+	sync->mtime = mtime;
+	sync->size = 0;
+	sync->state = ADB_SYNC_SENDING;
+
+	return 0;
+}
+
+/**
+ * Starts pulling a file from the device. The file data is handed to the writer callback piece by piece as it
+ * comes in, and the handler is called at the end of the file, or if the device can't send it.
+ *
+ * @param sync sync client, idle (see adb_isSyncIdle).
+ * @param path path of the file on the device.
+ * @param writer function that takes the next piece of the file.
+ * @return 0 for success, -2 if the client or the connection is busy, or error code.
+ */
+int adb_syncReceive(adb_syncClient * sync, const char * path, adb_syncWriter * writer)
+{
+	uint8_t header[8];
+	usb_segment segments[2];
+	int ret;
+
+	if (!adb_isSyncIdle(sync)) return -2;
+
+	segments[0].data = header;
+	segments[0].length = sizeof(header);
+	segments[0].progmem = false;
+	segments[1].data = (uint8_t*)path;
+	segments[1].length = strlen(path);
+	segments[1].progmem = false;
+
+	adb_syncHeader(header, ADB_SYNC_RECV, segments[1].length);
+
+	ret = adb_writev(sync->connection, 2, segments);
+	if (ret != 0) return ret;
+
+	sync->writer = writer;
+	sync->size = 0;
+	sync->state = ADB_SYNC_RECEIVING;
+
+	return 0;
+}
+
+/**
+ * Sends the next DATA chunk of a push, or the closing DONE, once the connection is ready for it. The main loop
+ * calls this as often as it can while a push is going on. The reader is only asked for a chunk when the
+ * connection can take it. A chunk can't be handed back to the reader, so if writing it fails anyway, the push ends
+ * with result -4 rather than leave a hole in the file.
+ *
+ * @param sync sync client.
+ * @return number of file bytes sent, or -1 if the chunk could not be written.
+ */
+int adb_pollSync(adb_syncClient * sync)
+{
+	adb_connection * connection = sync->connection;
+	adb_device * device = adb_getDevice(connection);
+	uint32_t maxData = device->remoteMaxData;
+	uint16_t length = sync->bufferSize;
+	uint8_t header[8];
+	usb_segment segments[2];
+
+	// Wait until the connection takes a write, see adb_writev.
+	if (sync->state != ADB_SYNC_SENDING || device->usb == NULL || !device->connected || connection->status != ADB_OPEN)
+		return 0;
+#if ADB_HAS(ADB_FEATURE_WRITE_QUEUE)
+	if (connection->writeQueueLength > 0) return 0;
+#endif
+
+	// A DATA chunk and its header go in one WRTE, which a device with a tiny maximum payload can't take.
+	if (maxData <= sizeof(header))
+	{
+		adb_finishSync(sync, -4, NULL);
+		return -1;
+	}
+	if (length > maxData - sizeof(header)) length = maxData - sizeof(header);
+	length = sync->reader(sync, length, sync->buffer);
+
+	segments[0].data = header;
+	segments[0].length = sizeof(header);
+	segments[0].progmem = false;
+	segments[1].data = sync->buffer;
+	segments[1].length = length;
+	segments[1].progmem = false;
+
+	// A DONE with the modification time ends the file.
+	if (length == 0)
+		adb_syncHeader(header, ADB_SYNC_DONE, sync->mtime);
+	else
+		adb_syncHeader(header, ADB_SYNC_DATA, length);
+
+	if (adb_writev(connection, length > 0 ? 2 : 1, segments) != 0)
+	{
+		adb_finishSync(sync, -4, NULL);
+		return -1;
+	}
+
+	if (length == 0)
+		sync->state = ADB_SYNC_WAITING;
+	sync->size += length;
+
+	return length;
+}
+
+/**
+ * Parses the responses of the sync service.
+ *
+ * @param client sync client.
+ * @param length number of bytes.
+ * @param data received bytes.
+ */
+static void adb_receiveSync(void * client, uint16_t length, uint8_t * data)
+{
+	adb_syncClient * sync = (adb_syncClient*)client;
+	uint32_t id, chunk, n;
+	uint8_t i;
+
+	while (length > 0)
+	{
+		// Collect the response header.
+		if (sync->headerLength < sizeof(sync->header))
+		{
+			sync->header[sync->headerLength++] = *data++;
+			length--;
+
+			if (sync->headerLength < sizeof(sync->header)) continue;
+
+			for (i = 0, sync->length = 0; i < 4; i++)
+				sync->length |= (uint32_t)sync->header[i + 4] << (8 * i);
+			sync->received = 0;
+		}
+
+		id = 0;
+		for (i = 0; i < 4; i++)
+			id |= (uint32_t)sync->header[i] << (8 * i);
+
+		// The length of OKAY and DONE is an argument, they carry no data.
+		if (id == ADB_SYNC_OKAY || id == ADB_SYNC_DONE)
+		{
+			sync->headerLength = 0;
+
+			if ((id == ADB_SYNC_OKAY && sync->state == ADB_SYNC_WAITING) || (id == ADB_SYNC_DONE && sync->state == ADB_SYNC_RECEIVING))
+				adb_finishSync(sync, 0, NULL);
+
+			continue;
+		}
+
+		chunk = sync->length - sync->received;
+		if (chunk > length) chunk = length;
+
+		if (id == ADB_SYNC_DATA && sync->state == ADB_SYNC_RECEIVING)
+		{
+			if (chunk > 0) sync->writer(sync, chunk, data);
+			sync->size += chunk;
+		}
+		else if (id == ADB_SYNC_FAIL)
+		{
+			// Keep as much of the message as fits.
+			for (n = sync->received; n < sync->received + chunk && n < sync->bufferSize - 1u; n++)
+				sync->buffer[n] = data[n - sync->received];
+		}
+
+		sync->received += chunk;
+		data += chunk;
+		length -= chunk;
+
+		if (sync->received < sync->length) continue;
+
+		sync->headerLength = 0;
+
+		if (id == ADB_SYNC_FAIL && sync->state != ADB_SYNC_IDLE)
+		{
+			sync->buffer[sync->length < sync->bufferSize ? sync->length : sync->bufferSize - 1u] = 0;
+			adb_finishSync(sync, -1, (char*)sync->buffer);
+		}
+	}
+}
+
+/**
+ * Handles an event of the connection of a sync client, parsing the responses received (see adb_receiveData). A
+ * transfer that is cut off by the connection closing ends with error code -3.
+ *
+ * @param sync sync client.
+ * @param event event type.
+ * @param length payload length.
+ * @param data payload data, or NULL if it is in the receive buffer.
+ */
+void adb_handleSyncEvent(adb_syncClient * sync, adb_eventType event, uint16_t length, uint8_t * data)
+{
+	switch (event)
+	{
+	case ADB_CONNECTION_CLOSE:
+	case ADB_CONNECTION_FAILED:
+		if (sync->state != ADB_SYNC_IDLE)
+			adb_finishSync(sync, -3, NULL);
+		sync->headerLength = 0;
+		break;
+
+	case ADB_CONNECTION_RECEIVE:
+		adb_receiveData(sync->connection, length, data, adb_receiveSync, sync);
+		break;
+
+	default:
+		break;
+	}
+}
+#endif
+
+#if ADB_HAS(ADB_FEATURE_SHELL)
+// Sent ahead of the first command after the connection opens: no echo of the commands (which would otherwise mix
+// with the output of the command before them) and no prompt.
+static const char shellSetup[] PROGMEM = "stty -echo -onlcr 2>/dev/null; PS1=\n";
+
+// Markers the output of a command is framed with. These bytes don't occur in text output.
+#define ADB_SHELL_START 0x1e
+#define ADB_SHELL_END 0x1f
+
+/**
+ * Sets up a shell session on top of a connection, which must have been opened for "shell:". The session runs
+ * any number of commands in the one shell on the device, instead of paying for a connection and a shell per
+ * command. Commands are pipelined: adb_shellCommand sends a command right away, the shell runs them one after the
+ * other, and the output and exit code of each go to the handler given with the command.
+ *
+ * To tell the output of the commands apart, each one is wrapped in printf statements that print a start marker
+ * and an end marker with the exit code, and everything outside the markers (like the prompt) is dropped. The
+ * shell on the device needs printf, and stty to switch the echo off.
+ *
+ * The application forwards the events of the connection with adb_handleShellEvent. Give the connection an
+ * outbound queue (see adb_setWriteQueue) to queue commands while the one before is still being sent.
+ *
+ * @param session shell session record.
+ * @param connection ADB connection to the "shell:" service.
+ */
+void adb_initShell(adb_shellSession * session, adb_connection * connection)
+{
+	session->connection = connection;
+	session->head = 0;
+	session->count = 0;
+	session->nextId = 0;
+	session->state = ADB_SHELL_SKIPPING;
+	session->ready = false;
+	session->broken = false;
+}
+
+/**
+ * @param session shell session.
+ * @return number of commands sent that have not finished yet.
+ */
+uint8_t adb_getShellPending(adb_shellSession * session)
+{
+	return session->count;
+}
+
+/**
+ * Writes a number in decimal.
+ *
+ * @param str buffer to write to, not zero terminated.
+ * @param number number.
+ * @return number of characters written.
+ */
+static uint8_t adb_shellNumber(char * str, uint8_t number)
+{
+	uint8_t length = number >= 100 ? 3 : number >= 10 ? 2 : 1, i;
+
+	for (i = length; i > 0; i--)
+	{
+		str[i - 1] = '0' + number % 10;
+		number /= 10;
+	}
+
+	return length;
+}
+
+/**
+ * Sends a command to the shell. The handler is called with the output of the command as it comes in, and once
+ * more at the end with a NULL data pointer and the exit code of the command. If the connection closes before, the
+ * exit code is -1. Commands go on a single line and must be complete, an unmatched quote stalls the session.
+ *
+ * A USB error while the command is being written may leave the shell with part of it, so the session is then
+ * broken: all commands fail with -1 until the connection reopens.
+ *
+ * @param session shell session.
+ * @param command command line, without the trailing newline.
+ * @param handler function to be called with the output and exit code.
+ * @return ID of the command, -1 if the session is broken, -2 if the connection is not open or busy, or -3 if the
+ * command does not fit in the outbound queue or ADB_SHELL_QUEUE_SIZE commands are pending already.
+ */
+int adb_shellCommand(adb_shellSession * session, const char * command, adb_shellHandler * handler)
+{
+	adb_connection * connection = session->connection;
+	char setup[sizeof(shellSetup)];
+	char prefix[20], suffix[28];
+	usb_segment segments[4];
+	uint8_t id = session->nextId, count = 0, i, n;
+	int ret;
+
+	if (session->broken) return -1;
+	if (session->count == ADB_SHELL_QUEUE_SIZE) return -3;
+
+	// printf '\036<id>\n', the command, printf '\037<id> %d\n' $?
+	memcpy(prefix, "printf '\\036", 12);
+	n = 12;
+	n += adb_shellNumber(prefix + n, id);
+	memcpy(prefix + n, "\\n'\n", 4); n += 4;
+
+	if (!session->ready)
+	{
+		memcpy_P(setup, shellSetup, sizeof(setup) - 1);
+		segments[count].data = (uint8_t*)setup;
+		segments[count++].length = sizeof(setup) - 1;
+	}
+	segments[count].data = (uint8_t*)prefix;
+	segments[count++].length = n;
+	segments[count].data = (uint8_t*)command;
+	segments[count++].length = strlen(command);
+
+	memcpy(suffix, "\nprintf '\\037", 13);
+	n = 13;
+	n += adb_shellNumber(suffix + n, id);
+	memcpy(suffix + n, " %d\\n' $?\n", 10); n += 10;
+	segments[count].data = (uint8_t*)suffix;
+	segments[count++].length = n;
+
+	for (i = 0; i < count; i++)
+		segments[i].progmem = false;
+
+#if ADB_HAS(ADB_FEATURE_WRITE_QUEUE)
+	if (connection->writeQueue != NULL)
+	{
+		ret = adb_queueWrite(connection, count, segments, true);
+		if (ret < 0) return ret;
+	}
+	else
+#endif
+	{
+		// -1 and -2 mean nothing was sent, a USB error may have cut the command short.
+		ret = adb_writev(connection, count, segments);
+		if (ret < 0) return -2;
+		if (ret > 0)
+		{
+			session->broken = true;
+			return -1;
+		}
+	}
+
+	i = session->head + session->count;
+	if (i >= ADB_SHELL_QUEUE_SIZE) i -= ADB_SHELL_QUEUE_SIZE;
+	session->handlers[i] = handler;
+	session->count++;
+	session->nextId++;
+	session->ready = true;
+
+	return id;
+}
+
+/**
+ * Ends the oldest pending command.
+ *
+ * @param session shell session.
+ * @param exitCode exit code to report.
+ */
+static void adb_finishShellCommand(adb_shellSession * session, int exitCode)
+{
+	adb_shellHandler * handler = session->handlers[session->head];
+
+	if (++session->head == ADB_SHELL_QUEUE_SIZE) session->head = 0;
+	session->count--;
+
+	if (handler != NULL)
+		handler(session, 0, NULL, exitCode);
+}
+
+/**
+ * Parses the output of the shell: hands the output of the oldest pending command to its handler, and finishes
+ * the command at its end marker.
+ *
+ * @param client shell session.
+ * @param length number of bytes.
+ * @param data received bytes.
+ */
+static void adb_receiveShell(void * client, uint16_t length, uint8_t * data)
+{
+	adb_shellSession * session = (adb_shellSession*)client;
+	uint8_t id = session->nextId - session->count;
+	adb_shellHandler * handler;
+	uint16_t run;
+	uint8_t c;
+
+	while (length > 0)
+	{
+		// Command output goes to the handler in place, up to the end marker.
+		if (session->state == ADB_SHELL_OUTPUT)
+		{
+			for (run = 0; run < length && data[run] != ADB_SHELL_END; run++);
+
+			handler = session->handlers[session->head];
+			if (run > 0 && handler != NULL)
+				handler(session, run, data, 0);
+
+			data += run;
+			length -= run;
+			if (length == 0) break;
+
+			session->state = ADB_SHELL_END_ID;
+			session->number = 0;
+			data++;
+			length--;
+			continue;
+		}
+
+		c = *data++;
+		length--;
+
+		if (c == '\r') continue;
+
+		switch (session->state)
+		{
+		case ADB_SHELL_SKIPPING:
+			if (c == ADB_SHELL_START)
+			{
+				session->state = ADB_SHELL_START_ID;
+				session->number = 0;
+			}
+			break;
+
+		case ADB_SHELL_START_ID:
+		case ADB_SHELL_END_ID:
+		case ADB_SHELL_EXIT_CODE:
+			if (c >= '0' && c <= '9')
+			{
+				session->number = session->number * 10 + (c - '0');
+				break;
+			}
+
+			// A marker that doesn't belong to the oldest pending command can only be garbage.
+			if (session->count == 0 || (session->state != ADB_SHELL_EXIT_CODE && session->number != id))
+				session->state = ADB_SHELL_SKIPPING;
+			else if (session->state == ADB_SHELL_START_ID && c == '\n')
+				session->state = ADB_SHELL_OUTPUT;
+			else if (session->state == ADB_SHELL_END_ID && c == ' ')
+			{
+				session->state = ADB_SHELL_EXIT_CODE;
+				session->number = 0;
+			}
+			else if (session->state == ADB_SHELL_EXIT_CODE && c == '\n')
+			{
+				session->state = ADB_SHELL_SKIPPING;
+				adb_finishShellCommand(session, session->number);
+				id++;
+			}
+			else
+				session->state = ADB_SHELL_SKIPPING;
+			break;
+
+		default:
+			break;
+		}
+	}
+}
+
+/**
+ * Handles an event of the connection of a shell session, splitting the output received by command (see
+ * adb_receiveData). The commands still pending when the connection closes end with exit code -1, and a new
+ * shell is set up when it opens again.
+ *
+ * @param session shell session.
+ * @param event event type.
+ * @param length payload length.
+ * @param data payload data, or NULL if it is in the receive buffer.
+ */
+void adb_handleShellEvent(adb_shellSession * session, adb_eventType event, uint16_t length, uint8_t * data)
+{
+	switch (event)
+	{
+	case ADB_CONNECTION_OPEN:
+	case ADB_CONNECTION_CLOSE:
+	case ADB_CONNECTION_FAILED:
+		while (session->count > 0)
+			adb_finishShellCommand(session, -1);
+
+		session->state = ADB_SHELL_SKIPPING;
+		session->ready = false;
+		session->broken = false;
+		break;
+
+	case ADB_CONNECTION_RECEIVE:
+		adb_receiveData(session->connection, length, data, adb_receiveShell, session);
+		break;
+
+	default:
+		break;
+	}
+}
+#endif
+
+#if ADB_HAS(ADB_FEATURE_LOGCAT)
+/**
+ * Drops the partial line or entry of a logcat client.
+ *
+ * @param logcat logcat client.
  */
-static void adb_closeAll()
+static void adb_resetLogcat(adb_logcat * logcat)
 {
-	adb_connection * connection;
+	logcat->position = 0;
+	logcat->overflow = false;
+	logcat->headerLength = 0;
+	logcat->headerSize = ADB_LOGCAT_HEADER_SIZE;
+}
 
-	// Iterate over all connections and close the ones that are currently open.
-	for (connection = firstConnection; connection != NULL; connection = connection->next)
-		if (!(connection->status==ADB_UNUSED || connection->status==ADB_CLOSED))
-			adb_handleClose(connection);
+/**
+ * Sets up a logcat client. Log output is handed to the application either as text lines, or as parsed entries of
+ * the binary log format (logcat -B), whichever handler is given. Both go through the buffer: a text line longer
+ * than the buffer is cut short, and so is the payload of a binary entry.
+ *
+ * Open the logcat connection with adb_addLogcat, and forward its events with adb_handleLogcatEvent.
+ *
+ * @param logcat logcat client record.
+ * @param buffer line or entry buffer.
+ * @param size size of the buffer in bytes, at least ADB_LOGCAT_MIN_BUFFER. A client with a smaller buffer can't
+ * be connected.
+ * @param lineHandler function to be called for every line of text, or NULL.
+ * @param entryHandler function to be called for every binary entry, or NULL to receive text.
+ * @return 0 for success, or -1 if the buffer is too small.
+ */
+int adb_initLogcat(adb_logcat * logcat, uint8_t * buffer, uint16_t size, adb_logcatLineHandler * lineHandler, adb_logcatEntryHandler * entryHandler)
+{
+	if (buffer == NULL || size < ADB_LOGCAT_MIN_BUFFER) size = 0;
 
+	logcat->connection = NULL;
+	logcat->buffer = buffer;
+	logcat->bufferSize = size;
+	logcat->lineHandler = lineHandler;
+	logcat->entryHandler = entryHandler;
+	logcat->truncated = 0;
+	adb_resetLogcat(logcat);
+
+	return size > 0 ? 0 : -1;
 }
 
 /**
- * Handles an ADB connect message. This is a response to a connect message sent from our side.
- * @param message ADB message.
+ * Appends a string to a connection string being built.
+ *
+ * @param str connection string.
+ * @param length current length of the connection string.
+ * @param suffix string to append.
+ * @return new length, or ADB_CONNECTIONSTRING_LENGTH if it doesn't fit.
  */
-static void adb_handleConnect(adb_message * message)
+static uint8_t adb_appendString(char * str, uint8_t length, const char * suffix)
 {
-	unsigned int bytesRead;
-	uint8_t buf[MAX_BUF_SIZE];
-	uint16_t len;
+	uint8_t n = strlen(suffix);
 
-	// Read payload (remote ADB device ID)
-	len = message->data_length < MAX_BUF_SIZE ? message->data_length : MAX_BUF_SIZE;
-	bytesRead = usb_bulkRead(adbDevice, len, buf, false);
+	if (length + n >= ADB_CONNECTIONSTRING_LENGTH) return ADB_CONNECTIONSTRING_LENGTH;
 
-	// Signal that we are now connected to an Android device (yay!)
-	connected = true;
-
-	// Fire event.
-	adb_fireEvent(NULL, ADB_CONNECT, len, buf);
+	memcpy(str + length, suffix, n + 1);
 
+	return length + n;
 }
 
 /**
- * This method is called periodically to check for new messages on the USB bus and process them.
+ * Adds the connection of a logcat client, with filter specs so that only the log lines of interest leave the
+ * phone. The filters are logcat filter specs separated by spaces, a tag and a priority (V, D, I, W, E, F) like
+ * "MyApp:D GPS:W", everything else is silenced. Binary entries come from the exec: service, which doesn't mangle
+ * binary data the way the terminal of shell: does, and needs Android 5.0 or later.
+ *
+ * @param logcat logcat client, see adb_initLogcat.
+ * @param filters filter specs, or NULL for the whole log.
+ * @param reconnect true for automatic reconnect (persistent connections).
+ * @param handler event handler of the connection, which passes the events on to adb_handleLogcatEvent.
+ * @return the connection, or NULL if there is no free slot, the client has no usable buffer, or the command does
+ * not fit in ADB_CONNECTIONSTRING_LENGTH (the command and filters take up to 22 characters more).
  */
-void adb_poll()
+adb_connection * adb_addLogcat(adb_logcat * logcat, const char * filters, boolean reconnect, adb_eventHandler * handler)
 {
-	adb_connection * connection;
-	adb_message message;
-
-	// Poll the USB layer.
-	usb_poll();
+#if ADB_CONNECTIONSTRING_LENGTH > 0
+	char command[ADB_CONNECTIONSTRING_LENGTH];
+	uint8_t length;
 
-	// If no USB device, there's no work for us to be done, so just return.
-	if (adbDevice==NULL) return;
+	if (logcat->bufferSize == 0) return NULL;
 
-	// If not connected, send a connection string to the device.
-	if (!connected)
+	length = adb_appendString(command, 0, logcat->entryHandler != NULL ? "exec:logcat -B" : "shell:exec logcat");
+	if (filters != NULL && *filters != 0)
 	{
-		adb_writeStringMessage(adbDevice, A_CNXN, 0x01000000, 4096, "host::microbridge");
-		avr_delay(500); // Give the device some time to respond.
+		length = adb_appendString(command, length, " ");
+		length = adb_appendString(command, length, filters);
+		length = adb_appendString(command, length, " *:S");
 	}
+	if (length >= ADB_CONNECTIONSTRING_LENGTH) return NULL;
 
-	// If we are connected, check if there are connections that need to be opened
-	if (connected)
-		adb_openClosedConnections();
+	logcat->connection = adb_addConnection(command, reconnect, handler);
+	return logcat->connection;
+#else
+	return NULL;
+#endif
+}
 
-	// Check for an incoming ADB message.
-	if (!adb_pollMessage(&message, true))
-		return;
+/**
+ * Assembles text lines.
+ *
+ * @param client logcat client.
+ * @param length number of bytes.
+ * @param data received bytes.
+ */
+static void adb_receiveLines(void * client, uint16_t length, uint8_t * data)
+{
+	adb_logcat * logcat = (adb_logcat*)client;
+	uint8_t c;
 
-	// Handle a response from the ADB device to our CONNECT message.
-	if (message.command == A_CNXN)
-		adb_handleConnect(&message);
+	while (length-- > 0)
+	{
+		c = *data++;
 
-#ifdef DEBUG
-	avr_serialPrintf("IN >> ", connected); adb_printMessage(&message);
-#endif
+		if (c == '\r') continue;
 
-	// Handle messages for specific connections
-	for (connection = firstConnection; connection != NULL; connection = connection->next)
-	{
-		if (connection->status!=ADB_UNUSED && connection->localID==message.arg1)
+		if (c == '\n')
 		{
-			switch(message.command)
-			{
-			case A_OKAY:
-				adb_handleOkay(connection, &message);
-				break;
-			case A_CLSE:
-				adb_handleClose(connection);
-				break;
-			case A_WRTE:
-				adb_handleWrite(connection, &message);
-				break;
-			default:
-				break;
-			}
+			logcat->buffer[logcat->position] = 0;
+			logcat->lineHandler(logcat, logcat->position, (char*)logcat->buffer);
+			logcat->position = 0;
+			logcat->overflow = false;
+		}
+		else if (logcat->position < logcat->bufferSize - 1u)
+			logcat->buffer[logcat->position++] = c;
+		else if (!logcat->overflow)
+		{
+			logcat->overflow = true;
+			logcat->truncated++;
 		}
 	}
-
 }
 
 /**
- * Helper function for usb_isAdbDevice to check whether an interface is a valid ADB interface.
- * @param interface interface descriptor struct.
+ * Reads a 32-bit little-endian field of a binary log entry header.
+ *
+ * @param data first byte of the field.
+ * @return field value.
  */
-static boolean usb_isAdbInterface(usb_interfaceDescriptor * interface)
+static uint32_t adb_getLogField(uint8_t * data)
 {
-
-	// Check if the interface has exactly two endpoints.
-	if (interface->bNumEndpoints!=2) return false;
-
-	// Check if the endpoint supports bulk transfer.
-	if (interface->bInterfaceProtocol != ADB_PROTOCOL) return false;
-	if (interface->bInterfaceClass != ADB_CLASS) return false;
-	if (interface->bInterfaceSubClass != ADB_SUBCLASS) return false;
-
-	return true;
+	return data[0] | ((uint32_t)data[1] << 8) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
 }
 
 /**
- * Checks whether the a connected USB device is an ADB device and populates a configuration record if it is.
+ * Parses binary log entries (logcat -B): a header of payload length, header size (0 in the original format, which
+ * has a header of ADB_LOGCAT_HEADER_SIZE bytes), pid, tid and time, followed by the payload of a priority byte,
+ * the tag and the message, both zero terminated. Header fields beyond the original ones are skipped.
  *
- * @param device USB device.
- * @param handle pointer to a configuration record. The endpoint device address, configuration, and endpoint information will be stored here.
- * @return true iff the device is an ADB device.
+ * @param client logcat client.
+ * @param length number of bytes.
+ * @param data received bytes.
  */
-static boolean adb_isAdbDevice(usb_device * device, int configuration, adb_usbConfiguration * handle)
+static void adb_receiveEntries(void * client, uint16_t length, uint8_t * data)
 {
-	boolean ret = false;
-	uint8_t buf[MAX_BUF_SIZE];
-	int bytesRead;
+	adb_logcat * logcat = (adb_logcat*)client;
+	uint8_t * header = logcat->header;
+	uint16_t payloadLength, chunk, n;
+	adb_logEntry entry;
 
-	// Read the length of the configuration descriptor.
-	bytesRead = usb_getConfigurationDescriptor(device, configuration, MAX_BUF_SIZE, buf);
-	if (bytesRead<0) return false;
-
-	uint16_t pos = 0;
-	uint8_t descriptorLength;
-	uint8_t descriptorType;
-
-	usb_configurationDescriptor * config = NULL;
-	usb_interfaceDescriptor * interface = NULL;
-	usb_endpointDescriptor * endpoint = NULL;
-
-	while (pos < bytesRead)
+	while (length > 0)
 	{
-		descriptorLength = buf[pos];
-		descriptorType = buf[pos + 1];
-
-		switch (descriptorType)
+		if (logcat->headerLength < logcat->headerSize)
 		{
-		case (USB_DESCRIPTOR_CONFIGURATION):
-			config = (usb_configurationDescriptor *)(buf + pos);
-			break;
-		case (USB_DESCRIPTOR_INTERFACE):
-			interface = (usb_interfaceDescriptor *)(buf + pos);
+			if (logcat->headerLength < ADB_LOGCAT_HEADER_SIZE) header[logcat->headerLength] = *data;
+			logcat->headerLength++;
+			data++;
+			length--;
 
-			if (usb_isAdbInterface(interface))
+			if (logcat->headerLength == 4)
 			{
-				// handle->address = address;
-				handle->configuration = config->bConfigurationValue;
-				handle->interface = interface->bInterfaceNumber;
-
-				// Detected ADB interface!
-				ret = true;
+				logcat->headerSize = header[2] | (header[3] << 8);
+				if (logcat->headerSize < ADB_LOGCAT_HEADER_SIZE) logcat->headerSize = ADB_LOGCAT_HEADER_SIZE;
 			}
-			break;
-		case (USB_DESCRIPTOR_ENDPOINT):
-			endpoint = (usb_endpointDescriptor *)(buf + pos);
+		}
+		else
+		{
+			// Keep as much of the payload as fits, leaving room for a terminating zero.
+			chunk = (header[0] | (header[1] << 8)) - logcat->position;
+			if (chunk > length) chunk = length;
 
-			// If this endpoint descriptor is found right after the ADB interface descriptor, it belong to that interface.
-			if (interface->bInterfaceNumber == handle->interface)
+			if (logcat->position < logcat->bufferSize - 1u)
 			{
-				if (endpoint->bEndpointAddress & 0x80)
-					handle->inputEndPointAddress = endpoint->bEndpointAddress & ~0x80;
-				else
-					handle->outputEndPointAddress = endpoint->bEndpointAddress;
+				n = logcat->bufferSize - 1u - logcat->position;
+				memcpy(logcat->buffer + logcat->position, data, n < chunk ? n : chunk);
 			}
 
-			break;
-		default:
-			break;
+			logcat->position += chunk;
+			data += chunk;
+			length -= chunk;
 		}
 
-		pos += descriptorLength;
-	}
+		payloadLength = header[0] | (header[1] << 8);
+		if (logcat->headerLength < logcat->headerSize || logcat->position < payloadLength) continue;
 
-	return ret;
+		if (payloadLength > logcat->bufferSize - 1u)
+		{
+			payloadLength = logcat->bufferSize - 1u;
+			logcat->truncated++;
+		}
+		logcat->buffer[payloadLength] = 0;
+
+		entry.priority = payloadLength > 0 ? logcat->buffer[0] : 0;
+		entry.tag = (char*)logcat->buffer + (payloadLength > 0);
+		entry.message = entry.tag + strlen(entry.tag);
+		if (entry.message < (char*)logcat->buffer + payloadLength) entry.message++;
+		entry.pid = adb_getLogField(header + 4);
+		entry.tid = adb_getLogField(header + 8);
+		entry.sec = adb_getLogField(header + 12);
+		entry.nsec = adb_getLogField(header + 16);
+
+		logcat->entryHandler(logcat, &entry);
 
+		logcat->headerLength = 0;
+		logcat->headerSize = ADB_LOGCAT_HEADER_SIZE;
+		logcat->position = 0;
+	}
 }
 
 /**
- * Initialises an ADB device.
+ * Handles an event of the connection of a logcat client, assembling the data received into lines or entries for
+ * the handler (see adb_receiveData).
  *
- * @param device the USB device.
- * @param configuration configuration information.
+ * @param logcat logcat client.
+ * @param event event type.
+ * @param length payload length.
+ * @param data payload data, or NULL if it is in the receive buffer.
  */
-static void adb_initUsb(usb_device * device, adb_usbConfiguration * handle)
+void adb_handleLogcatEvent(adb_logcat * logcat, adb_eventType event, uint16_t length, uint8_t * data)
 {
-	// Initialise/configure the USB device.
-	// TODO write a usb_initBulkDevice function?
-	usb_initDevice(device, handle->configuration);
-
-	// Initialise bulk input endpoint.
-	usb_initEndPoint(&(device->bulk_in), handle->inputEndPointAddress);
-	device->bulk_in.attributes = USB_TRANSFER_TYPE_BULK;
-	device->bulk_in.maxPacketSize = ADB_USB_PACKETSIZE;
+	switch (event)
+	{
+	case ADB_CONNECTION_OPEN:
+		adb_resetLogcat(logcat);
+		break;
 
-	// Initialise bulk output endpoint.
-	usb_initEndPoint(&(device->bulk_out), handle->outputEndPointAddress);
-	device->bulk_out.attributes = USB_TRANSFER_TYPE_BULK;
-	device->bulk_out.maxPacketSize = ADB_USB_PACKETSIZE;
+	case ADB_CONNECTION_RECEIVE:
+		adb_receiveData(logcat->connection, length, data,
+				logcat->entryHandler != NULL ? adb_receiveEntries : adb_receiveLines, logcat);
+		break;
 
-	// Success, signal that we are now connected.
-	adbDevice = device;
+	default:
+		break;
+	}
 }
+#endif
 
+#if ADB_HAS(ADB_FEATURE_ACCESSORY)
 /**
- * Handles events from the USB layer.
+ * Sets up the Android Open Accessory transport. Phones that are plugged in from then on are asked to switch to
+ * accessory mode, and once a phone has switched, the application talks to the accessory app on the phone over the
+ * raw bulk endpoints: no message headers, no checksums and no OKAY round trips, and the phone doesn't need USB
+ * debugging. Phones that don't speak the protocol, and those plugged in while a phone is the accessory, are used
+ * through ADB as usual. There is one accessory.
  *
- * @param device USB device that generated the event.
- * @param event USB event.
+ * The phone picks the app for the accessory by manufacturer, model and version, and offers the URI to download it
+ * if there is none. The strings are sent as they are when a phone is plugged in, and must stay valid.
+ *
+ * @param accessory accessory record.
+ * @param manufacturer manufacturer name.
+ * @param model model name.
+ * @param description description, or NULL.
+ * @param version version, or NULL.
+ * @param uri URI, or NULL.
+ * @param serial serial number, or NULL.
+ * @param handler function to be called when the accessory opens, receives data and closes.
  */
-static void adb_usbEventHandler(usb_device * device, usb_eventType event)
+void adb_initAccessory(adb_accessory * accessory, const char * manufacturer, const char * model, const char * description,
+		const char * version, const char * uri, const char * serial, adb_accessoryHandler * handler)
 {
-	adb_usbConfiguration handle;
+	accessory->strings[0] = manufacturer;
+	accessory->strings[1] = model;
+	accessory->strings[2] = description;
+	accessory->strings[3] = version;
+	accessory->strings[4] = uri;
+	accessory->strings[5] = serial;
+	accessory->handler = handler;
+	accessory->usb = NULL;
 
-	switch (event)
+	aoa = accessory;
+}
+
+/**
+ * @param accessory accessory record.
+ * @return true iff a phone in accessory mode is attached.
+ */
+boolean adb_isAccessoryOpen(adb_accessory * accessory)
+{
+	return accessory->usb != NULL;
+}
+
+/**
+ * Reads what the accessory app has sent, up to ADB_AOA_READS packets, and hands it to the application.
+ */
+static void adb_serviceAccessory()
+{
+	uint8_t buf[ADB_USB_PACKETSIZE];
+	uint8_t i;
+	int n;
+
+	for (i = 0; i < ADB_AOA_READS && adb_hasBudget(); i++)
 	{
-	case USB_CONNECT:
+		n = usb_bulkRead(aoa->usb, sizeof(buf), buf, true);
+		if (n <= 0) break;
 
-		// Check if the newly connected device is an ADB device, and initialise it if so.
-		if (adb_isAdbDevice(device, 0, &handle))
-			adb_initUsb(device, &handle);
+#if ADB_HAS(ADB_FEATURE_IDLE)
+		adb_noteReceive();
+#endif
+		aoa->handler(aoa, ADB_CONNECTION_RECEIVE, n, buf);
 
-		break;
+		// Nothing more until the app writes again.
+		if (n < (int)sizeof(buf)) break;
+	}
+}
 
-	case USB_DISCONNECT:
+/**
+ * Writes a set of bytes to the accessory app. The write runs to completion.
+ *
+ * @param accessory accessory record.
+ * @param length number of bytes to transmit.
+ * @param data data to send.
+ * @return 0 on success, -1 if there is no accessory, or -2 if the transfer failed.
+ */
+int adb_writeAccessory(adb_accessory * accessory, uint16_t length, uint8_t * data)
+{
+	usb_segment segment;
 
-		// Check if the device that was disconnected is the ADB device we've been using.
-		if (device == adbDevice)
-		{
-			// Close all open ADB connections.
-			adb_closeAll();
+	segment.data = data;
+	segment.length = length;
+	segment.progmem = false;
 
-			// Signal that we're no longer connected by setting the global device handler to NULL;
-			adbDevice = NULL;
-			connected = false;
-		}
+	return adb_writevAccessory(accessory, 1, &segment);
+}
 
-		break;
+/**
+ * Writes data gathered from a list of segments to the accessory app, see adb_writeAccessory. Segments may reside
+ * in program memory.
+ *
+ * @param accessory accessory record.
+ * @param count number of segments.
+ * @param segments payload segments.
+ * @return 0 on success, -1 if there is no accessory, or -2 if the transfer failed.
+ */
+int adb_writevAccessory(adb_accessory * accessory, uint8_t count, usb_segment * segments)
+{
+	if (accessory->usb == NULL) return -1;
 
-	default:
-		// ignore
-		break;
-	}
+#if ADB_HAS(ADB_FEATURE_IDLE)
+	lastActivity = avr_micros();
+#endif
+	return usb_bulkWritev(accessory->usb, count, segments) == 0 ? 0 : -2;
 }
+#endif
 
 /**
  * Write a set of bytes to an open ADB connection.
- * 
+ *
+ * If the connection has an outbound queue (see adb_setWriteQueue), the data is queued and sent as soon as the
+ * connection is ready. In that case the return value is the number of bytes accepted, which is less than length
+ * when the queue is full.
+ *
  * @param connection ADB connection to write the data to.
  * @param length number of bytes to transmit.
  * @param data data to send.
@@ -643,16 +3920,31 @@ static void adb_usbEventHandler(usb_device * device, usb_eventType event)
  */
 int adb_write(adb_connection * connection, uint16_t length, uint8_t * data)
 {
+	adb_device * device = adb_getDevice(connection);
+#if ADB_HAS(ADB_FEATURE_WRITE_QUEUE)
+	usb_segment segment;
+#endif
 	int ret;
 
 	// First check if we have a working ADB connection
-	if (adbDevice==NULL || !connected) return -1;
+	if (device->usb==NULL || !device->connected) return -1;
+
+#if ADB_HAS(ADB_FEATURE_WRITE_QUEUE)
+	if (connection->writeQueue != NULL)
+	{
+		segment.data = data;
+		segment.length = length;
+		segment.progmem = false;
+
+		return adb_queueWrite(connection, 1, &segment, false);
+	}
+#endif
 
 	// Check if the connection is open for writing.
 	if (connection->status != ADB_OPEN) return -2;
 
 	// Write payload
-	ret = adb_writeMessage(adbDevice, A_WRTE, connection->localID, connection->remoteID, length, data);
+	ret = adb_writeMessage(device, A_WRTE, connection->localID, connection->remoteID, length, data);
 	if (ret==0)
 		connection->status = ADB_WRITING;
 
@@ -669,30 +3961,134 @@ int adb_write(adb_connection * connection, uint16_t length, uint8_t * data)
  */
 int adb_writeString(adb_connection * connection, char * str)
 {
+	adb_device * device = adb_getDevice(connection);
 	int ret;
 
+#if ADB_HAS(ADB_FEATURE_WRITE_QUEUE)
+	// Queued connections take the string as plain data.
+	if (connection->writeQueue != NULL)
+		return adb_write(connection, strlen(str), (uint8_t*)str);
+#endif
+
 	// First check if we have a working ADB connection
-	if (adbDevice==NULL || !connected) return -1;
+	if (device->usb==NULL || !device->connected) return -1;
 
 	// Check if the connection is open for writing.
 	if (connection->status != ADB_OPEN) return -2;
 
 	// Write payload
-	ret = adb_writeStringMessage(adbDevice, A_WRTE, connection->localID, connection->remoteID, str);
+	ret = adb_writeStringMessage(device, A_WRTE, connection->localID, connection->remoteID, str);
 	if (ret==0)
 		connection->status = ADB_WRITING;
 
 	return ret;
 }
 
+#if ADB_HAS(ADB_FEATURE_WRITE_QUEUE)
+/**
+ * @param connection ADB connection.
+ * @return the number of bytes that can currently be written to the outbound queue of the connection without blocking.
+ */
+uint16_t adb_getWriteQueueFree(adb_connection * connection)
+{
+	return connection->writeQueueSize - connection->writeQueueLength;
+}
+#endif
+
+#if ADB_HAS(ADB_FEATURE_WRITE_QUEUE)
+/**
+ * Appends a string to the write queue of a connection. The trailing zero is not queued.
+ *
+ * @param connection ADB connection.
+ * @param str string to append.
+ * @return number of bytes accepted.
+ */
+uint16_t adb_print(adb_connection * connection, const char * str)
+{
+	return adb_append(connection, strlen(str), (uint8_t*)str);
+}
+#endif
+
+#if ADB_HAS(ADB_FEATURE_HUB)
+/**
+ * Binds a connection to one of the ADB devices behind the hub. Devices are numbered in the order they attach, each
+ * taking the lowest number that is free. Connections are bound to device 0 when they are added; call this right
+ * after adb_addConnection, before the next poll opens the connection.
+ *
+ * @param connection ADB connection.
+ * @param device device number, less than ADB_MAX_DEVICES.
+ */
+void adb_setDevice(adb_connection * connection, uint8_t device)
+{
+	if (device < ADB_MAX_DEVICES)
+		connection->device = device;
+}
+
+/**
+ * Sets the share of a device in the polling schedule: the number of incoming messages handled for it per turn. The
+ * devices take turns in a round-robin, so a device with weight 2 gets twice the inbound bandwidth of a device
+ * with weight 1 when both are busy. The default is 1.
+ *
+ * @param device device number.
+ * @param weight number of messages per turn, at least 1.
+ */
+void adb_setDeviceWeight(uint8_t device, uint8_t weight)
+{
+	if (device < ADB_MAX_DEVICES)
+		devices[device].weight = weight > 0 ? weight : 1;
+}
+
+/**
+ * @param device device number.
+ * @return true iff the device is attached and has answered our CNXN.
+ */
+boolean adb_isDeviceConnected(uint8_t device)
+{
+	return device < ADB_MAX_DEVICES && devices[device].usb != NULL && devices[device].connected;
+}
+
+/**
+ * @return the number of the device an ADB_CONNECT, ADB_DISCONNECT or ADB_READY event refers to. Only valid from the event
+ * handler. The data of an ADB_CONNECT event is the identity banner the device sent with its CNXN.
+ */
+uint8_t adb_getEventDevice()
+{
+	return eventDevice;
+}
+#endif
+
+#if ADB_HAS(ADB_FEATURE_PROFILE_CACHE)
+/**
+ * Forgets the interface layouts of all devices seen so far, including the EEPROM copy (see ADB_PROFILE_EEPROM).
+ * Devices that attach from now on have their descriptors parsed.
+ */
+void adb_clearProfiles()
+{
+	memset(profiles, 0, sizeof(profiles));
+	nextProfile = 0;
+
+#ifdef ADB_PROFILE_EEPROM
+	eeprom_update_block(profiles, (uint8_t *)ADB_PROFILE_EEPROM + 1, sizeof(profiles));
+#endif
+}
+#endif
+
 /**
  * Initialises the ADB protocol. This function initialises the USB layer underneath so no further setup is required.
  */
 void adb_init()
 {
+	uint8_t i;
+
 	// Signal that we are not connected.
-	adbDevice = NULL;
-	connected = false;
+	memset(devices, 0, sizeof(devices));
+	for (i = 0; i < ADB_MAX_DEVICES; i++)
+		devices[i].weight = 1;
+	nextDevice = 0;
+
+#if ADB_HAS(ADB_FEATURE_PROFILE_CACHE)
+	adb_loadProfiles();
+#endif
 
 	// Initialise the USB layer and attach an event handler.
 	usb_setEventHandler(adb_usbEventHandler);
@@ -19,9 +19,11 @@ limitations under the License.#include <string.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include "avr.h"
+#include "adb_config.h"
+#include "usb.h"
 
 // ADB
-#define MAX_PAYLOAD 4096;
+#define MAX_PAYLOAD 4096
 
 #define A_SYNC 0x434e5953
 #define A_CNXN 0x4e584e43
@@ -30,12 +32,51 @@ limitations under the License.#include <string.h>
 #define A_CLSE 0x45534c43
 #define A_WRTE 0x45545257
 
+// Protocol versions. Devices that speak A_VERSION_SKIP_CHECKSUM or later neither send nor verify payload checksums.
+#define A_VERSION 0x01000000
+#define A_VERSION_SKIP_CHECKSUM 0x01000001
+
 #define ADB_CLASS 0xff
 #define ADB_SUBCLASS 0x42
 #define ADB_PROTOCOL 0x1
 
 #define ADB_USB_PACKETSIZE 0x40
+
+#if ADB_HAS(ADB_FEATURE_ACCESSORY)
+// Android Open Accessory: vendor requests, the IDs of a phone in accessory mode (0x2D00 up to 0x2D05, with or
+// without ADB and audio), and its accessory interface.
+#define ADB_AOA_GET_PROTOCOL 51
+#define ADB_AOA_SEND_STRING 52
+#define ADB_AOA_START 53
+#define ADB_AOA_VENDOR_ID 0x18d1
+#define ADB_AOA_PRODUCT_ID 0x2d00
+#define ADB_AOA_PRODUCT_LAST 0x2d05
+#define ADB_AOA_CLASS 0xff
+#define ADB_AOA_SUBCLASS 0xff
+#define ADB_AOA_PROTOCOL 0x0
+
+// Number of identification strings: manufacturer, model, description, version, URI and serial number.
+#define ADB_AOA_STRINGS 6
+#endif
+
+// Delay between CNXN attempts while waiting for the device, and the initial and maximum delay between OPEN attempts
+// of a persistent connection (in milliseconds). The OPEN delay doubles after every failed attempt.
+#define ADB_CONNECT_RETRY_TIME 500
 #define ADB_CONNECTION_RETRY_TIME 1000
+#define ADB_CONNECTION_RETRY_MAX 32000
+
+// Time the device has to answer an OPEN (in milliseconds), after which the connection fails.
+#define ADB_OPEN_TIMEOUT 5000
+
+#if ADB_HAS(ADB_FEATURE_TRACE)
+// Binary trace frames, see adb_trace. Event IDs from ADB_TRACE_USER up are free for the application.
+#define ADB_TRACE_SYNC 0xa5
+#define ADB_TRACE_IN 0x01
+#define ADB_TRACE_OUT 0x02
+#define ADB_TRACE_BROKEN 0x03
+#define ADB_TRACE_DROPPED 0x04
+#define ADB_TRACE_USER 0x80
+#endif
 
 typedef struct
 {
@@ -44,8 +85,34 @@ typedef struct
 	uint8_t interface;
 	uint8_t inputEndPointAddress;
 	uint8_t outputEndPointAddress;
+
+	// Total length of the configuration descriptor, see adb_profile.
+	uint16_t totalLength;
 } adb_usbConfiguration;
 
+/**
+ * Cached ADB interface layout of a device, see ADB_FEATURE_PROFILE_CACHE. A device is recognised by its vendor and
+ * product ID and release number, and the total length of its configuration descriptor. A phone keeps its IDs when
+ * it changes its USB composition (when USB debugging is switched on or off, say), but that length changes with
+ * the interfaces. An entry with configuration 0 is free.
+ */
+typedef struct
+{
+	uint16_t vendorId;
+	uint16_t productId;
+	uint16_t releaseNumber;
+	uint8_t configuration;
+	uint8_t interface;
+	uint8_t inputEndPointAddress;
+	uint8_t outputEndPointAddress;
+
+	// First supported language, which spares the string descriptor request of usb_initDevice.
+	uint16_t language;
+
+	// Total length of the first configuration descriptor.
+	uint16_t totalLength;
+} adb_profile;
+
 typedef struct
 {
 	// Command identifier constant
@@ -78,6 +145,44 @@ typedef enum
 	ADB_WRITING
 } adb_connectionStatus;
 
+#if ADB_HAS(ADB_FEATURE_STATS)
+/**
+ * Statistics block, see adb_getStats. A snapshot streamed with adb_writeStats is this struct as laid out in
+ * memory: little endian and without padding, so a host can parse it given the two sizes at the start.
+ */
+typedef struct
+{
+	// Number of histogram buckets and connections in this block, ADB_STATS_BUCKETS and ADB_MAX_CONNECTIONS.
+	uint8_t buckets;
+	uint8_t connections;
+
+	// Counters of the bulk endpoints of the ADB device.
+	usb_endpointStats in, out;
+
+	// Payload bytes received and sent, per connection (indexed by local ID - 1).
+	uint32_t bytesIn[ADB_MAX_CONNECTIONS];
+	uint32_t bytesOut[ADB_MAX_CONNECTIONS];
+
+	// Histograms of the time from sending a WRTE to receiving its OKAY, and of the time spent in adb_poll. See
+	// ADB_STATS_BUCKETS for the bucket boundaries. Counts saturate at 0xffff.
+	uint16_t okayLatency[ADB_STATS_BUCKETS];
+	uint16_t pollDuration[ADB_STATS_BUCKETS];
+
+	// Longest poll, in microseconds.
+	uint32_t pollMax;
+
+	// Histogram of how long adb_run slept each time, from going to sleep until the wake-up, and the total time
+	// asleep in microseconds. Only counted with ADB_FEATURE_IDLE.
+	uint16_t sleepDuration[ADB_STATS_BUCKETS];
+	uint32_t sleepTime;
+
+	// Histogram of the time from a wake-up in adb_run to the first ADB message or accessory packet received before
+	// it sleeps again, in microseconds. Only counted with ADB_FEATURE_IDLE.
+	uint16_t wakeLatency[ADB_STATS_BUCKETS];
+
+} adb_stats;
+#endif
+
 typedef enum
 {
 	ADB_CONNECT = 0,
@@ -85,7 +190,11 @@ typedef enum
 	ADB_CONNECTION_OPEN,
 	ADB_CONNECTION_CLOSE,
 	ADB_CONNECTION_FAILED,
-	ADB_CONNECTION_RECEIVE
+	ADB_CONNECTION_RECEIVE,
+	ADB_CONNECTION_THROTTLE,
+	ADB_CONNECTION_RESUME,
+	// All connections opened when the device connected have been answered, with an OKAY or a CLSE.
+	ADB_READY
 } adb_eventType;
 
 typedef struct _adb_connection adb_connection;
@@ -93,24 +202,415 @@ typedef struct _adb_connection adb_connection;
 // Event handler
 typedef void(adb_eventHandler)(adb_connection * connection, adb_eventType event, uint16_t length, uint8_t * data);
 
+// Parser of the data received by a client built on top of a connection, like a state channel or a framer.
+typedef void(adb_receiver)(void * client, uint16_t length, uint8_t * data);
+
 struct _adb_connection
 {
-	char * connectionString;
-	uint32_t localID, remoteID;
-	uint32_t lastConnectionAttempt;
+#if ADB_CONNECTIONSTRING_LENGTH > 0
+	char connectionString[ADB_CONNECTIONSTRING_LENGTH];
+#endif
+	// Connection string in program memory, see adb_addConnection_P, or NULL if it is in connectionString.
+	const char * progmemString;
+	uint32_t remoteID;
+	uint32_t retryDeadline;
 	uint16_t dataSize, dataRead;
-	adb_connectionStatus status;
-	boolean reconnect;
+	uint8_t localID;
+
+	// Packed to save SRAM: an adb_connectionStatus, the exponent of the OPEN retry back-off, and the flags of the
+	// write queue (see adb_setCoalescing) and the receive window (see adb_setFlowControl).
+	unsigned int status : 3;
+	unsigned int retryCount : 4;
+	unsigned int reconnect : 1;
+#if ADB_HAS(ADB_FEATURE_WRITE_QUEUE)
+	unsigned int coalesce : 1;
+	unsigned int flushRequested : 1;
+#endif
+#if ADB_HAS(ADB_FEATURE_FLOW_CONTROL)
+	unsigned int flowControl : 1;
+	unsigned int okayPending : 1;
+#endif
+
 	adb_eventHandler * eventHandler;
-	adb_connection * next;
+
+#if ADB_HAS(ADB_FEATURE_HUB)
+	// Index of the ADB device the connection is bound to, see adb_setDevice.
+	uint8_t device;
+#endif
+
+#if ADB_HAS(ADB_FEATURE_WRITE_QUEUE)
+	// Optional outbound queue, see adb_setWriteQueue.
+	uint8_t * writeQueue;
+	uint16_t writeQueueSize, writeQueueHead, writeQueueLength;
+
+	// Write coalescing policy, see adb_setCoalescing.
+	uint16_t coalesceSize, coalesceAge;
+	uint32_t queueTime;
+#endif
+
+#if ADB_HAS(ADB_FEATURE_RECEIVE_BUFFER)
+	// Optional inbound ring buffer, see adb_setReceiveBuffer.
+	uint8_t * receiveBuffer;
+	uint16_t receiveBufferSize, receiveHead, receiveLength;
+#endif
+
+#if ADB_HAS(ADB_FEATURE_FLOW_CONTROL)
+	// Receive window, see adb_setFlowControl, and the number of bytes received but not consumed yet. The okayPending
+	// flag tells whether the OKAY for the last WRTE is being withheld.
+	uint16_t window;
+	uint32_t unconsumed;
+#endif
+};
+
+#if ADB_HAS(ADB_FEATURE_STATE)
+// Maximum number of keys of a state channel, and the size of a record on the wire: the key and a 16-bit little
+// endian value.
+#define ADB_STATE_MAX_KEYS 32
+#define ADB_STATE_RECORD_SIZE 3
+
+/**
+ * Latest-value state channel on top of a connection, see adb_initStateChannel. Both ends keep a table of 16-bit
+ * values indexed by key, and only the newest value of each key is ever sent.
+ */
+typedef struct
+{
+	adb_connection * connection;
+
+	// Value table of the application, and its number of keys (at most ADB_STATE_MAX_KEYS).
+	uint16_t * values;
+	uint8_t count;
+
+	// Keys set locally, keys set locally but not sent yet, and keys received since the last adb_getStateChanges.
+	uint32_t local, dirty, changed;
+
+	// Minimum time between updates in milliseconds (0 sends every change right away), and the time of the next.
+	uint16_t period;
+	uint32_t deadline;
+
+	// Start of a record whose remainder is still to come.
+	uint8_t partial[ADB_STATE_RECORD_SIZE - 1];
+	uint8_t partialLength;
+
+} adb_stateChannel;
+#endif
+
+#if ADB_HAS(ADB_FEATURE_FRAMING)
+// Size of a frame header: the frame type and the 16-bit little endian payload length.
+#define ADB_FRAME_HEADER_SIZE 3
+
+typedef struct _adb_framer adb_framer;
+
+// Frame handler, see adb_initFramer. The data is only valid during the call.
+typedef void(adb_frameHandler)(adb_framer * framer, uint8_t type, uint16_t length, uint8_t * data);
+
+/**
+ * Message framing on top of a connection, see adb_initFramer.
+ */
+struct _adb_framer
+{
+	adb_connection * connection;
+	adb_frameHandler * handler;
+
+	// Buffer for frames that arrive split, see adb_initFramer.
+	uint8_t * buffer;
+	uint16_t bufferSize;
+
+	// Header of the frame being received and how much of it is in, and the payload length and how much of that
+	// is in. Only a frame that is split across calls to adb_parseFrames is received into the buffer.
+	uint8_t header[ADB_FRAME_HEADER_SIZE];
+	uint8_t headerLength;
+	uint16_t length, received;
+
+	// Number of split frames dropped because they were longer than the buffer.
+	uint16_t dropped;
 };
+#endif
+
+#if ADB_HAS(ADB_FEATURE_SYNC)
+// Smallest buffer a sync client takes, see adb_initSync: the size of a DATA header plus one byte.
+#define ADB_SYNC_MIN_BUFFER 9
+
+typedef enum
+{
+	ADB_SYNC_IDLE = 0,
+	ADB_SYNC_SENDING,
+	ADB_SYNC_WAITING,
+	ADB_SYNC_RECEIVING
+} adb_syncState;
+
+typedef struct _adb_syncClient adb_syncClient;
+
+// Callbacks of a sync client, see adb_syncSend, adb_syncReceive and adb_initSync. The reader fills the buffer with
+// up to length bytes of the file being pushed and returns the number of bytes, 0 at the end of the file.
+typedef uint16_t(adb_syncReader)(adb_syncClient * sync, uint16_t length, uint8_t * data);
+typedef void(adb_syncWriter)(adb_syncClient * sync, uint16_t length, uint8_t * data);
+typedef void(adb_syncHandler)(adb_syncClient * sync, int result, const char * message);
+
+/**
+ * Client of the file sync service, see adb_initSync.
+ */
+struct _adb_syncClient
+{
+	adb_connection * connection;
+	adb_syncHandler * handler;
+	adb_syncReader * reader;
+	adb_syncWriter * writer;
+
+	// Buffer for file data and error messages.
+	uint8_t * buffer;
+	uint16_t bufferSize;
+
+	// An adb_syncState, the modification time of the file being pushed, and the number of file bytes transferred.
+	uint8_t state;
+	uint32_t mtime;
+	uint32_t size;
+
+	// Header of the response being received and how much of it is in, and the response length and how much of
+	// its data is in.
+	uint8_t header[8];
+	uint8_t headerLength;
+	uint32_t length, received;
+};
+#endif
+
+#if ADB_HAS(ADB_FEATURE_SHELL)
+typedef enum
+{
+	ADB_SHELL_SKIPPING = 0,
+	ADB_SHELL_START_ID,
+	ADB_SHELL_OUTPUT,
+	ADB_SHELL_END_ID,
+	ADB_SHELL_EXIT_CODE
+} adb_shellState;
+
+typedef struct _adb_shellSession adb_shellSession;
+
+// Command handler, see adb_shellCommand. Called with pieces of output, and at the end with a NULL data pointer
+// and the exit code.
+typedef void(adb_shellHandler)(adb_shellSession * session, uint16_t length, uint8_t * data, int exitCode);
+
+/**
+ * Persistent shell that runs pipelined commands, see adb_initShell.
+ */
+struct _adb_shellSession
+{
+	adb_connection * connection;
+
+	// Handlers of the commands sent and not finished yet, oldest first, in a ring. Commands are numbered
+	// modulo 256, the oldest pending one is nextId - count.
+	adb_shellHandler * handlers[ADB_SHELL_QUEUE_SIZE];
+	uint8_t head, count;
+	uint8_t nextId;
+
+	// An adb_shellState, and the number in the marker being parsed.
+	uint8_t state;
+	uint16_t number;
+
+	// Whether the shell has been set up since the connection opened, and whether a write of a command failed
+	// halfway, which leaves the shell with part of a line until the connection reopens.
+	boolean ready, broken;
+};
+#endif
+
+#if ADB_HAS(ADB_FEATURE_LOGCAT)
+// Size of the header of a binary log entry in the original format: payload length, header size, pid, tid, seconds
+// and nanoseconds.
+#define ADB_LOGCAT_HEADER_SIZE 20
+
+// Smallest buffer a logcat client takes, see adb_initLogcat: one byte of a line or payload plus the terminating zero.
+#define ADB_LOGCAT_MIN_BUFFER 2
+
+/**
+ * Binary log entry, see adb_initLogcat. The strings are only valid during the call of the entry handler.
+ */
+typedef struct
+{
+	// Android log priority, from 2 (verbose) up to 7 (fatal).
+	uint8_t priority;
+	const char * tag;
+	const char * message;
+	int32_t pid, tid;
+	uint32_t sec, nsec;
+} adb_logEntry;
+
+typedef struct _adb_logcat adb_logcat;
+
+// Line handler, see adb_initLogcat. The line is zero terminated, without the line end, and only valid during the call.
+typedef void(adb_logcatLineHandler)(adb_logcat * logcat, uint16_t length, char * line);
+
+// Entry handler, see adb_initLogcat.
+typedef void(adb_logcatEntryHandler)(adb_logcat * logcat, adb_logEntry * entry);
+
+/**
+ * Logcat client, see adb_initLogcat.
+ */
+struct _adb_logcat
+{
+	adb_connection * connection;
+	adb_logcatLineHandler * lineHandler;
+	adb_logcatEntryHandler * entryHandler;
+
+	// Line or entry payload, and the number of bytes of it received so far.
+	uint8_t * buffer;
+	uint16_t bufferSize;
+	uint16_t position;
+
+	// Whether the current line is too long for the buffer, and the number of lines and entries cut short so far.
+	boolean overflow;
+	uint16_t truncated;
+
+	// Header of the current binary entry, the number of header bytes received and the size of the header.
+	uint8_t header[ADB_LOGCAT_HEADER_SIZE];
+	uint16_t headerLength, headerSize;
+};
+#endif
+
+#if ADB_HAS(ADB_FEATURE_ACCESSORY)
+typedef struct _adb_accessory adb_accessory;
+
+// Accessory event handler, see adb_initAccessory. Gets ADB_CONNECTION_OPEN, ADB_CONNECTION_RECEIVE and
+// ADB_CONNECTION_CLOSE, like the handler of a connection. Received data is only valid during the call.
+typedef void(adb_accessoryHandler)(adb_accessory * accessory, adb_eventType event, uint16_t length, uint8_t * data);
+
+/**
+ * Android Open Accessory transport, see adb_initAccessory.
+ */
+struct _adb_accessory
+{
+	// Identification sent to the phone, see ADB_AOA_STRINGS. Entries may be NULL.
+	const char * strings[ADB_AOA_STRINGS];
+
+	adb_accessoryHandler * handler;
+
+	// Phone in accessory mode, or NULL.
+	usb_device * usb;
+};
+#endif
+
+/**
+ * ADB device. There is one record per Android device that can be served at the same time, see ADB_MAX_DEVICES.
+ */
+typedef struct
+{
+	// USB device, or NULL if the record is free.
+	usb_device * usb;
+
+	// Whether the device has answered our CNXN, and the time of the next CNXN attempt while it has not.
+	boolean connected;
+	uint32_t connectDeadline;
+
+	// Connections opened when the device connected that have not been answered yet, a bit per local ID - 1. See
+	// ADB_READY.
+	uint32_t opening;
+
+	// Protocol version and maximum message payload size announced by the device in its CNXN message.
+	uint32_t remoteVersion;
+	uint32_t remoteMaxData;
+
+	// A WRTE to this device that ran out of time halfway, and the payload length it was started with. Nothing else
+	// can be sent to the device before its remainder.
+	adb_connection * sending;
+#if ADB_HAS(ADB_FEATURE_WRITE_QUEUE)
+	uint16_t sendingLength;
+#endif
+
+	// Set when the header of the message being sent is out, but (part of) its payload is not.
+	boolean headerSent;
+
+	// Number of incoming messages handled per turn, see adb_setDeviceWeight.
+	uint8_t weight;
+
+} adb_device;
 
 void adb_init();
 void adb_poll();
+void adb_pollBudget(uint32_t budget);
+#if ADB_HAS(ADB_FEATURE_IDLE)
+void adb_run();
+#endif
 
 void adb_setEventHandler(adb_eventHandler * handler);
 adb_connection * adb_addConnection(const char * connectionString, boolean reconnect, adb_eventHandler * eventHandler);
+adb_connection * adb_addConnection_P(const char * connectionString, boolean reconnect, adb_eventHandler * eventHandler);
 int adb_write(adb_connection * connection, uint16_t length, uint8_t * data);
 int adb_writeString(adb_connection * connection, char * str);
+int adb_writev(adb_connection * connection, uint8_t count, usb_segment * segments);
+#if ADB_HAS(ADB_FEATURE_WRITE_QUEUE)
+void adb_setWriteQueue(adb_connection * connection, uint8_t * buffer, uint16_t size);
+uint16_t adb_getWriteQueueFree(adb_connection * connection);
+void adb_setCoalescing(adb_connection * connection, boolean enable, uint16_t size, uint16_t age);
+uint16_t adb_append(adb_connection * connection, uint16_t length, uint8_t * data);
+uint16_t adb_print(adb_connection * connection, const char * str);
+int adb_flush(adb_connection * connection);
+#endif
+uint32_t adb_getRemoteVersion();
+uint32_t adb_getRemoteMaxData();
+#if ADB_HAS(ADB_FEATURE_HUB)
+void adb_setDevice(adb_connection * connection, uint8_t device);
+void adb_setDeviceWeight(uint8_t device, uint8_t weight);
+boolean adb_isDeviceConnected(uint8_t device);
+uint8_t adb_getEventDevice();
+#endif
+#if ADB_HAS(ADB_FEATURE_PROFILE_CACHE)
+void adb_clearProfiles();
+#endif
+#if ADB_HAS(ADB_FEATURE_RECEIVE_BUFFER)
+void adb_setReceiveBuffer(adb_connection * connection, uint8_t * buffer, uint16_t size);
+uint16_t adb_available(adb_connection * connection);
+int adb_readByte(adb_connection * connection);
+uint16_t adb_read(adb_connection * connection, uint16_t length, uint8_t * data);
+#endif
+#if ADB_HAS(ADB_FEATURE_FLOW_CONTROL)
+void adb_setFlowControl(adb_connection * connection, boolean enable, uint16_t window);
+void adb_consume(adb_connection * connection, uint16_t length);
+#endif
+#if ADB_HAS(ADB_FEATURE_STATS)
+void adb_getStats(adb_stats * snapshot);
+void adb_resetStats();
+int adb_writeStats(adb_connection * connection);
+#endif
+#if ADB_HAS(ADB_FEATURE_TRACE)
+void adb_trace(uint8_t event, uint8_t length, const void * data);
+#endif
+#if ADB_HAS(ADB_FEATURE_STATE)
+void adb_initStateChannel(adb_stateChannel * channel, adb_connection * connection, uint16_t * values, uint8_t count, uint16_t period);
+void adb_setState(adb_stateChannel * channel, uint8_t key, uint16_t value);
+uint16_t adb_getState(adb_stateChannel * channel, uint8_t key);
+uint32_t adb_getStateChanges(adb_stateChannel * channel);
+void adb_handleStateEvent(adb_stateChannel * channel, adb_eventType event, uint16_t length, uint8_t * data);
+int adb_flushState(adb_stateChannel * channel);
+#endif
+#if ADB_HAS(ADB_FEATURE_FRAMING)
+void adb_initFramer(adb_framer * framer, adb_connection * connection, uint8_t * buffer, uint16_t size, adb_frameHandler * handler);
+void adb_parseFrames(adb_framer * framer, uint16_t length, uint8_t * data);
+void adb_handleFrameEvent(adb_framer * framer, adb_eventType event, uint16_t length, uint8_t * data);
+int adb_writeFrame(adb_framer * framer, uint8_t type, uint16_t length, uint8_t * data);
+#endif
+#if ADB_HAS(ADB_FEATURE_SYNC)
+int adb_initSync(adb_syncClient * sync, adb_connection * connection, uint8_t * buffer, uint16_t size, adb_syncHandler * handler);
+boolean adb_isSyncIdle(adb_syncClient * sync);
+int adb_syncSend(adb_syncClient * sync, const char * path, uint16_t mode, uint32_t mtime, adb_syncReader * reader);
+int adb_syncReceive(adb_syncClient * sync, const char * path, adb_syncWriter * writer);
+int adb_pollSync(adb_syncClient * sync);
+void adb_handleSyncEvent(adb_syncClient * sync, adb_eventType event, uint16_t length, uint8_t * data);
+#endif
+#if ADB_HAS(ADB_FEATURE_SHELL)
+void adb_initShell(adb_shellSession * session, adb_connection * connection);
+uint8_t adb_getShellPending(adb_shellSession * session);
+int adb_shellCommand(adb_shellSession * session, const char * command, adb_shellHandler * handler);
+void adb_handleShellEvent(adb_shellSession * session, adb_eventType event, uint16_t length, uint8_t * data);
+#endif
+#if ADB_HAS(ADB_FEATURE_LOGCAT)
+int adb_initLogcat(adb_logcat * logcat, uint8_t * buffer, uint16_t size, adb_logcatLineHandler * lineHandler, adb_logcatEntryHandler * entryHandler);
+adb_connection * adb_addLogcat(adb_logcat * logcat, const char * filters, boolean reconnect, adb_eventHandler * handler);
+void adb_handleLogcatEvent(adb_logcat * logcat, adb_eventType event, uint16_t length, uint8_t * data);
+#endif
+#if ADB_HAS(ADB_FEATURE_ACCESSORY)
+void adb_initAccessory(adb_accessory * accessory, const char * manufacturer, const char * model, const char * description,
+		const char * version, const char * uri, const char * serial, adb_accessoryHandler * handler);
+boolean adb_isAccessoryOpen(adb_accessory * accessory);
+int adb_writeAccessory(adb_accessory * accessory, uint16_t length, uint8_t * data);
+int adb_writevAccessory(adb_accessory * accessory, uint8_t count, usb_segment * segments);
+#endif
 
 #endif
@@ -14,6 +14,7 @@ See the License for the specific language governing permissions and
 limitations under the License.#include <string.h>
 */
 #include "avr.h"
+#include <avr/sleep.h>
 #include <stdint.h>
 
 #define TIMER1_MULTIPLIER 64
@@ -38,6 +39,22 @@ volatile uint32_t timer0_millis = 0;
 static uint8_t timer0_fract = 0;
 volatile uint16_t timer1_overflow_count = 0x0;
 
+#define TX_MASK (AVR_SERIAL_TX_BUFFER_SIZE - 1)
+
+// Serial transmit ring. The main program adds at the head, the data register empty interrupt takes from the tail.
+static volatile uint8_t txBuffer[AVR_SERIAL_TX_BUFFER_SIZE];
+static volatile uint8_t txHead = 0, txTail = 0;
+
+static int avr_serialPut(char c, FILE * stream);
+static FILE serialStream = FDEV_SETUP_STREAM(avr_serialPut, NULL, _FDEV_SETUP_WRITE);
+
+// The ATmega1280 has four UARTs, the smaller parts have one without a number in its vector names.
+#ifdef USART0_UDRE_vect
+#define SERIAL_UDRE_vect USART0_UDRE_vect
+#else
+#define SERIAL_UDRE_vect USART_UDRE_vect
+#endif
+
 SIGNAL(TIMER0_OVF_vect)
 {
 
@@ -70,9 +87,6 @@ unsigned long avr_millis()
 	m = timer0_millis;
 	SREG = oldSREG;
 
-	// Enable interrupts
-	sei();
-
 	return m;
 }
 
@@ -81,6 +95,15 @@ uint64_t avr_ticks()
 	return (timer0_overflow_count * 256 + TCNT0) * 64;
 }
 
+void avr_idle()
+{
+	set_sleep_mode(SLEEP_MODE_IDLE);
+	sleep_enable();
+	sei();
+	sleep_cpu();
+	sleep_disable();
+}
+
 void avr_delay(unsigned long ms)
 {
 	unsigned long start = avr_millis();
@@ -91,7 +114,30 @@ void avr_delay(unsigned long ms)
 
 uint32_t avr_micros()
 {
-	return ((uint32_t)(TCNT1 + ((uint32_t)timer1_overflow_count << 16)) * TIMER1_MULTIPLIER) / TIMER1_MICROS_DIVIDER;
+	uint16_t overflows, count;
+	uint8_t pending;
+	uint32_t ticks;
+
+	// Read the overflow count and the counter without turning interrupts off, and start over if the overflow
+	// interrupt ran in between. An overflow whose interrupt has not run yet (e.g. because interrupts are off) is
+	// counted by hand.
+	do
+	{
+		overflows = timer1_overflow_count;
+		count = TCNT1;
+		pending = TIFR1 & _BV(TOV1);
+	} while (overflows != timer1_overflow_count);
+
+	if (pending && count < 0x8000) overflows++;
+
+	ticks = ((uint32_t)overflows << 16) | count;
+
+	// Prefer a plain multiplication, which keeps the count wrapping around at 2^32 microseconds.
+#if TIMER1_MULTIPLIER % TIMER1_MICROS_DIVIDER == 0
+	return ticks * (TIMER1_MULTIPLIER / TIMER1_MICROS_DIVIDER);
+#else
+	return (ticks * TIMER1_MULTIPLIER) / TIMER1_MICROS_DIVIDER;
+#endif
 }
 
 /*
@@ -180,11 +226,15 @@ void avr_serialPrint(char * str)
 		avr_serialWrite(str[i]);
 }
 
+static int avr_serialPut(char c, FILE * stream)
+{
+	avr_serialWrite(c);
+	return 0;
+}
+
 void avr_serialVPrint(char * format, va_list arg)
 {
-	char temp[128];
-	vsnprintf(temp, 128, format, arg);
-	avr_serialPrint(temp);
+	vfprintf(&serialStream, format, arg);
 }
 
 void avr_serialPrintf(char * format, ...)
@@ -197,8 +247,64 @@ void avr_serialPrintf(char * format, ...)
 
 }
 
+/**
+ * Moves the byte at the tail of the transmit ring into the UART, and turns the data register empty interrupt off
+ * once the ring is empty. The ring can already be empty here when avr_serialWrite enables the interrupt just
+ * after it drained the last byte.
+ */
+static void avr_serialTransmit()
+{
+	uint8_t tail = txTail;
+
+	if (tail == txHead)
+	{
+		cbi(UCSR0B, UDRIE0);
+		return;
+	}
+
+	UDR0 = txBuffer[tail];
+	tail = (tail + 1) & TX_MASK;
+	txTail = tail;
+
+	if (tail == txHead) cbi(UCSR0B, UDRIE0);
+}
+
+SIGNAL(SERIAL_UDRE_vect)
+{
+	avr_serialTransmit();
+}
+
 void avr_serialWrite(unsigned char value)
 {
-	while (!((UCSR0A) & (1 << UDRE0)));
-	UDR0 = value;
+	uint8_t head = txHead, next = (head + 1) & TX_MASK;
+
+	// Nothing queued and the UART is free, skip the ring.
+	if (head == txTail && (UCSR0A & _BV(UDRE0)))
+	{
+		UDR0 = value;
+		return;
+	}
+
+	// Wait for room in the ring. The interrupt cannot drain it while interrupts are off (i.e. when printing from an
+	// interrupt handler), so move bytes along by hand then.
+	while (next == txTail)
+		if (!(SREG & _BV(SREG_I)) && (UCSR0A & _BV(UDRE0)))
+			avr_serialTransmit();
+
+	txBuffer[head] = value;
+	txHead = next;
+
+	sbi(UCSR0B, UDRIE0);
+}
+
+uint8_t avr_serialWriteAvailable()
+{
+	return (txTail - txHead - 1) & TX_MASK;
+}
+
+void avr_serialFlush()
+{
+	while (txHead != txTail)
+		if (!(SREG & _BV(SREG_I)) && (UCSR0A & _BV(UDRE0)))
+			avr_serialTransmit();
 }
@@ -46,6 +46,15 @@ typedef uint8_t byte;
 #define F_CPU 16000000
 #endif
 
+// Size of the serial transmit ring, a power of two of at most 256 bytes. One byte of it is kept free.
+#ifndef AVR_SERIAL_TX_BUFFER_SIZE
+#define AVR_SERIAL_TX_BUFFER_SIZE 64
+#endif
+
+#if AVR_SERIAL_TX_BUFFER_SIZE & (AVR_SERIAL_TX_BUFFER_SIZE - 1) || AVR_SERIAL_TX_BUFFER_SIZE > 256
+#error "AVR_SERIAL_TX_BUFFER_SIZE must be a power of two of at most 256"
+#endif
+
 // clear bit, set bit macros
 #ifndef cbi
 #define cbi(sfr, bit) (_SFR_BYTE(sfr) &= ~_BV(bit))
@@ -73,10 +82,36 @@ uint32_t avr_millis();
 uint64_t avr_ticks();
 
 /**
- * @return micro seconds passed sicne timer initialisation.
+ * @return micro seconds passed sicne timer initialisation. The count wraps around at 2^32, and reading it does
+ * not turn interrupts off.
  */
 uint32_t avr_micros();
 
+/**
+ * @param us number of microseconds from now.
+ * @return a deadline, to be checked with avr_isPassed.
+ */
+static inline uint32_t avr_deadline(uint32_t us)
+{
+	return avr_micros() + us;
+}
+
+/**
+ * Checks a deadline. The comparison is wrap-safe for deadlines up to 2^31 microseconds (some 35 minutes) away.
+ * @param deadline deadline in microseconds, as returned by avr_deadline or avr_micros.
+ * @return true iff the deadline has passed.
+ */
+static inline bool avr_isPassed(uint32_t deadline)
+{
+	return (int32_t)(avr_micros() - deadline) >= 0;
+}
+
+/**
+ * Puts the processor in idle mode until the next interrupt: at the latest the next timer 0 overflow, some 1 ms
+ * away. The timers, the UART and the SPI keep running.
+ */
+void avr_idle();
+
 /**
  * Busy-wait for a given number of milliseconds.
  * @param ms number of milliseconds to wait.
@@ -84,7 +119,8 @@ uint32_t avr_micros();
 void avr_delay(unsigned long ms);
 
 /**
- * Set up serial port 0.
+ * Set up serial port 0. Output goes through a ring buffer of AVR_SERIAL_TX_BUFFER_SIZE bytes, which the data
+ * register empty interrupt drains, so printing only waits when the ring is full.
  * @param baud desired baud rate (i.e. 576000.
  */
 void avr_serialInit(uint32_t baud);
@@ -96,15 +132,25 @@ void avr_serialInit(uint32_t baud);
 void avr_serialPrint(char * str);
 
 /**
- * Serial printf.
+ * Serial printf. Formats straight into the transmit ring, without a buffer on the stack.
  * @param format printf format string.
  */
 void avr_serialPrintf(char * format, ...);
 
 /**
- * Print a single byte to the serial port.
+ * Print a single byte to the serial port. Waits for room in the transmit ring if it is full.
  * @param value
  */
 void avr_serialWrite(uint8_t value);
 
+/**
+ * @return number of bytes that can be written to the serial port without waiting.
+ */
+uint8_t avr_serialWriteAvailable();
+
+/**
+ * Waits until all buffered serial output has been handed to the UART.
+ */
+void avr_serialFlush();
+
 #endif
@@ -0,0 +1,279 @@
+/*
+Copyright 2011 Niels Brouwers
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+/**
+ * Throughput and latency benchmark, built with "make bench". Same tests and output as the Benchmark sketch in
+ * src/arduino/examples, paired with the Benchmark service on the phone (src/android/Benchmark):
+ *
+ *   adb shell am startservice -n org.microbridge.benchmark/.BenchmarkService
+ *
+ * Results go to the serial port as "BENCH <test> key=value ..." lines, one per measurement. Latencies are in
+ * microseconds. The tests run once per connection, replug the phone to run them again.
+ */
+#include "avr.h"
+#include "adb.h"
+
+// Payload sizes of the throughput tests.
+static const uint16_t sizes[] = { 1, 16, 64, 256, 1024, 4096 };
+#define SIZES (sizeof(sizes) / sizeof(sizes[0]))
+
+// Duration of each device->phone test, and the number of chunks requested in each phone->device test.
+#define TX_DURATION 2000
+#define RX_CHUNKS 32
+#define RX_TIMEOUT 10000
+
+// Number of round trips in the latency test, and how long to wait for each one.
+#define SAMPLES 32
+#define LATENCY_TIMEOUT 1000
+
+// One packet worth of data. Larger payloads are gathered from it with adb_writev, so no 4 KB buffer is needed.
+static uint8_t pattern[64];
+static usb_segment segments[4096 / sizeof(pattern)];
+
+// The phone discards data sent to sink, echoes data sent to echo, and answers requests on source.
+static adb_connection * sink, * echo, * source;
+
+// Time of the ADB_CONNECT event, of the last stream opening, and of the first byte the phone sent (milliseconds).
+static uint32_t connectTime, openTime, firstByteTime;
+
+// Bytes received on source, and when the last echo came in (microseconds).
+static uint32_t received;
+static boolean echoed;
+static uint32_t echoTime;
+
+// Latency samples.
+static uint32_t okayLatency[SAMPLES], echoLatency[SAMPLES];
+
+// Set after the tests ran, cleared on the next CNXN.
+static boolean done;
+
+static void adbEventHandler(adb_connection * connection, adb_eventType event, uint16_t length, uint8_t * data)
+{
+	switch (event)
+	{
+	case ADB_CONNECT:
+		connectTime = avr_millis();
+		firstByteTime = 0;
+		done = false;
+		break;
+
+	case ADB_CONNECTION_OPEN:
+		openTime = avr_millis();
+		break;
+
+	case ADB_CONNECTION_RECEIVE:
+		if (connection == sink && firstByteTime == 0)
+			firstByteTime = avr_millis();
+		else if (connection == source)
+			received += length;
+		else if (connection == echo)
+		{
+			echoTime = avr_micros();
+			echoed = true;
+		}
+		break;
+
+	default:
+		break;
+	}
+}
+
+/**
+ * Prints a throughput line.
+ */
+static void report(char * test, uint16_t size, uint32_t bytes, uint32_t ms)
+{
+	avr_serialPrintf("BENCH %s size=%u bytes=%lu ms=%lu bps=%lu\n", test, size, bytes, ms, ms > 0 ? bytes * 1000 / ms : 0);
+}
+
+/**
+ * Sorts a set of samples and prints its percentiles.
+ */
+static void reportLatency(char * kind, uint32_t * samples, uint8_t n)
+{
+	uint8_t i, j;
+	uint32_t x;
+
+	for (i = 1; i < n; i++)
+	{
+		x = samples[i];
+		for (j = i; j > 0 && samples[j - 1] > x; j--)
+			samples[j] = samples[j - 1];
+		samples[j] = x;
+	}
+
+	if (n > 0)
+		avr_serialPrintf("BENCH latency kind=%s n=%u p50=%lu p90=%lu p99=%lu max=%lu\n", kind, n,
+				samples[n / 2], samples[n * 9 / 10], samples[n * 99 / 100], samples[n - 1]);
+	else
+		avr_serialPrintf("BENCH latency kind=%s n=0\n", kind);
+}
+
+/**
+ * Polls until a connection is ready for the next write.
+ * @return false if the connection closed or the timeout expired.
+ */
+static boolean waitOpen(adb_connection * connection, uint32_t start, uint32_t timeout)
+{
+	while (connection->status != ADB_OPEN)
+	{
+		if (connection->status != ADB_WRITING && connection->status != ADB_RECEIVING) return false;
+		if (avr_millis() - start > timeout) return false;
+		adb_poll();
+	}
+
+	return true;
+}
+
+/**
+ * Device -> phone: sends WRTEs of a given size to the sink for TX_DURATION milliseconds.
+ */
+static void benchmarkTx(uint16_t size)
+{
+	uint8_t count = 0;
+	uint16_t left;
+	uint32_t bytes = 0, start = avr_millis();
+
+	// Describe the payload as a list of segments that all point to the same pattern.
+	for (left = size; left > 0; left -= segments[count++].length)
+	{
+		segments[count].data = pattern;
+		segments[count].length = left < sizeof(pattern) ? left : sizeof(pattern);
+		segments[count].progmem = false;
+	}
+
+	while (avr_millis() - start < TX_DURATION)
+	{
+		if (!waitOpen(sink, start, TX_DURATION)) break;
+		if (adb_writev(sink, count, segments) == 0) bytes += size;
+	}
+
+	// Wait for the last OKAY, so that only acknowledged data is counted.
+	waitOpen(sink, avr_millis(), LATENCY_TIMEOUT);
+	report("tx", size, bytes, avr_millis() - start);
+}
+
+/**
+ * Phone -> device: asks the source for RX_CHUNKS writes of a given size, and times their arrival.
+ */
+static void benchmarkRx(uint16_t size)
+{
+	uint8_t request[4];
+	uint32_t total = (uint32_t)size * RX_CHUNKS, start;
+
+	// Request: chunk size and number of chunks, little endian.
+	request[0] = size & 0xff;
+	request[1] = size >> 8;
+	request[2] = RX_CHUNKS & 0xff;
+	request[3] = RX_CHUNKS >> 8;
+
+	if (!waitOpen(source, avr_millis(), LATENCY_TIMEOUT)) return;
+
+	received = 0;
+	start = avr_millis();
+	adb_write(source, sizeof(request), request);
+
+	while (received < total && avr_millis() - start < RX_TIMEOUT && source->status != ADB_CLOSED)
+		adb_poll();
+
+	report("rx", size, received, avr_millis() - start);
+}
+
+/**
+ * Round trips: times the OKAY to a one-byte WRTE, and the echo of that byte.
+ */
+static void benchmarkLatency()
+{
+	uint8_t okays = 0, echoes = 0, i;
+	uint32_t start, timeout;
+	boolean okay;
+
+	for (i = 0; i < SAMPLES; i++)
+	{
+		if (!waitOpen(echo, avr_millis(), LATENCY_TIMEOUT)) break;
+
+		echoed = false;
+		okay = false;
+		timeout = avr_millis();
+		start = avr_micros();
+		if (adb_write(echo, 1, pattern) != 0) break;
+
+		while ((!okay || !echoed) && avr_millis() - timeout < LATENCY_TIMEOUT)
+		{
+			adb_poll();
+
+			if (!okay && echo->status != ADB_WRITING)
+			{
+				okayLatency[okays++] = avr_micros() - start;
+				okay = true;
+			}
+		}
+
+		if (echoed) echoLatency[echoes++] = echoTime - start;
+	}
+
+	reportLatency("okay", okayLatency, okays);
+	reportLatency("echo", echoLatency, echoes);
+}
+
+int main()
+{
+	uint8_t i;
+
+	// Initialise avr timers
+	avr_timerInit();
+
+	// Initialise serial port
+	avr_serialInit(57600);
+
+	for (i = 0; i < sizeof(pattern); i++)
+		pattern[i] = i;
+
+	// Initialise USB host shield.
+	adb_init();
+	adb_setEventHandler(adbEventHandler);
+
+	// Open the benchmark streams to the phone. Auto-reconnect
+	sink = adb_addConnection("tcp:4568", true, NULL);
+	echo = adb_addConnection("tcp:4569", true, NULL);
+	source = adb_addConnection("tcp:4570", true, NULL);
+
+	while (1)
+	{
+		adb_poll();
+
+		// Start once all streams are open and the phone said hello.
+		if (done || firstByteTime == 0) continue;
+		if (sink->status != ADB_OPEN || echo->status != ADB_OPEN || source->status != ADB_OPEN) continue;
+
+		avr_serialPrintf("BENCH config f_cpu=%lu spcr=0x%02x spsr=0x%02x maxdata=%lu\n", F_CPU, SPCR, SPSR, adb_getRemoteMaxData());
+		avr_serialPrintf("BENCH connect open_ms=%lu first_byte_ms=%lu\n", openTime - connectTime, firstByteTime - connectTime);
+
+		for (i = 0; i < SIZES; i++)
+			if (sizes[i] <= adb_getRemoteMaxData())
+				benchmarkTx(sizes[i]);
+
+		for (i = 0; i < SIZES; i++)
+			benchmarkRx(sizes[i]);
+
+		benchmarkLatency();
+
+		avr_serialPrintf("BENCH done\n");
+		done = true;
+	}
+
+	return 0;
+}
@@ -48,7 +48,7 @@ int main()
 	adb_init();
 
 	// Create a new ADB connection, run logcat
-	adb_addConnection("shell:exec logcat -s MYAPP:*", false, adbEventHandler);
+	adb_addConnection_P(PSTR("shell:exec logcat -s MYAPP:*"), false, adbEventHandler);
 
 	// ADB polling.
 	while (1)
@@ -16,11 +16,19 @@ limitations under the License.#include <string.h>
 #include "avr.h"
 #include "adb.h"
 
+// Logcat client and its line buffer, longer lines are cut short.
+static adb_logcat logcat;
+static uint8_t line[128];
+
+// Called once per log line.
+void logcatLineHandler(adb_logcat * logcat, uint16_t length, char * line)
+{
+	avr_serialPrintf("%s\n", line);
+}
+
 // Event handler to process incoming data from ADB.
 void adbEventHandler(adb_connection * connection, adb_eventType event, uint16_t length, uint8_t * data)
 {
-	int i;
-
 	switch (event)
 	{
 	case ADB_CONNECTION_OPEN:
@@ -31,18 +39,13 @@ void adbEventHandler(adb_connection * connection, adb_eventType event, uint16_t
 		break;
 	case ADB_CONNECTION_FAILED:
 		avr_serialPrintf("Connection failed %s\n", connection->connectionString);
-		break;
-	case ADB_CONNECTION_RECEIVE:
-
-		// Write the results to UART
-		for (i=0; i<length; i++)
-			avr_serialPrintf("%c", data[i]);
-
 		break;
 	default:
 		break;
 	}
 
+	// Assemble the log lines.
+	adb_handleLogcatEvent(&logcat, event, length, data);
 }
 
 int main()
@@ -56,8 +59,10 @@ int main()
  	// Initialise ADB connection
 	adb_init();
 
-	// Create a new ADB connection, run logcat
-	adb_addConnection("shell:exec logcat", false, adbEventHandler);
+	// Create a new ADB connection, run logcat. The phone filters the log and only sends the messages of the
+	// ActivityManager of priority info and up, and all messages tagged MicroBridge.
+	adb_initLogcat(&logcat, line, sizeof(line), logcatLineHandler, NULL);
+	adb_addLogcat(&logcat, "ActivityManager:I MicroBridge:V", false, adbEventHandler);
 
 	// ADB polling.
 	while (1)
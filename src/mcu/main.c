@@ -44,6 +44,8 @@ void adbEventHandler(adb_connection * connection, adb_eventType event, uint16_t
 		for (i=0; i<length; i++)
 			avr_serialPrintf("%c", data[i]);
 
+		break;
+	default:
 		break;
 	}
 
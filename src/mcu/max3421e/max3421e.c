@@ -34,69 +34,8 @@ limitations under the License.#include <string.h>
 
 static uint8_t vbusState;
 
-/*
- * Initialises the max3421e host shield. Initialises the SPI bus and sets the required pin directions.
- * Must be called before powerOn.
- */
-void max3421e_init()
-{
-	spi_begin();
-
-#if defined(__AVR_ATmega1280__) || defined(__AVR_ATmega2560__)
-
-	// Set MAX_INT and MAX_GPX pins to input mode.
-	DDRH &= ~(0x40 | 0x20);
-
-	// Set SPI !SS pint to output mode.
-	DDRB |= 0x10;
-
-	// Set RESET pin to output
-	DDRH |= 0x10;
-
-#elif defined(__AVR_ATmega168__) || defined(__AVR_ATmega328P__)
-
-	// Set MAX_INT and MAX_GPX pins to input mode.
-	DDRB &= ~0x3;
-
-	// Set RESET pin to output
-	DDRD |= 0x80;
-
-	// Set SS pin to output
-	DDRB |= 0x4;
-
-#endif
-
-	// Sparkfun botched their first attempt at cloning Oleg's max3421e shield and reversed the GPX and RESET pins.
-	// This hack is in place to make MicroBridge work with those shields. (see http://www.sparkfun.com/products/9628)
-#ifdef SFHACK
-
-#if defined(__AVR_ATmega1280__) || defined(__AVR_ATmega2560__)
-
-	// Set MAX_GPX pin to input mode.
-	DDRH &= ~0x10;
-
-	// Set RESET pin to output
-	DDRH |= 0x20;
-
-#elif defined(__AVR_ATmega168__) || defined(__AVR_ATmega328P__)
-
-	// Set GPX pin to input
-	DDRD &= ~0x80;
-
-	// Set RESET pin to output
-	DDRB |= 0x1;
-
-#endif
-
-#endif
-
-
-	// Pull SPI !SS high
-	MAX_SS(1);
-
-	// Reset
-	MAX_RESET(1);
-}
+// Called when a host transfer completes.
+static max3421e_transferHandler * transferHandler = NULL;
 
 /**
  * Resets the max3412e. Sets the chip reset bit, SPI configuration is not affected.
@@ -141,7 +80,7 @@ void max3421e_powerOn(void)
 
 	// Configure host operation.
 	max3421e_write(MAX_REG_MODE, bmDPPULLDN | bmDMPULLDN | bmHOST | bmSEPIRQ ); // set pull-downs, Host, Separate GPIN IRQ on GPX
-	max3421e_write(MAX_REG_HIEN, bmCONDETIE | bmFRAMEIE ); //connection detection
+	max3421e_write(MAX_REG_HIEN, bmCONDETIE | bmFRAMEIE | bmHXFRDNIE ); //connection detection, transfer done
 
 	// Check if device is connected.
 	max3421e_write(MAX_REG_HCTL, bmSAMPLEBUS ); // sample USB bus
@@ -154,124 +93,6 @@ void max3421e_powerOn(void)
 	max3421e_write(MAX_REG_CPUCTL, 0x01);
 }
 
-/**
- * Writes a single register.
- *
- * @param reg register address.
- * @param value value to write.
- */
-void max3421e_write(uint8_t reg, uint8_t value)
-{
-	// Pull slave select low to indicate start of transfer.
-	MAX_SS(0);
-
-	// Transfer command byte, 0x02 indicates write.
-	SPDR = (reg | 0x02);
-	while (!(SPSR & (1 << SPIF)));
-
-	// Transfer value byte.
-	SPDR = value;
-	while (!(SPSR & (1 << SPIF)));
-
-	// Pull slave select high to indicate end of transfer.
-	MAX_SS(1);
-
-	return;
-}
-
-/**
- * Writes multiple bytes to a register.
- * @param reg register address.
- * @param count number of bytes to write.
- * @param vaues input values.
- * @return a pointer to values, incremented by the number of bytes written (values + length).
- */
-uint8_t * max3421e_writeMultiple(uint8_t reg, uint8_t count, uint8_t * values)
-{
-	// Pull slave select low to indicate start of transfer.
-	MAX_SS(0);
-
-	// Transfer command byte, 0x02 indicates write.
-	SPDR = (reg | 0x02);
-	while (!(SPSR & (1 << SPIF)));
-
-	// Transfer values.
-	while (count--)
-	{
-		// Send next value byte.
-		SPDR = (*values);
-		while (!(SPSR & (1 << SPIF)));
-
-		values++;
-	}
-
-	// Pull slave select high to indicate end of transfer.
-	MAX_SS(1);
-
-	return (values);
-}
-
-/**
- * Reads a single register.
- *
- * @param reg register address.
- * @return result value.
- */
-uint8_t max3421e_read(uint8_t reg)
-{
-	// Pull slave-select high to initiate transfer.
-	MAX_SS(0);
-
-	// Send a command byte containing the register number.
-	SPDR = reg;
-	while (!(SPSR & (1 << SPIF)));
-
-	// Send an empty byte while reading.
-	SPDR = 0;
-	while (!(SPSR & (1 << SPIF)));
-
-	// Pull slave-select low to signal transfer complete.
-	MAX_SS(1);
-
-	// Return result byte.
-	return (SPDR);
-}
-
-/**
- * Reads multiple bytes from a register.
- *
- * @param reg register to read from.
- * @param count number of bytes to read.
- * @param values target buffer.
- * @return pointer to the input buffer + count.
- */
-uint8_t * max3421e_readMultiple(uint8_t reg, uint8_t count, uint8_t * values)
-{
-	// Pull slave-select high to initiate transfer.
-	MAX_SS(0);
-
-	// Send a command byte containing the register number.
-	SPDR = reg;
-	while (!(SPSR & (1 << SPIF))); //wait
-
-	// Read [count] bytes.
-	while (count--)
-	{
-		// Send empty byte while reading.
-		SPDR = 0;
-		while (!(SPSR & (1 << SPIF)));
-
-		*values = SPDR;
-		values++;
-	}
-
-	// Pull slave-select low to signal transfer complete.
-	MAX_SS(1);
-
-	// Return the byte array + count.
-	return (values);
-}
-
 /**
  * @return the status of Vbus.
  */
@@ -341,6 +162,17 @@ uint8_t max3421e_poll(void)
 	return (rcode);
 }
 
+/**
+ * Sets the function that is called when a host transfer completes. The handler is called from
+ * max3421e_interruptHandler, after HXFRDNIRQ has been cleared, so it may launch a new transfer right away.
+ *
+ * @param handler transfer completion handler, or NULL to ignore transfer completion.
+ */
+void max3421e_setTransferHandler(max3421e_transferHandler * handler)
+{
+	transferHandler = handler;
+}
+
 /**
  * Interrupt handler.
  */
@@ -352,6 +184,15 @@ uint8_t max3421e_interruptHandler(void)
 	// Determine interrupt source.
 	interruptStatus = max3421e_read(MAX_REG_HIRQ);
 
+	if (interruptStatus & bmHXFRDNIRQ)
+	{
+		// Clear the interrupt first, the handler may dispatch the next transfer (or a retry).
+		max3421e_write(MAX_REG_HIRQ, bmHXFRDNIRQ);
+
+		if (transferHandler != NULL)
+			transferHandler(max3421e_read(MAX_REG_HRSL));
+	}
+
 	if (interruptStatus & bmFRAMEIRQ)
 	{
 		//->1ms SOF interrupt handler
@@ -40,7 +40,7 @@ limitations under the License.#include <string.h>
 /**
  * Max3421e registers in host mode.
  */
-enum
+typedef enum
 {
 	MAX_REG_RCVFIFO = 0x08,
 	MAX_REG_SNDFIFO = 0x10,
@@ -64,18 +64,29 @@ enum
 	MAX_REG_HRSL = 0xf8
 } max_registers;
 
-#if defined(__AVR_ATmega1280__) || defined(__AVR_ATmega2560__)
+#if defined(MAX3421E_SIM)
+
+// Host build: the pins of the simulated controller, see sim/max3421e_sim.c.
+uint8_t max3421e_simInt();
+uint8_t max3421e_simGpx();
+
+#define MAX_SS(x)
+#define MAX_INT() max3421e_simInt()
+#define MAX_GPX() max3421e_simGpx()
+#define MAX_RESET(x)
+
+#elif defined(__AVR_ATmega1280__) || defined(__AVR_ATmega2560__)
 
 #define MAX_SS(x) { if (x) PORTB |= 0x10; else PORTB &= ~0x10; }
-#define MAX_INT() ((PORTH & 0x40) >> 6)
-#define MAX_GPX() ((PORTH & 0x20) >> 5)
+#define MAX_INT() ((PINH & 0x40) >> 6)
+#define MAX_GPX() ((PINH & 0x20) >> 5)
 #define MAX_RESET(x) { if (x) PORTH |= 0x10; else PORTH &= ~0x10; }
 
 #elif defined(__AVR_ATmega168__) || defined(__AVR_ATmega328P__)
 
 #define MAX_SS(x) SPI_SS(x)
-#define MAX_INT() ((PORTB & 2) >> 1)
-#define MAX_GPX() (PORTB & 1)
+#define MAX_INT() ((PINB & 2) >> 1)
+#define MAX_GPX() (PINB & 1)
 #define MAX_RESET(x) { if (x) PORTD |= 0x80; else PORTD &= ~0x80; }
 
 #endif
@@ -91,13 +102,13 @@ enum
 #if defined(__AVR_ATmega1280__) || defined(__AVR_ATmega2560__)
 
 // Untested!
-#define MAX_GPX() ((PORTH & 0x10) >> 4)
+#define MAX_GPX() ((PINH & 0x10) >> 4)
 #define MAX_RESET(x) { if (x) PORTH |= 0x20; else PORTH &= ~0x20; }
 
 #elif defined(__AVR_ATmega168__) || defined(__AVR_ATmega328P__)
 
 // Untested!
-#define MAX_GPX() ((PORTD & 0x80) >> 7)
+#define MAX_GPX() ((PIND & 0x80) >> 7)
 #define MAX_RESET(x) { if (x) PORTB |= 1; else PORTB &= ~1; }
 
 #endif
@@ -105,12 +116,22 @@ enum
 #endif
 
 
+/**
+ * Callback for host transfer completion. Called from max3421e_interruptHandler when HXFRDNIRQ is raised,
+ * with the contents of the HRSL register (result code in the lower four bits, toggle and bus state above).
+ */
+typedef void(max3421e_transferHandler)(uint8_t hrsl);
+
+// Register access layer, implemented over SPI by max3421e_spi.c, or by the simulator in the host build. Everything
+// else only talks to the controller through these functions and the MAX_INT/MAX_GPX pins.
 void max3421e_init();
 void max3421e_write(uint8_t reg, uint8_t val);
 uint8_t * max3421e_writeMultiple(uint8_t reg, uint8_t count, uint8_t * values);
-void max3421e_gpioWr(uint8_t val);
+const uint8_t * max3421e_writeMultiple_P(uint8_t reg, uint8_t count, const uint8_t * values);
 uint8_t max3421e_read(uint8_t reg);
 uint8_t * max3421e_readMultiple(uint8_t reg, uint8_t count, uint8_t * values);
+
+void max3421e_gpioWr(uint8_t val);
 uint8_t max3421e_gpioRd(void);
 boolean max3421e_reset();
 boolean max3421e_vbusPwr(boolean action);
@@ -121,6 +142,7 @@ uint8_t max3421e_getVbusState();
 uint8_t max3421e_poll(void);
 
 uint8_t max3421e_interruptHandler(void);
+void max3421e_setTransferHandler(max3421e_transferHandler * handler);
 uint8_t max3421e_gpxInterruptHandler(void);
 
 #endif //_MAX3421E_H_
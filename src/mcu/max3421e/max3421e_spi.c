@@ -0,0 +1,256 @@
+/*
+Copyright 2011 Niels Brouwers
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+/**
+ * Register access layer of the max3421e library: pin setup and register reads and writes over the AVR SPI
+ * interface. This is the only part of the USB stack that touches the SPI hardware. The host build replaces it
+ * with a simulated controller (see sim/max3421e_sim.c).
+ */
+
+#include <avr/pgmspace.h>
+
+#include "max3421e.h"
+#include "../spi.h"
+
+/*
+ * Initialises the max3421e host shield. Initialises the SPI bus and sets the required pin directions.
+ * Must be called before powerOn.
+ */
+void max3421e_init()
+{
+	spi_begin();
+
+#if defined(__AVR_ATmega1280__) || defined(__AVR_ATmega2560__)
+
+	// Set MAX_INT and MAX_GPX pins to input mode.
+	DDRH &= ~(0x40 | 0x20);
+
+	// Set SPI !SS pint to output mode.
+	DDRB |= 0x10;
+
+	// Set RESET pin to output
+	DDRH |= 0x10;
+
+#elif defined(__AVR_ATmega168__) || defined(__AVR_ATmega328P__)
+
+	// Set MAX_INT and MAX_GPX pins to input mode.
+	DDRB &= ~0x3;
+
+	// Set RESET pin to output
+	DDRD |= 0x80;
+
+	// Set SS pin to output
+	DDRB |= 0x4;
+
+#endif
+
+	// Sparkfun botched their first attempt at cloning Oleg's max3421e shield and reversed the GPX and RESET pins.
+	// This hack is in place to make MicroBridge work with those shields. (see http://www.sparkfun.com/products/9628)
+#ifdef SFHACK
+
+#if defined(__AVR_ATmega1280__) || defined(__AVR_ATmega2560__)
+
+	// Set MAX_GPX pin to input mode.
+	DDRH &= ~0x10;
+
+	// Set RESET pin to output
+	DDRH |= 0x20;
+
+#elif defined(__AVR_ATmega168__) || defined(__AVR_ATmega328P__)
+
+	// Set GPX pin to input
+	DDRD &= ~0x80;
+
+	// Set RESET pin to output
+	DDRB |= 0x1;
+
+#endif
+
+#endif
+
+
+	// Pull SPI !SS high
+	MAX_SS(1);
+
+	// Reset
+	MAX_RESET(1);
+}
+
+/**
+ * Writes a single register.
+ *
+ * @param reg register address.
+ * @param value value to write.
+ */
+void max3421e_write(uint8_t reg, uint8_t value)
+{
+	// Pull slave select low to indicate start of transfer.
+	MAX_SS(0);
+
+	// Transfer command byte, 0x02 indicates write.
+	SPDR = (reg | 0x02);
+	while (!(SPSR & (1 << SPIF)));
+
+	// Transfer value byte.
+	SPDR = value;
+	while (!(SPSR & (1 << SPIF)));
+
+	// Pull slave select high to indicate end of transfer.
+	MAX_SS(1);
+
+	return;
+}
+
+/**
+ * Writes multiple bytes to a register.
+ * @param reg register address.
+ * @param count number of bytes to write.
+ * @param vaues input values.
+ * @return a pointer to values, incremented by the number of bytes written (values + length).
+ */
+uint8_t * max3421e_writeMultiple(uint8_t reg, uint8_t count, uint8_t * values)
+{
+	uint8_t next;
+
+	// Pull slave select low to indicate start of transfer.
+	MAX_SS(0);
+
+	// Transfer command byte, 0x02 indicates write.
+	SPDR = (reg | 0x02);
+
+	// Transfer values. SPDR isn't buffered, so fetch the next byte while the last one is still shifting out and
+	// load it as soon as SPIF is up.
+	while (count--)
+	{
+		next = *values++;
+		while (!(SPSR & (1 << SPIF)));
+		SPDR = next;
+	}
+
+	// Wait for the last byte to go out.
+	while (!(SPSR & (1 << SPIF)));
+
+	// Pull slave select high to indicate end of transfer.
+	MAX_SS(1);
+
+	return (values);
+}
+
+/**
+ * Writes multiple bytes from program memory (flash) to a register.
+ * @param reg register address.
+ * @param count number of bytes to write.
+ * @param values input values, in program memory.
+ * @return a pointer to values, incremented by the number of bytes written (values + length).
+ */
+const uint8_t * max3421e_writeMultiple_P(uint8_t reg, uint8_t count, const uint8_t * values)
+{
+	uint8_t next;
+
+	// Pull slave select low to indicate start of transfer.
+	MAX_SS(0);
+
+	// Transfer command byte, 0x02 indicates write.
+	SPDR = (reg | 0x02);
+
+	// Transfer values, pipelined like max3421e_writeMultiple. The flash read (lpm) is slow enough that overlapping
+	// it with the transfer matters even more here.
+	while (count--)
+	{
+		next = pgm_read_byte(values++);
+		while (!(SPSR & (1 << SPIF)));
+		SPDR = next;
+	}
+
+	// Wait for the last byte to go out.
+	while (!(SPSR & (1 << SPIF)));
+
+	// Pull slave select high to indicate end of transfer.
+	MAX_SS(1);
+
+	return (values);
+}
+
+/**
+ * Reads a single register.
+ *
+ * @param reg register address.
+ * @return result value.
+ */
+uint8_t max3421e_read(uint8_t reg)
+{
+	// Pull slave-select high to initiate transfer.
+	MAX_SS(0);
+
+	// Send a command byte containing the register number.
+	SPDR = reg;
+	while (!(SPSR & (1 << SPIF)));
+
+	// Send an empty byte while reading.
+	SPDR = 0;
+	while (!(SPSR & (1 << SPIF)));
+
+	// Pull slave-select low to signal transfer complete.
+	MAX_SS(1);
+
+	// Return result byte.
+	return (SPDR);
+}
+
+/**
+ * Reads multiple bytes from a register.
+ *
+ * @param reg register to read from.
+ * @param count number of bytes to read.
+ * @param values target buffer.
+ * @return pointer to the input buffer + count.
+ */
+uint8_t * max3421e_readMultiple(uint8_t reg, uint8_t count, uint8_t * values)
+{
+	uint8_t value;
+
+	// Pull slave-select high to initiate transfer.
+	MAX_SS(0);
+
+	// Send a command byte containing the register number.
+	SPDR = reg;
+	while (!(SPSR & (1 << SPIF))); //wait
+
+	// Read [count] bytes. Each byte is picked up and the next one started right away, and stored while that one is
+	// shifting in.
+	if (count > 0)
+	{
+		SPDR = 0;
+
+		while (--count)
+		{
+			while (!(SPSR & (1 << SPIF)));
+			value = SPDR;
+			SPDR = 0;
+
+			*values++ = value;
+		}
+
+		while (!(SPSR & (1 << SPIF)));
+		*values++ = SPDR;
+	}
+
+	// Pull slave-select low to signal transfer complete.
+	MAX_SS(1);
+
+	// Return the byte array + count.
+	return (values);
+}
@@ -27,6 +27,34 @@ limitations under the License.#include <string.h>
 #define bmREQ_SET           USB_SETUP_HOST_TO_DEVICE|USB_SETUP_TYPE_STANDARD|USB_SETUP_RECIPIENT_DEVICE     //set request type for all but 'set feature' and 'set interface'
 #define bmREQ_CL_GET_INTF   USB_SETUP_DEVICE_TO_HOST|USB_SETUP_TYPE_CLASS|USB_SETUP_RECIPIENT_INTERFACE     //get interface request type
 
+/* Hub class (USB 2.0 chapter 11) */
+#define USB_CLASS_HUB               0x09
+#define USB_DESCRIPTOR_HUB          0x29
+#define bmREQ_HUB_GET_DESCR     USB_SETUP_DEVICE_TO_HOST|USB_SETUP_TYPE_CLASS|USB_SETUP_RECIPIENT_DEVICE   //get hub descriptor request type
+#define bmREQ_PORT_GET_STATUS   USB_SETUP_DEVICE_TO_HOST|USB_SETUP_TYPE_CLASS|USB_SETUP_RECIPIENT_OTHER    //get port status request type
+#define bmREQ_PORT_FEATURE      USB_SETUP_HOST_TO_DEVICE|USB_SETUP_TYPE_CLASS|USB_SETUP_RECIPIENT_OTHER    //set/clear port feature request type
+
+#define HUB_FEATURE_PORT_ENABLE     1       // port feature selectors
+#define HUB_FEATURE_PORT_RESET      4
+#define HUB_FEATURE_PORT_POWER      8
+#define HUB_FEATURE_C_PORT_CONNECTION   16
+#define HUB_FEATURE_C_PORT_ENABLE   17
+#define HUB_FEATURE_C_PORT_RESET    20
+
+#define bmHUB_PORT_CONNECTION       0x0001  // wPortStatus bits
+#define bmHUB_PORT_ENABLE           0x0002
+#define bmHUB_PORT_RESET            0x0010
+#define bmHUB_PORT_POWER            0x0100
+#define bmHUB_PORT_LOW_SPEED        0x0200
+#define bmHUB_PORT_C_CONNECTION     0x0001  // wPortChange bits
+#define bmHUB_PORT_C_ENABLE         0x0002
+#define bmHUB_PORT_C_RESET          0x0010
+
+#define USB_HUB_MAX_PORTS           7       // downstream ports served, so that the status change bitmap fits one byte
+#define USB_HUB_POLL_INTERVAL       32      // interval between status change polls in milliseconds
+#define USB_HUB_RESET_TIMEOUT       100     // time a port reset may take in milliseconds
+#define USB_HUB_RESET_RECOVERY      10      // reset recovery time in milliseconds, per section 7.1.7.5 of USB 2.0 spec
+
 /* HID requests */
 /*
 #define bmREQ_HIDOUT        USB_SETUP_HOST_TO_DEVICE|USB_SETUP_TYPE_CLASS|USB_SETUP_RECIPIENT_INTERFACE
@@ -39,8 +67,9 @@ limitations under the License.#include <string.h>
 #define USB_RETRY_LIMIT     3       // retry limit for a transfer
 #define USB_SETTLE_DELAY    200     // settle delay in milliseconds
 #define USB_NAK_NOWAIT      1       // used in Richard's PS2/Wiimote code
+#define USB_TRANSFER_ABORTED 0xff   // result code of a transfer that timed out while waiting for HXFRDNIRQ
+#define USB_TRANSFER_PENDING 0xfd   // a write was cut short by the deadline, and can be resumed
 
-#define USB_NUMDEVICES  2           // Number of USB devices
 
 /* USB state machine states */
 
@@ -79,4 +108,14 @@ uint8_t usb_getStringDescriptor(usb_device * device, unsigned int nbytes, uint8_
 int usb_setAddress(usb_device * device, uint8_t address);
 int usb_setConfiguration(usb_device * device, uint8_t configuration);
 
+int usb_startTransfer(usb_device * device, usb_endpoint * endpoint, uint8_t token, uint8_t length, uint8_t * data, unsigned int nakLimit, usb_transferCallback * callback);
+uint8_t usb_waitTransfer();
+void usb_setDeadline(uint32_t deadline);
+void usb_clearDeadline();
+boolean usb_isDeadlinePassed();
+boolean usb_isTransferPending();
+boolean usb_isEnumerating();
+usb_transfer * usb_getTransfer();
+int usb_dispatchPacket(uint8_t token, usb_endpoint * endpoint, unsigned int nakLimit);
+
 #endif //_usb_h_
@@ -0,0 +1,16 @@
+/**
+ * Host stand-in for <avr/eeprom.h>, see sim/sim.h. The EEPROM is an array in memory that starts out erased, so its
+ * contents last as long as the process.
+ */
+#ifndef __sim_avr_eeprom_h__
+#define __sim_avr_eeprom_h__
+
+#include <stddef.h>
+#include <stdint.h>
+
+uint8_t eeprom_read_byte(const uint8_t * address);
+void eeprom_update_byte(uint8_t * address, uint8_t value);
+void eeprom_read_block(void * destination, const void * source, size_t length);
+void eeprom_update_block(const void * source, void * destination, size_t length);
+
+#endif
@@ -0,0 +1,10 @@
+/**
+ * Host stand-in for <avr/interrupt.h>, see sim/sim.h. The simulator has no interrupts.
+ */
+#ifndef __sim_avr_interrupt_h__
+#define __sim_avr_interrupt_h__
+
+#define sei()
+#define cli()
+
+#endif
@@ -0,0 +1,12 @@
+/**
+ * Host stand-in for <avr/io.h>, see sim/sim.h. The stack reaches the hardware only through the max3421e register
+ * access layer and avr.c, which the simulator replaces, so no registers are needed here.
+ */
+#ifndef __sim_avr_io_h__
+#define __sim_avr_io_h__
+
+#include <stdint.h>
+
+#define _BV(bit) (1 << (bit))
+
+#endif
@@ -0,0 +1,21 @@
+/**
+ * Host stand-in for <avr/pgmspace.h>, see sim/sim.h. On the host, program memory is ordinary memory.
+ */
+#ifndef __sim_avr_pgmspace_h__
+#define __sim_avr_pgmspace_h__
+
+#include <stdint.h>
+#include <string.h>
+
+#define PROGMEM
+#define PSTR(s) (s)
+
+#define pgm_read_byte(address) (*(const uint8_t *)(address))
+#define pgm_read_word(address) (*(const uint16_t *)(address))
+
+#define memcpy_P memcpy
+#define strlen_P strlen
+#define strcpy_P strcpy
+#define strncpy_P strncpy
+
+#endif
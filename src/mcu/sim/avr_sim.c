@@ -0,0 +1,166 @@
+/*
+Copyright 2011 Niels Brouwers
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+/**
+ * Host implementation of avr.h. The timers read the simulated clock, busy waits advance it, and the serial port is
+ * standard output.
+ */
+
+#include "../avr.h"
+#include "sim.h"
+
+#include <string.h>
+#include <util/delay.h>
+#include <avr/eeprom.h>
+
+// Cost of reading a timer, so that loops that only wait for the clock make progress.
+#define SIM_TIMER_COST 100
+
+// Time between timer 0 overflows at 16 MHz, which wake the processor from idle mode (ns).
+#define SIM_TIMER0_PERIOD 1024000
+
+// EEPROM size of the ATmega1280, and the time it takes to write a byte in nanoseconds.
+#define SIM_EEPROM_SIZE 4096
+#define SIM_EEPROM_WRITE_TIME 3400000
+
+static uint8_t eeprom[SIM_EEPROM_SIZE];
+static boolean eepromErased;
+
+/**
+ * @param address EEPROM address.
+ * @return the EEPROM cell, which reads 0xff until it is first written.
+ */
+static uint8_t * sim_eeprom(const void * address)
+{
+	if (!eepromErased)
+	{
+		memset(eeprom, 0xff, sizeof(eeprom));
+		eepromErased = true;
+	}
+
+	return &eeprom[(uintptr_t)address % SIM_EEPROM_SIZE];
+}
+
+void avr_timerInit()
+{
+}
+
+uint32_t avr_millis()
+{
+	sim_advance(SIM_TIMER_COST);
+	return sim_now() / 1000000;
+}
+
+uint64_t avr_ticks()
+{
+	return sim_now() * (F_CPU / 1000000) / 1000;
+}
+
+uint32_t avr_micros()
+{
+	sim_advance(SIM_TIMER_COST);
+	return sim_now() / 1000;
+}
+
+void avr_idle()
+{
+	uint64_t wake = (sim_now() / SIM_TIMER0_PERIOD + 1) * SIM_TIMER0_PERIOD;
+	sim_counters * counters = sim_getCounters();
+
+	counters->sleeps++;
+	counters->sleepTime += wake - sim_now();
+	sim_advance(wake - sim_now());
+}
+
+void avr_delay(unsigned long ms)
+{
+	sim_advance((uint64_t)ms * 1000000);
+}
+
+void _delay_ms(double ms)
+{
+	sim_advance(ms * 1000000);
+}
+
+void _delay_us(double us)
+{
+	sim_advance(us * 1000);
+}
+
+void avr_serialInit(uint32_t baud)
+{
+}
+
+void avr_serialPrint(char * str)
+{
+	fputs(str, stdout);
+}
+
+void avr_serialPrintf(char * format, ...)
+{
+	va_list arg;
+
+	va_start(arg, format);
+	vprintf(format, arg);
+	va_end(arg);
+}
+
+void avr_serialWrite(uint8_t value)
+{
+	putchar(value);
+}
+
+uint8_t avr_serialWriteAvailable()
+{
+	return AVR_SERIAL_TX_BUFFER_SIZE - 1;
+}
+
+void avr_serialFlush()
+{
+	fflush(stdout);
+}
+
+uint8_t eeprom_read_byte(const uint8_t * address)
+{
+	return *sim_eeprom(address);
+}
+
+void eeprom_update_byte(uint8_t * address, uint8_t value)
+{
+	uint8_t * cell = sim_eeprom(address);
+
+	// Like the real thing, a write blocks until it is done, and is skipped if the cell already holds the value.
+	if (*cell == value) return;
+
+	*cell = value;
+	sim_advance(SIM_EEPROM_WRITE_TIME);
+}
+
+void eeprom_read_block(void * destination, const void * source, size_t length)
+{
+	size_t i;
+
+	for (i = 0; i < length; i++)
+		((uint8_t *)destination)[i] = eeprom_read_byte((const uint8_t *)source + i);
+}
+
+void eeprom_update_block(const void * source, void * destination, size_t length)
+{
+	size_t i;
+
+	for (i = 0; i < length; i++)
+		eeprom_update_byte((uint8_t *)destination + i, ((const uint8_t *)source)[i]);
+}
@@ -0,0 +1,1428 @@
+/*
+Copyright 2011 Niels Brouwers
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+/**
+ * Simulated Android devices for the host build. On the USB side each enumerates with a single configuration holding
+ * an ADB interface (bulk IN endpoint 1, bulk OUT endpoint 2), and keeps the data toggles of both bulk endpoints.
+ * A single device is on the root port, several are behind a hub (hub_sim.c), one per port.
+ * On the ADB side it plays adbd: it answers CNXN, accepts every OPEN, acknowledges every WRTE, and echoes or sources
+ * data as configured (see sim_config).
+ *
+ * A few services are modelled after those of adbd, for streams opened for them:
+ * - "sync:" stores pushed files (up to SIM_FILES of SIM_FILE_SIZE bytes, kept while the device is plugged in), and
+ *   sends them back when they are pulled. Pulling an unknown file fails with "No such file or directory".
+ * - "shell:" starts with a prompt and a terminal that echoes input, until "stty -echo" and "PS1=". It runs lines of
+ *   commands separated by ";": printf with a format of text, octal escapes and %d (for $?), echo, seq, true and
+ *   false. Anything else is not found and exits with 127.
+ * - "exec:logcat -B" writes sim_config.logcatEntries binary log entries. Entry i has priority 2 + i % 6, pid
+ *   1000 + i, tid 2000 + i, time 1600000000 + i seconds and i * 1000 nanoseconds, tag "sim" and message "entry <i> "
+ *   followed by (i * 37) % 150 'x' characters. The odd entries have the 24-byte header of version 3 of the format.
+ *
+ * With sim_config.accessory, a device answers the Android Open Accessory requests. Once it has been started, it
+ * drops off the bus, comes back after SIM_ACCESSORY_SWITCH_TIME with the accessory IDs and interface, and from
+ * then on echoes whatever it receives on the bulk endpoints, NAKing OUT packets while its buffer is full. It goes
+ * back to normal when it is plugged out.
+ *
+ * Messages to the host are queued and become available after the configured latency, the IN endpoint NAKs until
+ * then. Every packet the host sends is checked against the protocol, and violations are counted in
+ * sim_counters.errors rather than stopping the simulation.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../adb.h"
+#include "../ch9.h"
+#include "../max3421e/max3421e_usb.h"
+#include "sim.h"
+
+#define SIM_PACKET_SIZE 64
+#define SIM_ENDPOINT_IN 1
+#define SIM_ENDPOINT_OUT 2
+
+// Capacity of the message queue to the host, and number of streams.
+#define SIM_QUEUE_SIZE 64
+#define SIM_STREAMS 16
+
+// Files the sync service keeps, and their largest size.
+#define SIM_FILES 4
+#define SIM_FILE_SIZE 16384
+
+// Sync protocol IDs, on the wire little endian.
+#define SIM_SYNC_SEND 0x444e4553
+#define SIM_SYNC_RECV 0x56434552
+#define SIM_SYNC_DATA 0x41544144
+#define SIM_SYNC_DONE 0x454e4f44
+#define SIM_SYNC_OKAY 0x59414b4f
+#define SIM_SYNC_FAIL 0x4c494146
+
+// Largest binary log entry the logcat service writes: 24 header bytes, the priority, "sim", "entry 65535 ", 149 'x'
+// and the two terminating zeros.
+#define SIM_LOGCAT_ENTRY_SIZE 192
+
+// Android Open Accessory vendor requests, and the time a device takes to come back in accessory mode (ns).
+#define SIM_AOA_GET_PROTOCOL 51
+#define SIM_AOA_SEND_STRING 52
+#define SIM_AOA_START 53
+#define SIM_AOA_VERSION 2
+#define SIM_ACCESSORY_SWITCH_TIME 50000000ULL
+
+/**
+ * Message on its way to the host. The header goes out as one packet, the payload in packets of up to 64 bytes.
+ */
+typedef struct
+{
+	// Time from which the message may be sent, in nanoseconds.
+	uint64_t readyTime;
+
+	// Header and payload, the total length, and the number of bytes sent so far.
+	adb_message header;
+	uint8_t data[SIM_MAX_DATA];
+	uint16_t length, sent;
+
+	// Stream whose WRTE this message acknowledges (index + 1), or 0.
+	uint8_t okayFor;
+
+} sim_message;
+
+/**
+ * Services a stream can be opened for, see the top of this file. Other streams echo or source data.
+ */
+typedef enum
+{
+	SIM_SERVICE_NONE = 0,
+	SIM_SERVICE_SYNC,
+	SIM_SERVICE_SHELL,
+	SIM_SERVICE_LOGCAT,
+} sim_service;
+
+/**
+ * File stored by the sync service.
+ */
+typedef struct
+{
+	boolean used;
+	char path[64];
+	uint8_t data[SIM_FILE_SIZE];
+	uint16_t length;
+} sim_file;
+
+/**
+ * ADB stream, identified on the device's side by its index + 1.
+ */
+typedef struct
+{
+	boolean open;
+	uint32_t hostID;
+
+	// Sent a WRTE that the host has not acknowledged yet.
+	boolean writing;
+
+	// Sent OKAY to a WRTE from the host, but it has not been delivered yet.
+	boolean acknowledging;
+
+	// Holding back the OKAY to a WRTE from the host until there is room for another one.
+	boolean okayDeferred;
+
+	// Data waiting to be written to the host.
+	uint8_t pending[SIM_MAX_DATA * 2];
+	uint16_t pendingLength;
+
+	// Service the stream was opened for, and data from the host that the service has not taken in yet.
+	sim_service service;
+	uint8_t input[SIM_MAX_DATA * 2];
+	uint16_t inputLength;
+
+	// Sync: whether a push is going on, the file it goes to (NULL if there was no room for it) and whether it fails,
+	// and the file being pulled with the number of its bytes sent so far.
+	boolean pushing, pushFailed;
+	sim_file * pushFile;
+	sim_file * pullFile;
+	uint16_t pulled;
+
+	// Shell: whether the terminal echoes input and the shell prints a prompt, and the exit code of the last command.
+	boolean echoInput, prompt;
+	int exitCode;
+
+	// Logcat: number of entries written so far.
+	uint16_t entries;
+
+} sim_stream;
+
+static const uint8_t deviceDescriptor[] =
+{
+	18, USB_DESCRIPTOR_DEVICE, 0x00, 0x02, 0x00, 0x00, 0x00, SIM_PACKET_SIZE,
+	0xd1, 0x18, 0xe2, 0x4e, 0x00, 0x01, 0, 0, 0, 1
+};
+
+static const uint8_t configurationDescriptor[] =
+{
+	9, USB_DESCRIPTOR_CONFIGURATION, 32, 0, 1, 1, 0, 0x80, 250,
+	9, USB_DESCRIPTOR_INTERFACE, 0, 0, 2, ADB_CLASS, ADB_SUBCLASS, ADB_PROTOCOL, 0,
+	7, USB_DESCRIPTOR_ENDPOINT, 0x80 | SIM_ENDPOINT_IN, USB_TRANSFER_TYPE_BULK, SIM_PACKET_SIZE, 0, 0,
+	7, USB_DESCRIPTOR_ENDPOINT, SIM_ENDPOINT_OUT, USB_TRANSFER_TYPE_BULK, SIM_PACKET_SIZE, 0, 0
+};
+
+// Descriptors in accessory mode: the accessory product ID, and an interface with the same endpoints.
+static const uint8_t accessoryDeviceDescriptor[] =
+{
+	18, USB_DESCRIPTOR_DEVICE, 0x00, 0x02, 0x00, 0x00, 0x00, SIM_PACKET_SIZE,
+	0xd1, 0x18, 0x00, 0x2d, 0x00, 0x01, 0, 0, 0, 1
+};
+
+static const uint8_t accessoryConfigurationDescriptor[] =
+{
+	9, USB_DESCRIPTOR_CONFIGURATION, 32, 0, 1, 1, 0, 0x80, 250,
+	9, USB_DESCRIPTOR_INTERFACE, 0, 0, 2, 0xff, 0xff, 0x00, 0,
+	7, USB_DESCRIPTOR_ENDPOINT, 0x80 | SIM_ENDPOINT_IN, USB_TRANSFER_TYPE_BULK, SIM_PACKET_SIZE, 0, 0,
+	7, USB_DESCRIPTOR_ENDPOINT, SIM_ENDPOINT_OUT, USB_TRANSFER_TYPE_BULK, SIM_PACKET_SIZE, 0, 0
+};
+
+// String descriptor 0, the list of supported languages (US English).
+static const uint8_t languages[] = { 4, USB_DESCRIPTOR_STRING, 0x09, 0x04 };
+
+static const char identity[] = "device::ro.product.name=sim;ro.product.model=sim;";
+
+/**
+ * State of one simulated Android device.
+ */
+typedef struct
+{
+	boolean attached;
+
+	// USB address, and the address set by SET_ADDRESS that takes effect after its status stage.
+	uint8_t address, newAddress;
+	uint8_t configuration;
+
+	// Data stage of the last control request.
+	uint8_t control[64];
+	uint8_t controlLength, controlSent;
+
+	// Data toggles expected on the OUT endpoint and sent on the IN endpoint.
+	uint8_t outToggle, inToggle;
+
+	// Message being received from the host: header, payload, and payload bytes received so far.
+	adb_message header;
+	boolean headerReceived;
+	uint8_t payload[SIM_MAX_DATA];
+	uint16_t payloadLength;
+
+	// Queue of messages to the host.
+	sim_message queue[SIM_QUEUE_SIZE];
+	uint8_t queueHead, queueLength;
+
+	// ADB session state, and the maximum payload the host accepts.
+	boolean online;
+	uint32_t hostMaxData;
+	sim_stream streams[SIM_STREAMS];
+
+	// In accessory mode. Otherwise, the identification strings received (a bit per index), whether the status stage
+	// of START is due, and the time the device comes back in accessory mode (0 if it isn't switching).
+	boolean accessory;
+	uint8_t accessoryStrings;
+	boolean starting;
+	uint64_t switchTime;
+
+	// Data received in accessory mode and not echoed yet.
+	uint8_t raw[SIM_MAX_DATA];
+	uint16_t rawLength;
+
+	// Files stored by the sync service.
+	sim_file files[SIM_FILES];
+
+} sim_device;
+
+static sim_device devices[SIM_MAX_DEVICES];
+
+/**
+ * Queues a message to the host. It can be sent once the configured latency has passed.
+ *
+ * @param device device.
+ * @param command ADB command.
+ * @param arg0 first argument.
+ * @param arg1 second argument.
+ * @param length payload length.
+ * @param data payload.
+ * @return the queued message, or NULL if the queue is full.
+ */
+static sim_message * sim_send(sim_device * device, uint32_t command, uint32_t arg0, uint32_t arg1, uint16_t length, const uint8_t * data)
+{
+	sim_message * message;
+	uint32_t sum = 0;
+	uint16_t i;
+
+	if (device->queueLength == SIM_QUEUE_SIZE)
+	{
+		sim_getCounters()->errors++;
+		return NULL;
+	}
+
+	message = &device->queue[(device->queueHead + device->queueLength++) % SIM_QUEUE_SIZE];
+
+	for (i = 0; i < length; i++)
+		sum += data[i];
+
+	message->header.command = command;
+	message->header.arg0 = arg0;
+	message->header.arg1 = arg1;
+	message->header.data_length = length;
+	message->header.data_check = sim_getConfig()->version >= A_VERSION_SKIP_CHECKSUM ? 0 : sum;
+	message->header.magic = command ^ 0xffffffff;
+
+	if (length > 0) memcpy(message->data, data, length);
+	message->length = sizeof(adb_message) + length;
+	message->sent = 0;
+	message->okayFor = 0;
+	message->readyTime = sim_now() + (uint64_t)sim_getConfig()->latency * 1000;
+
+	sim_getCounters()->messagesOut++;
+	if (command == A_WRTE) sim_getCounters()->bytesOut += length;
+
+	return message;
+}
+
+/**
+ * Acknowledges the last WRTE from the host on a stream. An echoing device only does so once its pending data
+ * leaves room for another message, so a host that does not read its end keeps the device from taking more.
+ *
+ * @param device device.
+ * @param stream stream.
+ */
+static void sim_acknowledge(sim_device * device, sim_stream * stream)
+{
+	sim_message * reply;
+
+	if (sim_getConfig()->echo && stream->service == SIM_SERVICE_NONE
+			&& stream->pendingLength + sim_getConfig()->maxData > sizeof(stream->pending))
+	{
+		stream->okayDeferred = true;
+		return;
+	}
+
+	reply = sim_send(device, A_OKAY, stream - device->streams + 1, stream->hostID, 0, NULL);
+	if (reply != NULL)
+	{
+		reply->okayFor = stream - device->streams + 1;
+		stream->acknowledging = true;
+	}
+
+	stream->okayDeferred = false;
+}
+
+/**
+ * Appends service output to the data waiting to be written to the host.
+ *
+ * @param stream stream.
+ * @param length number of bytes.
+ * @param data output.
+ * @return true iff there was room for it. Output that doesn't fit is counted as an error.
+ */
+static boolean sim_output(sim_stream * stream, uint16_t length, const void * data)
+{
+	if (stream->pendingLength + length > sizeof(stream->pending))
+	{
+		sim_getCounters()->errors++;
+		return false;
+	}
+
+	memcpy(stream->pending + stream->pendingLength, data, length);
+	stream->pendingLength += length;
+
+	return true;
+}
+
+/**
+ * Appends a 32-bit little endian word to the output of a service.
+ *
+ * @param stream stream.
+ * @param value word.
+ */
+static void sim_outputWord(sim_stream * stream, uint32_t value)
+{
+	uint8_t word[4] = { value, value >> 8, value >> 16, value >> 24 };
+
+	sim_output(stream, sizeof(word), word);
+}
+
+/**
+ * @param data first byte of a 32-bit little endian word.
+ * @return the word.
+ */
+static uint32_t sim_word(const uint8_t * data)
+{
+	return data[0] | ((uint32_t)data[1] << 8) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+/**
+ * Answers a sync request with FAIL and a message.
+ *
+ * @param stream stream.
+ * @param message error message.
+ */
+static void sim_syncFail(sim_stream * stream, const char * message)
+{
+	sim_outputWord(stream, SIM_SYNC_FAIL);
+	sim_outputWord(stream, strlen(message));
+	sim_output(stream, strlen(message), message);
+}
+
+/**
+ * Looks up a file of the sync service.
+ *
+ * @param device device.
+ * @param path path of the file.
+ * @param create true to take a free slot for a file that doesn't exist yet.
+ * @return the file, or NULL if there is no such file or no free slot.
+ */
+static sim_file * sim_findFile(sim_device * device, const char * path, boolean create)
+{
+	sim_file * file;
+
+	for (file = device->files; file < device->files + SIM_FILES; file++)
+		if (file->used && strcmp(file->path, path) == 0)
+			return file;
+
+	if (!create || strlen(path) >= sizeof(file->path)) return NULL;
+
+	for (file = device->files; file < device->files + SIM_FILES; file++)
+		if (!file->used)
+		{
+			file->used = true;
+			strcpy(file->path, path);
+			file->length = 0;
+			return file;
+		}
+
+	return NULL;
+}
+
+/**
+ * Takes in the complete sync requests in the input of a stream: SEND with the path and mode, DATA and DONE to store
+ * a file, and RECV to pull one.
+ *
+ * @param device device.
+ * @param stream stream opened for "sync:".
+ */
+static void sim_syncRequests(sim_device * device, sim_stream * stream)
+{
+	char path[sizeof(device->files[0].path) + 8];
+	uint32_t id, length, used;
+	char * mode;
+
+	while (stream->inputLength >= 8)
+	{
+		id = sim_word(stream->input);
+		length = sim_word(stream->input + 4);
+
+		// The length of DONE is the modification time.
+		used = 8 + (id == SIM_SYNC_DONE ? 0 : length);
+		if (used > sizeof(stream->input))
+		{
+			sim_getCounters()->errors++;
+			stream->inputLength = 0;
+			return;
+		}
+		if (stream->inputLength < used) return;
+
+		if (id == SIM_SYNC_SEND || id == SIM_SYNC_RECV)
+		{
+			length = length < sizeof(path) - 1 ? length : sizeof(path) - 1;
+			memcpy(path, stream->input + 8, length);
+			path[length] = 0;
+		}
+
+		switch (id)
+		{
+		case SIM_SYNC_SEND:
+			// The request is the path and the mode, separated by the last comma.
+			mode = strrchr(path, ',');
+			if (mode == NULL || stream->pushing || stream->pullFile != NULL)
+			{
+				sim_getCounters()->errors++;
+				break;
+			}
+			*mode = 0;
+
+			stream->pushing = true;
+			stream->pushFile = sim_findFile(device, path, true);
+			stream->pushFailed = stream->pushFile == NULL;
+			if (stream->pushFile != NULL) stream->pushFile->length = 0;
+			break;
+
+		case SIM_SYNC_DATA:
+			if (!stream->pushing)
+				sim_getCounters()->errors++;
+			else if (stream->pushFile == NULL || stream->pushFile->length + length > SIM_FILE_SIZE)
+				stream->pushFailed = true;
+			else
+			{
+				memcpy(stream->pushFile->data + stream->pushFile->length, stream->input + 8, length);
+				stream->pushFile->length += length;
+			}
+			break;
+
+		case SIM_SYNC_DONE:
+			if (!stream->pushing)
+				sim_getCounters()->errors++;
+			else if (stream->pushFailed)
+				sim_syncFail(stream, "No space left on device");
+			else
+			{
+				sim_outputWord(stream, SIM_SYNC_OKAY);
+				sim_outputWord(stream, 0);
+			}
+			stream->pushing = false;
+			break;
+
+		case SIM_SYNC_RECV:
+			if (stream->pushing || stream->pullFile != NULL)
+			{
+				sim_getCounters()->errors++;
+				break;
+			}
+
+			// The file goes out from sim_serve, as the stream takes it.
+			stream->pullFile = sim_findFile(device, path, false);
+			stream->pulled = 0;
+			if (stream->pullFile == NULL)
+				sim_syncFail(stream, "No such file or directory");
+			break;
+
+		default:
+			sim_getCounters()->errors++;
+			break;
+		}
+
+		memmove(stream->input, stream->input + used, stream->inputLength - used);
+		stream->inputLength -= used;
+	}
+}
+
+/**
+ * Runs the shell printf: the format, with octal escapes, \n, and %d replaced by the exit code of the last command.
+ * The other arguments are ignored.
+ *
+ * @param stream stream opened for "shell:".
+ * @param args arguments of printf.
+ */
+static void sim_shellPrintf(sim_stream * stream, const char * args)
+{
+	char number[12];
+	uint8_t c, i;
+
+	if (*args++ != '\'') return;
+
+	for (; *args != 0 && *args != '\''; args++)
+	{
+		c = *args;
+
+		if (c == '\\' && args[1] == 'n')
+		{
+			c = '\n';
+			args++;
+		}
+		else if (c == '\\')
+		{
+			for (c = 0, i = 0; i < 3 && args[1] >= '0' && args[1] <= '7'; i++)
+				c = c * 8 + (*++args - '0');
+		}
+		else if (c == '%' && args[1] == 'd')
+		{
+			snprintf(number, sizeof(number), "%d", stream->exitCode);
+			sim_output(stream, strlen(number), number);
+			args++;
+			continue;
+		}
+
+		sim_output(stream, 1, &c);
+	}
+}
+
+/**
+ * Runs a command of the shell.
+ *
+ * @param stream stream opened for "shell:".
+ * @param command command, without leading spaces.
+ */
+static void sim_shellCommand(sim_stream * stream, char * command)
+{
+	char line[24];
+	int exitCode = 0;
+	long n, i;
+
+	if (*command == 0) return;
+
+	if (strncmp(command, "stty ", 5) == 0)
+	{
+		if (strstr(command, "-echo") != NULL) stream->echoInput = false;
+	}
+	else if (strncmp(command, "PS1=", 4) == 0)
+		stream->prompt = command[4] != 0;
+	else if (strncmp(command, "printf ", 7) == 0)
+		sim_shellPrintf(stream, command + 7);
+	else if (strncmp(command, "echo ", 5) == 0)
+	{
+		sim_output(stream, strlen(command + 5), command + 5);
+		sim_output(stream, 1, "\n");
+	}
+	else if (strncmp(command, "seq ", 4) == 0)
+	{
+		n = strtol(command + 4, NULL, 10);
+		for (i = 1; i <= n; i++)
+		{
+			snprintf(line, sizeof(line), "%ld\n", i);
+			sim_output(stream, strlen(line), line);
+		}
+	}
+	else if (strcmp(command, "false") == 0)
+		exitCode = 1;
+	else if (strcmp(command, "true") != 0)
+	{
+		sim_output(stream, 4, "sh: ");
+		sim_output(stream, strlen(command), command);
+		sim_output(stream, 12, ": not found\n");
+		exitCode = 127;
+	}
+
+	stream->exitCode = exitCode;
+}
+
+/**
+ * Runs the complete lines in the input of a shell stream.
+ *
+ * @param stream stream opened for "shell:".
+ */
+static void sim_shellLines(sim_stream * stream)
+{
+	uint8_t * end;
+	char line[SIM_MAX_DATA];
+	char * command, * next;
+	uint16_t length;
+
+	while ((end = memchr(stream->input, '\n', stream->inputLength)) != NULL)
+	{
+		length = end - stream->input;
+		if (length >= sizeof(line)) length = sizeof(line) - 1;
+		memcpy(line, stream->input, length);
+		line[length] = 0;
+
+		memmove(stream->input, end + 1, stream->inputLength - (end + 1 - stream->input));
+		stream->inputLength -= end + 1 - stream->input;
+
+		// The terminal echoes the line before the shell runs it.
+		if (stream->echoInput)
+		{
+			sim_output(stream, strlen(line), line);
+			sim_output(stream, 2, "\r\n");
+		}
+
+		for (command = line; command != NULL; command = next)
+		{
+			next = strchr(command, ';');
+			if (next != NULL) *next++ = 0;
+			while (*command == ' ') command++;
+			sim_shellCommand(stream, command);
+		}
+
+		if (stream->prompt) sim_output(stream, 2, "$ ");
+	}
+}
+
+/**
+ * Writes binary log entry i, see the top of this file.
+ *
+ * @param stream stream opened for "exec:logcat -B".
+ * @param i entry number.
+ */
+static void sim_logEntry(sim_stream * stream, uint16_t i)
+{
+	char payload[SIM_LOGCAT_ENTRY_SIZE];
+	uint16_t length, x;
+	uint8_t header[4];
+	boolean v3 = i & 1;
+
+	payload[0] = 2 + i % 6;
+	memcpy(payload + 1, "sim", 4);
+	length = 5 + snprintf(payload + 5, sizeof(payload) - 5, "entry %u ", i);
+	for (x = 0; x < (i * 37u) % 150; x++)
+		payload[length++] = 'x';
+	payload[length++] = 0;
+
+	// Payload length and header size, which is 0 in the original format.
+	header[0] = length;
+	header[1] = length >> 8;
+	header[2] = v3 ? 24 : 0;
+	header[3] = 0;
+	sim_output(stream, sizeof(header), header);
+
+	sim_outputWord(stream, 1000 + i);
+	sim_outputWord(stream, 2000 + i);
+	sim_outputWord(stream, 1600000000u + i);
+	sim_outputWord(stream, i * 1000u);
+	if (v3) sim_outputWord(stream, 3);
+
+	sim_output(stream, length, payload);
+}
+
+/**
+ * Produces the output of a service that doesn't wait for input, as far as the stream has room for it: the file
+ * being pulled through the sync service, and the log entries.
+ *
+ * @param stream stream.
+ */
+static void sim_serve(sim_stream * stream)
+{
+	uint16_t room, chunk;
+
+	switch (stream->service)
+	{
+	case SIM_SERVICE_SYNC:
+		while (stream->pullFile != NULL)
+		{
+			room = sizeof(stream->pending) - stream->pendingLength;
+			if (room < 8) return;
+
+			chunk = stream->pullFile->length - stream->pulled;
+			if (chunk > room - 8) chunk = room - 8;
+
+			// Wait for room for a byte of data at least.
+			if (chunk == 0 && stream->pulled < stream->pullFile->length) return;
+
+			// The end of the file is a DONE.
+			if (chunk == 0)
+			{
+				sim_outputWord(stream, SIM_SYNC_DONE);
+				sim_outputWord(stream, 0);
+				stream->pullFile = NULL;
+				break;
+			}
+
+			sim_outputWord(stream, SIM_SYNC_DATA);
+			sim_outputWord(stream, chunk);
+			sim_output(stream, chunk, stream->pullFile->data + stream->pulled);
+			stream->pulled += chunk;
+		}
+		break;
+
+	case SIM_SERVICE_LOGCAT:
+		while (stream->entries < sim_getConfig()->logcatEntries
+				&& sizeof(stream->pending) - stream->pendingLength >= SIM_LOGCAT_ENTRY_SIZE)
+			sim_logEntry(stream, stream->entries++);
+		break;
+
+	default:
+		break;
+	}
+}
+
+/**
+ * Hands the payload of a WRTE from the host to the service of the stream.
+ *
+ * @param device device.
+ * @param stream stream opened for a service.
+ */
+static void sim_serviceInput(sim_device * device, sim_stream * stream)
+{
+	if (stream->inputLength + device->payloadLength > sizeof(stream->input))
+	{
+		sim_getCounters()->errors++;
+		return;
+	}
+
+	memcpy(stream->input + stream->inputLength, device->payload, device->payloadLength);
+	stream->inputLength += device->payloadLength;
+
+	if (stream->service == SIM_SERVICE_SYNC)
+		sim_syncRequests(device, stream);
+	else if (stream->service == SIM_SERVICE_SHELL)
+		sim_shellLines(stream);
+	else
+		stream->inputLength = 0;
+}
+
+/**
+ * Sets up the service a stream is opened for.
+ *
+ * @param stream stream, just opened.
+ * @param name name of the service from the OPEN, zero terminated.
+ */
+static void sim_openService(sim_stream * stream, const char * name)
+{
+	if (strcmp(name, "sync:") == 0)
+		stream->service = SIM_SERVICE_SYNC;
+	else if (strcmp(name, "shell:") == 0)
+	{
+		stream->service = SIM_SERVICE_SHELL;
+		stream->echoInput = true;
+		stream->prompt = true;
+		sim_output(stream, 8, "sim:/ $ ");
+	}
+	else if (strncmp(name, "exec:logcat -B", 14) == 0)
+		stream->service = SIM_SERVICE_LOGCAT;
+}
+
+/**
+ * Writes pending data of a stream to the host, unless the last write has not been acknowledged yet. Sourced data
+ * is replenished first.
+ *
+ * @param device device.
+ * @param stream stream.
+ */
+static void sim_pump(sim_device * device, sim_stream * stream)
+{
+	uint16_t length, i;
+	uint32_t maxData = device->hostMaxData < SIM_MAX_DATA ? device->hostMaxData : SIM_MAX_DATA;
+
+	if (!stream->open || stream->writing) return;
+
+	sim_serve(stream);
+
+	if (stream->pendingLength == 0 && stream->service == SIM_SERVICE_NONE && sim_getConfig()->source > 0)
+	{
+		for (i = 0; i < sim_getConfig()->source && i < SIM_MAX_DATA; i++)
+			stream->pending[i] = i;
+		stream->pendingLength = i;
+	}
+
+	if (stream->pendingLength == 0) return;
+
+	length = stream->pendingLength < maxData ? stream->pendingLength : maxData;
+	if (sim_getConfig()->split > 0 && length > 1)
+		length = 1 + sim_random() % (length < sim_getConfig()->split ? length : sim_getConfig()->split);
+	if (sim_send(device, A_WRTE, stream - device->streams + 1, stream->hostID, length, stream->pending) == NULL) return;
+
+	memmove(stream->pending, stream->pending + length, stream->pendingLength - length);
+	stream->pendingLength -= length;
+	stream->writing = true;
+
+	if (stream->okayDeferred)
+		sim_acknowledge(device, stream);
+}
+
+/**
+ * Looks up the stream a message from the host is addressed to (by the device's ID in arg1).
+ *
+ * @param device device.
+ * @param message ADB message.
+ * @return the stream, or NULL (and an error is counted) if no such stream is open.
+ */
+static sim_stream * sim_getStream(sim_device * device, adb_message * message)
+{
+	if (message->arg1 >= 1 && message->arg1 <= SIM_STREAMS && device->streams[message->arg1 - 1].open
+			&& device->streams[message->arg1 - 1].hostID == message->arg0)
+		return &device->streams[message->arg1 - 1];
+
+	sim_getCounters()->errors++;
+	return NULL;
+}
+
+/**
+ * Handles a complete message from the host.
+ *
+ * @param device device.
+ */
+static void sim_handleMessage(sim_device * device)
+{
+	sim_stream * stream;
+	uint8_t i;
+
+	sim_getCounters()->messagesIn++;
+
+	switch (device->header.command)
+	{
+	case A_CNXN:
+		// A new session closes all streams.
+		memset(device->streams, 0, sizeof(device->streams));
+		device->hostMaxData = device->header.arg1;
+		device->online = true;
+
+		sim_send(device, A_CNXN, sim_getConfig()->version, sim_getConfig()->maxData, sizeof(identity), (const uint8_t *)identity);
+		break;
+
+	case A_OPEN:
+		if (!device->online) { sim_getCounters()->errors++; break; }
+
+		if (sim_chance(sim_getConfig()->openLossRate))
+		{
+			sim_getCounters()->lostOpens++;
+			break;
+		}
+
+		for (i = 0; i < SIM_STREAMS && device->streams[i].open; i++);
+
+		if (i == SIM_STREAMS)
+		{
+			sim_send(device, A_CLSE, 0, device->header.arg0, 0, NULL);
+			break;
+		}
+
+		memset(&device->streams[i], 0, sizeof(sim_stream));
+		device->streams[i].open = true;
+		device->streams[i].hostID = device->header.arg0;
+
+		device->payload[device->payloadLength < sizeof(device->payload) ? device->payloadLength : sizeof(device->payload) - 1] = 0;
+		sim_openService(&device->streams[i], (const char *)device->payload);
+
+		sim_send(device, A_OKAY, i + 1, device->header.arg0, 0, NULL);
+		sim_pump(device, &device->streams[i]);
+		break;
+
+	case A_OKAY:
+		stream = sim_getStream(device, &device->header);
+		if (stream == NULL) break;
+
+		if (!stream->writing)
+			sim_getCounters()->errors++;
+
+		stream->writing = false;
+		sim_pump(device, stream);
+		break;
+
+	case A_WRTE:
+		stream = sim_getStream(device, &device->header);
+		if (stream == NULL) break;
+
+		// The host may only write again once it has the OKAY for its last write.
+		if (stream->acknowledging || stream->okayDeferred)
+			sim_getCounters()->errors++;
+
+		sim_getCounters()->bytesIn += device->payloadLength;
+
+		if (stream->service != SIM_SERVICE_NONE)
+			sim_serviceInput(device, stream);
+		else if (sim_getConfig()->echo)
+		{
+			if (stream->pendingLength + device->payloadLength > sizeof(stream->pending))
+				sim_getCounters()->errors++;
+			else
+			{
+				memcpy(stream->pending + stream->pendingLength, device->payload, device->payloadLength);
+				stream->pendingLength += device->payloadLength;
+			}
+		}
+
+		sim_acknowledge(device, stream);
+		sim_pump(device, stream);
+		break;
+
+	case A_CLSE:
+		stream = sim_getStream(device, &device->header);
+		if (stream == NULL) break;
+
+		stream->open = false;
+		break;
+
+	default:
+		sim_getCounters()->errors++;
+		break;
+	}
+}
+
+/**
+ * Takes in a packet on the OUT endpoint: either a message header, or part of the payload of the last header.
+ *
+ * @param device device.
+ * @param data packet data.
+ * @param length packet length.
+ */
+static void sim_receive(sim_device * device, uint8_t * data, uint8_t length)
+{
+	uint32_t sum = 0;
+	uint16_t i;
+
+	if (!device->headerReceived)
+	{
+		if (length != sizeof(adb_message))
+		{
+			sim_getCounters()->errors++;
+			return;
+		}
+
+		memcpy(&device->header, data, sizeof(adb_message));
+		device->payloadLength = 0;
+
+		if (device->header.magic != (device->header.command ^ 0xffffffff) || device->header.data_length > sim_getConfig()->maxData)
+		{
+			sim_getCounters()->errors++;
+			return;
+		}
+
+		device->headerReceived = true;
+	}
+	else
+	{
+		if (device->payloadLength + length > device->header.data_length)
+		{
+			// Without a header for it, this is garbage. Start over.
+			sim_getCounters()->errors++;
+			device->headerReceived = false;
+			return;
+		}
+
+		memcpy(device->payload + device->payloadLength, data, length);
+		device->payloadLength += length;
+	}
+
+	if (device->payloadLength < device->header.data_length) return;
+
+	device->headerReceived = false;
+
+	// Hosts only send checksums to devices that have not told them to skip them.
+	if (sim_getConfig()->version < A_VERSION_SKIP_CHECKSUM)
+	{
+		for (i = 0; i < device->payloadLength; i++)
+			sum += device->payload[i];
+
+		if (sum != device->header.data_check)
+		{
+			sim_getCounters()->errors++;
+			return;
+		}
+	}
+
+	sim_handleMessage(device);
+}
+
+/**
+ * Returns a device to address 0, unconfigured, and ends its ADB session.
+ *
+ * @param device device.
+ */
+static void sim_reset(sim_device * device)
+{
+	device->address = 0;
+	device->newAddress = 0;
+	device->configuration = 0;
+	device->controlLength = device->controlSent = 0;
+	device->outToggle = device->inToggle = 0;
+
+	device->headerReceived = false;
+	device->queueHead = device->queueLength = 0;
+	device->online = false;
+	memset(device->streams, 0, sizeof(device->streams));
+
+	device->accessoryStrings = 0;
+	device->starting = false;
+	device->rawLength = 0;
+}
+
+/**
+ * Brings back the devices that are due to come back in accessory mode, called as the simulated clock advances.
+ */
+void sim_deviceTick()
+{
+	uint8_t i;
+
+	if (!sim_getConfig()->accessory) return;
+
+	for (i = 0; i < sim_getConfig()->devices; i++)
+		if (devices[i].switchTime != 0 && sim_now() >= devices[i].switchTime)
+		{
+			devices[i].switchTime = 0;
+			sim_plugDevice(i, true);
+		}
+}
+
+/**
+ * Finds the device a transaction is addressed to, among those that see it: the device on the root port, or with a
+ * hub, the devices on enabled hub ports.
+ *
+ * @param target address the transaction was sent to.
+ * @return the device, or NULL if none answers at that address.
+ */
+static sim_device * sim_select(uint8_t target)
+{
+	uint8_t i;
+
+	if (sim_getConfig()->devices <= 1)
+		return devices[0].attached && devices[0].address == target ? &devices[0] : NULL;
+
+	for (i = 0; i < sim_getConfig()->devices; i++)
+		if (devices[i].attached && sim_hubIsPortEnabled(i + 1) && devices[i].address == target)
+			return &devices[i];
+
+	return NULL;
+}
+
+/**
+ * Sets up the devices of a new simulation, all plugged in and waiting for the root port to come up (see sim_plug).
+ */
+void sim_deviceInit()
+{
+	uint8_t i;
+
+	memset(devices, 0, sizeof(devices));
+	for (i = 0; i < sim_getConfig()->devices; i++)
+		devices[i].attached = true;
+}
+
+/**
+ * Plugs whatever is on the root port in or out: the device, or with several devices, the hub they are behind. The
+ * controller raises CONDETIRQ, and a device that is plugged out loses its state.
+ *
+ * @param plugged true to plug in.
+ */
+void sim_plug(boolean plugged)
+{
+	uint8_t i;
+
+	// Plugged out, a phone leaves accessory mode.
+	if (!plugged)
+		for (i = 0; i < sim_getConfig()->devices; i++)
+			devices[i].accessory = false;
+
+	if (sim_getConfig()->devices > 1)
+		sim_hubPlug(plugged);
+	else
+		devices[0].attached = plugged;
+
+	sim_deviceReset();
+	sim_busEvent();
+}
+
+/**
+ * Plugs one device in or out. Behind a hub, the hub reports the connection change on the port of the device.
+ *
+ * @param index device number, less than sim_config.devices.
+ * @param plugged true to plug the device in.
+ */
+void sim_plugDevice(uint8_t index, boolean plugged)
+{
+	if (sim_getConfig()->devices <= 1)
+	{
+		sim_plug(plugged);
+		return;
+	}
+
+	devices[index].attached = plugged;
+	if (!plugged) devices[index].accessory = false;
+	sim_reset(&devices[index]);
+	sim_hubPortEvent(index + 1);
+}
+
+/**
+ * @return true iff there is something plugged into the root port.
+ */
+boolean sim_isAttached()
+{
+	return sim_getConfig()->devices > 1 ? sim_hubIsAttached() : devices[0].attached;
+}
+
+/**
+ * @param index device number.
+ * @return true iff the device is plugged in.
+ */
+boolean sim_isDeviceAttached(uint8_t index)
+{
+	return devices[index].attached;
+}
+
+/**
+ * Handles a bus reset on the root port.
+ */
+void sim_deviceReset()
+{
+	if (sim_getConfig()->devices > 1)
+		sim_hubReset();
+	else
+		sim_reset(&devices[0]);
+}
+
+/**
+ * Handles a reset of the hub port a device is on.
+ *
+ * @param index device number.
+ */
+void sim_devicePortReset(uint8_t index)
+{
+	sim_reset(&devices[index]);
+}
+
+/**
+ * Handles a SETUP packet on the control endpoint.
+ *
+ * @param target address the packet was sent to.
+ * @param packet the 8 byte setup packet.
+ * @return result code for the controller.
+ */
+uint8_t sim_deviceSetup(uint8_t target, uint8_t * packet)
+{
+	uint8_t requestType = packet[0], request = packet[1];
+	uint8_t index = packet[2], type = packet[3];
+	uint16_t length = packet[6] | (packet[7] << 8);
+	const uint8_t * data = NULL;
+	uint8_t size = 0;
+	sim_device * device;
+
+	if (sim_hubIsAddressed(target)) return sim_hubSetup(packet);
+
+	device = sim_select(target);
+	if (device == NULL) return hrTIMEOUT;
+
+	device->controlLength = device->controlSent = 0;
+
+	if (requestType == (bmREQ_GET_DESCR) && request == USB_REQUEST_GET_DESCRIPTOR)
+	{
+		switch (type)
+		{
+		case USB_DESCRIPTOR_DEVICE:
+			data = device->accessory ? accessoryDeviceDescriptor : deviceDescriptor;
+			size = sizeof(deviceDescriptor);
+			break;
+		case USB_DESCRIPTOR_CONFIGURATION:
+			if (index != 0) return hrSTALL;
+			data = device->accessory ? accessoryConfigurationDescriptor : configurationDescriptor;
+			size = sizeof(configurationDescriptor);
+			break;
+		case USB_DESCRIPTOR_STRING:
+			if (index != 0) return hrSTALL;
+			data = languages;
+			size = sizeof(languages);
+			break;
+		default:
+			return hrSTALL;
+		}
+
+		device->controlLength = size < length ? size : length;
+		memcpy(device->control, data, device->controlLength);
+	}
+	else if (requestType == (bmREQ_SET) && request == USB_REQUEST_SET_ADDRESS)
+		device->newAddress = index;
+	else if (requestType == (bmREQ_SET) && request == USB_REQUEST_SET_CONFIGURATION)
+	{
+		device->configuration = index;
+		device->outToggle = device->inToggle = 0;
+	}
+	else if (sim_getConfig()->accessory && !device->accessory && requestType == (USB_SETUP_DEVICE_TO_HOST | USB_SETUP_TYPE_VENDOR)
+			&& request == SIM_AOA_GET_PROTOCOL)
+	{
+		device->control[0] = SIM_AOA_VERSION;
+		device->control[1] = 0;
+		device->controlLength = length < 2 ? length : 2;
+	}
+	else if (sim_getConfig()->accessory && !device->accessory && requestType == (USB_SETUP_HOST_TO_DEVICE | USB_SETUP_TYPE_VENDOR)
+			&& request == SIM_AOA_SEND_STRING && packet[4] < 8)
+		device->accessoryStrings |= 1 << packet[4];
+	else if (sim_getConfig()->accessory && !device->accessory && requestType == (USB_SETUP_HOST_TO_DEVICE | USB_SETUP_TYPE_VENDOR)
+			&& request == SIM_AOA_START)
+	{
+		// A phone needs at least the manufacturer and model to pick an app.
+		if ((device->accessoryStrings & 0x03) != 0x03) return hrSTALL;
+		device->starting = true;
+	}
+	else
+		return hrSTALL;
+
+	return hrSUCCESS;
+}
+
+/**
+ * Handles the status stage of a control transfer. A new address takes effect here.
+ *
+ * @param target address the handshake was sent to.
+ * @return result code for the controller.
+ */
+uint8_t sim_deviceStatus(uint8_t target)
+{
+	sim_device * device;
+
+	if (sim_hubIsAddressed(target)) return sim_hubStatus();
+
+	device = sim_select(target);
+	if (device == NULL) return hrTIMEOUT;
+
+	device->address = device->newAddress;
+
+	// Started, the phone drops off the bus to come back in accessory mode.
+	if (device->starting)
+	{
+		sim_plugDevice(device - devices, false);
+		device->accessory = true;
+		device->switchTime = sim_now() + SIM_ACCESSORY_SWITCH_TIME;
+		sim_getCounters()->accessorySwitches++;
+	}
+
+	return hrSUCCESS;
+}
+
+/**
+ * Handles an IN token. The packet is not consumed until sim_deviceAck, so a packet that is lost on the bus is
+ * sent again.
+ *
+ * @param target address the token was sent to.
+ * @param endpoint endpoint number.
+ * @param data receives the packet.
+ * @param length receives the packet length.
+ * @param toggle receives the data toggle of the packet.
+ * @return result code for the controller.
+ */
+uint8_t sim_deviceIn(uint8_t target, uint8_t endpoint, uint8_t * data, uint8_t * length, uint8_t * toggle)
+{
+	sim_device * device;
+	sim_message * message;
+	uint16_t offset, size;
+
+	if (sim_hubIsAddressed(target)) return sim_hubIn(endpoint, data, length, toggle);
+
+	device = sim_select(target);
+	if (device == NULL) return hrTIMEOUT;
+
+	if (endpoint == 0)
+	{
+		size = device->controlLength - device->controlSent;
+		*length = size < SIM_PACKET_SIZE ? size : SIM_PACKET_SIZE;
+		memcpy(data, device->control + device->controlSent, *length);
+		*toggle = 1;
+		return hrSUCCESS;
+	}
+
+	if (endpoint != SIM_ENDPOINT_IN || device->configuration == 0) return hrSTALL;
+
+	if (device->accessory)
+	{
+		if (device->rawLength == 0) return hrNAK;
+
+		*length = device->rawLength < SIM_PACKET_SIZE ? device->rawLength : SIM_PACKET_SIZE;
+		memcpy(data, device->raw, *length);
+		*toggle = device->inToggle;
+		return hrSUCCESS;
+	}
+
+	message = &device->queue[device->queueHead];
+	if (device->queueLength == 0 || sim_now() < message->readyTime) return hrNAK;
+
+	// The header is a packet of its own.
+	if (message->sent == 0)
+	{
+		memcpy(data, &message->header, sizeof(adb_message));
+		*length = sizeof(adb_message);
+	}
+	else
+	{
+		offset = message->sent - sizeof(adb_message);
+		size = message->length - message->sent;
+		*length = size < SIM_PACKET_SIZE ? size : SIM_PACKET_SIZE;
+		memcpy(data, message->data + offset, *length);
+	}
+
+	*toggle = device->inToggle;
+
+	return hrSUCCESS;
+}
+
+/**
+ * Consumes the packet returned by the last sim_deviceIn, which the host acknowledged.
+ *
+ * @param target address the token was sent to.
+ * @param endpoint endpoint number.
+ */
+void sim_deviceAck(uint8_t target, uint8_t endpoint)
+{
+	sim_device * device;
+	sim_message * message;
+	uint16_t size;
+
+	if (sim_hubIsAddressed(target))
+	{
+		sim_hubAck(endpoint);
+		return;
+	}
+
+	device = sim_select(target);
+	if (device == NULL) return;
+
+	message = &device->queue[device->queueHead];
+
+	if (endpoint == 0)
+	{
+		size = device->controlLength - device->controlSent;
+		device->controlSent += size < SIM_PACKET_SIZE ? size : SIM_PACKET_SIZE;
+		return;
+	}
+
+	device->inToggle ^= 1;
+
+	if (device->accessory)
+	{
+		size = device->rawLength < SIM_PACKET_SIZE ? device->rawLength : SIM_PACKET_SIZE;
+		memmove(device->raw, device->raw + size, device->rawLength - size);
+		device->rawLength -= size;
+		return;
+	}
+
+	size = message->sent == 0 ? sizeof(adb_message) : message->length - message->sent;
+	message->sent += message->sent == 0 ? size : (size < SIM_PACKET_SIZE ? size : SIM_PACKET_SIZE);
+
+	if (message->sent < message->length) return;
+
+	// Delivered. The host may write again once it has the OKAY.
+	if (message->okayFor != 0)
+		device->streams[message->okayFor - 1].acknowledging = false;
+
+	device->queueHead = (device->queueHead + 1) % SIM_QUEUE_SIZE;
+	device->queueLength--;
+}
+
+/**
+ * Handles an OUT packet. A packet with an unexpected toggle is a retransmission of one that was received already,
+ * it is acknowledged but dropped.
+ *
+ * @param target address the packet was sent to.
+ * @param endpoint endpoint number.
+ * @param toggle data toggle of the packet.
+ * @param data packet data.
+ * @param length packet length.
+ * @return result code for the controller.
+ */
+uint8_t sim_deviceOut(uint8_t target, uint8_t endpoint, uint8_t toggle, uint8_t * data, uint8_t length)
+{
+	sim_device * device;
+
+	if (sim_hubIsAddressed(target)) return sim_hubOut(endpoint);
+
+	device = sim_select(target);
+	if (device == NULL) return hrTIMEOUT;
+
+	// Control OUT data stages are not used by the stack.
+	if (endpoint == 0) return hrSUCCESS;
+
+	if (endpoint != SIM_ENDPOINT_OUT || device->configuration == 0) return hrSTALL;
+
+	// In accessory mode, a full buffer holds the host off.
+	if (device->accessory && toggle == device->outToggle && device->rawLength + length > sizeof(device->raw))
+		return hrNAK;
+
+	if (toggle != device->outToggle)
+	{
+		sim_getCounters()->duplicates++;
+		return hrSUCCESS;
+	}
+
+	device->outToggle ^= 1;
+
+	if (device->accessory)
+	{
+		if (length == 0) sim_getCounters()->zeroLengthPackets++;
+		memcpy(device->raw + device->rawLength, data, length);
+		device->rawLength += length;
+		return hrSUCCESS;
+	}
+
+	sim_receive(device, data, length);
+
+	return hrSUCCESS;
+}
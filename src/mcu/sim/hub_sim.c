@@ -0,0 +1,405 @@
+/*
+Copyright 2011 Niels Brouwers
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+/**
+ * Simulated USB hub for the host build, on the root port when the simulation has more than one Android device. It
+ * has one downstream port per device, with individual port power, and reports port status changes on its interrupt
+ * IN endpoint (endpoint 1), which NAKs while nothing has changed. A port reset takes SIM_HUB_RESET_TIME, after
+ * which the device on the port is enabled and answers at address 0.
+ */
+
+#include <string.h>
+
+#include "../ch9.h"
+#include "../max3421e/max3421e_usb.h"
+#include "sim.h"
+
+#define SIM_HUB_PACKET_SIZE 64
+#define SIM_HUB_ENDPOINT 1
+
+// Duration of a port reset in nanoseconds.
+#define SIM_HUB_RESET_TIME 10000000
+
+/**
+ * Downstream port.
+ */
+typedef struct
+{
+	boolean powered, enabled;
+
+	// Port reset in progress, and the time it completes.
+	boolean resetting;
+	uint64_t resetDone;
+
+	// wPortChange bits.
+	uint16_t change;
+
+} sim_port;
+
+static const uint8_t deviceDescriptor[] =
+{
+	18, USB_DESCRIPTOR_DEVICE, 0x00, 0x02, USB_CLASS_HUB, 0x00, 0x00, SIM_HUB_PACKET_SIZE,
+	0x24, 0x04, 0x14, 0x25, 0x00, 0x01, 0, 0, 0, 1
+};
+
+static const uint8_t configurationDescriptor[] =
+{
+	9, USB_DESCRIPTOR_CONFIGURATION, 25, 0, 1, 1, 0, 0xe0, 1,
+	9, USB_DESCRIPTOR_INTERFACE, 0, 0, 1, USB_CLASS_HUB, 0, 0, 0,
+	7, USB_DESCRIPTOR_ENDPOINT, 0x80 | SIM_HUB_ENDPOINT, USB_TRANSFER_TYPE_INTERRUPT, 1, 0, 12
+};
+
+static boolean attached;
+
+// USB address, and the address set by SET_ADDRESS that takes effect after its status stage.
+static uint8_t address, newAddress;
+static uint8_t configuration;
+
+// Data stage of the last control request.
+static uint8_t control[64];
+static uint8_t controlLength, controlSent;
+
+// Data toggle sent on the status change endpoint.
+static uint8_t inToggle;
+
+static sim_port ports[SIM_MAX_DEVICES];
+
+/**
+ * Completes the port resets whose time is up. The device on the port is enabled, at address 0.
+ */
+static void sim_hubUpdate()
+{
+	uint8_t i;
+
+	for (i = 0; i < sim_getConfig()->devices; i++)
+		if (ports[i].resetting && sim_now() >= ports[i].resetDone)
+		{
+			ports[i].resetting = false;
+			ports[i].enabled = sim_isDeviceAttached(i);
+			ports[i].change |= bmHUB_PORT_C_RESET;
+		}
+}
+
+/**
+ * @param port port number, 1 based.
+ * @return wPortStatus of the port.
+ */
+static uint16_t sim_hubPortStatus(uint8_t port)
+{
+	sim_port * state = &ports[port - 1];
+	uint16_t status = 0;
+
+	if (state->powered)
+	{
+		status |= bmHUB_PORT_POWER;
+		if (sim_isDeviceAttached(port - 1)) status |= bmHUB_PORT_CONNECTION;
+	}
+
+	if (state->enabled) status |= bmHUB_PORT_ENABLE;
+	if (state->resetting) status |= bmHUB_PORT_RESET;
+
+	return status;
+}
+
+/**
+ * Handles a port request: GET_STATUS, SET_FEATURE and CLEAR_FEATURE.
+ *
+ * @param request request code.
+ * @param feature feature selector (wValue).
+ * @param port port number (wIndex).
+ * @return result code for the controller.
+ */
+static uint8_t sim_hubPortRequest(uint8_t request, uint8_t feature, uint16_t port)
+{
+	sim_port * state;
+	uint16_t status;
+
+	if (port < 1 || port > sim_getConfig()->devices) return hrSTALL;
+	state = &ports[port - 1];
+
+	switch (request)
+	{
+	case USB_REQUEST_GET_STATUS:
+		status = sim_hubPortStatus(port);
+		control[0] = status;
+		control[1] = status >> 8;
+		control[2] = state->change;
+		control[3] = state->change >> 8;
+		controlLength = 4;
+		break;
+
+	case USB_REQUEST_SET_FEATURE:
+		if (feature == HUB_FEATURE_PORT_POWER)
+		{
+			if (!state->powered && sim_isDeviceAttached(port - 1))
+				state->change |= bmHUB_PORT_C_CONNECTION;
+			state->powered = true;
+		}
+		else if (feature == HUB_FEATURE_PORT_RESET)
+		{
+			if (!state->powered || !sim_isDeviceAttached(port - 1)) break;
+
+			state->enabled = false;
+			state->resetting = true;
+			state->resetDone = sim_now() + SIM_HUB_RESET_TIME;
+			sim_devicePortReset(port - 1);
+		}
+		else
+			return hrSTALL;
+		break;
+
+	case USB_REQUEST_CLEAR_FEATURE:
+		switch (feature)
+		{
+		case HUB_FEATURE_PORT_ENABLE: state->enabled = false; break;
+		case HUB_FEATURE_PORT_POWER: state->powered = state->enabled = false; break;
+		case HUB_FEATURE_C_PORT_CONNECTION: state->change &= ~bmHUB_PORT_C_CONNECTION; break;
+		case HUB_FEATURE_C_PORT_ENABLE: state->change &= ~bmHUB_PORT_C_ENABLE; break;
+		case HUB_FEATURE_C_PORT_RESET: state->change &= ~bmHUB_PORT_C_RESET; break;
+		default: return hrSTALL;
+		}
+		break;
+
+	default:
+		return hrSTALL;
+	}
+
+	return hrSUCCESS;
+}
+
+/**
+ * Plugs the hub into the root port, or out of it.
+ *
+ * @param plugged true to plug the hub in.
+ */
+void sim_hubPlug(boolean plugged)
+{
+	attached = plugged;
+}
+
+/**
+ * @return true iff the hub is plugged in.
+ */
+boolean sim_hubIsAttached()
+{
+	return attached;
+}
+
+/**
+ * Handles a bus reset: the hub returns to address 0, unconfigured, and powers down its ports, which resets the
+ * devices on them.
+ */
+void sim_hubReset()
+{
+	uint8_t i;
+
+	address = 0;
+	newAddress = 0;
+	configuration = 0;
+	controlLength = controlSent = 0;
+	inToggle = 0;
+
+	memset(ports, 0, sizeof(ports));
+	for (i = 0; i < sim_getConfig()->devices; i++)
+		sim_devicePortReset(i);
+}
+
+/**
+ * Reports that a device was plugged into or out of a port.
+ *
+ * @param port port number, 1 based.
+ */
+void sim_hubPortEvent(uint8_t port)
+{
+	sim_port * state = &ports[port - 1];
+
+	if (!state->powered) return;
+
+	state->change |= bmHUB_PORT_C_CONNECTION;
+	state->enabled = false;
+	state->resetting = false;
+}
+
+/**
+ * @param port port number, 1 based.
+ * @return true iff the device on the port is enabled, and so takes part in bus traffic.
+ */
+boolean sim_hubIsPortEnabled(uint8_t port)
+{
+	sim_hubUpdate();
+
+	return ports[port - 1].enabled;
+}
+
+/**
+ * @param target address a transaction was sent to.
+ * @return true iff the transaction is for the hub.
+ */
+boolean sim_hubIsAddressed(uint8_t target)
+{
+	return attached && target == address;
+}
+
+/**
+ * Handles a SETUP packet on the control endpoint of the hub.
+ *
+ * @param packet the 8 byte setup packet.
+ * @return result code for the controller.
+ */
+uint8_t sim_hubSetup(uint8_t * packet)
+{
+	uint8_t requestType = packet[0], request = packet[1];
+	uint8_t index = packet[2], type = packet[3];
+	uint16_t port = packet[4] | (packet[5] << 8);
+	uint16_t length = packet[6] | (packet[7] << 8);
+	const uint8_t * data = NULL;
+	uint8_t size = 0;
+
+	sim_hubUpdate();
+	controlLength = controlSent = 0;
+
+	if (requestType == (bmREQ_GET_DESCR) && request == USB_REQUEST_GET_DESCRIPTOR)
+	{
+		switch (type)
+		{
+		case USB_DESCRIPTOR_DEVICE:
+			data = deviceDescriptor;
+			size = sizeof(deviceDescriptor);
+			break;
+		case USB_DESCRIPTOR_CONFIGURATION:
+			if (index != 0) return hrSTALL;
+			data = configurationDescriptor;
+			size = sizeof(configurationDescriptor);
+			break;
+		default:
+			return hrSTALL;
+		}
+
+		controlLength = size < length ? size : length;
+		memcpy(control, data, controlLength);
+	}
+	else if (requestType == (bmREQ_HUB_GET_DESCR) && request == USB_REQUEST_GET_DESCRIPTOR && type == USB_DESCRIPTOR_HUB)
+	{
+		// Individual port power switching and overcurrent protection, 20 ms from power on to power good, no
+		// removable devices.
+		control[0] = 9;
+		control[1] = USB_DESCRIPTOR_HUB;
+		control[2] = sim_getConfig()->devices;
+		control[3] = 0x09;
+		control[4] = 0x00;
+		control[5] = 10;
+		control[6] = 100;
+		control[7] = 0x00;
+		control[8] = 0xff;
+		controlLength = length < 9 ? length : 9;
+	}
+	else if (requestType == (bmREQ_PORT_GET_STATUS) || requestType == (bmREQ_PORT_FEATURE))
+		return sim_hubPortRequest(request, index, port);
+	else if (requestType == (bmREQ_SET) && request == USB_REQUEST_SET_ADDRESS)
+		newAddress = index;
+	else if (requestType == (bmREQ_SET) && request == USB_REQUEST_SET_CONFIGURATION)
+	{
+		configuration = index;
+		inToggle = 0;
+	}
+	else
+		return hrSTALL;
+
+	return hrSUCCESS;
+}
+
+/**
+ * Handles the status stage of a control transfer to the hub. A new address takes effect here.
+ *
+ * @return result code for the controller.
+ */
+uint8_t sim_hubStatus()
+{
+	address = newAddress;
+
+	return hrSUCCESS;
+}
+
+/**
+ * Handles an IN token to the hub: the data stage of a control request, or the status change bitmap, with one bit
+ * per port (bit 0 is the hub itself).
+ *
+ * @param endpoint endpoint number.
+ * @param data receives the packet.
+ * @param length receives the packet length.
+ * @param toggle receives the data toggle of the packet.
+ * @return result code for the controller.
+ */
+uint8_t sim_hubIn(uint8_t endpoint, uint8_t * data, uint8_t * length, uint8_t * toggle)
+{
+	uint8_t changes = 0, i;
+	uint16_t size;
+
+	if (endpoint == 0)
+	{
+		size = controlLength - controlSent;
+		*length = size < SIM_HUB_PACKET_SIZE ? size : SIM_HUB_PACKET_SIZE;
+		memcpy(data, control + controlSent, *length);
+		*toggle = 1;
+		return hrSUCCESS;
+	}
+
+	if (endpoint != SIM_HUB_ENDPOINT || configuration == 0) return hrSTALL;
+
+	sim_hubUpdate();
+
+	for (i = 0; i < sim_getConfig()->devices; i++)
+		if (ports[i].change != 0)
+			changes |= 1 << (i + 1);
+
+	if (changes == 0) return hrNAK;
+
+	data[0] = changes;
+	*length = 1;
+	*toggle = inToggle;
+
+	return hrSUCCESS;
+}
+
+/**
+ * Consumes the packet returned by the last sim_hubIn, which the host acknowledged.
+ *
+ * @param endpoint endpoint number.
+ */
+void sim_hubAck(uint8_t endpoint)
+{
+	uint16_t size;
+
+	if (endpoint == 0)
+	{
+		size = controlLength - controlSent;
+		controlSent += size < SIM_HUB_PACKET_SIZE ? size : SIM_HUB_PACKET_SIZE;
+		return;
+	}
+
+	inToggle ^= 1;
+}
+
+/**
+ * Handles an OUT packet to the hub. Only control requests without a data stage are used.
+ *
+ * @param endpoint endpoint number.
+ * @return result code for the controller.
+ */
+uint8_t sim_hubOut(uint8_t endpoint)
+{
+	return endpoint == 0 ? hrSUCCESS : hrSTALL;
+}
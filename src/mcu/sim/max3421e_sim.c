@@ -0,0 +1,433 @@
+/*
+Copyright 2011 Niels Brouwers
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+/**
+ * Simulated max3421e, implementing the register access layer of the max3421e library (see max3421e.h) for the
+ * host build. It models the registers the stack uses, the SEND, SETUP and the two RECEIVE FIFOs, the data toggles,
+ * the interrupt flags and the INT pin, and runs host transactions against the device model in device_sim.c.
+ *
+ * Each register access costs its SPI transfer time. A transaction takes its USB bus time and completes with
+ * HXFRDNIRQ once that has passed, so the stack sees the same sequence of busy, NAK and done states as on the
+ * real chip. NAKs and packet losses (see sim_config) only apply to the bulk endpoints, control transfers always
+ * go through.
+ */
+
+#include <string.h>
+
+#include "../max3421e/max3421e.h"
+#include "sim.h"
+
+// Fixed cost of a register access (chip select and call overhead), and of sampling a pin, in nanoseconds.
+#define SIM_ACCESS_COST 1000
+#define SIM_PIN_COST 250
+
+// Fixed cost of a USB transaction (token, handshake, turnaround) and cost per payload byte at 12 Mbit/s.
+#define SIM_TRANSACTION_COST 5000
+#define SIM_BYTE_COST 667
+
+// Time a bus reset takes, and the frame period.
+#define SIM_BUS_RESET_TIME 10000000
+#define SIM_FRAME_TIME 1000000
+
+#define REG(r) registers[(r) >> 3]
+
+static uint8_t registers[32];
+
+// FIFOs and their read/write positions. The receive FIFO is double buffered: the CPU reads one while the other
+// takes the next packet, and clearing RCVDAVIRQ hands over to the other one.
+static uint8_t sendFifo[64], sendPosition, sendCount;
+static uint8_t receiveFifo[2][64], receiveCount[2], receivePosition, receiveCpu;
+static boolean receiveFull[2];
+static uint8_t setupFifo[8], setupPosition;
+
+// Data toggles the controller sends and expects next (0 or 1).
+static uint8_t sendToggle, receiveToggle;
+
+// Transaction in flight, its outcome, and when it completes.
+static boolean busy;
+static uint64_t doneTime;
+static uint8_t result;
+static boolean received;
+static uint8_t receivedData[64], receivedLength;
+
+static uint64_t busResetDone;
+static uint64_t nextFrame;
+
+/**
+ * Charges the SPI time of a register access.
+ *
+ * @param count number of data bytes.
+ */
+static void max3421e_simTransfer(uint8_t count)
+{
+	sim_advance(SIM_ACCESS_COST + (uint64_t)(count + 1) * 8 * 1000000000 / sim_getConfig()->spiClock);
+}
+
+/**
+ * Brings the interrupt flags up to date with the simulated clock: completes the transaction in flight when its
+ * time is up, and raises FRAMEIRQ once per frame while SOF generation is on.
+ */
+static void max3421e_simUpdate()
+{
+	uint64_t now = sim_now();
+	uint8_t fifo;
+
+	if (busy && now >= doneTime)
+	{
+		busy = false;
+
+		if (received)
+		{
+			// Into the FIFO the CPU is on if that one is free, the other one otherwise.
+			fifo = receiveFull[receiveCpu] ? receiveCpu ^ 1 : receiveCpu;
+
+			memcpy(receiveFifo[fifo], receivedData, receivedLength);
+			receiveCount[fifo] = receivedLength;
+			receiveFull[fifo] = true;
+			received = false;
+
+			if (fifo == receiveCpu)
+			{
+				receivePosition = 0;
+				REG(MAX_REG_HIRQ) |= bmRCVDAVIRQ;
+			}
+		}
+
+		REG(MAX_REG_HIRQ) |= bmHXFRDNIRQ | bmSNDBAVIRQ;
+	}
+
+	if (REG(MAX_REG_MODE) & bmSOFKAENAB)
+	{
+		if (now >= nextFrame)
+		{
+			REG(MAX_REG_HIRQ) |= bmFRAMEIRQ;
+			nextFrame = (now / SIM_FRAME_TIME + 1) * SIM_FRAME_TIME;
+		}
+	}
+	else
+		nextFrame = 0;
+}
+
+/**
+ * @return the value of the HRSL register.
+ */
+static uint8_t max3421e_simHrsl()
+{
+	uint8_t hrsl = busy ? hrBUSY : result;
+
+	if (receiveToggle) hrsl |= bmRCVTOGRD;
+	if (sendToggle) hrsl |= bmSNDTOGRD;
+	if (sim_isAttached()) hrsl |= bmJSTATUS;
+
+	return hrsl;
+}
+
+/**
+ * Runs a host transaction, launched by writing HXFR. The outcome is settled right away, but only becomes visible
+ * when the transaction completes.
+ *
+ * @param value value written to HXFR, token and endpoint.
+ */
+static void max3421e_simLaunch(uint8_t value)
+{
+	uint8_t token = value & 0xf0, endpoint = value & 0x0f;
+	uint8_t address = REG(MAX_REG_PERADDR);
+	uint8_t length = 0, toggle;
+	boolean bulk = endpoint != 0;
+	sim_counters * counters = sim_getCounters();
+	sim_config * config = sim_getConfig();
+
+	if (bulk) counters->transactions++;
+
+	if (!sim_isAttached())
+		result = hrTIMEOUT;
+	else if (bulk && sim_chance(config->nakRate))
+	{
+		counters->naks++;
+		result = hrNAK;
+	}
+	else switch (token)
+	{
+	case tokSETUP:
+		result = sim_deviceSetup(address, setupFifo);
+		length = sizeof(setupFifo);
+		setupPosition = 0;
+		break;
+
+	case tokINHS:
+	case tokOUTHS:
+		result = sim_deviceStatus(address);
+		break;
+
+	case tokIN:
+		// An IN with both receive FIFOs still full would overwrite a packet the CPU has not read.
+		if (receiveFull[0] && receiveFull[1])
+		{
+			counters->errors++;
+			result = hrBADREQ;
+			break;
+		}
+
+		result = sim_deviceIn(address, endpoint, receivedData, &receivedLength, &toggle);
+		if (result != hrSUCCESS)
+		{
+			if (result == hrNAK) counters->naks++;
+			break;
+		}
+
+		length = receivedLength;
+
+		// A lost data packet is not acknowledged, so the device sends it again.
+		if (bulk && sim_chance(config->lossRate))
+		{
+			counters->losses++;
+			result = hrTIMEOUT;
+			break;
+		}
+
+		// The controller acknowledges a packet with the wrong toggle but drops it.
+		sim_deviceAck(address, endpoint);
+		if (bulk && toggle != receiveToggle)
+		{
+			result = hrTOGERR;
+			break;
+		}
+
+		receiveToggle ^= 1;
+		received = true;
+		break;
+
+	case tokOUT:
+		length = sendCount;
+
+		if (bulk && sim_chance(config->lossRate))
+		{
+			counters->losses++;
+			result = hrTIMEOUT;
+			break;
+		}
+
+		result = sim_deviceOut(address, endpoint, sendToggle, sendFifo, sendCount);
+		if (result == hrSUCCESS)
+			sendToggle ^= 1;
+		else if (result == hrNAK)
+			counters->naks++;
+		break;
+
+	default:
+		result = hrBADREQ;
+		break;
+	}
+
+	busy = true;
+	doneTime = sim_now() + SIM_TRANSACTION_COST + (uint64_t)length * SIM_BYTE_COST;
+}
+
+/**
+ * Handles a register write.
+ *
+ * @param reg register address.
+ * @param value value written.
+ */
+static void max3421e_simWrite(uint8_t reg, uint8_t value)
+{
+	switch (reg)
+	{
+	case MAX_REG_SNDFIFO:
+		sendFifo[sendPosition++ & 0x3f] = value;
+		break;
+
+	case MAX_REG_SUDFIFO:
+		setupFifo[setupPosition++ & 0x07] = value;
+		break;
+
+	case MAX_REG_SNDBC:
+		// Commits the FIFO contents, the next byte written goes to the start of the FIFO.
+		sendCount = value > sizeof(sendFifo) ? sizeof(sendFifo) : value;
+		sendPosition = 0;
+		break;
+
+	case MAX_REG_USBCTL:
+		if (value & bmCHIPRES)
+			max3421e_init();
+		break;
+
+	case MAX_REG_HIRQ:
+		// Interrupt flags are cleared by writing a one, except SNDBAVIRQ.
+		if ((value & bmRCVDAVIRQ) && (REG(MAX_REG_HIRQ) & bmRCVDAVIRQ))
+		{
+			// Release the FIFO the CPU was reading and move on to the other one.
+			receiveFull[receiveCpu] = false;
+			receiveCpu ^= 1;
+			receivePosition = 0;
+		}
+
+		REG(MAX_REG_HIRQ) &= ~(value & ~bmSNDBAVIRQ);
+		if (receiveFull[receiveCpu])
+			REG(MAX_REG_HIRQ) |= bmRCVDAVIRQ;
+		break;
+
+	case MAX_REG_HCTL:
+		if (value & bmBUSRST)
+		{
+			sim_deviceReset();
+			sim_getCounters()->resets++;
+			busResetDone = sim_now() + SIM_BUS_RESET_TIME;
+		}
+
+		if (value & bmRCVTOG0) receiveToggle = 0;
+		if (value & bmRCVTOG1) receiveToggle = 1;
+		if (value & bmSNDTOG0) sendToggle = 0;
+		if (value & bmSNDTOG1) sendToggle = 1;
+		break;
+
+	case MAX_REG_HXFR:
+		max3421e_simLaunch(value);
+		break;
+
+	default:
+		REG(reg) = value;
+		break;
+	}
+}
+
+/**
+ * Handles a register read.
+ *
+ * @param reg register address.
+ * @return register value.
+ */
+static uint8_t max3421e_simRead(uint8_t reg)
+{
+	switch (reg)
+	{
+	case MAX_REG_RCVFIFO:
+		return receiveFifo[receiveCpu][receivePosition++ & 0x3f];
+
+	case MAX_REG_RCVBC:
+		return receiveCount[receiveCpu];
+
+	case MAX_REG_USBIRQ:
+		// The oscillator is stable right after reset.
+		return bmOSCOKIRQ;
+
+	case MAX_REG_REVISION:
+		return 0x13;
+
+	case MAX_REG_HCTL:
+		// Bus sampling completes immediately, bus resets take a while.
+		return bmSAMPLEBUS | (sim_now() < busResetDone ? bmBUSRST : 0);
+
+	case MAX_REG_HRSL:
+		return max3421e_simHrsl();
+
+	default:
+		return REG(reg);
+	}
+}
+
+/**
+ * Raises CONDETIRQ, called by the device model when the device is plugged in or out.
+ */
+void sim_busEvent()
+{
+	REG(MAX_REG_HIRQ) |= bmCONDETIRQ;
+}
+
+/**
+ * Powers up the simulated controller. All registers, FIFOs and flags are cleared. Also called on a chip reset.
+ */
+void max3421e_init()
+{
+	memset(registers, 0, sizeof(registers));
+
+	sendPosition = sendCount = 0;
+	memset(receiveFull, 0, sizeof(receiveFull));
+	receivePosition = receiveCpu = 0;
+	setupPosition = 0;
+	sendToggle = receiveToggle = 0;
+
+	busy = false;
+	received = false;
+	result = hrSUCCESS;
+	busResetDone = 0;
+	nextFrame = 0;
+
+	REG(MAX_REG_HIRQ) = bmSNDBAVIRQ;
+}
+
+void max3421e_write(uint8_t reg, uint8_t value)
+{
+	max3421e_simTransfer(1);
+	max3421e_simUpdate();
+	max3421e_simWrite(reg, value);
+}
+
+uint8_t * max3421e_writeMultiple(uint8_t reg, uint8_t count, uint8_t * values)
+{
+	max3421e_simTransfer(count);
+	max3421e_simUpdate();
+
+	while (count--)
+		max3421e_simWrite(reg, *values++);
+
+	return values;
+}
+
+const uint8_t * max3421e_writeMultiple_P(uint8_t reg, uint8_t count, const uint8_t * values)
+{
+	max3421e_writeMultiple(reg, count, (uint8_t *)values);
+
+	return values + count;
+}
+
+uint8_t max3421e_read(uint8_t reg)
+{
+	max3421e_simTransfer(1);
+	max3421e_simUpdate();
+
+	return max3421e_simRead(reg);
+}
+
+uint8_t * max3421e_readMultiple(uint8_t reg, uint8_t count, uint8_t * values)
+{
+	max3421e_simTransfer(count);
+	max3421e_simUpdate();
+
+	while (count--)
+		*values++ = max3421e_simRead(reg);
+
+	return values;
+}
+
+/**
+ * @return the level of the INT pin, low when an enabled interrupt flag is set.
+ */
+uint8_t max3421e_simInt()
+{
+	sim_advance(SIM_PIN_COST);
+	max3421e_simUpdate();
+
+	return ((REG(MAX_REG_HIRQ) & REG(MAX_REG_HIEN)) && (REG(MAX_REG_CPUCTL) & bmIE)) ? 0 : 1;
+}
+
+/**
+ * @return the level of the GPX pin, which never signals anything.
+ */
+uint8_t max3421e_simGpx()
+{
+	return 1;
+}
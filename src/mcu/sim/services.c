@@ -0,0 +1,430 @@
+/*
+Copyright 2011 Niels Brouwers
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+/**
+ * Protocol client test for the host build ("make simservices"). Runs the sync client, a shell session, a binary
+ * logcat client and a state channel against the services of the simulated device (see device_sim.c). The device
+ * cuts its replies into WRTEs of random size, so sync headers, shell markers, log entries and state records reach
+ * the parsers split at arbitrary points. The sync client pushes a file, pulls it back and pulls a file that doesn't
+ * exist, the shell runs rounds of commands, the log entries are checked field by field, and the state channel gets
+ * its records back from the echo. Prints one line per client, and exits with a nonzero status if any check failed
+ * or the device saw a protocol error.
+ *
+ *   ./microbridge-services -t 5 -k 0.2 -q 512
+ *
+ * Options:
+ *   -t bytes     largest WRTE the device writes, see sim_config.split (23)
+ *   -f size      size of the file pushed and pulled, at most 16384 (10000)
+ *   -c rounds    rounds of shell commands (50)
+ *   -e entries   number of log entries (300)
+ *   -n rounds    rounds of state updates (100)
+ *   -k rate      NAK rate, 0 - 1 (0)
+ *   -d us        device latency in microseconds (200)
+ *   -q size      write queue size of the shell connection, which pipelines the commands (0, one at a time)
+ *   -r size      receive buffer size of all connections, see adb_setReceiveBuffer (0, per packet events)
+ *   -s seed      random seed (1)
+ *   -v           print all ADB events
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../adb.h"
+#include "sim.h"
+
+#if !ADB_HAS(ADB_FEATURE_SYNC) || !ADB_HAS(ADB_FEATURE_SHELL) || !ADB_HAS(ADB_FEATURE_LOGCAT) || !ADB_HAS(ADB_FEATURE_STATE)
+#error "The services test needs ADB_FEATURE_SYNC, ADB_FEATURE_SHELL, ADB_FEATURE_LOGCAT and ADB_FEATURE_STATE"
+#endif
+
+// Give up when this much simulated time passes without progress (milliseconds).
+#define STALL_TIMEOUT 30000
+
+// Sizes of the client buffers. The logcat buffer is smaller than the longest entries, which are cut short.
+#define SYNC_BUFFER_SIZE 100
+#define LOGCAT_BUFFER_SIZE 128
+
+// Number of state channel keys.
+#define STATE_KEYS 8
+
+/**
+ * Shell command and what it should print.
+ */
+typedef struct
+{
+	const char * command;
+	const char * output;
+	int exitCode;
+} command;
+
+static char seqOutput[2048];
+
+static command commands[] =
+{
+	{ "echo hello", "hello\n", 0 },
+	{ "seq 300", seqOutput, 0 },
+	{ "false", "", 1 },
+	{ "nosuch", "sh: nosuch: not found\n", 127 },
+	{ "echo one; echo two", "one\ntwo\n", 0 },
+	{ "printf 'a%db\\n' $?", "a0b\n", 0 },
+};
+
+#define COMMANDS (sizeof(commands) / sizeof(commands[0]))
+
+// Connections of the clients.
+static adb_connection * syncConnection;
+static adb_connection * shellConnection;
+static adb_connection * logcatConnection;
+static adb_connection * stateConnection;
+static boolean verbose;
+
+// Sync: current step (push, pull, pull of a missing file, done), whether a transfer is going on, its result and
+// message, the size of the file, the number of bytes read by the push and written by the pull, and the number of
+// failed checks.
+static adb_syncClient sync;
+static uint8_t syncBuffer[SYNC_BUFFER_SIZE];
+static uint8_t syncStep;
+static boolean syncBusy;
+static uint32_t fileSize = 10000, pushed, pulled, syncFailures;
+
+// Shell: commands sent and finished, the output of the oldest pending command so far, and the number of commands
+// whose output or exit code was wrong.
+static adb_shellSession shell;
+static uint32_t shellRounds = 50, shellSent, shellFinished, shellFailures;
+static char shellOutput[2048];
+static uint16_t shellOutputLength;
+
+// Logcat: entries expected and received, and the number of wrong ones.
+static adb_logcat logcat;
+static uint8_t logcatBuffer[LOGCAT_BUFFER_SIZE];
+static uint16_t logcatEntries = 300;
+static uint32_t logcatReceived, logcatFailures, logcatTruncated;
+
+// State channel: rounds to run and done, the keys echoed back in the current round, and the number of wrong values.
+static adb_stateChannel state;
+static uint16_t stateValues[STATE_KEYS];
+static uint32_t stateRounds = 100, stateRound, stateFailures;
+static uint32_t stateEchoed;
+
+#if ADB_HAS(ADB_FEATURE_RECEIVE_BUFFER)
+static uint8_t receiveBuffers[4][0x4000];
+#endif
+#if ADB_HAS(ADB_FEATURE_WRITE_QUEUE)
+static uint8_t shellQueue[0x1000];
+#endif
+
+/**
+ * @param position position in the file.
+ * @return the byte at that position.
+ */
+static uint8_t fileByte(uint32_t position)
+{
+	return (position * 2654435761u) >> 24;
+}
+
+static uint16_t syncReader(adb_syncClient * sync, uint16_t length, uint8_t * data)
+{
+	uint16_t i;
+
+	if (length > fileSize - pushed) length = fileSize - pushed;
+	for (i = 0; i < length; i++)
+		data[i] = fileByte(pushed++);
+
+	return length;
+}
+
+static void syncWriter(adb_syncClient * sync, uint16_t length, uint8_t * data)
+{
+	uint16_t i;
+
+	for (i = 0; i < length; i++)
+		if (data[i] != fileByte(pulled++))
+			syncFailures++;
+}
+
+static void syncHandler(adb_syncClient * sync, int result, const char * message)
+{
+	if (verbose)
+		printf("%10llu us sync step %u result %d %s\n", (unsigned long long)(sim_now() / 1000), syncStep, result,
+				message != NULL ? message : "");
+
+	switch (syncStep)
+	{
+	case 0:
+		if (result != 0 || pushed != fileSize) syncFailures++;
+		break;
+	case 1:
+		if (result != 0 || pulled != fileSize) syncFailures++;
+		break;
+	case 2:
+		if (result != -1 || message == NULL || strcmp(message, "No such file or directory") != 0) syncFailures++;
+		break;
+	}
+
+	syncBusy = false;
+	syncStep++;
+}
+
+/**
+ * Starts the next sync step once the client is idle.
+ */
+static void runSync()
+{
+	int ret;
+
+	if (syncBusy || syncStep > 2 || !adb_isSyncIdle(&sync)) return;
+
+	if (syncStep == 0)
+		ret = adb_syncSend(&sync, "/sdcard/sim.bin", 0644, 1600000000, syncReader);
+	else
+		ret = adb_syncReceive(&sync, syncStep == 1 ? "/sdcard/sim.bin" : "/sdcard/missing.bin", syncWriter);
+
+	if (ret == 0) syncBusy = true;
+}
+
+static void shellHandler(adb_shellSession * session, uint16_t length, uint8_t * data, int exitCode)
+{
+	command * command = &commands[shellFinished % COMMANDS];
+
+	if (data != NULL)
+	{
+		if (shellOutputLength + length > sizeof(shellOutput) - 1)
+			shellFailures++;
+		else
+		{
+			memcpy(shellOutput + shellOutputLength, data, length);
+			shellOutputLength += length;
+		}
+		return;
+	}
+
+	shellOutput[shellOutputLength] = 0;
+	if (strcmp(shellOutput, command->output) != 0 || exitCode != command->exitCode)
+	{
+		shellFailures++;
+		if (verbose)
+			printf("shell: '%s' printed '%s' and exited with %d\n", command->command, shellOutput, exitCode);
+	}
+
+	shellOutputLength = 0;
+	shellFinished++;
+}
+
+/**
+ * Sends the next shell commands, as far as the session takes them.
+ */
+static void runShell()
+{
+	while (shellSent < shellRounds * COMMANDS
+			&& adb_shellCommand(&shell, commands[shellSent % COMMANDS].command, shellHandler) >= 0)
+		shellSent++;
+}
+
+static void logcatHandler(adb_logcat * logcat, adb_logEntry * entry)
+{
+	uint32_t i = logcatReceived++;
+	char message[200];
+	uint16_t length, x;
+
+	length = snprintf(message, sizeof(message), "entry %u ", (unsigned)i);
+	for (x = 0; x < (i * 37u) % 150; x++)
+		message[length++] = 'x';
+	message[length] = 0;
+
+	// The priority, "sim" and the zeros take 6 bytes of the payload, and the buffer keeps room for one more zero.
+	if (length + 6 > LOGCAT_BUFFER_SIZE - 1)
+	{
+		message[LOGCAT_BUFFER_SIZE - 1 - 5] = 0;
+		logcatTruncated++;
+	}
+
+	if (entry->priority != 2 + i % 6 || entry->pid != (int32_t)(1000 + i) || entry->tid != (int32_t)(2000 + i)
+			|| entry->sec != 1600000000u + i || entry->nsec != i * 1000u || strcmp(entry->tag, "sim") != 0
+			|| strcmp(entry->message, message) != 0)
+	{
+		logcatFailures++;
+		if (verbose)
+			printf("logcat: entry %u is %u %s '%s' from %ld/%ld\n", (unsigned)i, entry->priority, entry->tag,
+					entry->message, (long)entry->pid, (long)entry->tid);
+	}
+}
+
+/**
+ * Checks the values the echo brought back, and starts the next round of state updates once all keys are back.
+ */
+static void runState()
+{
+	uint32_t changed = adb_getStateChanges(&state);
+	uint8_t key;
+
+	for (key = 0; key < STATE_KEYS; key++)
+		if ((changed & ((uint32_t)1 << key)) && adb_getState(&state, key) != stateRound * STATE_KEYS + key)
+			stateFailures++;
+	stateEchoed |= changed;
+
+	if (stateRound < stateRounds && (stateRound == 0 || stateEchoed == (1u << STATE_KEYS) - 1)
+			&& state.connection->status == ADB_OPEN)
+	{
+		stateRound++;
+		stateEchoed = 0;
+		for (key = 0; key < STATE_KEYS; key++)
+			adb_setState(&state, key, stateRound * STATE_KEYS + key);
+	}
+
+	adb_flushState(&state);
+}
+
+static void adbEventHandler(adb_connection * connection, adb_eventType event, uint16_t length, uint8_t * data)
+{
+	if (verbose)
+		printf("%10llu us event %d length %u\n", (unsigned long long)(sim_now() / 1000), event, length);
+
+	if (connection == NULL) return;
+
+	if (connection == syncConnection)
+		adb_handleSyncEvent(&sync, event, length, data);
+	else if (connection == shellConnection)
+		adb_handleShellEvent(&shell, event, length, data);
+	else if (connection == logcatConnection)
+		adb_handleLogcatEvent(&logcat, event, length, data);
+	else if (connection == stateConnection)
+		adb_handleStateEvent(&state, event, length, data);
+}
+
+/**
+ * @return true iff all clients are done.
+ */
+static boolean isDone()
+{
+	return syncStep > 2 && shellFinished == shellRounds * COMMANDS && logcatReceived >= logcatEntries
+			&& stateRound == stateRounds && stateEchoed == (1u << STATE_KEYS) - 1;
+}
+
+int main(int argc, char ** argv)
+{
+	sim_config config;
+	sim_counters * counters;
+	uint16_t queueSize = 0, receiveSize = 0, i;
+	uint32_t progress = 0, last = 0, now;
+	boolean ok;
+	int option;
+
+	sim_defaults(&config);
+	config.split = 23;
+
+	while ((option = getopt(argc, argv, "t:f:c:e:n:k:d:q:r:s:v")) != -1)
+	{
+		switch (option)
+		{
+		case 't': config.split = strtoul(optarg, NULL, 0); break;
+		case 'f': fileSize = strtoul(optarg, NULL, 0); break;
+		case 'c': shellRounds = strtoul(optarg, NULL, 0); break;
+		case 'e': logcatEntries = strtoul(optarg, NULL, 0); break;
+		case 'n': stateRounds = strtoul(optarg, NULL, 0); break;
+		case 'k': config.nakRate = atof(optarg); break;
+		case 'd': config.latency = strtoul(optarg, NULL, 0); break;
+		case 'q': queueSize = strtoul(optarg, NULL, 0); break;
+		case 'r': receiveSize = strtoul(optarg, NULL, 0); break;
+		case 's': config.seed = strtoul(optarg, NULL, 0); break;
+		case 'v': verbose = true; break;
+		default:
+			fprintf(stderr, "usage: %s [-t split] [-f file size] [-c shell rounds] [-e log entries] [-n state rounds] "
+					"[-k nak rate] [-d latency] [-q queue] [-r receive buffer] [-s seed] [-v]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	if (fileSize > 16384) fileSize = 16384;
+	if (receiveSize > 0 && receiveSize < MAX_PAYLOAD) receiveSize = MAX_PAYLOAD;
+	config.logcatEntries = logcatEntries;
+
+	for (i = 1; i <= 300; i++)
+		snprintf(seqOutput + strlen(seqOutput), sizeof(seqOutput) - strlen(seqOutput), "%u\n", i);
+
+	sim_init(&config);
+	adb_init();
+
+	syncConnection = adb_addConnection("sync:", true, adbEventHandler);
+	shellConnection = adb_addConnection("shell:", true, adbEventHandler);
+	stateConnection = adb_addConnection("tcp:4567", true, adbEventHandler);
+
+	adb_initSync(&sync, syncConnection, syncBuffer, sizeof(syncBuffer), syncHandler);
+	adb_initShell(&shell, shellConnection);
+	adb_initLogcat(&logcat, logcatBuffer, sizeof(logcatBuffer), NULL, logcatHandler);
+	logcatConnection = adb_addLogcat(&logcat, "sim:V", true, adbEventHandler);
+	adb_initStateChannel(&state, stateConnection, stateValues, STATE_KEYS, 0);
+
+#if ADB_HAS(ADB_FEATURE_WRITE_QUEUE)
+	if (queueSize > 0)
+		adb_setWriteQueue(shellConnection, shellQueue, queueSize < sizeof(shellQueue) ? queueSize : sizeof(shellQueue));
+#endif
+#if ADB_HAS(ADB_FEATURE_RECEIVE_BUFFER)
+	if (receiveSize > 0)
+	{
+		if (receiveSize > sizeof(receiveBuffers[0])) receiveSize = sizeof(receiveBuffers[0]);
+		adb_setReceiveBuffer(syncConnection, receiveBuffers[0], receiveSize);
+		adb_setReceiveBuffer(shellConnection, receiveBuffers[1], receiveSize);
+		adb_setReceiveBuffer(logcatConnection, receiveBuffers[2], receiveSize);
+		adb_setReceiveBuffer(stateConnection, receiveBuffers[3], receiveSize);
+	}
+#endif
+
+	while (!isDone())
+	{
+		adb_poll();
+
+		runSync();
+		adb_pollSync(&sync);
+		runShell();
+		runState();
+
+		now = pushed + pulled + shellFinished + logcatReceived + stateRound;
+		if (now != last)
+		{
+			last = now;
+			progress = avr_millis();
+		}
+
+		if (avr_millis() - progress > STALL_TIMEOUT)
+		{
+			fprintf(stderr, "stalled at %lu ms: sync step %u, %lu of %lu commands, %lu of %u entries, state round %lu\n",
+					(unsigned long)avr_millis(), syncStep, (unsigned long)shellFinished,
+					(unsigned long)(shellRounds * COMMANDS), (unsigned long)logcatReceived, logcatEntries,
+					(unsigned long)stateRound);
+			break;
+		}
+	}
+
+	counters = sim_getCounters();
+
+	printf("SIM sync steps=%u pushed=%lu pulled=%lu failures=%lu\n", syncStep, (unsigned long)pushed,
+			(unsigned long)pulled, (unsigned long)syncFailures);
+	printf("SIM shell commands=%lu failures=%lu\n", (unsigned long)shellFinished, (unsigned long)shellFailures);
+	printf("SIM logcat entries=%lu truncated=%u expected_truncated=%lu failures=%lu\n", (unsigned long)logcatReceived,
+			logcat.truncated, (unsigned long)logcatTruncated, (unsigned long)logcatFailures);
+	printf("SIM state rounds=%lu failures=%lu\n", (unsigned long)stateRound, (unsigned long)stateFailures);
+	printf("SIM device transactions=%lu naks=%lu in=%lu out=%lu errors=%lu sim_ms=%lu\n",
+			(unsigned long)counters->transactions, (unsigned long)counters->naks, (unsigned long)counters->messagesIn,
+			(unsigned long)counters->messagesOut, (unsigned long)counters->errors, (unsigned long)(sim_now() / 1000000));
+
+	ok = isDone() && syncFailures == 0 && shellFailures == 0 && logcatFailures == 0 && logcat.truncated == logcatTruncated
+			&& stateFailures == 0 && counters->errors == 0;
+
+	return ok ? 0 : 1;
+}
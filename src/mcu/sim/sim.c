@@ -0,0 +1,133 @@
+/*
+Copyright 2011 Niels Brouwers
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+/**
+ * Simulator core: settings, counters, the simulated clock, and the random generator. See sim.h.
+ */
+
+#include <string.h>
+
+#include "sim.h"
+#include "../adb.h"
+
+static sim_config config;
+static sim_counters counters;
+
+// Simulated time in nanoseconds.
+static uint64_t now;
+
+// State of the xorshift generator.
+static uint32_t state;
+
+/**
+ * Fills out the default settings: a well-behaved device that answers after 200 microseconds and echoes what it
+ * receives, an SPI clock of 4 MHz (fosc/4 at 16 MHz), and payload checksums (A_VERSION).
+ *
+ * @param config settings to fill out.
+ */
+void sim_defaults(sim_config * config)
+{
+	config->nakRate = 0;
+	config->lossRate = 0;
+	config->openLossRate = 0;
+	config->latency = 200;
+	config->spiClock = 4000000;
+	config->version = A_VERSION;
+	config->maxData = MAX_PAYLOAD;
+	config->echo = true;
+	config->source = 0;
+	config->split = 0;
+	config->logcatEntries = 100;
+	config->seed = 1;
+	config->devices = 1;
+	config->accessory = false;
+}
+
+/**
+ * Starts a simulation: resets the clock and the counters, and plugs in the devices. Must be called before adb_init.
+ *
+ * @param settings simulator settings, copied.
+ */
+void sim_init(sim_config * settings)
+{
+	config = *settings;
+	if (config.maxData > SIM_MAX_DATA) config.maxData = SIM_MAX_DATA;
+	if (config.devices < 1) config.devices = 1;
+	if (config.devices > SIM_MAX_DEVICES) config.devices = SIM_MAX_DEVICES;
+
+	memset(&counters, 0, sizeof(counters));
+	now = 0;
+	state = config.seed != 0 ? config.seed : 1;
+
+	sim_deviceInit();
+	sim_plug(true);
+}
+
+/**
+ * @return the settings of the simulation in progress.
+ */
+sim_config * sim_getConfig()
+{
+	return &config;
+}
+
+/**
+ * @return the counters of the simulation in progress.
+ */
+sim_counters * sim_getCounters()
+{
+	return &counters;
+}
+
+/**
+ * @return simulated time in nanoseconds.
+ */
+uint64_t sim_now()
+{
+	return now;
+}
+
+/**
+ * Advances the simulated clock.
+ *
+ * @param ns number of nanoseconds.
+ */
+void sim_advance(uint64_t ns)
+{
+	now += ns;
+	sim_deviceTick();
+}
+
+/**
+ * @return the next number of the pseudo random sequence (xorshift32).
+ */
+uint32_t sim_random()
+{
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+
+	return state;
+}
+
+/**
+ * @param probability probability between 0 and 1.
+ * @return true with the given probability.
+ */
+boolean sim_chance(double probability)
+{
+	return probability > 0 && sim_random() < probability * 4294967296.0;
+}
@@ -0,0 +1,180 @@
+/*
+Copyright 2011 Niels Brouwers
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+/**
+ * \brief Host build of the USB/ADB stack against a simulated max3421e and Android device.
+ *
+ * "make sim" compiles adb.c, usb.c and the max3421e library unmodified for the host, with the register access layer
+ * (max3421e_spi.c) replaced by a model of the controller (max3421e_sim.c), avr.c replaced by avr_sim.c, and an
+ * Android device on the other end of the bus (device_sim.c). The device enumerates as an ADB interface, answers
+ * CNXN and OPEN, acknowledges every WRTE, and can echo or source data. With more than one device, the devices are
+ * behind a hub on the root port (hub_sim.c), which needs a build with ADB_FEATURE_HUB. A device can also switch to
+ * Android Open Accessory mode, and echo raw bulk data from then on.
+ *
+ * Streams opened for "sync:", "shell:" or "exec:logcat -B" get a model of that service instead of the echo, for
+ * the protocol clients of the stack (see device_sim.c). With sim_config.split, the device cuts everything it writes
+ * into WRTEs of random size, so that replies reach the host split at arbitrary points.
+ *
+ * Time is simulated. The clock advances with the SPI traffic and the USB transactions the stack generates, plus
+ * busy waits, so a run is deterministic for a given seed and takes as long on the host as the stack's own code.
+ * It does not account for the CPU time of the AVR: use a profiler on the host binary for that.
+ */
+
+#ifndef __sim_h__
+#define __sim_h__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "../avr.h"
+
+// Largest WRTE payload the device model accepts or sends.
+#define SIM_MAX_DATA 4096
+
+// Largest number of devices, and so of hub ports.
+#define SIM_MAX_DEVICES 4
+
+/**
+ * Simulator settings, see sim_init.
+ */
+typedef struct
+{
+	// Probability (0 - 1) that the device NAKs a bulk transaction it could have completed.
+	double nakRate;
+
+	// Probability (0 - 1) that a bulk data packet is lost on the bus, which the controller reports as hrTIMEOUT.
+	double lossRate;
+
+	// Probability (0 - 1) that the device never answers an OPEN, like an adbd whose service hangs.
+	double openLossRate;
+
+	// Time the device takes to respond to a message, in microseconds. Its replies are NAKed until then.
+	uint32_t latency;
+
+	// SPI clock in Hz. Every register access costs one command byte plus its data bytes.
+	uint32_t spiClock;
+
+	// Protocol version and maximum payload size the device announces in its CNXN.
+	uint32_t version;
+	uint32_t maxData;
+
+	// Send the payload of every WRTE back on the same stream.
+	boolean echo;
+
+	// If nonzero, write WRTEs of this many bytes to every open stream, each as soon as the last one is acknowledged.
+	uint16_t source;
+
+	// If nonzero, cut every WRTE to the host to a random length of 1 to this many bytes.
+	uint16_t split;
+
+	// Number of entries the logcat service writes on a stream opened for "exec:logcat -B", see device_sim.c.
+	uint16_t logcatEntries;
+
+	// Seed of the random generator that decides NAKs and losses.
+	uint32_t seed;
+
+	// Number of devices, up to SIM_MAX_DEVICES. A single device is on the root port, several are on ports 1 and up
+	// of a hub.
+	uint8_t devices;
+
+	// Speak the Android Open Accessory protocol: switch to accessory mode when asked to, and then echo the raw data
+	// of the bulk endpoints instead of playing adbd.
+	boolean accessory;
+
+} sim_config;
+
+/**
+ * Counters kept by the controller, device and AVR models, see sim_getCounters.
+ */
+typedef struct
+{
+	// Bulk transactions, and those NAKed or lost.
+	uint32_t transactions;
+	uint32_t naks;
+	uint32_t losses;
+
+	// ADB messages received from and sent to the host, and WRTE payload bytes in both directions.
+	uint32_t messagesIn;
+	uint32_t messagesOut;
+	uint32_t bytesIn;
+	uint32_t bytesOut;
+
+	// OUT packets the device acknowledged but dropped because of their data toggle (retransmissions).
+	uint32_t duplicates;
+
+	// Protocol violations by the host: corrupt headers and checksums, oversized payloads, messages for unknown
+	// streams, OKAYs that were not due, and WRTEs sent before the previous one was acknowledged.
+	uint32_t errors;
+
+	// Bus resets.
+	uint32_t resets;
+
+	// OPENs the device left unanswered (see sim_config.openLossRate).
+	uint32_t lostOpens;
+
+	// Switches to accessory mode, and zero-length packets received in accessory mode.
+	uint32_t accessorySwitches;
+	uint32_t zeroLengthPackets;
+
+	// Times the processor went to sleep (avr_idle), and the simulated time spent asleep in nanoseconds.
+	uint32_t sleeps;
+	uint64_t sleepTime;
+
+} sim_counters;
+
+// Simulator core (sim.c).
+void sim_defaults(sim_config * config);
+void sim_init(sim_config * config);
+sim_config * sim_getConfig();
+sim_counters * sim_getCounters();
+
+uint64_t sim_now();
+void sim_advance(uint64_t ns);
+uint32_t sim_random();
+boolean sim_chance(double probability);
+
+// Controller model (max3421e_sim.c).
+void sim_busEvent();
+
+// Device model (device_sim.c).
+void sim_deviceInit();
+void sim_plug(boolean attached);
+void sim_plugDevice(uint8_t index, boolean attached);
+boolean sim_isAttached();
+boolean sim_isDeviceAttached(uint8_t index);
+void sim_deviceReset();
+void sim_devicePortReset(uint8_t index);
+void sim_deviceTick();
+uint8_t sim_deviceSetup(uint8_t address, uint8_t * packet);
+uint8_t sim_deviceStatus(uint8_t address);
+uint8_t sim_deviceIn(uint8_t address, uint8_t endpoint, uint8_t * data, uint8_t * length, uint8_t * toggle);
+void sim_deviceAck(uint8_t address, uint8_t endpoint);
+uint8_t sim_deviceOut(uint8_t address, uint8_t endpoint, uint8_t toggle, uint8_t * data, uint8_t length);
+
+// Hub model (hub_sim.c), addressed through the device model.
+void sim_hubPlug(boolean attached);
+boolean sim_hubIsAttached();
+void sim_hubReset();
+void sim_hubPortEvent(uint8_t port);
+boolean sim_hubIsPortEnabled(uint8_t port);
+boolean sim_hubIsAddressed(uint8_t address);
+uint8_t sim_hubSetup(uint8_t * packet);
+uint8_t sim_hubStatus();
+uint8_t sim_hubIn(uint8_t endpoint, uint8_t * data, uint8_t * length, uint8_t * toggle);
+void sim_hubAck(uint8_t endpoint);
+uint8_t sim_hubOut(uint8_t endpoint);
+
+#endif
@@ -0,0 +1,556 @@
+/*
+Copyright 2011 Niels Brouwers
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+/**
+ * Stress test for the host build ("make sim"). Opens a connection to the simulated device, writes a stream of
+ * randomly sized messages to it, and checks that the echo that comes back is the same stream. With several devices
+ * (behind a hub), there is one connection and one stream per device, and the writes are spread over them. Prints one line with
+ * the results, and exits with a nonzero status if any data was corrupted or the device saw a protocol error.
+ *
+ *   ./microbridge-sim -n 1000000 -k 0.2 -p 0.01 -d 500
+ *
+ * Options:
+ *   -n count     number of writes (10000)
+ *   -l length    maximum write length (64)
+ *   -k rate      NAK rate, 0 - 1 (0)
+ *   -p rate      packet loss rate, 0 - 1 (0)
+ *   -o rate      share of OPENs the device never answers, 0 - 1 (0). They time out after ADB_OPEN_TIMEOUT
+ *   -d us        device latency in microseconds (200)
+ *   -b us        poll budget in microseconds, see adb_pollBudget (0, unbounded)
+ *   -q size      write queue size, see adb_setWriteQueue (0, no queue)
+ *   -c ms        coalesce queued writes for up to ms milliseconds, see adb_setCoalescing (off)
+ *   -r size      receive buffer size, see adb_setReceiveBuffer (0, per packet events). At least MAX_PAYLOAD, since
+ *                the receive buffer drops what does not fit and the echo of coalesced writes comes in messages of up
+ *                to that size.
+ *   -u ms        plug a device out and back in every ms milliseconds, taking turns with several devices (never).
+ *                The time from plug to open connection is reported.
+ *   -w window    receive window, see adb_setFlowControl. Received data is then consumed in small random chunks from
+ *                the main loop instead of the event handler (off)
+ *   -x           device skips checksums (A_VERSION_SKIP_CHECKSUM)
+ *   -m devices   number of devices, behind a hub if more than one, see adb_setDevice. Needs a build with
+ *                ADB_FEATURE_HUB and ADB_MAX_DEVICES set accordingly (1)
+ *   -a           talk to the device as an Android Open Accessory instead of through ADB, see adb_initAccessory.
+ *                Needs a build with ADB_FEATURE_ACCESSORY, and takes a single device
+ *   -g ms        wait for the echo of each write, and then ms milliseconds before the next one, for a bridge that
+ *                is mostly idle. The time from write to complete echo is reported (0, write flat out)
+ *   -i           run the main loop with adb_run, which sleeps while the device is quiet. Needs a build with
+ *                ADB_FEATURE_IDLE. The number of sleeps and the share of time asleep are reported
+ *   -s seed      random seed (1)
+ *   -v           print all ADB events
+ *
+ * Loss rates of a few percent start to exceed USB_RETRY_LIMIT, at which point a message is cut short and the stream
+ * to the device is lost. The device counts the garbage that follows as errors.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <avr/pgmspace.h>
+
+#include "../adb.h"
+#include "sim.h"
+
+#if !ADB_HAS(ADB_FEATURE_PACKET_EVENTS) && !ADB_HAS(ADB_FEATURE_RECEIVE_BUFFER)
+#error "The stress test checks the echo, which needs ADB_FEATURE_PACKET_EVENTS or ADB_FEATURE_RECEIVE_BUFFER"
+#endif
+
+// Give up when this much simulated time passes without progress (milliseconds).
+#define STALL_TIMEOUT 30000
+
+// Most data in flight to and from an accessory. Writes to an accessory block until they are done, so this has to
+// stay below what the device buffers, or it would NAK the write while the host can't read the echo.
+#define ACCESSORY_IN_FLIGHT 2048
+
+/**
+ * Connection to one device, and the stream written to it.
+ */
+typedef struct
+{
+	adb_connection * connection;
+
+	// Stream positions of the next byte to write and the next byte expected back.
+	uint32_t written, echoed;
+
+	// Simulated time the device was last plugged back in, until the connection is open again (0 otherwise).
+	uint64_t plugTime;
+
+	// Simulated time of the last write with -g, until all of it has come back (0 otherwise).
+	uint64_t writeTime;
+
+#if ADB_HAS(ADB_FEATURE_FLOW_CONTROL)
+	// Bytes received but not consumed yet (see deferred).
+	uint32_t backlog;
+#endif
+
+#if ADB_HAS(ADB_FEATURE_WRITE_QUEUE)
+	uint8_t writeQueue[0x10000];
+#endif
+#if ADB_HAS(ADB_FEATURE_RECEIVE_BUFFER)
+	uint8_t receiveBuffer[0x10000];
+#endif
+
+} lane;
+
+static lane lanes[SIM_MAX_DEVICES];
+static uint8_t laneCount = 1;
+static boolean verbose;
+
+#if ADB_HAS(ADB_FEATURE_ACCESSORY)
+// With -a, the one lane goes through the accessory rather than a connection.
+static adb_accessory accessory;
+static boolean useAccessory;
+#endif
+
+// Number of corrupted bytes, and of opened streams.
+static uint32_t mismatches;
+static uint32_t opens;
+
+// Number of times a replugged device got its connection back, and the total and longest time from plug to open
+// (nanoseconds).
+static uint32_t reconnects;
+static uint64_t reconnectTime, reconnectMax;
+
+// Number of paced writes (-g) that came back, and the total and longest time from write to complete echo
+// (nanoseconds).
+static uint32_t echoes;
+static uint64_t echoTime, echoMax;
+
+#if ADB_HAS(ADB_FEATURE_FLOW_CONTROL)
+// With a receive window, the event handler leaves the data to the main loop. The number of times the OKAY was
+// withheld.
+static boolean deferred;
+static uint32_t throttles;
+#endif
+
+/**
+ * @param position position in the data stream.
+ * @return the byte at that position.
+ */
+static uint8_t streamByte(uint32_t position)
+{
+	return (position * 2654435761u) >> 24;
+}
+
+/**
+ * Checks data that came back against the stream.
+ */
+static void check(lane * lane, uint16_t length, uint8_t * data)
+{
+	uint16_t i;
+
+	for (i = 0; i < length; i++)
+		if (data[i] != streamByte(lane->echoed++))
+			mismatches++;
+
+	if (lane->writeTime != 0 && lane->echoed == lane->written)
+	{
+		echoes++;
+		echoTime += sim_now() - lane->writeTime;
+		if (sim_now() - lane->writeTime > echoMax) echoMax = sim_now() - lane->writeTime;
+		lane->writeTime = 0;
+	}
+}
+
+/**
+ * @return true iff all data written has come back.
+ */
+static boolean isEchoed()
+{
+	uint8_t i;
+
+	for (i = 0; i < laneCount; i++)
+		if (lanes[i].echoed < lanes[i].written)
+			return false;
+
+	return true;
+}
+
+static void adbEventHandler(adb_connection * connection, adb_eventType event, uint16_t length, uint8_t * data)
+{
+#if ADB_HAS(ADB_FEATURE_RECEIVE_BUFFER)
+	uint8_t buf[256];
+	uint16_t n;
+#endif
+	lane * lane;
+
+	if (verbose)
+		printf("%10llu us event %d length %u\n", (unsigned long long)(sim_now() / 1000), event, length);
+
+	// Device events have no connection.
+	for (lane = lanes; lane < lanes + laneCount && lane->connection != connection; lane++);
+	if (lane == lanes + laneCount) return;
+
+	switch (event)
+	{
+	case ADB_CONNECTION_OPEN:
+		// Whatever was in flight on the last stream is gone, start a new one.
+		lane->written = lane->echoed = 0;
+		opens++;
+
+		if (lane->plugTime != 0)
+		{
+			reconnects++;
+			reconnectTime += sim_now() - lane->plugTime;
+			if (sim_now() - lane->plugTime > reconnectMax) reconnectMax = sim_now() - lane->plugTime;
+			lane->plugTime = 0;
+		}
+#if ADB_HAS(ADB_FEATURE_FLOW_CONTROL)
+		lane->backlog = 0;
+#endif
+		break;
+
+	case ADB_CONNECTION_RECEIVE:
+#if ADB_HAS(ADB_FEATURE_RECEIVE_BUFFER)
+		if (data == NULL)
+		{
+#if ADB_HAS(ADB_FEATURE_FLOW_CONTROL)
+			if (deferred) break;
+#endif
+			while ((n = adb_read(connection, sizeof(buf), buf)) > 0)
+				check(lane, n, buf);
+			break;
+		}
+#endif
+		check(lane, length, data);
+#if ADB_HAS(ADB_FEATURE_FLOW_CONTROL)
+		if (deferred) lane->backlog += length;
+#endif
+		break;
+
+#if ADB_HAS(ADB_FEATURE_FLOW_CONTROL)
+	case ADB_CONNECTION_THROTTLE:
+		throttles++;
+		break;
+#endif
+
+	default:
+		break;
+	}
+}
+
+#if ADB_HAS(ADB_FEATURE_ACCESSORY)
+static void accessoryHandler(adb_accessory * accessory, adb_eventType event, uint16_t length, uint8_t * data)
+{
+	lane * lane = &lanes[0];
+
+	if (verbose)
+		printf("%10llu us accessory event %d length %u\n", (unsigned long long)(sim_now() / 1000), event, length);
+
+	switch (event)
+	{
+	case ADB_CONNECTION_OPEN:
+		lane->written = lane->echoed = 0;
+		opens++;
+
+		if (lane->plugTime != 0)
+		{
+			reconnects++;
+			reconnectTime += sim_now() - lane->plugTime;
+			if (sim_now() - lane->plugTime > reconnectMax) reconnectMax = sim_now() - lane->plugTime;
+			lane->plugTime = 0;
+		}
+		break;
+
+	case ADB_CONNECTION_RECEIVE:
+		check(lane, length, data);
+		break;
+
+	default:
+		break;
+	}
+}
+#endif
+
+int main(int argc, char ** argv)
+{
+	sim_config config;
+	sim_counters * counters;
+	uint32_t count = 10000, writes = 0, bytes = 0, budget = 0, replug = 0, lastPlug = 0, progress = 0, echoed = 0;
+	uint32_t lastEchoed = 0, written = 0;
+	uint16_t maxLength = 64, queueSize = 0, receiveSize = 0, length, i;
+	uint32_t turn = 0, gap = 0, lastWrite = 0;
+	uint8_t plugs = 0;
+	lane * lane;
+#if ADB_HAS(ADB_FEATURE_FLOW_CONTROL)
+	uint32_t window = 0;
+	uint16_t chunk;
+#if ADB_HAS(ADB_FEATURE_RECEIVE_BUFFER)
+	uint8_t buf[128];
+#endif
+#endif
+#if ADB_HAS(ADB_FEATURE_WRITE_QUEUE)
+	uint16_t coalesce = 0;
+#endif
+	uint8_t data[SIM_MAX_DATA];
+	boolean queued;
+#if ADB_HAS(ADB_FEATURE_IDLE)
+	boolean idle = false;
+#endif
+	clock_t start;
+	double elapsed;
+	int option, ret;
+
+	sim_defaults(&config);
+
+	while ((option = getopt(argc, argv, "n:l:k:p:o:d:b:q:c:r:u:w:xm:ag:is:v")) != -1)
+	{
+		switch (option)
+		{
+		case 'n': count = strtoul(optarg, NULL, 0); break;
+		case 'l': maxLength = strtoul(optarg, NULL, 0); break;
+		case 'k': config.nakRate = atof(optarg); break;
+		case 'p': config.lossRate = atof(optarg); break;
+		case 'o': config.openLossRate = atof(optarg); break;
+		case 'd': config.latency = strtoul(optarg, NULL, 0); break;
+		case 'b': budget = strtoul(optarg, NULL, 0); break;
+		case 'q': queueSize = strtoul(optarg, NULL, 0); break;
+#if ADB_HAS(ADB_FEATURE_WRITE_QUEUE)
+		case 'c': coalesce = strtoul(optarg, NULL, 0); break;
+#else
+		case 'c': break;
+#endif
+		case 'r': receiveSize = strtoul(optarg, NULL, 0); break;
+		case 'u': replug = strtoul(optarg, NULL, 0); break;
+#if ADB_HAS(ADB_FEATURE_FLOW_CONTROL)
+		case 'w': window = strtoul(optarg, NULL, 0); deferred = true; break;
+#else
+		case 'w': break;
+#endif
+		case 'x': config.version = A_VERSION_SKIP_CHECKSUM; break;
+#if ADB_HAS(ADB_FEATURE_HUB)
+		case 'm': config.devices = strtoul(optarg, NULL, 0); break;
+#else
+		case 'm': break;
+#endif
+#if ADB_HAS(ADB_FEATURE_ACCESSORY)
+		case 'a': config.accessory = true; useAccessory = true; config.devices = 1; break;
+#else
+		case 'a': break;
+#endif
+		case 'g': gap = strtoul(optarg, NULL, 0); break;
+#if ADB_HAS(ADB_FEATURE_IDLE)
+		case 'i': idle = true; break;
+#else
+		case 'i': break;
+#endif
+		case 's': config.seed = strtoul(optarg, NULL, 0); break;
+		case 'v': verbose = true; break;
+		default:
+			fprintf(stderr, "usage: %s [-n count] [-l length] [-k nak rate] [-p loss rate] [-o open loss rate] [-d latency] [-b budget] "
+					"[-q queue] [-c coalesce] [-r receive buffer] [-u replug] [-w window] [-x] [-m devices] [-a] [-g gap] [-i] "
+					"[-s seed] [-v]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	if (maxLength < 1) maxLength = 1;
+	if (maxLength > SIM_MAX_DATA) maxLength = SIM_MAX_DATA;
+	if (receiveSize > 0 && receiveSize < MAX_PAYLOAD) receiveSize = MAX_PAYLOAD;
+#if ADB_HAS(ADB_FEATURE_FLOW_CONTROL)
+	// The receive buffer has to hold the window plus one more message.
+	if (receiveSize > 0 && window > (uint32_t)receiveSize - MAX_PAYLOAD) window = receiveSize - MAX_PAYLOAD;
+	if (window > 0xffff) window = 0xffff;
+#endif
+
+	sim_init(&config);
+	laneCount = sim_getConfig()->devices;
+
+	adb_init();
+
+#if ADB_HAS(ADB_FEATURE_ACCESSORY)
+	if (useAccessory)
+		adb_initAccessory(&accessory, "microbridge", "sim", "stress test", "1.0", NULL, NULL, accessoryHandler);
+	else
+#endif
+	for (lane = lanes; lane < lanes + laneCount; lane++)
+	{
+		lane->connection = adb_addConnection_P(PSTR("tcp:4567"), true, adbEventHandler);
+#if ADB_HAS(ADB_FEATURE_HUB)
+		adb_setDevice(lane->connection, lane - lanes);
+#endif
+
+#if ADB_HAS(ADB_FEATURE_WRITE_QUEUE)
+		if (queueSize > 0)
+		{
+			adb_setWriteQueue(lane->connection, lane->writeQueue,
+					queueSize < sizeof(lane->writeQueue) ? queueSize : sizeof(lane->writeQueue));
+			if (coalesce > 0)
+				adb_setCoalescing(lane->connection, true, MAX_PAYLOAD, coalesce);
+		}
+#endif
+#if ADB_HAS(ADB_FEATURE_RECEIVE_BUFFER)
+		if (receiveSize > 0)
+			adb_setReceiveBuffer(lane->connection, lane->receiveBuffer,
+					receiveSize < sizeof(lane->receiveBuffer) ? receiveSize : sizeof(lane->receiveBuffer));
+#endif
+#if ADB_HAS(ADB_FEATURE_FLOW_CONTROL)
+		if (deferred)
+			adb_setFlowControl(lane->connection, true, window);
+#endif
+	}
+	queued = queueSize > 0 && ADB_HAS(ADB_FEATURE_WRITE_QUEUE);
+
+	start = clock();
+
+	while (writes < count || !isEchoed())
+	{
+#if ADB_HAS(ADB_FEATURE_IDLE)
+		if (idle)
+			adb_run();
+		else
+#endif
+		adb_pollBudget(budget);
+
+		if (replug > 0 && avr_millis() - lastPlug >= replug)
+		{
+			sim_plugDevice(plugs % laneCount, false);
+			adb_poll();
+			sim_plugDevice(plugs % laneCount, true);
+			lanes[plugs % laneCount].plugTime = sim_now();
+			plugs++;
+			lastPlug = avr_millis();
+		}
+
+		for (echoed = 0, written = 0, lane = lanes; lane < lanes + laneCount; lane++)
+		{
+			echoed += lane->echoed;
+			written += lane->written;
+		}
+
+		if (echoed != lastEchoed)
+		{
+			lastEchoed = echoed;
+			progress = avr_millis();
+		}
+
+		if (avr_millis() - progress > STALL_TIMEOUT)
+		{
+			fprintf(stderr, "stalled at %lu ms: %lu writes, %lu of %lu bytes echoed\n", (unsigned long)avr_millis(),
+					(unsigned long)writes, (unsigned long)echoed, (unsigned long)written);
+			break;
+		}
+
+		// The lanes take turns.
+		lane = &lanes[turn++ % laneCount];
+
+#if ADB_HAS(ADB_FEATURE_FLOW_CONTROL)
+		// A slow consumer.
+		if (deferred)
+		{
+			chunk = sim_random() % 128;
+#if ADB_HAS(ADB_FEATURE_RECEIVE_BUFFER)
+			if (receiveSize > 0)
+				check(lane, adb_read(lane->connection, chunk, buf), buf);
+			else
+#endif
+			{
+				if (chunk > lane->backlog) chunk = lane->backlog;
+				adb_consume(lane->connection, chunk);
+				lane->backlog -= chunk;
+			}
+		}
+#endif
+
+		if (writes == count) continue;
+
+		// Paced, one write at a time.
+		if (gap > 0 && (lane->echoed != lane->written || avr_millis() - lastWrite < gap)) continue;
+
+#if ADB_HAS(ADB_FEATURE_ACCESSORY)
+		if (useAccessory)
+		{
+			if (!adb_isAccessoryOpen(&accessory)) continue;
+
+			length = 1 + sim_random() % maxLength;
+			if (lane->written - lane->echoed + length > ACCESSORY_IN_FLIGHT) continue;
+			for (i = 0; i < length; i++)
+				data[i] = streamByte(lane->written + i);
+
+			if (adb_writeAccessory(&accessory, length, data) != 0) continue;
+
+			if (gap > 0)
+			{
+				lane->writeTime = sim_now();
+				lastWrite = avr_millis();
+			}
+			lane->written += length;
+			bytes += length;
+			writes++;
+			progress = avr_millis();
+			continue;
+		}
+#endif
+
+		// Without a queue, each write has to wait for the OKAY of the last one.
+		if (lane->connection->status != ADB_OPEN
+				&& !(queued && (lane->connection->status == ADB_WRITING || lane->connection->status == ADB_RECEIVING)))
+			continue;
+
+		length = 1 + sim_random() % maxLength;
+		if (length > adb_getRemoteMaxData()) length = adb_getRemoteMaxData();
+		for (i = 0; i < length; i++)
+			data[i] = streamByte(lane->written + i);
+
+		ret = adb_write(lane->connection, length, data);
+		if (queued ? ret <= 0 : ret != 0) continue;
+
+		length = queued ? ret : length;
+		if (gap > 0)
+		{
+			lane->writeTime = sim_now();
+			lastWrite = avr_millis();
+		}
+		lane->written += length;
+		bytes += length;
+		writes++;
+		progress = avr_millis();
+	}
+
+	elapsed = (double)(clock() - start) / CLOCKS_PER_SEC;
+	for (echoed = 0, lane = lanes; lane < lanes + laneCount; lane++)
+		echoed += lane->echoed;
+	counters = sim_getCounters();
+
+	printf("SIM writes=%lu bytes=%lu echoed=%lu mismatches=%lu opens=%lu sim_ms=%lu host_ms=%.0f\n",
+			(unsigned long)writes, (unsigned long)bytes, (unsigned long)echoed, (unsigned long)mismatches,
+			(unsigned long)opens, (unsigned long)(sim_now() / 1000000), elapsed * 1000);
+	if (reconnects > 0)
+		printf("SIM reconnects=%lu reconnect_us avg=%lu max=%lu\n", (unsigned long)reconnects,
+				(unsigned long)(reconnectTime / reconnects / 1000), (unsigned long)(reconnectMax / 1000));
+#if ADB_HAS(ADB_FEATURE_FLOW_CONTROL)
+	if (deferred)
+		printf("SIM window=%lu throttles=%lu\n", (unsigned long)window, (unsigned long)throttles);
+#endif
+	if (echoes > 0)
+		printf("SIM echoes=%lu echo_us avg=%lu max=%lu\n", (unsigned long)echoes,
+				(unsigned long)(echoTime / echoes / 1000), (unsigned long)(echoMax / 1000));
+	if (counters->sleeps > 0)
+		printf("SIM sleeps=%lu asleep=%.1f%%\n", (unsigned long)counters->sleeps,
+				100.0 * counters->sleepTime / sim_now());
+	if (counters->lostOpens > 0)
+		printf("SIM lost_opens=%lu\n", (unsigned long)counters->lostOpens);
+	if (counters->accessorySwitches > 0)
+		printf("SIM accessory switches=%lu zero_length_packets=%lu\n", (unsigned long)counters->accessorySwitches,
+				(unsigned long)counters->zeroLengthPackets);
+	printf("SIM device transactions=%lu naks=%lu losses=%lu duplicates=%lu in=%lu out=%lu errors=%lu resets=%lu\n",
+			(unsigned long)counters->transactions, (unsigned long)counters->naks, (unsigned long)counters->losses,
+			(unsigned long)counters->duplicates, (unsigned long)counters->messagesIn,
+			(unsigned long)counters->messagesOut, (unsigned long)counters->errors, (unsigned long)counters->resets);
+
+	return (mismatches > 0 || counters->errors > 0 || writes < count || !isEchoed()) ? 1 : 0;
+}
@@ -0,0 +1,10 @@
+/**
+ * Host stand-in for <util/delay.h>, see sim/sim.h. Busy waits advance the simulated clock.
+ */
+#ifndef __sim_util_delay_h__
+#define __sim_util_delay_h__
+
+void _delay_ms(double ms);
+void _delay_us(double us);
+
+#endif
@@ -0,0 +1,124 @@
+#!/usr/bin/env python3
+#
+# Copyright 2011 Niels Brouwers
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#    http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""
+Formats the binary trace of a build with ADB_FEATURE_TRACE (see adb_trace in adb.c). Reads the raw serial output
+from a file or standard input, e.g.
+
+    stty -F /dev/ttyUSB0 raw 57600; ./trace.py < /dev/ttyUSB0
+
+Ordinary serial output between the trace frames is passed through as is.
+"""
+
+import struct
+import sys
+
+SYNC = 0xa5
+
+COMMANDS = {
+    b'SY': 'SYNC', b'CN': 'CNXN', b'OP': 'OPEN', b'OK': 'OKAY', b'CL': 'CLSE', b'WR': 'WRTE',
+}
+
+
+def message(direction, payload):
+    command, arg0, arg1, length = struct.unpack('<2sIIH', payload)
+    name = COMMANDS.get(command, repr(command))
+    text = '%s %s %d %d' % (direction, name, arg0, arg1)
+    if length > 0:
+        text += ', %d bytes' % length
+    return text
+
+
+def broken(payload):
+    command, arg0, arg1, length, check, magic = struct.unpack('<6I', payload[:24])
+    return 'BROKEN [%08x] %d %d, %d bytes, magic %08x' % (command, arg0, arg1, length, magic)
+
+
+def dropped(payload):
+    return 'DROPPED %d frames' % struct.unpack('<H', payload)
+
+
+EVENTS = {
+    0x01: lambda payload: message('IN >>', payload),
+    0x02: lambda payload: message('OUT <<', payload),
+    0x03: broken,
+    0x04: dropped,
+}
+
+
+def frames(stream):
+    """
+    Splits the input into text and trace frames. Yields (None, text) for text, and (event, time, payload) for
+    frames, with the timestamp unwrapped to a running count of microseconds.
+    """
+    base, last = 0, None
+    text = bytearray()
+
+    while True:
+        byte = stream.read(1)
+        if not byte:
+            break
+        if byte[0] != SYNC:
+            text += byte
+            if byte == b'\n':
+                yield None, text.decode('latin-1')
+                text = bytearray()
+            continue
+
+        header = stream.read(6)
+        if len(header) < 6:
+            break
+        event, length, time = struct.unpack('<BBI', header)
+        payload = stream.read(length)
+        if len(payload) < length:
+            break
+
+        if last is not None and time < last:
+            base += 1 << 32
+        last = time
+
+        if text:
+            yield None, text.decode('latin-1')
+            text = bytearray()
+        yield event, base + time, payload
+
+    if text:
+        yield None, text.decode('latin-1')
+
+
+def main():
+    stream = open(sys.argv[1], 'rb') if len(sys.argv) > 1 else sys.stdin.buffer
+    previous = None
+
+    for frame in frames(stream):
+        if frame[0] is None:
+            sys.stdout.write(frame[1])
+            continue
+
+        event, time, payload = frame
+        delta = time - previous if previous is not None else 0
+        previous = time
+
+        if event in EVENTS:
+            text = EVENTS[event](payload)
+        else:
+            text = 'EVENT %02x %s' % (event, payload.hex())
+
+        print('[%10.6f +%7d] %s' % (time / 1e6, delta, text))
+
+
+if __name__ == '__main__':
+    main()
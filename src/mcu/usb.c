@@ -40,6 +40,28 @@ void usb_initEndPoint(usb_endpoint * endpoint, uint8_t address)
 	endpoint->address = address;
 	endpoint->sendToggle = bmSNDTOG0;
 	endpoint->receiveToggle = bmRCVTOG0;
+	endpoint->transferred = 0;
+	endpoint->nakCount = 0;
+	endpoint->readAhead = 0;
+	endpoint->nakLimit = 0;
+	endpoint->nakTime = 0;
+	endpoint->zeroLengthPacket = false;
+}
+
+/**
+ * Limits the NAKs a transfer on an endpoint may take, on top of the limit the caller passes and the deadline of
+ * usb_setDeadline. A transfer that reaches the NAK count fails with hrNAK. One that is still NAKed once the time is
+ * up completes with hrNAK as well, but usb_bulkWritev treats that like the deadline, i.e. the write can be resumed.
+ * Endpoints start without a budget every time the device is enumerated, so set it after USB_CONNECT.
+ *
+ * @param endpoint USB endpoint.
+ * @param naks maximum number of NAKs per transfer, or 0 for no limit of its own.
+ * @param time maximum time per transfer in microseconds that NAKs are retried for, or 0 for no limit.
+ */
+void usb_setNakBudget(usb_endpoint * endpoint, unsigned int naks, uint16_t time)
+{
+	endpoint->nakLimit = naks;
+	endpoint->nakTime = time;
 }
 
 /**
@@ -19,6 +19,8 @@ limitations under the License.#include <string.h>
 #include <stdint.h>
 #include <stdbool.h>
 
+#include "adb_config.h"
+
 // Device descriptor.
 typedef struct {
 	uint8_t bLength;				// Length of this descriptor.
@@ -85,6 +87,21 @@ typedef struct
 	uint16_t wLength;				// 6 Depends on bRequest
 } usb_setupPacket;
 
+#if ADB_HAS(ADB_FEATURE_STATS)
+/**
+ * Per-endpoint counters, see adb_getStats.
+ */
+typedef struct
+{
+	// Number of NAKs received.
+	uint32_t naks;
+	// Number of bus timeouts, including transfers aborted after USB_XFER_TIMEOUT.
+	uint16_t timeouts;
+	// Number of IN transfers that completed without data (toggle errors).
+	uint16_t toggleErrors;
+} usb_endpointStats;
+#endif
+
 /**
  * USB endpoint.
  */
@@ -102,6 +119,22 @@ typedef struct
     // The max3421e uses these bits to toggle between DATA0 and DATA1.
     uint8_t sendToggle;
     uint8_t receiveToggle;
+    // Progress of a write that was cut short by the deadline (see usb_setDeadline): number of bytes sent, and
+    // number of NAKs so far for the packet that is next.
+    uint16_t transferred;
+    unsigned int nakCount;
+    // Number of bytes still expected on an IN endpoint, see usb_setReadAhead.
+    uint32_t readAhead;
+    // NAK budget of each transfer on the endpoint: the maximum number of NAKs, and the time in microseconds after
+    // which NAKs are no longer retried. 0 means no limit of its own, see usb_setNakBudget.
+    unsigned int nakLimit;
+    uint16_t nakTime;
+    // End writes that fill their last packet with a zero-length packet, for devices that read in blocks of more
+    // than a packet and would otherwise wait for the rest of the block (Android accessories).
+    boolean zeroLengthPacket;
+#if ADB_HAS(ADB_FEATURE_STATS)
+    usb_endpointStats stats;
+#endif
 
 } usb_endpoint;
 
@@ -116,15 +149,89 @@ typedef struct
 	// Indicates whether this device is active.
 	uint8_t active;
 
-	// Endpoints.
+	// Hub port the device is attached to, or 0 if it is on the root port.
+	uint8_t port;
+
+	// Endpoints. A hub keeps its status change (interrupt) endpoint in bulk_in.
 	usb_endpoint control;
 	usb_endpoint bulk_in, bulk_out;
 
 	// First supported language (for retrieving Strings)
 	uint16_t firstStringLanguage;
 
+	// Vendor and product ID and release number, from the device descriptor.
+	uint16_t vendorId, productId, releaseNumber;
+
 } usb_device;
 
+/**
+ * A contiguous piece of an outgoing payload, see usb_bulkWritev. Segments can live in RAM or in program memory.
+ */
+typedef struct
+{
+	// Segment data.
+	const uint8_t * data;
+
+	// Number of bytes in the segment.
+	uint16_t length;
+
+	// True iff data points into program memory (PROGMEM).
+	boolean progmem;
+
+} usb_segment;
+
+typedef enum
+{
+	USB_TRANSFER_IDLE = 0,
+	USB_TRANSFER_BUSY,
+	USB_TRANSFER_DONE
+} usb_transferState;
+
+typedef struct _usb_transfer usb_transfer;
+
+// Transfer completion callback.
+typedef void(usb_transferCallback)(usb_transfer * transfer);
+
+/**
+ * Host transfer in flight. The max3421e executes one transfer at a time, so there is a single instance of this
+ * record. A transfer is launched by usb_startTransfer and completed (or retried on NAK/timeout) from the max3421e
+ * interrupt handler. The handler is not an ISR: max3421e_poll calls it when it finds the INT pin asserted, from
+ * usb_poll and usb_waitTransfer. So transfers are pin-polled, and still synchronous. Every caller except the
+ * read-ahead (see usb_setReadAhead) waits for its transfer to finish, and the time spent waiting is only bounded by
+ * the NAK limit and the poll budget. The pin is polled rather than attached to an interrupt because the handler
+ * talks to the max3421e over SPI, a bus the application may be using itself when the interrupt fires.
+ */
+struct _usb_transfer
+{
+	// Transfer state, see usb_transferState.
+	volatile uint8_t state;
+
+	// Token and endpoint the transfer was dispatched on.
+	uint8_t token;
+	usb_endpoint * endpoint;
+
+	// Length and first byte of the payload of an OUT transfer, needed to re-arm the FIFO after a NAK.
+	uint8_t length;
+	uint8_t first;
+
+	// NAK and retry bookkeeping, and the time after which NAKs are no longer retried if nakTimed is set.
+	unsigned int nakLimit;
+	unsigned int nakCount;
+	uint8_t retryCount;
+	boolean nakTimed;
+	uint32_t nakDeadline;
+
+	// Result code (lower four bits of HRSL) and raw HRSL value of the last attempt.
+	uint8_t result;
+	uint8_t hrsl;
+
+	// Deadline of the transfer in microseconds (see avr_deadline), after which it is aborted.
+	uint32_t deadline;
+
+	// Called when the transfer is done, may be NULL.
+	usb_transferCallback * callback;
+};
+
 typedef enum
 {
 	USB_CONNECT,
@@ -146,8 +253,12 @@ int usb_initDevice(usb_device * device, int configuration);
 usb_device * usb_getDevice(uint8_t address);
 
 void usb_initEndPoint(usb_endpoint * endpoint, uint8_t address);
+void usb_setNakBudget(usb_endpoint * endpoint, unsigned int naks, uint16_t time);
 
 int usb_bulkRead(usb_device * device, uint16_t length, uint8_t * data, boolean poll);
+int usb_bulkReadRing(usb_device * device, uint16_t length, uint8_t * ring, uint16_t size, uint16_t offset, boolean poll);
+void usb_setReadAhead(usb_device * device, uint32_t length);
 int usb_bulkWrite(usb_device * device, uint16_t length, uint8_t * data);
+int usb_bulkWritev(usb_device * device, uint8_t count, usb_segment * segments);
 
 #endif